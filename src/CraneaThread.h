@@ -0,0 +1,223 @@
+#ifndef _CRANEA_THREAD_H_
+#define _CRANEA_THREAD_H_
+
+/* Minimal portable threading primitives (Win32 threads on Windows, pthreads elsewhere).
+ */
+
+#ifdef WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h> // for sysconf
+#endif
+
+class Mutex
+{
+public:
+#ifdef WIN32
+    Mutex() { InitializeCriticalSection(&cs_); }
+    ~Mutex() { DeleteCriticalSection(&cs_); }
+    void lock() { EnterCriticalSection(&cs_); }
+    void unlock() { LeaveCriticalSection(&cs_); }
+#else
+    Mutex() { pthread_mutex_init(&mutex_, NULL); }
+    ~Mutex() { pthread_mutex_destroy(&mutex_); }
+    void lock() { pthread_mutex_lock(&mutex_); }
+    void unlock() { pthread_mutex_unlock(&mutex_); }
+#endif
+
+private:
+    Mutex(const Mutex &);
+    Mutex &operator=(const Mutex &);
+
+#ifdef WIN32
+    CRITICAL_SECTION cs_;
+#else
+    pthread_mutex_t mutex_;
+#endif
+};
+
+class ScopedLock
+{
+public:
+    ScopedLock(Mutex &mutex) : mutex_(&mutex) { mutex_->lock(); }
+    ~ScopedLock() { mutex_->unlock(); }
+private:
+    ScopedLock(const ScopedLock &);
+    ScopedLock &operator=(const ScopedLock &);
+
+    Mutex *mutex_;
+};
+
+/* Event
+ * =====
+ * An auto-reset event: wait() blocks until set() is called, and then resets the event.
+ * Setting an event that is already set has no effect.
+ */
+class Event
+{
+public:
+#ifdef WIN32
+    Event() { event_ = CreateEvent(NULL, FALSE, FALSE, NULL); }
+    ~Event() { CloseHandle(event_); }
+    void set() { SetEvent(event_); }
+    void wait() { WaitForSingleObject(event_, INFINITE); }
+
+    // returns false if the event was not set within ms milliseconds
+    bool wait(unsigned int ms) { return WaitForSingleObject(event_, ms) == WAIT_OBJECT_0; }
+#else
+    Event() : set_(false)
+    {
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&cond_, NULL);
+    }
+    ~Event()
+    {
+        pthread_cond_destroy(&cond_);
+        pthread_mutex_destroy(&mutex_);
+    }
+    void set()
+    {
+        pthread_mutex_lock(&mutex_);
+        set_ = true;
+        pthread_cond_signal(&cond_);
+        pthread_mutex_unlock(&mutex_);
+    }
+    void wait()
+    {
+        pthread_mutex_lock(&mutex_);
+        while (!set_)
+        {
+            pthread_cond_wait(&cond_, &mutex_);
+        }
+        set_ = false;
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    // returns false if the event was not set within ms milliseconds
+    bool wait(unsigned int ms);
+#endif
+
+private:
+    Event(const Event &);
+    Event &operator=(const Event &);
+
+#ifdef WIN32
+    HANDLE event_;
+#else
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+    bool set_;
+#endif
+};
+
+#ifndef WIN32
+#include <sys/time.h>
+#include <errno.h>
+
+inline bool Event::wait(unsigned int ms)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + ms / 1000;
+    deadline.tv_nsec = (now.tv_usec + (ms % 1000) * 1000) * 1000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&mutex_);
+    int res = 0;
+    while (!set_ && res != ETIMEDOUT)
+    {
+        res = pthread_cond_timedwait(&cond_, &mutex_, &deadline);
+    }
+    bool wasSet = set_;
+    set_ = false;
+    pthread_mutex_unlock(&mutex_);
+    return wasSet;
+}
+#endif
+
+/* Thread
+ * ======
+ * Runs fn(arg) on a new thread. The thread must be joined before the Thread is destroyed.
+ */
+class Thread
+{
+public:
+    typedef void (*ThreadFn)(void *arg);
+
+    Thread() : started_(false) {}
+
+    bool start(ThreadFn fn, void *arg)
+    {
+        fn_ = fn;
+        arg_ = arg;
+#ifdef WIN32
+        thread_ = CreateThread(NULL, 0, &Thread::run, this, 0, NULL);
+        started_ = (thread_ != NULL);
+#else
+        started_ = (pthread_create(&thread_, NULL, &Thread::run, this) == 0);
+#endif
+        return started_;
+    }
+
+    void join()
+    {
+        if (started_)
+        {
+#ifdef WIN32
+            WaitForSingleObject(thread_, INFINITE);
+            CloseHandle(thread_);
+#else
+            pthread_join(thread_, NULL);
+#endif
+            started_ = false;
+        }
+    }
+
+private:
+    Thread(const Thread &);
+    Thread &operator=(const Thread &);
+
+#ifdef WIN32
+    static DWORD WINAPI run(LPVOID self)
+    {
+        ((Thread *)self)->fn_(((Thread *)self)->arg_);
+        return 0;
+    }
+    HANDLE thread_;
+#else
+    static void *run(void *self)
+    {
+        ((Thread *)self)->fn_(((Thread *)self)->arg_);
+        return NULL;
+    }
+    pthread_t thread_;
+#endif
+
+    ThreadFn fn_;
+    void *arg_;
+    bool started_;
+};
+
+// the number of processors that threads can run on
+inline size_t numProcessors()
+{
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long num = sysconf(_SC_NPROCESSORS_ONLN);
+    return num > 0 ? (size_t)num : 1;
+#endif
+}
+
+#endif
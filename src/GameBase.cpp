@@ -1,1630 +1,2492 @@
-#include "GameBase.h"
-#include "GameInput.h"
-
-using namespace std;
-using namespace CryptoPP;
-
-#include "cryptlib.h"
-#include "filters.h"
-#include "files.h"
-#include "modes.h"
-#include "aes.h"
-#include <fstream>
-#include <map>
-
-#ifdef WIN32
-#define PATH_SEP "\\"
-#else
-#define PATH_SEP "/"
-#endif
-
-#ifdef WIN32
-#define VC_EXTRALEAN
-#define WIN32_LEAN_AND_MEAN			
-#include <windows.h> // for Sleep
-#else
-
-#include <unistd.h> // for usleep
-
-void Sleep(unsigned int ms)
-{
-  unsigned int sec = ms / 1000;
-  ms = ms % 1000;
-
-  sleep(sec);
-  usleep(1000 * ms);
-}
-
-#endif
-
-#include <sys/stat.h> 
-
-
-class AutoPumpFilter : public StreamTransformationFilter
-{
-public:
-    AutoPumpFilter(StreamTransformation &c, Source &pumpee, size_t pumpSlack = AES::BLOCKSIZE) 
-        : StreamTransformationFilter(c), pumpee_(&pumpee), pumpSlack_(pumpSlack)
-    {
-    }
-
-    virtual ~AutoPumpFilter() 
-    {
-    }
-
-    virtual size_t Get(byte &outByte)
-    {
-        return this->Get(&outByte, 1);
-    }
-
-    virtual size_t Get(byte *outString, size_t getMax)
-    {
-        size_t res = this->StreamTransformationFilter::Get(outString, getMax);
-
-        if (res < getMax)
-        {
-            size_t left = getMax - res;
-            pumpee_->Pump(left + pumpSlack_);
-            res += this->StreamTransformationFilter::Get(outString + res, left);
-        }
-        return res;
-    }
-
-    Source &GetSource()
-    {
-        return *pumpee_;
-    }
-private:
-    Source *pumpee_;
-    size_t pumpSlack_;
-};
-
-GameContext::~GameContext()
-{
-    for (map<int, GameItem *>::iterator it = savedItems_.begin(); it != savedItems_.end(); ++it)
-    {
-        delete it->second;
-    }
-
-    for (map<int, GameLocation *>::iterator it = savedLocations_.begin(); it != savedLocations_.end(); ++it)
-    {
-        delete it->second;
-    }
-}
-
-template <typename ElemType>
-ElemType readVal(ifstream &in)
-{
-    ElemType val;
-    in.read((char *)&val, sizeof(ElemType));
-    canonicalizeEndianness(val);
-    return val;
-}
-
-GameLocation *GameContext::readLocationChain(ifstream &in)
-{
-    size_t numAncestors = readVal<size_t>(in);
-
-    GameLocation *loc = NULL;
-    for (size_t i = 0; i < numAncestors; i++)
-    {
-        int gid = readVal<int>(in);
-        byte locationKey[KEY_SIZE];
-        in.read((char *)locationKey, KEY_SIZE);
-
-        loc = getLocation(gid, locationKey, loc);
-        assert(loc);
-    }
-    return loc;
-}
-
-void splitVariable(const string &var, string &first, string &rest)
-{
-    size_t dot = var.find('.');
-    if (dot == string::npos)
-    {
-        first = var;
-        rest = "";
-    }
-    else
-    {
-        first = var.substr(0, dot);
-        rest = var.substr(dot + 1);
-    }
-}
-
-void GameLocation::printVariable(const string &var, int expansionCount)
-{
-    if (var == "title")
-    {
-        ctx_->printExpansion(title, false, expansionCount);
-    }
-    else if (var == "desc")
-    {
-        ctx_->printExpansion(desc, false, expansionCount);
-    }
-    else if (var == "gid")
-    {
-        cout << gid();
-    }
-    else if (var == "prompt")
-    {
-        cout << getPrompt();
-    }
-}
-
-void GameContext::printVariable(const string &var, int expansionCount)
-{
-    if (var == "d")
-    {
-        Sleep(500);
-    }
-    else if (var == "p")
-    {
-        string line;
-        getline(cin, line);
-    }
-    else if (var == "cmd")
-    {
-        cout << lastCommand;
-    }
-    else if (var == "args")
-    {
-        cout << lastArgs;
-    }
-    else if (var == "s")
-    {
-        cout << " ";
-    }
-    else if (var == "br")
-    {
-        cout << endl;
-    }
-    else
-    {
-        string first, rest;
-        splitVariable(var, first, rest);
-
-        if (first == "location")
-        {
-            curLocation()->printVariable(rest, expansionCount);
-        }
-    }
-}
-
-bool GameContext::load(ifstream &in)
-{
-    if (in.fail())
-        return false;
-
-    GameContext backup(*this);
-
-    locationStacks_.clear();
-    savedLocations_.clear();
-    savedItems_.clear();
-    inventory_.clear();
-    inventoryByTakeyHash_.clear();
-    droppedItemLocations_.clear();
-    originalItemLocations_.clear();
-
-    size_t numLocationStacks = readVal<size_t>(in);
-
-    //cout << "# location stacks: " << numLocationStacks << endl;
-
-    for (size_t i = 0; i < numLocationStacks; i++)
-    {
-        locationStacks_.push_back(vector<GameLocation *>());
-        vector<GameLocation *> &locationStack = locationStacks_.back();
-
-        size_t locationsInStack = readVal<size_t>(in);
-
-        //cout << "# locations in stack: " << locationsInStack << endl;
-
-        GameLocation *parent = NULL;
-        for (size_t j = 0; j < locationsInStack; j++)
-        {
-            int gid = readVal<int>(in);
-            byte locationKey[KEY_SIZE];
-            in.read((char *)locationKey, KEY_SIZE);
-
-            GameLocation *loc = getLocation(gid, locationKey, parent);
-
-            locationStack.push_back(loc);
-            //cout << "pushed " << loc->title << " onto location stack" << endl;
-
-            parent = loc;
-        }
-    }
-    
-    // items to take from original location (from inventory):
-    // (gid, item key, item takey, (original loc gid, original loc key)+)+
-
-    size_t inventorySize = readVal<size_t>(in);
-
-    for (size_t i = 0; i < inventorySize; i++)
-    {        
-        int itemGid = readVal<int>(in);
-        
-        byte itemKey[KEY_SIZE];
-        in.read((char *)itemKey, KEY_SIZE);
-
-        byte itemTakey[KEY_SIZE];
-        in.read((char *)itemTakey, KEY_SIZE);
-
-        GameItem *item = getItem(itemGid, itemKey);
-
-        GameLocation *originalLoc = readLocationChain(in);
-
-        originalLoc->takeItem(item, itemTakey);
-    }
-
-    // items to take from some location and drop on a new location (from droppedItemLocations):
-        // (gid, item key, item takey, (original loc gid, original loc key)+, (dropped loc gid, dropped loc key)+)+
-
-    size_t numMovedItems = readVal<size_t>(in);
-
-    for (size_t i = 0; i < numMovedItems; i++)
-    {
-        int itemGid = readVal<int>(in);
-        byte itemKey[KEY_SIZE];
-        in.read((char *)itemKey, KEY_SIZE);
-
-        byte itemTakey[KEY_SIZE];
-        in.read((char *)itemTakey, KEY_SIZE);
-
-        GameItem *item = getItem(itemGid, itemKey);
-
-        GameLocation *originalLoc = readLocationChain(in);
-
-        originalLoc->takeItem(item, itemTakey);
-
-        GameLocation *droppedLoc = readLocationChain(in);
-
-        dropInventoryItem(item->takeyhash(), droppedLoc);
-    }    
-
-    bool success = !in.fail();
-    if (!success)
-    {
-        *this = backup;
-
-        /* prevent deleting items/locations when backup gets destructed 
-         * (if success == true, we want to delete the old items/locations)
-         */
-        backup.savedLocations_.clear();
-        backup.savedItems_.clear();
-    }
-    
-    //cout << "current location: " << curLocation()->title << endl;
-
-    return success;
-}
-
-template <typename ElemType>
-void writeVal(ofstream &out, ElemType val)
-{
-    canonicalizeEndianness(val);
-    out.write((char *)&val, sizeof(ElemType));
-}
-
-void GameContext::writeLocationChain(ofstream &out, GameLocation *loc)
-{
-    vector<GameLocation *> locAncestors;
-    loc->getAncestors(locAncestors);
-    size_t numAncestors = locAncestors.size();
-    writeVal<size_t>(out, numAncestors);
-    for (int i = (int)numAncestors - 1; i >= 0; i--) /* write locations starting from root */
-    {
-        GameLocation *ancestorLoc = locAncestors[i];
-        writeVal<int>(out, ancestorLoc->gid());
-        out.write((char *)ancestorLoc->key(), KEY_SIZE);
-    }
-}
-
-bool GameContext::save(ofstream &out)
-{
-    if (out.fail())
-        return false;
-
-    // # locationStacks (# locations in stack, (gid, location key)+)+
-    size_t numLocationStacks = locationStacks_.size();
-    writeVal<size_t>(out, numLocationStacks);
-
-    for (size_t i = 0; i < numLocationStacks; i++)
-    {
-        vector<GameLocation *> &locationStack = locationStacks_[i];
-        size_t locationsInStack = locationStack.size();
-
-        writeVal<size_t>(out, locationsInStack);
-
-        for (size_t j = 0; j < locationsInStack; j++)
-        {
-            GameLocation *loc = locationStack[j];
-            writeVal<int>(out, loc->gid());
-            out.write((char *)loc->key(), KEY_SIZE);
-        }
-    }
-
-    // items to take from original location (from inventory):
-    // (gid, item key, item takey, (original loc gid, original loc key)+)+
-
-    size_t inventorySize = inventory_.size();
-    writeVal<size_t>(out, inventorySize);
-
-    for (size_t i = 0; i < inventorySize; i++)
-    {
-        GameItem *item = inventory_[i];
-        writeVal<int>(out, item->gid());
-        out.write((char *)item->key(), KEY_SIZE);
-        out.write((char *)item->takey(), KEY_SIZE);
-
-        GameLocation *originalLoc = originalItemLocations_[item->gid()].second;
-
-        writeLocationChain(out, originalLoc);
-    }
-
-    // items to take from some location and drop on a new location (from droppedItemLocations):
-        // (gid, item key, item takey, (original loc gid, original loc key)+, (dropped loc gid, dropped loc key)+)+
-
-    writeVal<size_t>(out, droppedItemLocations_.size());
-
-    for (map<int, pair<GameItem *, GameLocation *> >::const_iterator it = droppedItemLocations_.begin(); 
-            it != droppedItemLocations_.end(); ++it)
-    {
-        GameItem *item = it->second.first;
-        GameLocation *droppedLoc = it->second.second;
-
-        writeVal<int>(out, item->gid());
-        out.write((char *)item->key(), KEY_SIZE);
-        out.write((char *)item->takey(), KEY_SIZE);
-
-        GameLocation *originalLoc = originalItemLocations_[item->gid()].second;
-
-        writeLocationChain(out, originalLoc);
-        writeLocationChain(out, droppedLoc);
-    }
-
-    return !out.fail();
-}
-
-std::string GameContext::getPrompt()
-{
-    return curLocation()->getPrompt();
-}
-
-void GameContext::doCommand(const string &cmd)
-{
-    curLocation()->doCommand(cmd);
-}
-
-GameItem *GameContext::getItem(int gid, const byte *key)
-{
-    map<int, GameItem *>::iterator it = savedItems_.find(gid);
-    if (it != savedItems_.end())
-    {   
-        return it->second;
-    }
-    else
-    {
-        GameLocation *curLoc = curLocation();
-        GameItem *item = GameItem::read(*this, gid, key, curLoc);    
-        if (item)
-        {
-            savedItems_[gid] = item;
-            originalItemLocations_[gid] = pair<GameItem *, GameLocation *>(item, curLoc);
-        }
-        return item;
-    }
-}
-
-void GameContext::playGame()
-{
-    GameLocation *loc = getTopLevelLocation(in->initialKey());
-   
-    if (!loc)
-    {
-        cout << "invalid data file: no initial location" << endl;
-        return;
-    }
-
-    pushLocation(loc);
-    loc->enter();
-
-    while (true)
-    {
-        printExpansion(getPrompt());
-
-        string cmd;
-        getline(cin, cmd);
-
-        try 
-        {
-            doCommand(cmd);
-        }
-        catch (GameQuitException &ex)
-        {
-            ex;
-            break;
-        }        
-    }
-}
-
-GameLocation *GameContext::getSavedLocation(int gid)
-{
-    std::map<int, GameLocation *>::iterator it = savedLocations_.find(gid);
-    if (it != savedLocations_.end())
-    {
-        return it->second;
-    }
-    return NULL;
-}
-
-void trim(string &str)
-{
-    size_t start = str.find_first_not_of(' ');
-    if (start != string::npos)
-    {
-        str = str.substr(start, str.find_last_not_of(' ') - start + 1);
-    }
-    else
-    {
-        str = "";
-    }
-}
-
-void GameContext::addToInventory(GameItem *item)
-{
-    inventory_.push_back(item);
-    inventoryByTakeyHash_[bytestring(item->takeyhash(), KEYHASH_SIZE)] = item;
-}
-
-bool GameContext::retakeItem(int gid)
-{
-    std::map<int, pair<GameItem *, GameLocation *> >::iterator it = droppedItemLocations_.find(gid);
-
-    if (it != droppedItemLocations_.end())
-    {
-        GameItem *item = it->second.first;
-        GameLocation *loc = it->second.second;
-        loc->takeItem(item, item->takey());
-        droppedItemLocations_.erase(it);
-        return true;
-    }
-    else
-    {
-        return false;
-    }
-}
-
-GameLocation *GameContext::getLocation(int gid, const byte *key, GameLocation *parent)
-{
-    GameLocation *loc = getSavedLocation(gid);
-    if (loc)
-    {
-        return loc;
-    }
-
-    loc = GameLocation::read(*this, gid, key, parent);
-
-    if (loc)
-    {
-        savedLocations_[loc->gid()] = loc;
-    }
-
-    return loc;
-}
-void GameContext::dropInventoryItem(const byte *takeyHash)
-{
-    dropInventoryItem(takeyHash, curLocation());
-}
-
-void GameContext::dropInventoryItem(const byte *takeyHash, GameLocation *whereToDrop)
-{
-    std::map<bytestring, GameItem *>::iterator it = inventoryByTakeyHash_.find(bytestring(takeyHash, KEYHASH_SIZE));
-
-    if (it != inventoryByTakeyHash_.end())
-    {
-        GameItem *item = it->second;
-        for (size_t i = 0; i < inventory_.size(); i++)
-        {
-            if (inventory_[i] == item)
-            {
-                inventory_.erase(inventory_.begin() + i);
-                i--;
-            }
-        }
-
-        whereToDrop->dropItem(item);
-        droppedItemLocations_[item->gid()] = pair<GameItem *, GameLocation *>(item, whereToDrop);
-
-        inventoryByTakeyHash_.erase(it);
-    }
-}
-
-void GameContext::popLocationUntil(GameLocation *loc)
-{
-    vector<GameLocation *> &curLocationStack = locationStacks_.back();
-    while (!curLocationStack.empty() && curLocationStack.back() != loc)
-    {
-        curLocationStack.pop_back();
-    }
-}
-
-void GameContext::popLocation()
-{ 
-    locationStacks_.back().pop_back(); 
-}
-
-GameLocation *GameContext::curLocation()
-{ 
-    return locationStacks_.back().empty() ? NULL : locationStacks_.back().back(); 
-}
-
-void GameContext::pushLocation(GameLocation *loc)
-{ 
-    locationStacks_.back().push_back(loc); 
-}
-
-void GameContext::doCall()
-{   
-    locationStacks_.push_back(vector<GameLocation *>());
-    
-    // duplicate the previous location stack
-    locationStacks_.back() = locationStacks_[locationStacks_.size() - 2];
-}
-
-void GameContext::doReturn()
-{
-    if (locationStacks_.size() > 1)
-    {
-        locationStacks_.pop_back();
-    }
-}
-
-GameLocation *GameContext::getTopLevelLocation(const byte *key)
-{
-    int gid = in->getGid(ObjectTypeLocation, key);    
-    return getLocation(gid, key, NULL);
-}
-
-void GameContext::printExpansion(const string &story, bool appendNewline, int expansionCount)
-{
-    string line;
-	size_t start = 0; // where to start looking for open brackets { 
-    size_t nextPrint = 0; // the first character we haven't printed yet
-    size_t len = story.length();
-
-	while (true)
-	{
-		size_t bracket = story.find("{", start);        
-
-		if (bracket != string::npos)
-		{
-            size_t endBracket = string::npos;
-            size_t cur = bracket + 1;            
-            while (cur < len)
-            {
-                char ch = story[cur];
-                if (ch == '}')
-                {
-                    endBracket = cur;
-                    break;
-                }
-                if (ch == ' ' || (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || ch == '_' || ch == '.' || (ch >= '0' && ch <= '9'))
-                {
-                    cur++;
-                }
-                else
-                {
-                    break;
-                }
-            }
-
-            if (endBracket != string::npos)
-            {
-                cout << story.substr(nextPrint, bracket - nextPrint);
-
-                if (expansionCount > 0)
-                {
-                    string var = story.substr(bracket + 1, endBracket - bracket - 1);
-                    trim(var);
-                    transformLower(var);
-                    printVariable(var, expansionCount - 1);
-                }
-                start = nextPrint = endBracket + 1;
-            }
-            else
-            {
-                start = bracket + 1;
-            }
-        }
-        else // no more start brackets in the story
-        {
-            if (!story.empty())
-            {
-                cout << story.substr(nextPrint);
-                if (appendNewline)
-                {
-                    cout << endl;
-                }
-            }
-            return;
-        }
-    } // end while loop
-}
-
-string GameBase::decryptString(StreamTransformationFilter &decryptor)
-{
-    size_t len = decryptVal<int>(decryptor);
-    byte * buf = new byte[len];
-    if (decryptor.Get(buf, len) != len)
-    {
-        throw "WTF2 couldn't get enough bytes from decryptor";
-    }
-    string result((char*)buf, len);
-
-    delete buf;
-
-    return result;
-}
-
-GameBase *GameBase::read(GameContext &ctx, int gid, const byte *key, GameLocation *parent, DecryptFn decryptFn)
-{
-    if (!ctx.in->seekObject(gid))
-    {
-        return NULL;
-    }
-
-    byte iv[AES::BLOCKSIZE];
-    ctx.in->stream().read((char *)iv, AES::BLOCKSIZE);
-
-    CFB_Mode<AES>::Decryption decryption(key, KEY_SIZE, iv);
-
-    FileSource source(ctx.in->stream(), false);
-
-    AutoPumpFilter *decryptor = new AutoPumpFilter(decryption, source);
-
-    source.Attach(decryptor);
-
-    int magic = decryptVal<int>(*decryptor);
-
-    if (magic != DEBUG_MAGIC)
-    {
-        cout << "UH OH! bad magic" << endl;
-        return NULL;
-    }
-
-    GameBase *result = decryptFn(ctx, *decryptor, parent);
-
-    if (result)
-    {
-        memcpy(result->key_, key, KEY_SIZE);
-        result->gid_ = gid;
-    }
-
-    return result;
-}
-
-GameLocation::~GameLocation()
-{ 
-    if (startKey_) delete[] startKey_; 
-}
-
-void GameLocation::doAction(const byte *key)
-{
-    GameAction *action = this->getAction(key, true);
-    if (action)
-    {
-        doAction(action);
-        delete action;
-    }
-}
-
-void GameLocation::doAction(GameAction *action, const std::vector<std::string> &args)
-{
-    string argStr;
-    concatenateTokens(args, argStr);
-
-    ctx_->lastArgs = argStr;
-
-    action->doAction(args);
-}
-
-void GameLocation::doCommand(const std::string &cmd)
-{
-    ctx_->lastCommand = cmd;
-
-    vector<string> tokens;
-    tokenize(cmd, tokens);
-
-    byte actionKey[KEY_SIZE];
-
-    vector<string> reverseArgs;
-
-    bool isExactCommand = true;
-    while (true)
-    {
-        string partialCmd;
-        concatenateTokens(tokens, partialCmd);
-
-        commandKey(partialCmd, actionKey);
-
-        GameAction *action = this->getAction(actionKey, isExactCommand);
-        if (action != NULL)
-        {
-            vector <string> args;
-            while (reverseArgs.size())
-            {
-                args.push_back(reverseArgs.back());
-                reverseArgs.pop_back();
-            }
-
-            doAction(action, args);
-            delete action;
-            return;
-        }
-
-        if (!tokens.size())
-            break;
-
-        reverseArgs.push_back(tokens.back());
-        tokens.pop_back();
-        isExactCommand = false;        
-    }
-
-}
-
-void GameLocation::getAncestors(vector<GameLocation *> &ancestors)
-{
-    GameLocation *cur = this;
-    while (cur != NULL)
-    {
-        ancestors.push_back(cur);
-        cur = cur->gameParent();
-    }
-
-}
-
-GameBase *GameLocation::decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent)
-{
-    GameLocation *loc = new GameLocation(ctx, parent);
-
-    char hasStart = decryptVal<char>(decryptor);
-
-    if (hasStart != 0 && hasStart != 1)
-    {
-        throw "OMG WTF BBQ bad hasStart value";
-    }
-
-    if (hasStart)
-    {
-        // save somewhere
-        loc->startKey_ = new byte[KEY_SIZE];
-        decryptor.Get(loc->startKey_, KEY_SIZE);
-    }
-
-    loc->title = decryptString(decryptor);
-    loc->desc = decryptString(decryptor);
-    loc->prompt = decryptString(decryptor);
-    size_t numIgnored = decryptVal<size_t>(decryptor);
-    for (size_t i = 0; i < numIgnored; i++)
-    {
-        string ig = decryptString(decryptor);
-        loc->ignoredSet_.insert(ig);
-    }
-
-    size_t numChildLocations = decryptVal<size_t>(decryptor);
-
-    for (size_t i = 0; i < numChildLocations; i++)
-    {
-        byte keyhashBuf[KEYHASH_SIZE];
-        decryptor.Get(keyhashBuf, KEYHASH_SIZE);
-        
-        int gid = decryptVal<int>(decryptor);
-
-        loc->locationTable_[bytestring(keyhashBuf, KEYHASH_SIZE)] = gid;
-    }
-
-    size_t numItems = decryptVal<size_t>(decryptor);
-    for (size_t i = 0; i < numItems; i++)
-    {
-        byte itemKey[KEY_SIZE];
-        decryptor.Get(itemKey, KEY_SIZE);
-        loc->itemKeys_.push_back(bytestring(itemKey, KEY_SIZE));
-    }
-
-    size_t numChildActions = decryptVal<size_t>(decryptor);
-
-    for (size_t i = 0; i < numChildActions; i++)
-    {
-        byte cmdKeyHash[KEYHASH_SIZE];
-
-        decryptor.Get(cmdKeyHash, KEYHASH_SIZE);
-
-        byte encCommandBlock[3 * AES::BLOCKSIZE];
-        decryptor.Get(encCommandBlock, 3 * AES::BLOCKSIZE);
-        
-        loc->actionTable_[bytestring(cmdKeyHash, KEYHASH_SIZE)].push_back(bytestring(encCommandBlock, 3 * AES::BLOCKSIZE));
-    }
-
-    return loc;
-}
-
-GameLocation *GameLocation::getChildByKey(const byte *key)
-{
-    byte keyHash[KEYHASH_SIZE];
-    hashKey(key, keyHash);
-
-    map<bytestring,int>::const_iterator it = locationTable_.find(bytestring(keyHash, KEYHASH_SIZE));
-
-    if (it == locationTable_.end())
-    {       
-        throw "WTF bad location";
-    }
-
-    int startGid = it->second;
-
-    return ctx_->getLocation(startGid, key, this);
-}
-
-std::string GameLocation::getPrompt()
-{
-    if (this->prompt.empty() && this->parent_)
-    {
-        return this->gameParent()->getPrompt();
-    }
-    else
-    {
-        return this->prompt;
-    }
-}
-
-void GameLocation::dropItem(GameItem *item)
-{
-    itemKeys_.push_back(bytestring(item->key(), KEY_SIZE));
-}
-
-void GameLocation::enter()
-{
-    if (startKey_)
-    {
-        GameLocation *startLoc = getChildByKey(startKey_);
-        if (startLoc)
-        {
-            ctx_->pushLocation(startLoc);
-            startLoc->enter();
-        }
-    }
-    else
-    {
-        if (!hasEnteredBefore_)
-        {
-            doAction(ctx_->firstVisitKey());
-            hasEnteredBefore_ = true;
-        }
-        else
-        {
-            doAction(ctx_->returnVisitKey());
-        }
-
-        doAction(ctx_->forcedKey());
-    }
-}
-
-GameAction *GameLocation::getAction(const byte *actionKey, bool isExactCommand, bool searchParents)
-{
-    byte keyHash[KEYHASH_SIZE];
-    hashKey(actionKey, keyHash);
-    bytestring keyHashStr = bytestring(keyHash, KEYHASH_SIZE);
-
-    GameLocation *cur = this;
-    while (cur != NULL)
-    {
-        GameAction *act = cur->getActionInternal(actionKey, keyHashStr, isExactCommand);
-        if (act != NULL)
-        {
-            return act;
-        }
-        if (!searchParents)
-        {
-            break;
-        }
-
-        cur = cur->gameParent();
-    }
-    return NULL;
-}
-
-GameAction *GameLocation::getActionInternal(const byte *actionKey, const bytestring &actionKeyHash, bool isExactCommand)
-{
-    map<bytestring, vector<bytestring> >::const_iterator it = actionTable_.find(actionKeyHash);
-
-    if (it != actionTable_.end())
-    {
-        vector<bytestring> actionBlocks = it->second;
-
-        size_t numActionBlocks = actionBlocks.size();
-
-        for (size_t i = 0; i < numActionBlocks; i++)
-        {
-            //H(CK(normalized cmd))->iv,E(CK(normalized cmd), gid + R(cmd))
-
-            const byte *encryptedBlock = actionBlocks[i].c_str(); // 3x AES::BLOCKSIZE
-            
-            const byte *iv = encryptedBlock; // 1st block is IV
-            const byte *encGid = encryptedBlock + AES::BLOCKSIZE;
-            const byte *encKey = encGid + AES::BLOCKSIZE;
-            
-            CFB_Mode<AES>::Decryption decryption(actionKey, KEY_SIZE, iv);
-
-            byte gidBlock[AES::BLOCKSIZE];
-            byte actionKey[AES::BLOCKSIZE];
-            decryption.ProcessData(gidBlock, encGid, AES::BLOCKSIZE);
-            decryption.ProcessData(actionKey, encKey, AES::BLOCKSIZE);
-
-            bool needsExactCommand = *gidBlock ? true : false; // byte 0 has exact bit
-
-            if (needsExactCommand && !isExactCommand)
-                continue;
-
-            int gid = *((int *)gidBlock + 1); // bytes 4-7 are gid
-            canonicalizeEndianness(gid);
-
-            GameAction *action = GameAction::read(*ctx_, gid, actionKey, this);
-            if (action)
-            {
-                return action;
-            }
-        }
-    }
-    return NULL;
-}
-
-void GameAction::doAction(const std::vector<std::string> &args)
-{
-    ctx_->printExpansion(this->desc, true);
-
-    for (size_t i = 0; i < takesKeys_.size(); i++)
-    {
-        TakenItem &takenItem = takesKeys_[i];
-
-        int gid = ctx_->in->getGid(ObjectTypeItem, takenItem.key);
-
-        if (!ctx_->retakeItem(gid))
-        {
-            // the item may be in a different location, so we go to that location, take the item, 
-            // and then return to where we were before.
-            ctx_->doCall();
-
-            followPath(takenItem.levelsUp, takenItem.locationKeysDown);
-            
-            GameLocation *itemLoc = ctx_->curLocation();
-
-            GameItem *item = ctx_->getItem(gid, takenItem.key);
-
-            itemLoc->takeItem(item, takenItem.takey);
-            
-            ctx_->doReturn();
-        }
-    }
-
-    for (size_t i = 0; i < dropsTakeyHashes_.size(); i++)
-    {
-        ctx_->dropInventoryItem(dropsTakeyHashes_[i].c_str());
-    }
-
-    vector<GameFile *> filesToLaunch;
-    for (size_t i = 0; i < files_.size(); i++)
-    {
-        const byte *fileKey = files_[i].key;
-        int fileGid = ctx_->in->getGid(ObjectTypeFile, fileKey);
-        GameFile *file = GameFile::read(*ctx_, fileGid, fileKey);
-        if (files_[i].launch)
-        {
-            filesToLaunch.push_back(file);
-        }
-        else
-        {
-            delete file;
-        }
-    }
-    for (size_t i = 0; i < filesToLaunch.size(); i++)
-    {
-        filesToLaunch[i]->launch();
-        delete filesToLaunch[i];
-    }
-
-    if (this->changesLocation_)
-    {
-        followPath(levelsUp_, locationKeysDown_);
-        ctx_->curLocation()->enter();
-    }
-}
-
-void GameAction::followPath(size_t levelsUp, const vector<KeyBuffer> &locationKeysDown)
-{
-    ctx_->popLocationUntil(this->gameParent());
-
-    for (size_t i = 0; i < levelsUp; i++)
-    {
-        ctx_->popLocation();
-    }
-
-    for (size_t i = 0; i < locationKeysDown.size(); i++)
-    {
-        const byte *locationKey = locationKeysDown[i].buf;
-
-        GameLocation *cur = ctx_->curLocation();
-        GameLocation *loc;
-
-        if (cur)
-        {
-            loc = cur->getChildByKey(locationKey);
-        }
-        else
-        {
-            loc = ctx_->getTopLevelLocation(locationKey);
-        }
-
-        assert(loc);
-        ctx_->pushLocation(loc);
-    }
-}
-
-byte *GameAction::dokey()
-{
-    return dokey_;
-}
-
-#define NEW_ACTION_FOR_TYPE(type) case type: return new GameSpecializedAction<type>(ctx, parent);
-GameAction *GameAction::newActionByType(int actionType, GameContext &ctx, GameLocation *parent)
-{
-    switch (actionType)
-    {
-        NEW_ACTION_FOR_TYPE(ActionTypeInventory);
-        NEW_ACTION_FOR_TYPE(ActionTypeLook);
-        NEW_ACTION_FOR_TYPE(ActionTypeQuit);
-        NEW_ACTION_FOR_TYPE(ActionTypeCall);
-        NEW_ACTION_FOR_TYPE(ActionTypeReturn);
-        NEW_ACTION_FOR_TYPE(ActionTypeTake);
-        NEW_ACTION_FOR_TYPE(ActionTypeDrop);
-        NEW_ACTION_FOR_TYPE(ActionTypeSave);
-        NEW_ACTION_FOR_TYPE(ActionTypeLoad);
-        default:
-        NEW_ACTION_FOR_TYPE(ActionTypeDefault);
-    }
-}
-
-bool GameAction::getDokeyFromPredicate(GameContext &ctx, AutoPumpFilter &decryptor, byte *dokey)
-{
-    size_t predicateSize = decryptVal<size_t>(decryptor);
-    if (predicateSize == 0)
-    {
-        decryptor.Get(dokey, KEY_SIZE);
-        return true;
-    }
-
-    bool hasDokey = false;
-    for (size_t i = 0; i < predicateSize; i++)
-    {
-        byte keyhashBuf[KEYHASH_SIZE];
-        byte encDokey[KEY_SIZE];   
-        byte iv[KEY_SIZE];
-
-        vector<GameItem *> items;
-
-        size_t conjunctionSize = decryptVal<size_t>(decryptor);
-
-        bool hasAllItems = true;
-        for (size_t j = 0; j < conjunctionSize; j++)
-        {
-            decryptor.Get(keyhashBuf, KEYHASH_SIZE);
-
-            if (hasAllItems)
-            {
-                GameItem *item = ctx.getInventoryItem(keyhashBuf);
-                if (item != NULL)
-                {
-                    items.push_back(item);
-                }
-                else
-                {
-                    hasAllItems = false;
-                }
-            }
-        }
-
-        decryptor.Get(iv, AES::BLOCKSIZE);
-        decryptor.Get(encDokey, KEY_SIZE);
-
-        if (hasAllItems && !hasDokey)
-        {
-            byte conjunctionKey[KEY_SIZE];
-            makeConjunctionKey(items, conjunctionKey);
-            
-            CFB_Mode<AES>::Decryption dokeyDecryption(conjunctionKey, KEY_SIZE, iv);
-
-            dokeyDecryption.ProcessData(dokey, encDokey, KEY_SIZE);
-            hasDokey = true;
-        }
-    }
-
-    return hasDokey;
-}
-
-GameBase *GameAction::decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent)
-{
-    byte dokey[KEY_SIZE];
-
-    if (!getDokeyFromPredicate(ctx, decryptor, dokey))
-    {
-        return NULL;
-    }
-
-    byte iv[AES::BLOCKSIZE];
-    decryptor.Get(iv, AES::BLOCKSIZE);
-   
-    CFB_Mode<AES>::Decryption innerDecryption(dokey, KEY_SIZE, iv);
-
-    StreamTransformationFilter *innerDecryptorPtr = new AutoPumpFilter(innerDecryption, decryptor.GetSource(), 2 * AES::BLOCKSIZE);
-
-    decryptor.Attach(innerDecryptorPtr);
-
-    StreamTransformationFilter &innerDecryptor = *innerDecryptorPtr;
-
-    int actionType = decryptVal<int>(innerDecryptor);
-
-    GameAction *act = newActionByType(actionType, ctx, parent);
-
-    act->desc = decryptString(innerDecryptor);
-
-    size_t numFiles = decryptVal<size_t>(innerDecryptor);
-    for (size_t i = 0; i < numFiles; i++)
-    {
-        act->files_.push_back(OpenedFile());
-        OpenedFile &file = act->files_.back();
-        innerDecryptor.Get(file.key, KEY_SIZE);
-        file.launch = decryptVal<byte>(innerDecryptor) ? 1 : 0;
-    }
-
-    size_t numTakes = decryptVal<size_t>(innerDecryptor);
-
-    for (size_t i = 0; i < numTakes; i++)
-    {
-        act->takesKeys_.push_back(TakenItem());
-
-        TakenItem &takenItem = act->takesKeys_.back();
-                
-        innerDecryptor.Get(takenItem.key, KEY_SIZE);
-        innerDecryptor.Get(takenItem.takey, KEY_SIZE);
-
-        takenItem.levelsUp = decryptVal<size_t>(innerDecryptor);
-        
-        size_t numLocationsDown = decryptVal<size_t>(innerDecryptor);
-
-        for (size_t i = 0; i < numLocationsDown; i++)
-        {
-            takenItem.locationKeysDown.push_back(KeyBuffer());
-            KeyBuffer &keybuf = takenItem.locationKeysDown.back();
-            innerDecryptor.Get(keybuf.buf, KEY_SIZE);
-        }
-    }
-
-    size_t numDrops = decryptVal<size_t>(innerDecryptor);
-    for (size_t i = 0; i < numDrops; i++)
-    {
-        byte itemTakeyHash[KEYHASH_SIZE];
-        innerDecryptor.Get(itemTakeyHash, KEYHASH_SIZE);
-        act->dropsTakeyHashes_.push_back(bytestring(itemTakeyHash, KEYHASH_SIZE));
-    }
-    
-    act->changesLocation_ = decryptVal<byte>(innerDecryptor) ? true : false;
-    
-    if (act->changesLocation_)
-    {
-        act->levelsUp_ = decryptVal<size_t>(innerDecryptor);       
-
-        size_t numLocationsDown = decryptVal<size_t>(innerDecryptor);
-
-        for (size_t i = 0; i < numLocationsDown; i++)
-        {
-            act->locationKeysDown_.push_back(KeyBuffer());
-            innerDecryptor.Get(act->locationKeysDown_.back().buf, KEY_SIZE);            
-        }
-    }
-    else
-    {
-        act->levelsUp_ = 0;
-    }
-    
-    size_t auxDataSize = decryptVal<size_t>(innerDecryptor);
-    for (size_t i = 0; i < auxDataSize; i++)
-    {
-        string key = decryptString(innerDecryptor);
-        act->auxData[key] = decryptString(innerDecryptor);
-    }
-
-    memcpy(act->dokey_, dokey, KEY_SIZE);
-
-    return act;
-}
-
-template <ActionType actionType>
-void GameSpecializedAction<actionType>::doAction(const std::vector<std::string> &args)
-{
-    this->GameAction::doAction(args);
-}
-
-void GameAction::iterateItems(const vector<GameItem *> &items)
-{
-    size_t numItems = items.size();
-    if (numItems == 0)
-    {
-        ctx_->printExpansion(auxData["empty"], true);
-    }
-    else
-    {
-        ctx_->printExpansion(auxData["nonempty"], true);
-    }
-
-    for (size_t i = 0; i < numItems; i++)
-    {
-        ctx_->printExpansion(auxData["prefix"]);
-        ctx_->printExpansion(items[i]->title);
-        ctx_->printExpansion(auxData["suffix"]);
-        cout << endl;
-    }
-}
-
-template <>
-void GameSpecializedAction<ActionTypeLook>::doAction(const std::vector<std::string> &args)
-{
-    this->GameAction::doAction(args);
-
-    GameLocation *loc = ctx_->curLocation();
-
-    vector<GameItem *> visibleItems;
-    for (size_t i = 0; i < loc->numItems(); i++)
-    {
-        GameItem *item = loc->getItem(i);
-        if (item->visible && !item->title.empty())
-        {
-            visibleItems.push_back(item);
-        }
-    }
-
-    iterateItems(visibleItems);
-}
-
-template <>
-void GameSpecializedAction<ActionTypeInventory>::doAction(const std::vector<std::string> &args)
-{
-    this->GameAction::doAction(args);
-
-    vector<GameItem *> visibleItems;
-    for (size_t i = 0; i < ctx_->inventorySize(); i++)
-    {
-        GameItem *item = ctx_->getInventoryItem(i);
-
-        if (!item->title.empty())
-        {
-            visibleItems.push_back(item);
-        }
-    }
-    iterateItems(visibleItems);
-}
-
-template <>
-void GameSpecializedAction<ActionTypeQuit>::doAction(const std::vector<std::string> &args)
-{
-    this->GameAction::doAction(args);
-    throw GameQuitException();
-}
-
-template <>
-void GameSpecializedAction<ActionTypeCall>::doAction(const vector<string> &args)
-{
-    ctx_->doCall(); // call must go before action because we need to duplicate the previous location stack
-    this->GameAction::doAction(args);
-}
-
-template <>
-void GameSpecializedAction<ActionTypeReturn>::doAction(const vector<string> &args)
-{
-    this->GameAction::doAction(args);
-    ctx_->doReturn();    
-    ctx_->curLocation()->enter();
-}
-
-#define SAVE_FILE_EXTENSION ".crs"
-
-bool isOkSaveName(const std::string &saveFile)
-{
-    for (size_t i = 0; i < saveFile.size(); i++)
-    {
-        if (!isOkFilenameChar(saveFile[i]))
-        {
-            return false;
-        }
-    }
-    return true;
-}
-
-bool GameAction::getSaveFilename(const vector<string> &args, string &filename)
-{
-    filename = auxData["savename"];
-
-    if (filename.empty())
-    {
-        if (!args.empty())
-        {
-            filename = args[0];
-        }
-        else
-        {
-            ctx_->printExpansion(auxData["prompt"]);
-            getline(cin, filename);
-        }
-    }
-
-    if (filename.empty())
-    {
-        ctx_->printExpansion(auxData["empty"], true);
-        return false;
-    }
-    else if (!isOkSaveName(filename))
-    {
-        ctx_->printExpansion(auxData["invalid"], true);
-        return false;
-    }
-    else
-    {
-        filename += SAVE_FILE_EXTENSION;
-        return true;
-    }
-}
-
-template <>
-void GameSpecializedAction<ActionTypeLoad>::doAction(const vector<string> &args)
-{
-    string filename;
-    if (getSaveFilename(args, filename))
-    {
-        ifstream in(filename.c_str(), ios::binary | ios::in);
-        
-        if (ctx_->load(in))
-        {
-            ctx_->printExpansion(auxData["success"], true);
-        }
-        else
-        {
-            ctx_->printExpansion(auxData["failure"], true);
-        }
-        in.close();
-
-    }
-    this->GameAction::doAction(args);
-}
-
-template <>
-void GameSpecializedAction<ActionTypeSave>::doAction(const vector<string> &args)
-{
-    string filename;
-    if (getSaveFilename(args, filename))
-    {
-        ofstream out(filename.c_str(), ios::binary | ios::out | ios::trunc);
-
-        if (ctx_->save(out))
-        {
-            ctx_->printExpansion(auxData["success"], true);
-        }
-        else
-        {
-            ctx_->printExpansion(auxData["failure"], true);
-        }
-
-        out.close();
-    }
-
-    this->GameAction::doAction(args);
-}
-
-template <>
-void GameSpecializedAction<ActionTypeTake>::doAction(const vector<string> &args)
-{
-    string itemTitle;
-    concatenateTokens(args, itemTitle);
-
-    GameLocation *curLocation = ctx_->curLocation();
-    size_t numItems = curLocation->numItems();
-
-    bool tookSomething = false;
-    for (size_t i = 0; i < numItems; i++)
-    {
-        GameItem *item = curLocation->getItem(i);
-        byte *takey = item->takey();
-        if (takey && item->hasTitle(itemTitle))
-        {
-            curLocation->takeItem(item, takey);
-            ctx_->printExpansion(auxData["success"], true);
-            tookSomething = true;
-            break;
-        }
-    }
-    if (!tookSomething)
-    {
-        ctx_->printExpansion(auxData["failure"], true);
-    }
-    
-    this->GameAction::doAction(args);
-}
-
-template<>
-void GameSpecializedAction<ActionTypeDrop>::doAction(const vector<string> &args)
-{
-    string itemTitle;
-    concatenateTokens(args, itemTitle);
-
-    size_t inventorySize = ctx_->inventorySize();
-
-    bool droppedSomething = false;
-    for (size_t i = 0; i < inventorySize; i++)
-    {
-        GameItem *item = ctx_->getInventoryItem(i);
-        if (item->hasTitle(itemTitle))
-        {
-            ctx_->dropInventoryItem(item->takeyhash());
-            ctx_->printExpansion(auxData["success"], true);
-            droppedSomething = true;
-            break;
-        }
-    }
-    if (!droppedSomething)
-    {
-        ctx_->printExpansion(auxData["failure"], true);
-    }
-
-    this->GameAction::doAction(args);
-}
-
-GameItem *GameLocation::getItem(size_t i)
-{
-    const byte *itemKey = itemKeys_[i].c_str();
-
-    int gid = ctx_->in->getGid(ObjectTypeItem, itemKey);
-
-    if (gid == -1)
-    {
-        throw "WTF";
-    }
-
-    return ctx_->getItem(gid, itemKey);
-}
-
-void GameLocation::takeItem(GameItem *item, const byte *takey)
-{
-    bytestring itemKeyStr = bytestring(item->key(), KEY_SIZE);
-
-    for (size_t i = 0; i < itemKeys_.size(); i++)
-    {
-        if (itemKeys_[i] == itemKeyStr)
-        {
-            item->setTakey(takey);
-            itemKeys_.erase(itemKeys_.begin() + i);
-            ctx_->addToInventory(item);
-            return;
-        }   
-    }
-}
-
-bool GameItem::hasTitle(const std::string &title)
-{
-    byte titleKey[KEY_SIZE];
-    byte titleKeyHash[KEYHASH_SIZE];
-    
-    commandKey(title, titleKey);
-    hashKey(titleKey, titleKeyHash);
-
-    for (size_t i = 0; i < this->titles.size(); i++)
-    {
-        if (!memcmp(this->titles[i].buf, titleKeyHash, KEYHASH_SIZE))
-        {
-            return true;
-        }
-    }
-    return false;
-}
-
-GameBase* GameItem::decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent)
-{
-    GameItem *item = new GameItem(ctx, parent);
-    
-    item->visible = decryptVal<byte>(decryptor) ? true : false;
-    item->title = decryptString(decryptor);
-    size_t numTitles = decryptVal<size_t>(decryptor);
-    for (size_t i = 0; i < numTitles; i++)
-    {
-        item->titles.push_back(KeyHashBuffer());
-
-        decryptor.Get(item->titles.back().buf, KEYHASH_SIZE);
-    }
-    item->desc = decryptString(decryptor);
-    item->restrictTake = decryptVal<byte>(decryptor) ? true : false;
-    if (!item->restrictTake)
-    {
-        item->takey_ = new byte[KEY_SIZE];
-        decryptor.Get(item->takey_, KEY_SIZE);
-    }
-    return item;
-}
-
-void GameFile::launch()
-{
-#ifdef WIN32
-	const string &cmd = dest;
-#else
-	string cmd = "open " + dest;
-#endif
-    //cout << dest << endl;
-	if (system(("\"" + dest + "\"").c_str()) == -1)
-	{
-		cerr << "Your computer could not open " << dest << " automatically." << endl;
-	}
-}
-
-#define FILEBUF_SIZE 2048
-#define MIN(a,b) (((a)<(b))?(a):(b))
-
-#define OUTPUT_DIR "extracted"
-
-GameBase* GameFile::decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent)
-{
-    GameFile *file = new GameFile(ctx);
-
-    file->dest = decryptString(decryptor);
-
-    cleanFilename(file->dest, true);
-
-    file->dest = OUTPUT_DIR PATH_SEP + file->dest;
-    
-    struct stat outputDirInfo;
-    if (stat(OUTPUT_DIR, &outputDirInfo) != 0)
-    {
-        system("mkdir "OUTPUT_DIR);
-    }
-    
-    struct stat fileInfo; 
-    if (stat(file->dest.c_str(), &fileInfo) == 0) 
-    { 
-        cout << "file exists" << endl;
-    }
-    else
-    {
-        size_t len = decryptVal<size_t>(decryptor);
-        fstream out(file->dest.c_str(), ios::out|ios::binary);
-
-        if (out.fail())
-        {   
-            cerr << "ERROR: could not open " << file->dest << " for writing" << endl;
-        }
-        else
-        {
-            byte buf[FILEBUF_SIZE];
-            
-            // there's surely a way to do this with crypto++ filters...
-            size_t left = len;
-            while (true)
-            {
-                size_t len = decryptor.Get(buf, MIN(left,FILEBUF_SIZE));
-                if (len == 0)
-                {
-                    break;
-                }
-                out.write((char *)buf,len);
-                left -= len;
-            }
-            out.close();
-        }
-    }
-    return file;
-}
+#include "GameBase.h"
+#include "GameInput.h"
+#include "GameRecoveryLog.h"
+
+using namespace std;
+using namespace CryptoPP;
+
+#include "cryptlib.h"
+#include "filters.h"
+#include "files.h"
+#include "modes.h"
+#include "aes.h"
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include <ctime>
+
+#ifdef WIN32
+#define PATH_SEP "\\"
+#else
+#define PATH_SEP "/"
+#endif
+
+#ifdef WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN			
+#include <windows.h> // for Sleep
+#else
+
+#include <unistd.h> // for usleep
+
+void Sleep(unsigned int ms)
+{
+  unsigned int sec = ms / 1000;
+  ms = ms % 1000;
+
+  sleep(sec);
+  usleep(1000 * ms);
+}
+
+#endif
+
+#include <sys/stat.h> 
+
+
+class AutoPumpFilter : public StreamTransformationFilter
+{
+public:
+    AutoPumpFilter(StreamTransformation &c, Source &pumpee, size_t pumpSlack = AES::BLOCKSIZE) 
+        : StreamTransformationFilter(c), pumpee_(&pumpee), pumpSlack_(pumpSlack)
+    {
+    }
+
+    virtual ~AutoPumpFilter() 
+    {
+    }
+
+    virtual size_t Get(byte &outByte)
+    {
+        return this->Get(&outByte, 1);
+    }
+
+    virtual size_t Get(byte *outString, size_t getMax)
+    {
+        size_t res = this->StreamTransformationFilter::Get(outString, getMax);
+
+        if (res < getMax)
+        {
+            size_t left = getMax - res;
+            pumpee_->Pump(left + pumpSlack_);
+            res += this->StreamTransformationFilter::Get(outString + res, left);
+        }
+        return res;
+    }
+
+    Source &GetSource()
+    {
+        return *pumpee_;
+    }
+private:
+    Source *pumpee_;
+    size_t pumpSlack_;
+};
+
+GameContext::~GameContext()
+{
+    delete awaitingAction_;
+
+    // finishes writing the last autosave
+    delete autosave_;
+
+    delete recoveryLog_;
+
+    flushOutput();
+
+    for (map<int, GameItem *>::iterator it = savedItems_.begin(); it != savedItems_.end(); ++it)
+    {
+        delete it->second;
+    }
+
+    for (map<int, GameLocation *>::iterator it = savedLocations_.begin(); it != savedLocations_.end(); ++it)
+    {
+        delete it->second;
+    }
+}
+
+GameStateSnapshot::~GameStateSnapshot()
+{
+    for (map<int, GameItem *>::iterator it = savedItems.begin(); it != savedItems.end(); ++it)
+    {
+        delete it->second;
+    }
+
+    for (map<int, GameLocation *>::iterator it = savedLocations.begin(); it != savedLocations.end(); ++it)
+    {
+        delete it->second;
+    }
+}
+
+void GameContext::swapState(GameStateSnapshot &state)
+{
+    locationStacks_.swap(state.locationStacks);
+    savedLocations_.swap(state.savedLocations);
+    savedItems_.swap(state.savedItems);
+    inventory_.swap(state.inventory);
+    inventoryByTakeyHash_.swap(state.inventoryByTakeyHash);
+    droppedItemLocations_.swap(state.droppedItemLocations);
+    originalItemLocations_.swap(state.originalItemLocations);
+}
+
+void GameContext::printVariable(GameTemplate::Op op, int expansionCount)
+{
+    switch (op)
+    {
+    case GameTemplate::OpDelay:
+        if (!replaying_)
+        {
+            scheduler_.add(outBuffer_, GameScheduler::WaitDelay, DELAY_MS);
+        }
+        break;
+    case GameTemplate::OpPause:
+        if (replaying_)
+        {
+            string line;
+            readInputLine(line);
+        }
+        else
+        {
+            scheduler_.add(outBuffer_, GameScheduler::WaitInput);
+        }
+        break;
+    case GameTemplate::OpCommand:
+        out_ << lastCommand;
+        break;
+    case GameTemplate::OpArgs:
+        out_ << lastArgs;
+        break;
+    case GameTemplate::OpSpace:
+        out_ << " ";
+        break;
+    case GameTemplate::OpBreak:
+        out_ << endl;
+        break;
+    case GameTemplate::OpLocationTitle:
+        printExpansion(curLocation()->titleTemplate(), false, expansionCount);
+        break;
+    case GameTemplate::OpLocationDesc:
+        printExpansion(curLocation()->descTemplate(), false, expansionCount);
+        break;
+    case GameTemplate::OpLocationGid:
+        out_ << curLocation()->gid();
+        break;
+    case GameTemplate::OpLocationPrompt:
+        printExpansion(curLocation()->promptTemplate(), false, expansionCount);
+        break;
+    case GameTemplate::OpTime:
+        {
+            time_t now = time(NULL);
+            char buf[32];
+            strftime(buf, sizeof(buf), "%H:%M:%S", localtime(&now));
+            out_ << buf;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+bool GameContext::load(const string &name)
+{
+    SaveData data;
+    if (!saveStore_->load(name, data))
+        return false;
+
+    return load(data);
+}
+
+bool GameContext::load(const SaveData &data)
+{
+    wake();
+
+    // the previous state is kept by the journal, so that we can roll back to it if the load fails
+    size_t mark = journal_.mark();
+    journal_.replaceState(new GameStateSnapshot());
+
+    bool success = restoreSaveData(data);
+    if (!success)
+    {
+        journal_.rollback(mark);
+    }
+    
+    //cout << "current location: " << curLocation()->title << endl;
+
+    return success;
+}
+
+/* Restores the state captured by captureSaveData(). The locations and items are not decrypted 
+ * until the game needs their contents, so that loading doesn't have to decrypt
+ * every location and item that was visited before the game was saved.
+ */
+bool GameContext::restoreSaveData(const SaveData &data)
+{
+    // a game is always somewhere (curLocation needs a stack)
+    if (data.locationStacks.empty())
+    {
+        return false;
+    }
+
+    vector<GameLocation *> locations;
+    for (size_t i = 0; i < data.locations.size(); i++)
+    {
+        const SaveData::Location &savedLoc = data.locations[i];
+        GameLocation *parent = savedLoc.parent ? locations[savedLoc.parent - 1] : NULL;
+
+        GameLocation *loc = getLazyLocation(savedLoc.gid, savedLoc.key, parent);
+        if (!loc)
+        {
+            return false;
+        }
+        locations.push_back(loc);
+    }
+
+    for (size_t i = 0; i < data.locationStacks.size(); i++)
+    {
+        locationStacks_.push_back(vector<GameLocation *>());
+        vector<GameLocation *> &locationStack = locationStacks_.back();
+
+        // each location stack consists of the innermost location and all of its ancestors
+        for (size_t index = data.locationStacks[i]; index != 0; index = data.locations[index - 1].parent)
+        {
+            locationStack.push_back(locations[index - 1]);
+        }
+        reverse(locationStack.begin(), locationStack.end());
+    }
+
+    // items to take from their original location
+    for (size_t i = 0; i < data.inventory.size(); i++)
+    {
+        const SaveData::Item &savedItem = data.inventory[i];
+        GameLocation *originalLoc = locations[savedItem.originalLocation];
+
+        GameItem *item = getLazyItem(savedItem.gid, savedItem.key, originalLoc);
+        if (!item)
+        {
+            return false;
+        }
+
+        originalLoc->restoreItemRemoved(savedItem.key);
+        item->setTakey(savedItem.takey);
+        addToInventory(item);
+    }
+
+    // items to take from their original location and drop on a new location
+    for (size_t i = 0; i < data.droppedItems.size(); i++)
+    {
+        const SaveData::Item &savedItem = data.droppedItems[i];
+        GameLocation *originalLoc = locations[savedItem.originalLocation];
+        GameLocation *droppedLoc = locations[savedItem.droppedLocation];
+
+        GameItem *item = getLazyItem(savedItem.gid, savedItem.key, originalLoc);
+        if (!item)
+        {
+            return false;
+        }
+
+        originalLoc->restoreItemRemoved(savedItem.key);
+        droppedLoc->restoreItemAdded(savedItem.key);
+        item->setTakey(savedItem.takey);
+        journal_.setDroppedLocation(savedItem.gid, item, droppedLoc);
+    }    
+
+    return curLocation() != NULL;
+}
+
+// returns the index of loc in locations, adding it and its ancestors if necessary
+static size_t addSavedLocation(vector<SaveData::Location> &locations, map<GameLocation *, size_t> &indexes, GameLocation *loc)
+{
+    map<GameLocation *, size_t>::const_iterator it = indexes.find(loc);
+    if (it != indexes.end())
+    {
+        return it->second;
+    }
+
+    GameLocation *parent = loc->gameParent();
+
+    SaveData::Location savedLoc;
+    savedLoc.parent = parent ? addSavedLocation(locations, indexes, parent) + 1 : 0;
+    savedLoc.gid = loc->gid();
+    memcpy(savedLoc.key, loc->key(), KEY_SIZE);
+
+    locations.push_back(savedLoc);
+    return indexes[loc] = locations.size() - 1;
+}
+
+static void setSavedItem(SaveData::Item &savedItem, GameItem *item)
+{
+    savedItem.gid = item->gid();
+    memcpy(savedItem.key, item->key(), KEY_SIZE);
+    memcpy(savedItem.takey, item->takey(), KEY_SIZE);
+    savedItem.droppedLocation = 0;
+}
+
+void GameContext::captureSaveData(SaveData &data)
+{
+    map<GameLocation *, size_t> indexes;
+    captureSaveData(data, indexes);
+}
+
+// indexes maps the locations in data to their index in data.locations
+void GameContext::captureSaveData(SaveData &data, map<GameLocation *, size_t> &indexes)
+{
+    data.clear();
+
+    for (size_t i = 0; i < locationStacks_.size(); i++)
+    {
+        vector<GameLocation *> &locationStack = locationStacks_[i];
+        data.locationStacks.push_back(locationStack.empty() ? 0 : addSavedLocation(data.locations, indexes, locationStack.back()) + 1);
+    }
+
+    for (size_t i = 0; i < inventory_.size(); i++)
+    {
+        GameItem *item = inventory_[i];
+
+        data.inventory.push_back(SaveData::Item());
+        SaveData::Item &savedItem = data.inventory.back();
+        setSavedItem(savedItem, item);
+
+        GameLocation *originalLoc = originalItemLocations_[item->gid()].second;
+        savedItem.originalLocation = addSavedLocation(data.locations, indexes, originalLoc);
+    }
+
+    for (map<int, pair<GameItem *, GameLocation *> >::const_iterator it = droppedItemLocations_.begin(); 
+            it != droppedItemLocations_.end(); ++it)
+    {
+        GameItem *item = it->second.first;
+        GameLocation *droppedLoc = it->second.second;
+
+        data.droppedItems.push_back(SaveData::Item());
+        SaveData::Item &savedItem = data.droppedItems.back();
+        setSavedItem(savedItem, item);
+
+        GameLocation *originalLoc = originalItemLocations_[item->gid()].second;
+        savedItem.originalLocation = addSavedLocation(data.locations, indexes, originalLoc);
+        savedItem.droppedLocation = addSavedLocation(data.locations, indexes, droppedLoc);
+    }
+}
+
+bool GameContext::hibernate()
+{
+    if (isHibernating() || ended_ || quit_ || needPrompt_ || startingRecovery_ || replaying_ || awaitingAction_
+        || !inputLines_.empty() || scheduler_.state() != GameScheduler::Idle)
+    {
+        return false;
+    }
+
+    // the journal refers to the objects that are freed, so its changes are kept by the keys
+    // of the objects that they refer to
+    HibernatedGame game;
+    ostringstream blob;
+    if (!journal_.captureHistory(game) || !game.write(blob))
+    {
+        return false;
+    }
+
+    journal_.clear();
+
+    // deletes the game objects when it goes out of scope
+    GameStateSnapshot state;
+    swapState(state);
+
+    hibernated_ = blob.str();
+    return true;
+}
+
+// a saved game, plus the locations that have been entered and the items at each location
+void GameContext::captureHibernatedState(SaveData &data)
+{
+    map<GameLocation *, size_t> indexes;
+    captureSaveData(data, indexes);
+    for (map<int, GameLocation *>::iterator it = savedLocations_.begin(); it != savedLocations_.end(); ++it)
+    {
+        if (it->second->hasEnteredBefore())
+        {
+            data.enteredLocations.push_back(addSavedLocation(data.locations, indexes, it->second));
+        }
+    }
+
+    // the items at each location whose items aren't the ones in the data file
+    for (map<int, GameLocation *>::iterator it = savedLocations_.begin(); it != savedLocations_.end(); ++it)
+    {
+        SaveData::LocationItems items;
+        if (it->second->captureItems(items))
+        {
+            items.location = addSavedLocation(data.locations, indexes, it->second);
+            data.locationItems.push_back(items);
+        }
+    }
+}
+
+bool GameContext::restoreHibernatedState(const SaveData &data)
+{
+    if (!restoreSaveData(data))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < data.enteredLocations.size(); i++)
+    {
+        journal_.enterLocation(getSavedLocation(data.locations[data.enteredLocations[i]].gid));
+    }
+    for (size_t i = 0; i < data.locationItems.size(); i++)
+    {
+        getSavedLocation(data.locations[data.locationItems[i].location].gid)->restoreItems(data.locationItems[i]);
+    }
+    return true;
+}
+
+size_t GameContext::addHibernatedLocation(HibernatedGame &game, map<GameLocation *, size_t> &indexes, GameLocation *loc)
+{
+    return addSavedLocation(game.locations, indexes, loc);
+}
+
+// returns false if item hasn't been taken (only taken items are in the history)
+bool GameContext::addHibernatedItem(HibernatedGame &game, map<GameLocation *, size_t> &locationIndexes, 
+                                    map<GameItem *, size_t> &itemIndexes, GameItem *item, size_t &index)
+{
+    map<GameItem *, size_t>::const_iterator it = itemIndexes.find(item);
+    if (it != itemIndexes.end())
+    {
+        index = it->second;
+        return true;
+    }
+
+    if (!item->takey())
+    {
+        return false;
+    }
+
+    SaveData::Item savedItem;
+    setSavedItem(savedItem, item);
+    savedItem.originalLocation = addSavedLocation(game.locations, locationIndexes, originalItemLocations_[item->gid()].second);
+
+    game.items.push_back(savedItem);
+    index = itemIndexes[item] = game.items.size() - 1;
+    return true;
+}
+
+GameLocation *GameContext::getHibernatedLocation(const vector<SaveData::Location> &locations, size_t index)
+{
+    const SaveData::Location &savedLoc = locations[index];
+
+    GameLocation *parent = NULL;
+    if (savedLoc.parent)
+    {
+        parent = getHibernatedLocation(locations, savedLoc.parent - 1);
+        if (!parent)
+        {
+            return NULL;
+        }
+    }
+    return getLazyLocation(savedLoc.gid, savedLoc.key, parent);
+}
+
+GameItem *GameContext::getHibernatedItem(const HibernatedGame &game, size_t index)
+{
+    const SaveData::Item &savedItem = game.items[index];
+
+    GameLocation *originalLoc = getHibernatedLocation(game.locations, savedItem.originalLocation);
+    if (!originalLoc)
+    {
+        return NULL;
+    }
+
+    GameItem *item = getLazyItem(savedItem.gid, savedItem.key, originalLoc);
+    if (item)
+    {
+        item->setTakey(savedItem.takey);
+    }
+    return item;
+}
+
+// restores a hibernating game, like loading a saved game
+void GameContext::wake()
+{
+    if (!isHibernating())
+    {
+        return;
+    }
+
+    HibernatedGame game;
+    istringstream blob(hibernated_);
+    hibernated_.clear();
+    if (!game.read(blob) || !journal_.replayHistory(game))
+    {
+        throw "WTF couldn't restore hibernating game";
+    }
+}
+
+bool GameContext::save(const string &name)
+{
+    SaveData data;
+    captureSaveData(data);
+    return saveStore_->save(name, data);
+}
+
+void GameContext::setSaveStore(GameSaveStore &store)
+{
+    saveStore_ = &store;
+}
+
+void GameContext::setAutosave(size_t interval, const string &name)
+{
+    delete autosave_;
+    autosave_ = interval ? new GameAutosave(*saveStore_, name) : NULL;
+    autosaveInterval_ = interval;
+    commandsSinceAutosave_ = 0;
+}
+
+void GameContext::autosave()
+{
+    SaveData *data = new SaveData();
+    captureSaveData(*data);
+    autosave_->submit(data);
+}
+
+void GameContext::setRecoveryLog(const string &filename, size_t checkpointInterval)
+{
+    recoveryFilename_ = filename;
+    checkpointInterval_ = checkpointInterval;
+}
+
+// takes the next line of input, if the player has entered one
+bool GameContext::readInputLine(string &line)
+{
+    if (!replayLines_.empty())
+    {
+        line = replayLines_.front();
+        replayLines_.pop_front();
+    }
+    else if (!inputLines_.empty())
+    {
+        line = inputLines_.front();
+        inputLines_.pop_front();
+    }
+    else
+    {
+        return false;
+    }
+
+    if (recoveryLog_)
+    {
+        recoveryLog_->addLine(line);
+    }
+    return true;
+}
+
+/* If the recovery log is left over from a game that crashed, restores the last checkpoint
+ * in the log and queues the input after it to be replayed (without printing anything).
+ * Then starts a new log with a checkpoint of the current state.
+ */
+void GameContext::startRecoveryLog()
+{
+    SaveData data;
+    bool hasCheckpoint;
+    vector<string> lines;
+
+    if (GameRecoveryLog::read(recoveryFilename_, data, hasCheckpoint, lines))
+    {
+        bool success = true;
+        if (hasCheckpoint)
+        {
+            size_t mark = journal_.mark();
+            journal_.replaceState(new GameStateSnapshot());
+
+            success = restoreSaveData(data);
+            if (!success)
+            {
+                journal_.rollback(mark);
+            }
+            journal_.clear();
+        }
+
+        if (success && (hasCheckpoint || !lines.empty()))
+        {
+            // the output of the replay is discarded
+            replayLines_.assign(lines.begin(), lines.end());
+            replaying_ = true;
+        }
+    }
+
+    recoveryLog_ = new GameRecoveryLog(recoveryFilename_);
+    checkpoint();
+}
+
+void GameContext::finishReplay()
+{
+    flushOutput();
+    replaying_ = false;
+
+    out_ << "(recovered the game in progress)" << endl;
+}
+
+void GameContext::checkpoint()
+{
+    SaveData *data = new SaveData();
+    captureSaveData(*data);
+    recoveryLog_->addCheckpoint(data);
+    commandsSinceCheckpoint_ = 0;
+    checkpointDue_ = false;
+}
+
+void GameContext::doCommand(const string &cmd)
+{
+    journal_.beginCommand();
+    curLocation()->doCommand(cmd);
+
+    if (!awaitingAction_)
+    {
+        commandDone();
+    }
+}
+
+void GameContext::awaitLine(GameAction *action, const vector<string> &args)
+{
+    delete awaitingAction_;
+    awaitingAction_ = action;
+    awaitingArgs_ = args;
+}
+
+void GameContext::commandDone()
+{
+    needPrompt_ = true;
+
+    if (autosave_ && ++commandsSinceAutosave_ >= autosaveInterval_)
+    {
+        commandsSinceAutosave_ = 0;
+        autosave();
+    }
+
+    // the answers to the command's pauses have to be logged before its checkpoint, or they
+    // would be replayed as commands, so it waits for the prompt (see run())
+    if (recoveryLog_ && ++commandsSinceCheckpoint_ >= checkpointInterval_)
+    {
+        checkpointDue_ = true;
+    }
+}
+
+bool GameContext::undo()
+{
+    return journal_.undo();
+}
+
+bool GameContext::redo()
+{
+    return journal_.redo();
+}
+
+GameItem *GameContext::getItem(int gid, const byte *key)
+{
+    map<int, GameItem *>::iterator it = savedItems_.find(gid);
+    if (it != savedItems_.end())
+    {   
+        it->second->ensureDecrypted();
+        return it->second;
+    }
+    else
+    {
+        GameLocation *curLoc = curLocation();
+        GameItem *item = GameItem::read(*this, gid, key, curLoc);    
+        if (item)
+        {
+            savedItems_[gid] = item;
+            originalItemLocations_[gid] = pair<GameItem *, GameLocation *>(item, curLoc);
+        }
+        return item;
+    }
+}
+
+GameItem *GameContext::getLazyItem(int gid, const byte *key, GameLocation *originalLoc)
+{
+    map<int, GameItem *>::iterator it = savedItems_.find(gid);
+    if (it != savedItems_.end())
+    {   
+        return it->second;
+    }
+
+    GameItem *item = GameItem::readLazy(*this, gid, key, originalLoc);
+    if (item)
+    {
+        savedItems_[gid] = item;
+        originalItemLocations_[gid] = pair<GameItem *, GameLocation *>(item, originalLoc);
+    }
+    return item;
+}
+
+GameItem *GameContext::getInventoryItem(size_t i)
+{
+    GameItem *item = inventory_[i];
+    item->ensureDecrypted();
+    return item;
+}
+
+void GameContext::start()
+{
+    GameLocation *loc = getTopLevelLocation(in->initialKey());
+   
+    if (!loc)
+    {
+        out_ << "invalid data file: no initial location" << endl;
+        endGame();
+        flushOutput();
+        return;
+    }
+
+    pushLocation(loc);
+    try
+    {
+        loc->enter();
+    }
+    catch (GameQuitException &)
+    {
+        quit_ = true;
+    }
+
+    // the player can't undo entering the initial location
+    journal_.clear();
+
+    // pauses in the output so far are not logged, since the output is printed again when recovering
+    startingRecovery_ = !recoveryFilename_.empty();
+    needPrompt_ = true;
+    run();
+}
+
+void GameContext::submitLine(const string &line)
+{
+    inputLines_.push_back(line);
+    run();
+}
+
+void GameContext::endInput()
+{
+    inputEnded_ = true;
+    run();
+}
+
+void GameContext::resume()
+{
+    run();
+}
+
+GameContext::Status GameContext::status()
+{
+    if (scheduler_.state() == GameScheduler::Delayed)
+    {
+        return Delayed;
+    }
+    return ended_ ? Ended : WaitingForInput;
+}
+
+/* Runs the game as far as it can go without waiting: delivers the output, takes the input 
+ * that the player has entered for its pauses, and handles the commands. 
+ */
+void GameContext::run()
+{
+    wake();
+
+    while (!ended_ || scheduler_.state() != GameScheduler::Idle)
+    {
+        flushOutput();
+
+        string line;
+        switch (scheduler_.state())
+        {
+        case GameScheduler::Delayed:
+            return;
+        case GameScheduler::AwaitingInput:
+            if (!readInputLine(line) && !inputEnded_)
+            {
+                return;
+            }
+            scheduler_.inputReceived();
+            continue;
+        default:
+            break;
+        }
+
+        // all the output so far has been delivered
+        if (ended_)
+        {
+            break;
+        }
+        else if (quit_)
+        {
+            endGame();
+        }
+        else if (startingRecovery_)
+        {
+            startingRecovery_ = false;
+            startRecoveryLog();
+        }
+        else if (needPrompt_)
+        {
+            if (replaying_ && replayLines_.empty())
+            {
+                finishReplay();
+            }
+            needPrompt_ = false;
+            if (checkpointDue_ && recoveryLog_)
+            {
+                checkpoint();
+            }
+            printExpansion(curLocation()->promptTemplate());
+        }
+        else if (readInputLine(line))
+        {
+            handleLine(line);
+        }
+        else if (!inputEnded_)
+        {
+            return;
+        }
+        else if (awaitingAction_)
+        {
+            // the player left without answering
+            handleLine(string());
+        }
+        else
+        {
+            endGame();
+        }
+    }
+}
+
+void GameContext::handleLine(const string &line)
+{
+    try 
+    {
+        if (awaitingAction_)
+        {
+            GameAction *action = awaitingAction_;
+            awaitingAction_ = NULL;
+            action->doAction(awaitingArgs_, line);
+            delete action;
+
+            if (!awaitingAction_)
+            {
+                commandDone();
+            }
+        }
+        else
+        {
+            doCommand(line);
+        }
+    }
+    catch (GameQuitException &)
+    {
+        if (recoveryLog_)
+        {
+            recoveryLog_->discard();
+        }
+        quit_ = true;
+    }
+}
+
+// writes the rest of the recovery log (or deletes it if the game ended normally)
+void GameContext::endGame()
+{
+    delete recoveryLog_;
+    recoveryLog_ = NULL;
+    ended_ = true;
+}
+
+void GameContext::playGame(LineSource &source)
+{
+    start();
+
+    while (true)
+    {
+        switch (status())
+        {
+        case Delayed:
+            Sleep(scheduler_.dueIn());
+            resume();
+            break;
+        case WaitingForInput:
+            {
+                string line;
+                if (source.readLine(line))
+                {
+                    submitLine(line);
+                }
+                else
+                {
+                    endInput();
+                }
+            }
+            break;
+        default:
+            return;
+        }
+    }
+}
+
+void GameContext::flushOutput()
+{
+    if (replaying_)
+    {
+        outBuffer_.flushTo(NULL);
+        return;
+    }
+
+    scheduler_.add(outBuffer_, GameScheduler::WaitNone);
+    scheduler_.deliver(*sink_);
+}
+
+void GameContext::setOutputSink(OutputSink &sink)
+{
+    flushOutput();
+    sink_ = &sink;
+}
+
+GameLocation *GameContext::getSavedLocation(int gid)
+{
+    std::map<int, GameLocation *>::iterator it = savedLocations_.find(gid);
+    if (it != savedLocations_.end())
+    {
+        return it->second;
+    }
+    return NULL;
+}
+
+void GameContext::addToInventory(GameItem *item)
+{
+    journal_.addToInventory(item);
+}
+
+bool GameContext::retakeItem(int gid)
+{
+    std::map<int, pair<GameItem *, GameLocation *> >::iterator it = droppedItemLocations_.find(gid);
+
+    if (it != droppedItemLocations_.end())
+    {
+        GameItem *item = it->second.first;
+        GameLocation *loc = it->second.second;
+        loc->takeItem(item, item->takey());
+        journal_.setDroppedLocation(gid, NULL, NULL);
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+GameLocation *GameContext::getLocation(int gid, const byte *key, GameLocation *parent)
+{
+    GameLocation *loc = getSavedLocation(gid);
+    if (loc)
+    {
+        loc->ensureDecrypted();
+        return loc;
+    }
+
+    loc = GameLocation::read(*this, gid, key, parent);
+
+    if (loc)
+    {
+        savedLocations_[loc->gid()] = loc;
+    }
+
+    return loc;
+}
+
+GameLocation *GameContext::getLazyLocation(int gid, const byte *key, GameLocation *parent)
+{
+    GameLocation *loc = getSavedLocation(gid);
+    if (loc)
+    {
+        return loc;
+    }
+
+    loc = GameLocation::readLazy(*this, gid, key, parent);
+
+    if (loc)
+    {
+        savedLocations_[gid] = loc;
+    }
+
+    return loc;
+}
+void GameContext::dropInventoryItem(const byte *takeyHash)
+{
+    dropInventoryItem(takeyHash, curLocation());
+}
+
+void GameContext::dropInventoryItem(const byte *takeyHash, GameLocation *whereToDrop)
+{
+    std::map<bytestring, GameItem *>::iterator it = inventoryByTakeyHash_.find(bytestring(takeyHash, KEYHASH_SIZE));
+
+    if (it != inventoryByTakeyHash_.end())
+    {
+        GameItem *item = it->second;
+        for (size_t i = 0; i < inventory_.size(); i++)
+        {
+            if (inventory_[i] == item)
+            {
+                journal_.removeFromInventory(i);
+                i--;
+            }
+        }
+
+        whereToDrop->dropItem(item);
+        journal_.setDroppedLocation(item->gid(), item, whereToDrop);
+    }
+}
+
+void GameContext::popLocationUntil(GameLocation *loc)
+{
+    vector<GameLocation *> &curLocationStack = locationStacks_.back();
+    while (!curLocationStack.empty() && curLocationStack.back() != loc)
+    {
+        journal_.popLocation();
+    }
+}
+
+void GameContext::popLocation()
+{ 
+    journal_.popLocation(); 
+}
+
+GameLocation *GameContext::curLocation()
+{ 
+    return locationStacks_.back().empty() ? NULL : locationStacks_.back().back(); 
+}
+
+void GameContext::pushLocation(GameLocation *loc)
+{ 
+    journal_.pushLocation(loc); 
+}
+
+void GameContext::doCall()
+{   
+    journal_.pushLocationStack();
+}
+
+void GameContext::doReturn()
+{
+    if (locationStacks_.size() > 1)
+    {
+        journal_.popLocationStack();
+    }
+}
+
+GameLocation *GameContext::getTopLevelLocation(const byte *key)
+{
+    int gid = in->getGid(ObjectTypeLocation, key);    
+    return getLocation(gid, key, NULL);
+}
+
+void GameContext::printExpansion(const GameTemplate &story, bool appendNewline, int expansionCount)
+{
+    const vector<GameTemplate::Segment> &segments = story.segments();
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        const GameTemplate::Segment &segment = segments[i];
+        if (segment.op == GameTemplate::OpLiteral)
+        {
+            out_ << segment.text;
+        }
+        else if (expansionCount > 0)
+        {
+            printVariable(segment.op, expansionCount - 1);
+        }
+    }
+
+    if (appendNewline && !story.empty())
+    {
+        out_ << endl;
+    }
+}
+
+string GameBase::decryptString(StreamTransformationFilter &decryptor)
+{
+    size_t len = decryptVal<int>(decryptor);
+    byte * buf = new byte[len];
+    if (decryptor.Get(buf, len) != len)
+    {
+        throw "WTF2 couldn't get enough bytes from decryptor";
+    }
+    string result((char*)buf, len);
+
+    delete buf;
+
+    return result;
+}
+
+GameBase *GameBase::read(GameContext &ctx, int gid, const byte *key, GameLocation *parent, DecryptFn decryptFn)
+{
+    if (!ctx.in->seekObject(gid))
+    {
+        return NULL;
+    }
+
+    byte iv[AES::BLOCKSIZE];
+    ctx.in->stream().read((char *)iv, AES::BLOCKSIZE);
+
+    CFB_Mode<AES>::Decryption decryption(key, KEY_SIZE, iv);
+
+    FileSource source(ctx.in->stream(), false);
+
+    AutoPumpFilter *decryptor = new AutoPumpFilter(decryption, source);
+
+    source.Attach(decryptor);
+
+    int magic = decryptVal<int>(*decryptor);
+
+    if (magic != DEBUG_MAGIC)
+    {
+        ctx.out() << "UH OH! bad magic" << endl;
+        return NULL;
+    }
+
+    GameBase *result = decryptFn(ctx, *decryptor, parent);
+
+    if (result)
+    {
+        result->setIdentity(gid, key);
+    }
+
+    return result;
+}
+
+bool GameBase::checkKey(GameContext &ctx, int gid, const byte *key)
+{
+    if (!ctx.in->seekObject(gid))
+    {
+        return false;
+    }
+
+    byte iv[AES::BLOCKSIZE];
+    ctx.in->stream().read((char *)iv, AES::BLOCKSIZE);
+
+    int magic;
+    ctx.in->stream().read((char *)&magic, sizeof(int));
+
+    if (ctx.in->stream().fail())
+    {
+        return false;
+    }
+
+    CFB_Mode<AES>::Decryption decryption(key, KEY_SIZE, iv);
+    decryption.ProcessData((byte *)&magic, (byte *)&magic, sizeof(int));
+    canonicalizeEndianness(magic);
+
+    return magic == DEBUG_MAGIC;
+}
+
+void GameBase::parseTemplate(GameTemplate &tmpl, const string &story)
+{
+    if (tmpl.isParsed())
+    {
+        return;
+    }
+
+    if (!ctx_->in->hasCompiledText())
+    {
+        tmpl.parse(story);
+    }
+    else if (!tmpl.decode(story))
+    {
+        throw "WTF invalid text bytecode";
+    }
+}
+
+void GameBase::setIdentity(int gid, const byte *key)
+{
+    memcpy(key_, key, KEY_SIZE);
+    gid_ = gid;
+}
+
+GameLocation::~GameLocation()
+{ 
+    if (startKey_) delete[] startKey_; 
+}
+
+GameLocation *GameLocation::readLazy(GameContext &ctx, int gid, const byte *key, GameLocation *parent)
+{
+    if (!checkKey(ctx, gid, key))
+    {
+        return NULL;
+    }
+
+    GameLocation *loc = new GameLocation(ctx, parent);
+    loc->setIdentity(gid, key);
+    loc->decrypted_ = false;
+    return loc;
+}
+
+void GameLocation::ensureDecrypted()
+{
+    if (decrypted_)
+    {
+        return;
+    }
+
+    GameLocation *loc = read(*ctx_, gid(), key(), gameParent());
+    if (!loc)
+    {
+        throw "WTF couldn't decrypt restored location";
+    }
+
+    std::swap(startKey_, loc->startKey_);
+    title.swap(loc->title);
+    desc.swap(loc->desc);
+    prompt.swap(loc->prompt);
+    ignoredSet_.swap(loc->ignoredSet_);
+    canonicalSynonyms_.swap(loc->canonicalSynonyms_);
+    maxSynonymTokens_ = loc->maxSynonymTokens_;
+    actionTable_.swap(loc->actionTable_);
+    locationTable_.swap(loc->locationTable_);
+
+    // apply the changes to the items here that were restored while the location was encrypted
+    if (hasRestoredItemKeys_)
+    {
+        itemKeys_.swap(restoredItemKeys_);
+    }
+    else
+    {
+        for (size_t i = 0; i < loc->itemKeys_.size(); i++)
+        {
+            if (removedItemKeys_.find(loc->itemKeys_[i]) == removedItemKeys_.end())
+            {
+                itemKeys_.push_back(loc->itemKeys_[i]);
+            }
+        }
+        itemKeys_.insert(itemKeys_.end(), addedItemKeys_.begin(), addedItemKeys_.end());
+    }
+
+    removedItemKeys_.clear();
+    addedItemKeys_.clear();
+    hasRestoredItemKeys_ = false;
+    restoredItemKeys_.clear();
+
+    delete loc;
+
+    decrypted_ = true;
+}
+
+void GameLocation::restoreItemRemoved(const byte *itemKey)
+{
+    bytestring itemKeyStr = bytestring(itemKey, KEY_SIZE);
+
+    if (!decrypted_)
+    {
+        removedItemKeys_.insert(itemKeyStr);
+        return;
+    }
+
+    for (size_t i = 0; i < itemKeys_.size(); i++)
+    {
+        if (itemKeys_[i] == itemKeyStr)
+        {
+            ctx_->journal().removeItemKey(this, i);
+            return;
+        }   
+    }
+}
+
+void GameLocation::restoreItemAdded(const byte *itemKey)
+{
+    bytestring itemKeyStr = bytestring(itemKey, KEY_SIZE);
+
+    if (!decrypted_)
+    {
+        addedItemKeys_.push_back(itemKeyStr);
+    }
+    else
+    {
+        ctx_->journal().addItemKey(this, itemKeyStr);
+    }
+}
+
+bool GameLocation::captureItems(SaveData::LocationItems &items)
+{
+    // all of the items, unless only the changes to the ones in the data file are known
+    items.decrypted = decrypted_ || hasRestoredItemKeys_;
+    if (decrypted_)
+    {
+        items.itemKeys = itemKeys_;
+        return true;
+    }
+    if (hasRestoredItemKeys_)
+    {
+        items.itemKeys = restoredItemKeys_;
+        return true;
+    }
+
+    items.itemKeys = addedItemKeys_;
+    items.removedItemKeys.assign(removedItemKeys_.begin(), removedItemKeys_.end());
+    return !items.itemKeys.empty() || !items.removedItemKeys.empty();
+}
+
+void GameLocation::restoreItems(const SaveData::LocationItems &items)
+{
+    removedItemKeys_.clear();
+    addedItemKeys_.clear();
+    hasRestoredItemKeys_ = false;
+    restoredItemKeys_.clear();
+
+    if (!items.decrypted)
+    {
+        removedItemKeys_.insert(items.removedItemKeys.begin(), items.removedItemKeys.end());
+        addedItemKeys_ = items.itemKeys;
+    }
+    else if (decrypted_)
+    {
+        itemKeys_ = items.itemKeys;
+    }
+    else
+    {
+        hasRestoredItemKeys_ = true;
+        restoredItemKeys_ = items.itemKeys;
+    }
+}
+
+bool GameLocation::isIgnoredInternal(const std::string &token)
+{
+    ensureDecrypted();
+    return CraneaLocation::isIgnoredInternal(token);
+}
+
+bool GameLocation::hasCanonicalSynonyms()
+{
+    ensureDecrypted();
+    return CraneaLocation::hasCanonicalSynonyms();
+}
+
+void GameLocation::doAction(const byte *key)
+{
+    GameAction *action = this->getAction(key, true);
+    if (action)
+    {
+        doAction(action);
+        delete action;
+    }
+}
+
+void GameLocation::doAction(GameAction *action, const std::vector<std::string> &args)
+{
+    string argStr;
+    concatenateTokens(args, argStr);
+
+    ctx_->lastArgs = argStr;
+
+    action->doAction(args);
+}
+
+void GameLocation::doCommand(const std::string &cmd)
+{
+    ctx_->lastCommand = cmd;
+
+    vector<string> tokens;
+    tokenize(cmd, tokens);
+
+    vector<string> reverseArgs;
+
+    bool isExactCommand = true;
+    while (true)
+    {
+        GameAction *action = this->getCommandAction(tokens, isExactCommand);
+        if (action != NULL)
+        {
+            vector <string> args;
+            while (reverseArgs.size())
+            {
+                args.push_back(reverseArgs.back());
+                reverseArgs.pop_back();
+            }
+
+            string argStr;
+            concatenateTokens(args, argStr);
+            ctx_->lastArgs = argStr;
+
+            if (action->promptForLine(args))
+            {
+                // the action runs with the next line that the player enters
+                ctx_->awaitLine(action, args);
+                return;
+            }
+
+            action->doAction(args);
+            delete action;
+            return;
+        }
+
+        if (!tokens.size())
+            break;
+
+        reverseArgs.push_back(tokens.back());
+        tokens.pop_back();
+        isExactCommand = false;        
+    }
+
+}
+
+void GameLocation::getAncestors(vector<GameLocation *> &ancestors)
+{
+    GameLocation *cur = this;
+    while (cur != NULL)
+    {
+        ancestors.push_back(cur);
+        cur = cur->gameParent();
+    }
+
+}
+
+GameBase *GameLocation::decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent)
+{
+    GameLocation *loc = new GameLocation(ctx, parent);
+
+    char hasStart = decryptVal<char>(decryptor);
+
+    if (hasStart != 0 && hasStart != 1)
+    {
+        throw "OMG WTF BBQ bad hasStart value";
+    }
+
+    if (hasStart)
+    {
+        // save somewhere
+        loc->startKey_ = new byte[KEY_SIZE];
+        decryptor.Get(loc->startKey_, KEY_SIZE);
+    }
+
+    loc->title = decryptString(decryptor);
+    loc->desc = decryptString(decryptor);
+    loc->prompt = decryptString(decryptor);
+    size_t numIgnored = decryptVal<size_t>(decryptor);
+    for (size_t i = 0; i < numIgnored; i++)
+    {
+        string ig = decryptString(decryptor);
+        loc->ignoredSet_.insert(ig);
+    }
+
+    if (ctx.in->hasCanonicalSynonyms())
+    {
+        size_t numSynonyms = decryptVal<size_t>(decryptor);
+        for (size_t i = 0; i < numSynonyms; i++)
+        {
+            string phrase = decryptString(decryptor);
+            string canonical = decryptString(decryptor);
+            loc->addCanonicalSynonym(phrase, canonical);
+        }
+    }
+
+    size_t numChildLocations = decryptVal<size_t>(decryptor);
+
+    for (size_t i = 0; i < numChildLocations; i++)
+    {
+        byte keyhashBuf[KEYHASH_SIZE];
+        decryptor.Get(keyhashBuf, KEYHASH_SIZE);
+        
+        int gid = decryptVal<int>(decryptor);
+
+        loc->locationTable_[bytestring(keyhashBuf, KEYHASH_SIZE)] = gid;
+    }
+
+    size_t numItems = decryptVal<size_t>(decryptor);
+    for (size_t i = 0; i < numItems; i++)
+    {
+        byte itemKey[KEY_SIZE];
+        decryptor.Get(itemKey, KEY_SIZE);
+        loc->itemKeys_.push_back(bytestring(itemKey, KEY_SIZE));
+    }
+
+    size_t numChildActions = decryptVal<size_t>(decryptor);
+
+    for (size_t i = 0; i < numChildActions; i++)
+    {
+        byte cmdKeyHash[KEYHASH_SIZE];
+
+        decryptor.Get(cmdKeyHash, KEYHASH_SIZE);
+
+        byte encCommandBlock[3 * AES::BLOCKSIZE];
+        decryptor.Get(encCommandBlock, 3 * AES::BLOCKSIZE);
+        
+        loc->actionTable_[bytestring(cmdKeyHash, KEYHASH_SIZE)].push_back(bytestring(encCommandBlock, 3 * AES::BLOCKSIZE));
+    }
+
+    return loc;
+}
+
+GameLocation *GameLocation::getChildByKey(const byte *key)
+{
+    ensureDecrypted();
+
+    byte keyHash[KEYHASH_SIZE];
+    hashKey(key, keyHash);
+
+    map<bytestring,int>::const_iterator it = locationTable_.find(bytestring(keyHash, KEYHASH_SIZE));
+
+    if (it == locationTable_.end())
+    {       
+        throw "WTF bad location";
+    }
+
+    int startGid = it->second;
+
+    return ctx_->getLocation(startGid, key, this);
+}
+
+const GameTemplate &GameLocation::titleTemplate()
+{
+    ensureDecrypted();
+    parseTemplate(titleTemplate_, title);
+    return titleTemplate_;
+}
+
+const GameTemplate &GameLocation::descTemplate()
+{
+    ensureDecrypted();
+    parseTemplate(descTemplate_, desc);
+    return descTemplate_;
+}
+
+const GameTemplate &GameLocation::promptTemplate()
+{
+    ensureDecrypted();
+
+    if (this->prompt.empty() && this->parent_)
+    {
+        return this->gameParent()->promptTemplate();
+    }
+
+    parseTemplate(promptTemplate_, prompt);
+    return promptTemplate_;
+}
+
+void GameLocation::dropItem(GameItem *item)
+{
+    ensureDecrypted();
+    ctx_->journal().addItemKey(this, bytestring(item->key(), KEY_SIZE));
+}
+
+void GameLocation::enter()
+{
+    ensureDecrypted();
+
+    if (startKey_)
+    {
+        GameLocation *startLoc = getChildByKey(startKey_);
+        if (startLoc)
+        {
+            ctx_->pushLocation(startLoc);
+            startLoc->enter();
+        }
+    }
+    else
+    {
+        if (!hasEnteredBefore_)
+        {
+            doAction(ctx_->firstVisitKey());
+            ctx_->journal().enterLocation(this);
+        }
+        else
+        {
+            doAction(ctx_->returnVisitKey());
+        }
+
+        doAction(ctx_->forcedKey());
+    }
+}
+
+GameAction *GameLocation::getAction(const byte *actionKey, bool isExactCommand, bool searchParents)
+{
+    byte keyHash[KEYHASH_SIZE];
+    hashKey(actionKey, keyHash);
+    bytestring keyHashStr = bytestring(keyHash, KEYHASH_SIZE);
+
+    GameLocation *cur = this;
+    while (cur != NULL)
+    {
+        GameAction *act = cur->getActionInternal(actionKey, keyHashStr, isExactCommand);
+        if (act != NULL)
+        {
+            return act;
+        }
+        if (!searchParents)
+        {
+            break;
+        }
+
+        cur = cur->gameParent();
+    }
+    return NULL;
+}
+
+GameAction *GameLocation::getCommandAction(const vector<string> &tokens, bool isExactCommand)
+{
+    byte actionKey[KEY_SIZE];
+
+    if (!ctx_->in->hasCanonicalSynonyms())
+    {
+        string cmd;
+        concatenateTokens(tokens, cmd);
+        commandKey(cmd, actionKey);
+        return this->getAction(actionKey, isExactCommand);
+    }
+
+    // the actions of each location are stored under the command in that location's canonical form
+    string lastCmd;
+    bytestring keyHashStr;
+    for (GameLocation *cur = this; cur != NULL; cur = cur->gameParent())
+    {
+        vector<string> canonicalTokens = tokens;
+        cur->canonicalize(canonicalTokens);
+
+        string cmd;
+        concatenateTokens(canonicalTokens, cmd);
+        if (cur == this || cmd != lastCmd)
+        {
+            commandKey(cmd, actionKey);
+
+            byte keyHash[KEYHASH_SIZE];
+            hashKey(actionKey, keyHash);
+            keyHashStr = bytestring(keyHash, KEYHASH_SIZE);
+            lastCmd = cmd;
+        }
+
+        GameAction *act = cur->getActionInternal(actionKey, keyHashStr, isExactCommand);
+        if (act != NULL)
+        {
+            return act;
+        }
+    }
+    return NULL;
+}
+
+GameAction *GameLocation::getActionInternal(const byte *actionKey, const bytestring &actionKeyHash, bool isExactCommand)
+{
+    ensureDecrypted();
+
+    map<bytestring, vector<bytestring> >::const_iterator it = actionTable_.find(actionKeyHash);
+
+    if (it != actionTable_.end())
+    {
+        vector<bytestring> actionBlocks = it->second;
+
+        size_t numActionBlocks = actionBlocks.size();
+
+        for (size_t i = 0; i < numActionBlocks; i++)
+        {
+            //H(CK(normalized cmd))->iv,E(CK(normalized cmd), gid + R(cmd))
+
+            const byte *encryptedBlock = actionBlocks[i].c_str(); // 3x AES::BLOCKSIZE
+            
+            const byte *iv = encryptedBlock; // 1st block is IV
+            const byte *encGid = encryptedBlock + AES::BLOCKSIZE;
+            const byte *encKey = encGid + AES::BLOCKSIZE;
+            
+            CFB_Mode<AES>::Decryption decryption(actionKey, KEY_SIZE, iv);
+
+            byte gidBlock[AES::BLOCKSIZE];
+            byte actionKey[AES::BLOCKSIZE];
+            decryption.ProcessData(gidBlock, encGid, AES::BLOCKSIZE);
+            decryption.ProcessData(actionKey, encKey, AES::BLOCKSIZE);
+
+            bool needsExactCommand = *gidBlock ? true : false; // byte 0 has exact bit
+
+            if (needsExactCommand && !isExactCommand)
+                continue;
+
+            int gid = *((int *)gidBlock + 1); // bytes 4-7 are gid
+            canonicalizeEndianness(gid);
+
+            GameAction *action = GameAction::read(*ctx_, gid, actionKey, this);
+            if (action)
+            {
+                return action;
+            }
+        }
+    }
+    return NULL;
+}
+
+void GameAction::doAction(const std::vector<std::string> &args)
+{
+    parseTemplate(descTemplate_, desc);
+    ctx_->printExpansion(descTemplate_, true);
+
+    for (size_t i = 0; i < takesKeys_.size(); i++)
+    {
+        TakenItem &takenItem = takesKeys_[i];
+
+        int gid = ctx_->in->getGid(ObjectTypeItem, takenItem.key);
+
+        if (!ctx_->retakeItem(gid))
+        {
+            // the item may be in a different location, so we go to that location, take the item, 
+            // and then return to where we were before.
+            ctx_->doCall();
+
+            followPath(takenItem.levelsUp, takenItem.locationKeysDown);
+            
+            GameLocation *itemLoc = ctx_->curLocation();
+
+            GameItem *item = ctx_->getItem(gid, takenItem.key);
+
+            itemLoc->takeItem(item, takenItem.takey);
+            
+            ctx_->doReturn();
+        }
+    }
+
+    for (size_t i = 0; i < dropsTakeyHashes_.size(); i++)
+    {
+        ctx_->dropInventoryItem(dropsTakeyHashes_[i].c_str());
+    }
+
+    vector<GameFile *> filesToLaunch;
+    for (size_t i = 0; i < files_.size(); i++)
+    {
+        const byte *fileKey = files_[i].key;
+        int fileGid = ctx_->in->getGid(ObjectTypeFile, fileKey);
+        GameFile *file = GameFile::read(*ctx_, fileGid, fileKey);
+        if (files_[i].launch && !ctx_->isReplaying())
+        {
+            filesToLaunch.push_back(file);
+        }
+        else
+        {
+            delete file;
+        }
+    }
+    for (size_t i = 0; i < filesToLaunch.size(); i++)
+    {
+        filesToLaunch[i]->launch();
+        delete filesToLaunch[i];
+    }
+
+    if (this->changesLocation_)
+    {
+        followPath(levelsUp_, locationKeysDown_);
+        ctx_->curLocation()->enter();
+    }
+}
+
+void GameAction::followPath(size_t levelsUp, const vector<KeyBuffer> &locationKeysDown)
+{
+    ctx_->popLocationUntil(this->gameParent());
+
+    for (size_t i = 0; i < levelsUp; i++)
+    {
+        ctx_->popLocation();
+    }
+
+    for (size_t i = 0; i < locationKeysDown.size(); i++)
+    {
+        const byte *locationKey = locationKeysDown[i].buf;
+
+        GameLocation *cur = ctx_->curLocation();
+        GameLocation *loc;
+
+        if (cur)
+        {
+            loc = cur->getChildByKey(locationKey);
+        }
+        else
+        {
+            loc = ctx_->getTopLevelLocation(locationKey);
+        }
+
+        assert(loc);
+        ctx_->pushLocation(loc);
+    }
+}
+
+byte *GameAction::dokey()
+{
+    return dokey_;
+}
+
+#define NEW_ACTION_FOR_TYPE(type) case type: return new GameSpecializedAction<type>(ctx, parent);
+GameAction *GameAction::newActionByType(int actionType, GameContext &ctx, GameLocation *parent)
+{
+    switch (actionType)
+    {
+        NEW_ACTION_FOR_TYPE(ActionTypeInventory);
+        NEW_ACTION_FOR_TYPE(ActionTypeLook);
+        NEW_ACTION_FOR_TYPE(ActionTypeQuit);
+        NEW_ACTION_FOR_TYPE(ActionTypeCall);
+        NEW_ACTION_FOR_TYPE(ActionTypeReturn);
+        NEW_ACTION_FOR_TYPE(ActionTypeTake);
+        NEW_ACTION_FOR_TYPE(ActionTypeDrop);
+        NEW_ACTION_FOR_TYPE(ActionTypeSave);
+        NEW_ACTION_FOR_TYPE(ActionTypeLoad);
+        NEW_ACTION_FOR_TYPE(ActionTypeUndo);
+        NEW_ACTION_FOR_TYPE(ActionTypeRedo);
+        default:
+        NEW_ACTION_FOR_TYPE(ActionTypeDefault);
+    }
+}
+
+bool GameAction::getDokeyFromPredicate(GameContext &ctx, AutoPumpFilter &decryptor, byte *dokey)
+{
+    size_t predicateSize = decryptVal<size_t>(decryptor);
+    if (predicateSize == 0)
+    {
+        decryptor.Get(dokey, KEY_SIZE);
+        return true;
+    }
+
+    bool hasDokey = false;
+    for (size_t i = 0; i < predicateSize; i++)
+    {
+        byte keyhashBuf[KEYHASH_SIZE];
+        byte encDokey[KEY_SIZE];   
+        byte iv[KEY_SIZE];
+
+        vector<GameItem *> items;
+
+        size_t conjunctionSize = decryptVal<size_t>(decryptor);
+
+        bool hasAllItems = true;
+        for (size_t j = 0; j < conjunctionSize; j++)
+        {
+            decryptor.Get(keyhashBuf, KEYHASH_SIZE);
+
+            if (hasAllItems)
+            {
+                GameItem *item = ctx.getInventoryItem(keyhashBuf);
+                if (item != NULL)
+                {
+                    items.push_back(item);
+                }
+                else
+                {
+                    hasAllItems = false;
+                }
+            }
+        }
+
+        decryptor.Get(iv, AES::BLOCKSIZE);
+        decryptor.Get(encDokey, KEY_SIZE);
+
+        if (hasAllItems && !hasDokey)
+        {
+            byte conjunctionKey[KEY_SIZE];
+            makeConjunctionKey(items, conjunctionKey);
+            
+            CFB_Mode<AES>::Decryption dokeyDecryption(conjunctionKey, KEY_SIZE, iv);
+
+            dokeyDecryption.ProcessData(dokey, encDokey, KEY_SIZE);
+            hasDokey = true;
+        }
+    }
+
+    return hasDokey;
+}
+
+GameBase *GameAction::decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent)
+{
+    byte dokey[KEY_SIZE];
+
+    if (!getDokeyFromPredicate(ctx, decryptor, dokey))
+    {
+        return NULL;
+    }
+
+    byte iv[AES::BLOCKSIZE];
+    decryptor.Get(iv, AES::BLOCKSIZE);
+   
+    CFB_Mode<AES>::Decryption innerDecryption(dokey, KEY_SIZE, iv);
+
+    StreamTransformationFilter *innerDecryptorPtr = new AutoPumpFilter(innerDecryption, decryptor.GetSource(), 2 * AES::BLOCKSIZE);
+
+    decryptor.Attach(innerDecryptorPtr);
+
+    StreamTransformationFilter &innerDecryptor = *innerDecryptorPtr;
+
+    int actionType = decryptVal<int>(innerDecryptor);
+
+    GameAction *act = newActionByType(actionType, ctx, parent);
+
+    act->desc = decryptString(innerDecryptor);
+
+    size_t numFiles = decryptVal<size_t>(innerDecryptor);
+    for (size_t i = 0; i < numFiles; i++)
+    {
+        act->files_.push_back(OpenedFile());
+        OpenedFile &file = act->files_.back();
+        innerDecryptor.Get(file.key, KEY_SIZE);
+        file.launch = decryptVal<byte>(innerDecryptor) ? 1 : 0;
+    }
+
+    size_t numTakes = decryptVal<size_t>(innerDecryptor);
+
+    for (size_t i = 0; i < numTakes; i++)
+    {
+        act->takesKeys_.push_back(TakenItem());
+
+        TakenItem &takenItem = act->takesKeys_.back();
+                
+        innerDecryptor.Get(takenItem.key, KEY_SIZE);
+        innerDecryptor.Get(takenItem.takey, KEY_SIZE);
+
+        takenItem.levelsUp = decryptVal<size_t>(innerDecryptor);
+        
+        size_t numLocationsDown = decryptVal<size_t>(innerDecryptor);
+
+        for (size_t i = 0; i < numLocationsDown; i++)
+        {
+            takenItem.locationKeysDown.push_back(KeyBuffer());
+            KeyBuffer &keybuf = takenItem.locationKeysDown.back();
+            innerDecryptor.Get(keybuf.buf, KEY_SIZE);
+        }
+    }
+
+    size_t numDrops = decryptVal<size_t>(innerDecryptor);
+    for (size_t i = 0; i < numDrops; i++)
+    {
+        byte itemTakeyHash[KEYHASH_SIZE];
+        innerDecryptor.Get(itemTakeyHash, KEYHASH_SIZE);
+        act->dropsTakeyHashes_.push_back(bytestring(itemTakeyHash, KEYHASH_SIZE));
+    }
+    
+    act->changesLocation_ = decryptVal<byte>(innerDecryptor) ? true : false;
+    
+    if (act->changesLocation_)
+    {
+        act->levelsUp_ = decryptVal<size_t>(innerDecryptor);       
+
+        size_t numLocationsDown = decryptVal<size_t>(innerDecryptor);
+
+        for (size_t i = 0; i < numLocationsDown; i++)
+        {
+            act->locationKeysDown_.push_back(KeyBuffer());
+            innerDecryptor.Get(act->locationKeysDown_.back().buf, KEY_SIZE);            
+        }
+    }
+    else
+    {
+        act->levelsUp_ = 0;
+    }
+    
+    size_t auxDataSize = decryptVal<size_t>(innerDecryptor);
+    for (size_t i = 0; i < auxDataSize; i++)
+    {
+        string key = decryptString(innerDecryptor);
+        act->auxData[key] = decryptString(innerDecryptor);
+    }
+
+    memcpy(act->dokey_, dokey, KEY_SIZE);
+
+    return act;
+}
+
+template <ActionType actionType>
+void GameSpecializedAction<actionType>::doAction(const std::vector<std::string> &args)
+{
+    this->GameAction::doAction(args);
+}
+
+const GameTemplate &GameAction::auxTemplate(const string &name)
+{
+    GameTemplate &tmpl = auxTemplates_[name];
+    if (!tmpl.isParsed())
+    {
+        map<string, string>::const_iterator it = auxData.find(name);
+        parseTemplate(tmpl, it != auxData.end() ? it->second : string());
+    }
+    return tmpl;
+}
+
+void GameAction::iterateItems(const vector<GameItem *> &items)
+{
+    size_t numItems = items.size();
+    if (numItems == 0)
+    {
+        ctx_->printExpansion(auxTemplate("empty"), true);
+    }
+    else
+    {
+        ctx_->printExpansion(auxTemplate("nonempty"), true);
+    }
+
+    for (size_t i = 0; i < numItems; i++)
+    {
+        ctx_->printExpansion(auxTemplate("prefix"));
+        ctx_->printExpansion(items[i]->titleTemplate());
+        ctx_->printExpansion(auxTemplate("suffix"));
+        ctx_->out() << endl;
+    }
+}
+
+template <>
+void GameSpecializedAction<ActionTypeLook>::doAction(const std::vector<std::string> &args)
+{
+    this->GameAction::doAction(args);
+
+    GameLocation *loc = ctx_->curLocation();
+
+    vector<GameItem *> visibleItems;
+    for (size_t i = 0; i < loc->numItems(); i++)
+    {
+        GameItem *item = loc->getItem(i);
+        if (item->visible && !item->title.empty())
+        {
+            visibleItems.push_back(item);
+        }
+    }
+
+    iterateItems(visibleItems);
+}
+
+template <>
+void GameSpecializedAction<ActionTypeInventory>::doAction(const std::vector<std::string> &args)
+{
+    this->GameAction::doAction(args);
+
+    vector<GameItem *> visibleItems;
+    for (size_t i = 0; i < ctx_->inventorySize(); i++)
+    {
+        GameItem *item = ctx_->getInventoryItem(i);
+
+        if (!item->title.empty())
+        {
+            visibleItems.push_back(item);
+        }
+    }
+    iterateItems(visibleItems);
+}
+
+template <>
+void GameSpecializedAction<ActionTypeQuit>::doAction(const std::vector<std::string> &args)
+{
+    this->GameAction::doAction(args);
+    throw GameQuitException();
+}
+
+template <>
+void GameSpecializedAction<ActionTypeCall>::doAction(const vector<string> &args)
+{
+    ctx_->doCall(); // call must go before action because we need to duplicate the previous location stack
+    this->GameAction::doAction(args);
+}
+
+template <>
+void GameSpecializedAction<ActionTypeReturn>::doAction(const vector<string> &args)
+{
+    this->GameAction::doAction(args);
+    ctx_->doReturn();    
+    ctx_->curLocation()->enter();
+}
+
+bool isOkSaveName(const std::string &saveFile)
+{
+    for (size_t i = 0; i < saveFile.size(); i++)
+    {
+        if (!isOkFilenameChar(saveFile[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GameAction::promptForSaveName(const vector<string> &args)
+{
+    if (!auxData["savename"].empty() || !args.empty())
+    {
+        return false;
+    }
+    ctx_->printExpansion(auxTemplate("prompt"));
+    return true;
+}
+
+/* The name of the saved game is the savename aux data, or the first argument, or else the
+ * line that the player entered when prompted (which is empty if the action wasn't run by
+ * a command, since there was no prompt).
+ */
+bool GameAction::getSaveName(const vector<string> &args, const string &line, string &name)
+{
+    name = auxData["savename"];
+
+    if (name.empty())
+    {
+        name = args.empty() ? line : args[0];
+    }
+
+    if (name.empty())
+    {
+        ctx_->printExpansion(auxTemplate("empty"), true);
+        return false;
+    }
+    else if (!isOkSaveName(name))
+    {
+        ctx_->printExpansion(auxTemplate("invalid"), true);
+        return false;
+    }
+    else
+    {
+        return true;
+    }
+}
+
+template <>
+bool GameSpecializedAction<ActionTypeLoad>::promptForLine(const vector<string> &args)
+{
+    return promptForSaveName(args);
+}
+
+template <>
+void GameSpecializedAction<ActionTypeLoad>::doAction(const vector<string> &args, const string &line)
+{
+    string name;
+    if (getSaveName(args, line, name))
+    {
+        if (ctx_->load(name))
+        {
+            ctx_->printExpansion(auxTemplate("success"), true);
+        }
+        else
+        {
+            ctx_->printExpansion(auxTemplate("failure"), true);
+        }
+    }
+    this->GameAction::doAction(args);
+}
+
+template <>
+void GameSpecializedAction<ActionTypeLoad>::doAction(const vector<string> &args)
+{
+    doAction(args, string());
+}
+
+template <>
+bool GameSpecializedAction<ActionTypeSave>::promptForLine(const vector<string> &args)
+{
+    return promptForSaveName(args);
+}
+
+template <>
+void GameSpecializedAction<ActionTypeSave>::doAction(const vector<string> &args, const string &line)
+{
+    string name;
+    if (getSaveName(args, line, name))
+    {
+        if (ctx_->save(name))
+        {
+            ctx_->printExpansion(auxTemplate("success"), true);
+        }
+        else
+        {
+            ctx_->printExpansion(auxTemplate("failure"), true);
+        }
+    }
+
+    this->GameAction::doAction(args);
+}
+
+template <>
+void GameSpecializedAction<ActionTypeSave>::doAction(const vector<string> &args)
+{
+    doAction(args, string());
+}
+
+template <>
+void GameSpecializedAction<ActionTypeUndo>::doAction(const vector<string> &args)
+{
+    if (ctx_->undo())
+    {
+        ctx_->printExpansion(auxTemplate("success"), true);
+    }
+    else
+    {
+        ctx_->printExpansion(auxTemplate("failure"), true);
+    }
+
+    this->GameAction::doAction(args);
+}
+
+template <>
+void GameSpecializedAction<ActionTypeRedo>::doAction(const vector<string> &args)
+{
+    if (ctx_->redo())
+    {
+        ctx_->printExpansion(auxTemplate("success"), true);
+    }
+    else
+    {
+        ctx_->printExpansion(auxTemplate("failure"), true);
+    }
+
+    this->GameAction::doAction(args);
+}
+
+template <>
+void GameSpecializedAction<ActionTypeTake>::doAction(const vector<string> &args)
+{
+    string itemTitle;
+    concatenateTokens(args, itemTitle);
+
+    GameLocation *curLocation = ctx_->curLocation();
+    size_t numItems = curLocation->numItems();
+
+    bool tookSomething = false;
+    for (size_t i = 0; i < numItems; i++)
+    {
+        GameItem *item = curLocation->getItem(i);
+        byte *takey = item->takey();
+        if (takey && item->hasTitle(itemTitle))
+        {
+            curLocation->takeItem(item, takey);
+            ctx_->printExpansion(auxTemplate("success"), true);
+            tookSomething = true;
+            break;
+        }
+    }
+    if (!tookSomething)
+    {
+        ctx_->printExpansion(auxTemplate("failure"), true);
+    }
+    
+    this->GameAction::doAction(args);
+}
+
+template<>
+void GameSpecializedAction<ActionTypeDrop>::doAction(const vector<string> &args)
+{
+    string itemTitle;
+    concatenateTokens(args, itemTitle);
+
+    size_t inventorySize = ctx_->inventorySize();
+
+    bool droppedSomething = false;
+    for (size_t i = 0; i < inventorySize; i++)
+    {
+        GameItem *item = ctx_->getInventoryItem(i);
+        if (item->hasTitle(itemTitle))
+        {
+            ctx_->dropInventoryItem(item->takeyhash());
+            ctx_->printExpansion(auxTemplate("success"), true);
+            droppedSomething = true;
+            break;
+        }
+    }
+    if (!droppedSomething)
+    {
+        ctx_->printExpansion(auxTemplate("failure"), true);
+    }
+
+    this->GameAction::doAction(args);
+}
+
+GameItem *GameLocation::getItem(size_t i)
+{
+    ensureDecrypted();
+
+    const byte *itemKey = itemKeys_[i].c_str();
+
+    int gid = ctx_->in->getGid(ObjectTypeItem, itemKey);
+
+    if (gid == -1)
+    {
+        throw "WTF";
+    }
+
+    return ctx_->getItem(gid, itemKey);
+}
+
+void GameLocation::takeItem(GameItem *item, const byte *takey)
+{
+    ensureDecrypted();
+
+    bytestring itemKeyStr = bytestring(item->key(), KEY_SIZE);
+
+    for (size_t i = 0; i < itemKeys_.size(); i++)
+    {
+        if (itemKeys_[i] == itemKeyStr)
+        {
+            item->setTakey(takey);
+            ctx_->journal().removeItemKey(this, i);
+            ctx_->addToInventory(item);
+
+            // if the item had been dropped here, it isn't anymore (otherwise a saved game
+            // would restore it both here and in the inventory)
+            ctx_->journal().setDroppedLocation(item->gid(), NULL, NULL);
+            return;
+        }   
+    }
+}
+
+bool GameItem::hasTitle(const std::string &title)
+{
+    ensureDecrypted();
+
+    byte titleKey[KEY_SIZE];
+    byte titleKeyHash[KEYHASH_SIZE];
+    
+    commandKey(title, titleKey);
+    hashKey(titleKey, titleKeyHash);
+
+    for (size_t i = 0; i < this->titles.size(); i++)
+    {
+        if (!memcmp(this->titles[i].buf, titleKeyHash, KEYHASH_SIZE))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+GameItem *GameItem::readLazy(GameContext &ctx, int gid, const byte *key, GameLocation *parent)
+{
+    if (!checkKey(ctx, gid, key))
+    {
+        return NULL;
+    }
+
+    GameItem *item = new GameItem(ctx, parent);
+    item->setIdentity(gid, key);
+    item->decrypted_ = false;
+    return item;
+}
+
+void GameItem::ensureDecrypted()
+{
+    if (decrypted_)
+    {
+        return;
+    }
+
+    GameItem *item = read(*ctx_, gid(), key(), dynamic_cast<GameLocation *>(parent_));
+    if (!item)
+    {
+        throw "WTF couldn't decrypt restored item";
+    }
+
+    visible = item->visible;
+    title.swap(item->title);
+    titles.swap(item->titles);
+    desc.swap(item->desc);
+    restrictTake = item->restrictTake;
+    if (item->takey_)
+    {
+        setTakey(item->takey_);
+    }
+
+    delete item;
+
+    decrypted_ = true;
+}
+
+const GameTemplate &GameItem::titleTemplate()
+{
+    ensureDecrypted();
+    parseTemplate(titleTemplate_, title);
+    return titleTemplate_;
+}
+
+GameBase* GameItem::decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent)
+{
+    GameItem *item = new GameItem(ctx, parent);
+    
+    item->visible = decryptVal<byte>(decryptor) ? true : false;
+    item->title = decryptString(decryptor);
+    size_t numTitles = decryptVal<size_t>(decryptor);
+    for (size_t i = 0; i < numTitles; i++)
+    {
+        item->titles.push_back(KeyHashBuffer());
+
+        decryptor.Get(item->titles.back().buf, KEYHASH_SIZE);
+    }
+    item->desc = decryptString(decryptor);
+    item->restrictTake = decryptVal<byte>(decryptor) ? true : false;
+    if (!item->restrictTake)
+    {
+        item->takey_ = new byte[KEY_SIZE];
+        decryptor.Get(item->takey_, KEY_SIZE);
+    }
+    return item;
+}
+
+void GameFile::launch()
+{
+    ctx_->fileHandler().launch(dest, ctx_->out());
+}
+
+#define FILEBUF_SIZE 2048
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+GameBase* GameFile::decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent)
+{
+    GameFile *file = new GameFile(ctx);
+
+    file->dest = decryptString(decryptor);
+
+    cleanFilename(file->dest, true);
+
+    size_t len = decryptVal<size_t>(decryptor);
+    GameFileHandler &handler = ctx.fileHandler();
+    if (handler.open(file->dest, len, ctx.out()))
+    {
+        byte buf[FILEBUF_SIZE];
+        
+        // there's surely a way to do this with crypto++ filters...
+        size_t left = len;
+        while (true)
+        {
+            size_t len = decryptor.Get(buf, MIN(left,FILEBUF_SIZE));
+            if (len == 0)
+            {
+                break;
+            }
+            handler.write((char *)buf, len);
+            left -= len;
+        }
+        handler.close(ctx.out());
+    }
+    return file;
+}
+
+#define OUTPUT_DIR "extracted"
+
+bool ExtractedFileHandler::open(const string &name, size_t /* len */, ostream &out)
+{
+    path_ = OUTPUT_DIR PATH_SEP + name;
+    
+    struct stat outputDirInfo;
+    if (stat(OUTPUT_DIR, &outputDirInfo) != 0)
+    {
+        system("mkdir "OUTPUT_DIR);
+    }
+    
+    struct stat fileInfo; 
+    if (stat(path_.c_str(), &fileInfo) == 0) 
+    { 
+        out << "file exists" << endl;
+        return false;
+    }
+
+    file_.close();
+    file_.clear();
+    file_.open(path_.c_str(), ios::out|ios::binary);
+    if (file_.fail())
+    {   
+        out << "ERROR: could not open " << path_ << " for writing" << endl;
+        return false;
+    }
+    return true;
+}
+
+void ExtractedFileHandler::write(const char *data, size_t len)
+{
+    file_.write(data, len);
+}
+
+void ExtractedFileHandler::close(ostream & /* out */)
+{
+    file_.close();
+}
+
+void ExtractedFileHandler::launch(const string &name, ostream &out)
+{
+    string path = OUTPUT_DIR PATH_SEP + name;
+    if (system(("\"" + path + "\"").c_str()) == -1)
+    {
+        out << "Your computer could not open " << path << " automatically." << endl;
+    }
+}
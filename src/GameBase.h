@@ -1,350 +1,651 @@
-#ifndef _GAMEBASE_H
-#define _GAMEBASE_H
-
-#include "CraneaBase.h"
-#include "GameInput.h"
-#include "cranea.h"
-
-class AutoPumpFilter;
-class GameLocation;
-class GameAction;
-class GameItem;
-class GameFile;
-
-typedef std::basic_string<byte> bytestring;
-
-
-class GameQuitException
-{
-};
-
-struct KeyBuffer
-{
-    byte buf[KEY_SIZE];
-};
-
-struct KeyHashBuffer
-{
-    byte buf[KEYHASH_SIZE];
-};
-
-class GameContext
-{
-public:
-    GameContext(GameInput &in) : in(&in) 
-    {
-        commandKey(FORCED_COMMAND, forcedKey_);
-        commandKey(FIRST_VISIT_COMMAND, firstVisitKey_);
-        commandKey(RETURN_VISIT_COMMAND, returnVisitKey_);
-        locationStacks_.push_back(std::vector<GameLocation *>());
-    }
-    ~GameContext();    
-
-    GameInput *in;
-
-    void pushLocation(GameLocation *loc);
-
-    GameLocation *curLocation(); 
-    
-    bool load(std::ifstream &in);
-    bool save(std::ofstream &out);
-
-    void doCall();
-    void doReturn();
-
-    void popLocationUntil(GameLocation *loc);
-    void popLocation();
-
-    std::string lastCommand;
-    std::string lastArgs;
-
-    void printExpansion(const std::string &story, bool appendNewline = false, int expansionCount = 5);
-    
-    std::string getPrompt();
-    void doCommand(const std::string &cmd);
-
-    size_t inventorySize()
-    {
-        return inventory_.size();
-    }
-
-    GameItem *getInventoryItem(size_t i)
-    {
-        return inventory_[i];
-    }
-
-    void dropInventoryItem(const byte *takeyHash);
-    void dropInventoryItem(const byte *takeyHash, GameLocation *whereToDrop);
-
-    GameItem *getInventoryItem(const byte *takeyHash)
-    {
-        std::map<bytestring, GameItem *>::const_iterator it = inventoryByTakeyHash_.find(bytestring(takeyHash, KEYHASH_SIZE));
-
-        if (it == inventoryByTakeyHash_.end())
-        {
-            return NULL;
-        }
-
-        return it->second;
-    }
-
-    const byte *forcedKey() { return forcedKey_; }
-    const byte *firstVisitKey() { return firstVisitKey_; }
-    const byte *returnVisitKey() { return returnVisitKey_; }
-
-    void addToInventory(GameItem *item);
-
-    // take an item that we have previously dropped. returns true on success.
-    bool retakeItem(int gid);
-
-    GameItem *getItem(int gid, const byte *key);
-    GameLocation *getLocation(int gid, const byte *key, GameLocation *parent);
-    GameLocation *getTopLevelLocation(const byte *key);
-
-    void playGame();
-
-private:
-
-    void printVariable(const std::string &var, int expansionCount);
-
-    void writeLocationChain(std::ofstream &out, GameLocation *loc);
-    GameLocation *readLocationChain(std::ifstream &in);
-
-    GameLocation *getSavedLocation(int gid);
-
-    byte forcedKey_[KEY_SIZE];
-    byte firstVisitKey_[KEY_SIZE];
-    byte returnVisitKey_[KEY_SIZE];
-
-    std::vector<std::vector<GameLocation *> > locationStacks_;
-    std::map<int, GameLocation *> savedLocations_;
-    std::map<int, GameItem *> savedItems_;
-    std::vector<GameItem *> inventory_;
-    std::map<bytestring, GameItem *> inventoryByTakeyHash_;
-    std::map<int, std::pair<GameItem *, GameLocation *> > droppedItemLocations_;
-    std::map<int, std::pair<GameItem *, GameLocation *> > originalItemLocations_;
-};
-
-
-class GameBase : public CraneaBase
-{
-public:
-    GameBase(GameContext &ctx) : CraneaBase(), ctx_(&ctx) {}
-
-    virtual byte *key() { return key_; }
-    virtual int gid() { return gid_; }
-
-protected:
-
-    template <typename T>
-    static T decryptVal(CryptoPP::StreamTransformationFilter &decryptor)
-    {
-        T result;
-        if (decryptor.Get((byte *)&result, sizeof(T)) != sizeof(T))
-        {
-            throw "WTF couldn't get enough bytes from decryptor";
-        }
-        canonicalizeEndianness(result);
-        return result;
-    }
-
-    typedef GameBase *(* DecryptFn)(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
-
-    static GameBase *read(GameContext &ctx, int gid, const byte *key, GameLocation *parent, DecryptFn decryptFn);
-
-    static std::string decryptString(CryptoPP::StreamTransformationFilter &decryptor);
-
-    GameContext *ctx_;
-private:
-    static GameBase *decryptByType(GameContext &ctx, int objectType, CryptoPP::StreamTransformationFilter &decryptor, GameLocation *parent);
-    int gid_;
-    byte key_[KEY_SIZE];
-};
-
-
-
-class GameLocation : public GameBase, public CraneaLocation
-{
-public:
-    GameLocation(GameContext &ctx, GameLocation *parent = NULL) 
-      : GameBase(ctx), CraneaLocation(parent), hasEnteredBefore_(false), startKey_(NULL) {}
-    virtual ~GameLocation();
-
-    void doCommand(const std::string &cmd);
-    GameAction *getAction(const byte *actionKey, bool isExactCommand, bool searchParents = true);
-
-    size_t numItems() { return itemKeys_.size(); }
-    GameItem *getItem(size_t i);
-    void takeItem(GameItem *item, const byte *takey);
-    void dropItem(GameItem *item);
-    
-    void doAction(const byte *key);
-
-    void getAncestors(std::vector<GameLocation *> &ancestors);
-
-    void enter();
-    std::string getPrompt();
-
-    static GameLocation *read(GameContext &ctx, int gid, const byte *key, GameLocation *parent)
-    {
-        return dynamic_cast<GameLocation *>(GameBase::read(ctx, gid, key, parent, &GameLocation::decrypt));
-    }
-
-    GameLocation *gameParent() 
-    { 
-        if (parent_)
-        {
-            GameLocation *res = dynamic_cast<GameLocation *>(parent_);
-            if (!res)
-            {
-                throw "OMG WTF BBQ dynamic cast returned null (2)";
-            }
-            return res;
-        }
-        return NULL;
-    }
-
-    void printVariable(const std::string &var, int expansionCount = 5);
-
-    GameLocation *getChildByKey(const byte *key);
-   
-protected:
-    static GameBase *decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
-
-private:
-
-    void doAction(GameAction *action, const std::vector<std::string> &args = std::vector<std::string>());
-
-    bool hasEnteredBefore_;
-
-    GameAction *getActionInternal(const byte *actionKey, const bytestring &actionKeyHash, bool isExactCommand);
-
-    byte *startKey_;
-
-    std::map<bytestring, std::vector<bytestring> > actionTable_;
-    std::vector<bytestring> itemKeys_;
-    std::map<bytestring, int> locationTable_;
-
-};
-
-
-class GameAction : public GameBase, public CraneaAction
-{
-public:
-    GameAction(GameContext &ctx, GameLocation *parent) : GameBase(ctx), CraneaAction(parent) {}
-
-    GameLocation *gameParent() 
-    { 
-        return parent_ ? dynamic_cast<GameLocation *>(parent_) : NULL;
-    }
-
-    static GameAction *read(GameContext &ctx, int gid, const byte *key, GameLocation *parent)
-    {
-        return dynamic_cast<GameAction *>(GameBase::read(ctx, gid, key, parent, &GameAction::decrypt));
-    }
-
-    virtual void doAction(const std::vector<std::string> &args);
-
-    virtual byte *dokey();    
-
-    std::vector<KeyBuffer> locationKeysDown_;
-protected:
-    static GameBase* decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
-
-    typedef std::pair<std::vector<std::string>, std::string> Predicate;
-
-    bool getSaveFilename(const std::vector<std::string> &args, std::string &filename);
-
-    void iterateItems(const std::vector<GameItem *> &items);
-private:
-    static GameAction *newActionByType(int actionType, GameContext &ctx, GameLocation *parent);
-    static bool getDokeyFromPredicate(GameContext &ctx, AutoPumpFilter &decryptor, byte *dokey);
-    void followPath(size_t levelsUp, const std::vector<KeyBuffer> &locationKeysDown);
-
-    struct TakenItem
-    {
-        byte key[KEY_SIZE];
-        byte takey[KEY_SIZE];
-        size_t levelsUp;
-        std::vector<KeyBuffer> locationKeysDown;
-    };
-
-    struct OpenedFile
-    {
-        byte key[KEY_SIZE];
-        bool launch;
-    };
-
-    std::vector<TakenItem> takesKeys_;
-
-    std::vector<bytestring> dropsTakeyHashes_;
-
-    std::vector<OpenedFile> files_;
-
-    bool changesLocation_;
-    size_t levelsUp_;
-
-    typedef std::pair<std::vector<bytestring>, bytestring> EncryptedPredicate;
-
-    byte dokey_[KEY_SIZE];
-};
-
-template <ActionType actionType>
-class GameSpecializedAction : public GameAction
-{
-public:
-    GameSpecializedAction(GameContext &ctx, GameLocation *parent) : GameAction(ctx, parent){}
-    virtual void doAction(const std::vector<std::string> &args);
-};
-
-
-class GameItem : public GameBase, public CraneaItem
-{
-public:
-    GameItem(GameContext &ctx, GameLocation *parent) : GameBase(ctx), CraneaItem(parent), takey_(NULL) {}
-    ~GameItem() { if (takey_) delete[] takey_; }
-
-    std::vector<KeyHashBuffer> titles;
-
-    void setTakey(const byte *takey)
-    {
-        if (!takey_) 
-        {
-            takey_ = new byte[KEY_SIZE];
-            memcpy(takey_, takey, KEY_SIZE);
-        }
-    }
-
-    bool hasTitle(const std::string &title);
-
-    virtual byte *takey() { return takey_; }
-
-    static GameItem *read(GameContext &ctx, int gid, const byte *key, GameLocation *parent)
-    {
-        return dynamic_cast<GameItem *>(GameBase::read(ctx, gid, key, parent, &GameItem::decrypt));
-    }
-protected:
-    static GameBase* decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
-private:
-    byte *takey_;
-};
-
-class GameFile : public GameBase, public CraneaFile
-{
-public:
-    GameFile(GameContext &ctx) : GameBase(ctx), CraneaFile() {}
-
-    void launch();
-
-    static GameFile *read(GameContext &ctx, int gid, const byte *key)
-    {
-        return dynamic_cast<GameFile *>(GameBase::read(ctx, gid, key, NULL, &GameFile::decrypt));
-    }
-
-protected:
-
-    static GameBase* decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
-};
-
-
-#endif
+#ifndef _GAMEBASE_H
+#define _GAMEBASE_H
+
+#include "CraneaBase.h"
+#include "GameInput.h"
+#include "GameJournal.h"
+#include "GameSave.h"
+#include "GameTemplate.h"
+#include "GameOutput.h"
+#include "GameScheduler.h"
+#include "cranea.h"
+#include <fstream>
+
+class AutoPumpFilter;
+class GameLocation;
+class GameAction;
+class GameItem;
+class GameFile;
+class GameRecoveryLog;
+
+
+class GameQuitException
+{
+};
+
+struct KeyBuffer
+{
+    byte buf[KEY_SIZE];
+};
+
+struct KeyHashBuffer
+{
+    byte buf[KEYHASH_SIZE];
+};
+
+/* GameFileHandler
+ * ===============
+ * Takes the files that the player extracts (see GameFile). Messages for the player are
+ * written to out.
+ */
+class GameFileHandler
+{
+public:
+    virtual ~GameFileHandler() {}
+
+    // starts a file of len bytes called name (a relative path, already cleaned up).
+    // returns false to skip its contents.
+    virtual bool open(const std::string &name, size_t len, std::ostream &out) = 0;
+    virtual void write(const char *data, size_t len) = 0;
+    virtual void close(std::ostream &out) = 0;
+
+    // the adventure asks for the file to be opened for the player
+    virtual void launch(const std::string &name, std::ostream &out) = 0;
+};
+
+/* ExtractedFileHandler
+ * ====================
+ * Writes the files to the extracted/ directory in the current directory (leaving any
+ * that are there already), and launches them with the system's shell.
+ */
+class ExtractedFileHandler : public GameFileHandler
+{
+public:
+    virtual bool open(const std::string &name, size_t len, std::ostream &out);
+    virtual void write(const char *data, size_t len);
+    virtual void close(std::ostream &out);
+    virtual void launch(const std::string &name, std::ostream &out);
+
+private:
+    std::string path_;
+    std::fstream file_;
+};
+
+// discards the files (and never launches anything)
+class NullFileHandler : public GameFileHandler
+{
+public:
+    virtual bool open(const std::string & /* name */, size_t /* len */, std::ostream & /* out */) { return false; }
+    virtual void write(const char * /* data */, size_t /* len */) {}
+    virtual void close(std::ostream & /* out */) {}
+    virtual void launch(const std::string & /* name */, std::ostream & /* out */) {}
+};
+
+/* All of the state of a game in progress, as stored by GameContext.
+ * Owns the items and locations in savedItems and savedLocations.
+ */
+struct GameStateSnapshot
+{
+    ~GameStateSnapshot();
+
+    std::vector<std::vector<GameLocation *> > locationStacks;
+    std::map<int, GameLocation *> savedLocations;
+    std::map<int, GameItem *> savedItems;
+    std::vector<GameItem *> inventory;
+    std::map<bytestring, GameItem *> inventoryByTakeyHash;
+    std::map<int, std::pair<GameItem *, GameLocation *> > droppedItemLocations;
+    std::map<int, std::pair<GameItem *, GameLocation *> > originalItemLocations;
+};
+
+class GameContext
+{
+public:
+    GameContext(GameInput &in) 
+      : in(&in), saveStore_(&fileSaveStore_), fileHandler_(&extractedFileHandler_), autosave_(NULL), autosaveInterval_(0), commandsSinceAutosave_(0), 
+        recoveryLog_(NULL), checkpointInterval_(0), commandsSinceCheckpoint_(0), checkpointDue_(false), replaying_(false), 
+        sink_(&nullSink_), out_(&outBuffer_), inputEnded_(false), 
+        startingRecovery_(false), needPrompt_(false), quit_(false), ended_(false), awaitingAction_(NULL), 
+        journal_(*this)
+    {
+        commandKey(FORCED_COMMAND, forcedKey_);
+        commandKey(FIRST_VISIT_COMMAND, firstVisitKey_);
+        commandKey(RETURN_VISIT_COMMAND, returnVisitKey_);
+        locationStacks_.push_back(std::vector<GameLocation *>());
+    }
+    ~GameContext();    
+
+    GameInput *in;
+
+    // the game's output is collected here, and written to the output sink by flushOutput()
+    std::ostream &out() { return out_; }
+
+    // writes the output so far to the output sink, up to the first delay or pause in it
+    // (the rest is delivered by the scheduler)
+    void flushOutput();
+
+    GameScheduler &scheduler() { return scheduler_; }
+
+    // where the game's output goes (by default, nowhere). the sink must outlive the context.
+    void setOutputSink(OutputSink &sink);
+
+    /* A game never waits for anything itself: start() runs it until it needs a line of input,
+     * submitLine() passes it each line the player enters, and resume() continues it after a
+     * delay in the output. status() tells whoever drives the game what it is waiting for, so a
+     * single thread can drive any number of games (see GameServer); playGame() drives one game
+     * from a line source.
+     */
+    enum Status
+    {
+        WaitingForInput,    // for submitLine() or endInput()
+        Delayed,            // for resume(), scheduler().dueIn() milliseconds from now
+        Ended
+    };
+
+    // enters the initial location (or recovers the game in progress, see setRecoveryLog)
+    void start();
+
+    // handles a line of input: a command, the answer to a prompt or the end of a pause
+    void submitLine(const std::string &line);
+
+    // the player has left: delivers the rest of the output and ends the game
+    // (keeping the recovery log, so the game can be recovered)
+    void endInput();
+
+    void resume();
+
+    Status status();
+
+    // plays the whole game, reading lines from source and sleeping through delays
+    void playGame(LineSource &source);
+
+    // asks for a line of input in the middle of a command: the action runs with the next line
+    // that the player enters (see GameAction::promptForLine). takes ownership of the action.
+    void awaitLine(GameAction *action, const std::vector<std::string> &args);
+
+    void pushLocation(GameLocation *loc);
+
+    GameLocation *curLocation(); 
+    
+    // loads/saves the game with the given name from the save store
+    bool load(const std::string &name);
+    bool save(const std::string &name);
+
+    void captureSaveData(SaveData &data);
+
+    // replaces the game in progress with a saved game. returns false (keeping the game
+    // in progress) if the saved game doesn't belong to this data file.
+    bool load(const SaveData &data);
+
+    /* Frees the locations and items of a game that is waiting for a command (and the undo
+     * history that refers to them), keeping only the keys needed to restore them in a
+     * compact blob: the state before the oldest command that can be undone, kept like a
+     * saved game, and the changes that each command made from there (see HibernatedGame),
+     * so the blob grows with the changes in the history rather than with the size of the
+     * game. The next call that runs the game restores it, and objects are decrypted again
+     * only as the game needs them. Returns false if the game is in the middle of something.
+     */
+    bool hibernate();
+    bool isHibernating() { return !hibernated_.empty(); }
+
+    // where games are saved (by default, a .crs file per saved game). 
+    // the store must outlive the context.
+    void setSaveStore(GameSaveStore &store);
+
+    // what happens to the files that the player extracts (by default, they are written to
+    // the extracted/ directory). the handler must outlive the context.
+    void setFileHandler(GameFileHandler &handler) { fileHandler_ = &handler; }
+    GameFileHandler &fileHandler() { return *fileHandler_; }
+
+    // saves the game in the background every interval commands (0 to disable autosave)
+    void setAutosave(size_t interval, const std::string &name);
+
+    // logs the player's input to a recovery log (with a checkpoint every interval commands).
+    // if the log is left over from a game that didn't end normally, start() recovers that game.
+    void setRecoveryLog(const std::string &filename, size_t checkpointInterval);
+
+    // true while the input from a recovery log is being replayed
+    bool isReplaying() { return replaying_; }
+
+    void doCall();
+    void doReturn();
+
+    void popLocationUntil(GameLocation *loc);
+    void popLocation();
+
+    // reverts/re-applies the changes made by the last command. returns true on success.
+    bool undo();
+    bool redo();
+
+    GameJournal &journal() { return journal_; }
+
+    std::string lastCommand;
+    std::string lastArgs;
+
+    void printExpansion(const GameTemplate &story, bool appendNewline = false, int expansionCount = 5);
+    
+    void doCommand(const std::string &cmd);
+
+    size_t inventorySize()
+    {
+        return inventory_.size();
+    }
+
+    GameItem *getInventoryItem(size_t i);
+
+    void dropInventoryItem(const byte *takeyHash);
+    void dropInventoryItem(const byte *takeyHash, GameLocation *whereToDrop);
+
+    GameItem *getInventoryItem(const byte *takeyHash)
+    {
+        std::map<bytestring, GameItem *>::const_iterator it = inventoryByTakeyHash_.find(bytestring(takeyHash, KEYHASH_SIZE));
+
+        if (it == inventoryByTakeyHash_.end())
+        {
+            return NULL;
+        }
+
+        return it->second;
+    }
+
+    const byte *forcedKey() { return forcedKey_; }
+    const byte *firstVisitKey() { return firstVisitKey_; }
+    const byte *returnVisitKey() { return returnVisitKey_; }
+
+    void addToInventory(GameItem *item);
+
+    // take an item that we have previously dropped. returns true on success.
+    bool retakeItem(int gid);
+
+    GameItem *getItem(int gid, const byte *key);
+    GameLocation *getLocation(int gid, const byte *key, GameLocation *parent);
+    GameLocation *getTopLevelLocation(const byte *key);
+
+private:
+    friend class GameJournal;
+
+    GameContext(const GameContext &);
+    GameContext &operator=(const GameContext &);
+
+    void swapState(GameStateSnapshot &state);
+
+    void printVariable(GameTemplate::Op op, int expansionCount);
+
+    bool restoreSaveData(const SaveData &data);
+    void captureSaveData(SaveData &data, std::map<GameLocation *, size_t> &indexes);
+
+    void wake();
+    void captureHibernatedState(SaveData &data);
+    bool restoreHibernatedState(const SaveData &data);
+
+    // the locations and items that the history of a hibernating game refers to
+    size_t addHibernatedLocation(HibernatedGame &game, std::map<GameLocation *, size_t> &indexes, GameLocation *loc);
+    bool addHibernatedItem(HibernatedGame &game, std::map<GameLocation *, size_t> &locationIndexes, 
+                           std::map<GameItem *, size_t> &itemIndexes, GameItem *item, size_t &index);
+    GameLocation *getHibernatedLocation(const std::vector<SaveData::Location> &locations, size_t index);
+    GameItem *getHibernatedItem(const HibernatedGame &game, size_t index);
+
+    void autosave();
+
+    bool readInputLine(std::string &line);
+
+    void run();
+    void handleLine(const std::string &line);
+    void commandDone();
+    void endGame();
+
+    void startRecoveryLog();
+    void finishReplay();
+    void checkpoint();
+
+    // like getLocation/getItem, but objects that aren't in memory yet are only decrypted 
+    // when the game needs their contents (used when restoring a saved game)
+    GameLocation *getLazyLocation(int gid, const byte *key, GameLocation *parent);
+    GameItem *getLazyItem(int gid, const byte *key, GameLocation *originalLoc);
+
+    GameLocation *getSavedLocation(int gid);
+
+    byte forcedKey_[KEY_SIZE];
+    byte firstVisitKey_[KEY_SIZE];
+    byte returnVisitKey_[KEY_SIZE];
+
+    std::vector<std::vector<GameLocation *> > locationStacks_;
+    std::map<int, GameLocation *> savedLocations_;
+    std::map<int, GameItem *> savedItems_;
+    std::vector<GameItem *> inventory_;
+    std::map<bytestring, GameItem *> inventoryByTakeyHash_;
+    std::map<int, std::pair<GameItem *, GameLocation *> > droppedItemLocations_;
+    std::map<int, std::pair<GameItem *, GameLocation *> > originalItemLocations_;
+
+    FileSaveStore fileSaveStore_;
+    GameSaveStore *saveStore_;
+
+    ExtractedFileHandler extractedFileHandler_;
+    GameFileHandler *fileHandler_;
+
+    GameAutosave *autosave_;
+    size_t autosaveInterval_;
+    size_t commandsSinceAutosave_;
+
+    std::string recoveryFilename_;
+    GameRecoveryLog *recoveryLog_;
+    size_t checkpointInterval_;
+    size_t commandsSinceCheckpoint_;
+    bool checkpointDue_; // taken once the pauses of the last command have been answered
+    std::deque<std::string> replayLines_;
+    bool replaying_;
+
+    NullOutputSink nullSink_;
+    OutputSink *sink_;
+    OutputBuffer outBuffer_;
+    std::ostream out_;
+    GameScheduler scheduler_;
+
+    std::deque<std::string> inputLines_; // lines that the game hasn't read yet
+    bool inputEnded_;
+    bool startingRecovery_;     // the recovery log is started once the initial output has been delivered
+    bool needPrompt_;           // the last command is done, and the prompt for the next one is due
+    bool quit_;                 // the player quit, and the game ends once the output has been delivered
+    bool ended_;
+    GameAction *awaitingAction_;
+    std::vector<std::string> awaitingArgs_;
+
+    std::string hibernated_; // the SaveData of a hibernating game (see hibernate())
+
+    GameJournal journal_;
+};
+
+
+class GameBase : public CraneaBase
+{
+public:
+    GameBase(GameContext &ctx) : CraneaBase(), ctx_(&ctx), decrypted_(true) {}
+
+    virtual byte *key() { return key_; }
+    virtual int gid() { return gid_; }
+
+    bool isDecrypted() { return decrypted_; }
+
+protected:
+
+    template <typename T>
+    static T decryptVal(CryptoPP::StreamTransformationFilter &decryptor)
+    {
+        T result;
+        if (decryptor.Get((byte *)&result, sizeof(T)) != sizeof(T))
+        {
+            throw "WTF couldn't get enough bytes from decryptor";
+        }
+        canonicalizeEndianness(result);
+        return result;
+    }
+
+    typedef GameBase *(* DecryptFn)(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
+
+    static GameBase *read(GameContext &ctx, int gid, const byte *key, GameLocation *parent, DecryptFn decryptFn);
+
+    static std::string decryptString(CryptoPP::StreamTransformationFilter &decryptor);
+
+    // checks that key decrypts the object with the given gid, without decrypting its contents
+    static bool checkKey(GameContext &ctx, int gid, const byte *key);
+
+    void setIdentity(int gid, const byte *key);
+
+    // parses a story string of this object the first time it is needed
+    void parseTemplate(GameTemplate &tmpl, const std::string &story);
+
+    GameContext *ctx_;
+
+    // false if only the gid and key of this object are known so far
+    bool decrypted_;
+private:
+    static GameBase *decryptByType(GameContext &ctx, int objectType, CryptoPP::StreamTransformationFilter &decryptor, GameLocation *parent);
+    int gid_;
+    byte key_[KEY_SIZE];
+};
+
+
+
+class GameLocation : public GameBase, public CraneaLocation
+{
+public:
+    GameLocation(GameContext &ctx, GameLocation *parent = NULL) 
+      : GameBase(ctx), CraneaLocation(parent), hasEnteredBefore_(false), startKey_(NULL), hasRestoredItemKeys_(false) {}
+    virtual ~GameLocation();
+
+    void doCommand(const std::string &cmd);
+    GameAction *getAction(const byte *actionKey, bool isExactCommand, bool searchParents = true);
+
+    size_t numItems() { ensureDecrypted(); return itemKeys_.size(); }
+    GameItem *getItem(size_t i);
+    void takeItem(GameItem *item, const byte *takey);
+    void dropItem(GameItem *item);
+    
+    void doAction(const byte *key);
+
+    void getAncestors(std::vector<GameLocation *> &ancestors);
+
+    void enter();
+    bool hasEnteredBefore() { return hasEnteredBefore_; }
+
+    static GameLocation *read(GameContext &ctx, int gid, const byte *key, GameLocation *parent)
+    {
+        return dynamic_cast<GameLocation *>(GameBase::read(ctx, gid, key, parent, &GameLocation::decrypt));
+    }
+
+    // returns a location that is decrypted the first time its contents are needed
+    static GameLocation *readLazy(GameContext &ctx, int gid, const byte *key, GameLocation *parent);
+
+    void ensureDecrypted();
+
+    // changes to the items at this location when restoring a saved game.
+    // if the location hasn't been decrypted yet, they are applied when it is.
+    void restoreItemRemoved(const byte *itemKey);
+    void restoreItemAdded(const byte *itemKey);
+
+    // the items here, for a hibernating game (see SaveData::LocationItems). captureItems
+    // returns false if they are still the ones in the data file.
+    bool captureItems(SaveData::LocationItems &items);
+    void restoreItems(const SaveData::LocationItems &items);
+
+    GameLocation *gameParent() 
+    { 
+        if (parent_)
+        {
+            GameLocation *res = dynamic_cast<GameLocation *>(parent_);
+            if (!res)
+            {
+                throw "OMG WTF BBQ dynamic cast returned null (2)";
+            }
+            return res;
+        }
+        return NULL;
+    }
+
+    // the parsed title, description and prompt (the prompt of the nearest ancestor that has one)
+    const GameTemplate &titleTemplate();
+    const GameTemplate &descTemplate();
+    const GameTemplate &promptTemplate();
+
+    GameLocation *getChildByKey(const byte *key);
+   
+protected:
+    static GameBase *decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
+
+    virtual bool isIgnoredInternal(const std::string &token);
+    virtual bool hasCanonicalSynonyms();
+
+private:
+    friend class GameJournal;
+
+    void doAction(GameAction *action, const std::vector<std::string> &args = std::vector<std::string>());
+
+    bool hasEnteredBefore_;
+
+    GameAction *getActionInternal(const byte *actionKey, const bytestring &actionKeyHash, bool isExactCommand);
+
+    // the action for the command (as tokens) at this location or its ancestors
+    GameAction *getCommandAction(const std::vector<std::string> &tokens, bool isExactCommand);
+
+    byte *startKey_;
+
+    std::map<bytestring, std::vector<bytestring> > actionTable_;
+    std::vector<bytestring> itemKeys_;
+    std::map<bytestring, int> locationTable_;
+
+    std::set<bytestring> removedItemKeys_;
+    std::vector<bytestring> addedItemKeys_;
+    bool hasRestoredItemKeys_; // if so, restoredItemKeys_ replaces the items in the data file
+    std::vector<bytestring> restoredItemKeys_;
+
+    GameTemplate titleTemplate_;
+    GameTemplate descTemplate_;
+    GameTemplate promptTemplate_;
+
+};
+
+
+class GameAction : public GameBase, public CraneaAction
+{
+public:
+    GameAction(GameContext &ctx, GameLocation *parent) : GameBase(ctx), CraneaAction(parent) {}
+
+    GameLocation *gameParent() 
+    { 
+        return parent_ ? dynamic_cast<GameLocation *>(parent_) : NULL;
+    }
+
+    static GameAction *read(GameContext &ctx, int gid, const byte *key, GameLocation *parent)
+    {
+        return dynamic_cast<GameAction *>(GameBase::read(ctx, gid, key, parent, &GameAction::decrypt));
+    }
+
+    virtual void doAction(const std::vector<std::string> &args);
+
+    // runs the action with the line that the player entered after promptForLine
+    virtual void doAction(const std::vector<std::string> &args, const std::string & /* line */) { doAction(args); }
+
+    // if the action needs a line of input from the player before it can run (as a save
+    // without a name does), prompts for it and returns true
+    virtual bool promptForLine(const std::vector<std::string> & /* args */) { return false; }
+
+    virtual byte *dokey();    
+
+    std::vector<KeyBuffer> locationKeysDown_;
+protected:
+    static GameBase* decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
+
+    typedef std::pair<std::vector<std::string>, std::string> Predicate;
+
+    bool promptForSaveName(const std::vector<std::string> &args);
+    bool getSaveName(const std::vector<std::string> &args, const std::string &line, std::string &name);
+
+    // the parsed auxData[name] (empty if there is no such aux data)
+    const GameTemplate &auxTemplate(const std::string &name);
+
+    void iterateItems(const std::vector<GameItem *> &items);
+private:
+    static GameAction *newActionByType(int actionType, GameContext &ctx, GameLocation *parent);
+    static bool getDokeyFromPredicate(GameContext &ctx, AutoPumpFilter &decryptor, byte *dokey);
+    void followPath(size_t levelsUp, const std::vector<KeyBuffer> &locationKeysDown);
+
+    struct TakenItem
+    {
+        byte key[KEY_SIZE];
+        byte takey[KEY_SIZE];
+        size_t levelsUp;
+        std::vector<KeyBuffer> locationKeysDown;
+    };
+
+    struct OpenedFile
+    {
+        byte key[KEY_SIZE];
+        bool launch;
+    };
+
+    std::vector<TakenItem> takesKeys_;
+
+    std::vector<bytestring> dropsTakeyHashes_;
+
+    std::vector<OpenedFile> files_;
+
+    bool changesLocation_;
+    size_t levelsUp_;
+
+    typedef std::pair<std::vector<bytestring>, bytestring> EncryptedPredicate;
+
+    byte dokey_[KEY_SIZE];
+
+    GameTemplate descTemplate_;
+    std::map<std::string, GameTemplate> auxTemplates_;
+};
+
+template <ActionType actionType>
+class GameSpecializedAction : public GameAction
+{
+public:
+    GameSpecializedAction(GameContext &ctx, GameLocation *parent) : GameAction(ctx, parent){}
+    virtual void doAction(const std::vector<std::string> &args);
+    virtual void doAction(const std::vector<std::string> &args, const std::string & /* line */) { doAction(args); }
+    virtual bool promptForLine(const std::vector<std::string> & /* args */) { return false; }
+};
+
+
+class GameItem : public GameBase, public CraneaItem
+{
+public:
+    GameItem(GameContext &ctx, GameLocation *parent) : GameBase(ctx), CraneaItem(parent), takey_(NULL) {}
+    ~GameItem() { if (takey_) delete[] takey_; }
+
+    std::vector<KeyHashBuffer> titles;
+
+    void setTakey(const byte *takey)
+    {
+        if (!takey_) 
+        {
+            takey_ = new byte[KEY_SIZE];
+            memcpy(takey_, takey, KEY_SIZE);
+        }
+    }
+
+    bool hasTitle(const std::string &title);
+
+    virtual byte *takey() { return takey_; }
+
+    static GameItem *read(GameContext &ctx, int gid, const byte *key, GameLocation *parent)
+    {
+        return dynamic_cast<GameItem *>(GameBase::read(ctx, gid, key, parent, &GameItem::decrypt));
+    }
+
+    // returns an item that is decrypted the first time its contents are needed
+    static GameItem *readLazy(GameContext &ctx, int gid, const byte *key, GameLocation *parent);
+
+    void ensureDecrypted();
+
+    const GameTemplate &titleTemplate();
+protected:
+    static GameBase* decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
+private:
+    byte *takey_;
+
+    GameTemplate titleTemplate_;
+};
+
+class GameFile : public GameBase, public CraneaFile
+{
+public:
+    GameFile(GameContext &ctx) : GameBase(ctx), CraneaFile() {}
+
+    void launch();
+
+    static GameFile *read(GameContext &ctx, int gid, const byte *key)
+    {
+        return dynamic_cast<GameFile *>(GameBase::read(ctx, gid, key, NULL, &GameFile::decrypt));
+    }
+
+protected:
+
+    static GameBase* decrypt(GameContext &ctx, AutoPumpFilter &decryptor, GameLocation *parent);
+};
+
+
+#endif
@@ -0,0 +1,194 @@
+#include "GameExecutor.h"
+
+using namespace std;
+
+GameExecutor::GameExecutor(size_t numWorkers)
+    : stopping_(false)
+{
+    if (numWorkers == 0)
+    {
+        numWorkers = 1;
+    }
+
+    for (size_t i = 0; i < numWorkers; i++)
+    {
+        Worker *worker = new Worker();
+        worker->executor = this;
+        worker->index = i;
+        workers_.push_back(worker);
+    }
+
+    for (size_t i = 0; i < numWorkers; i++)
+    {
+        if (!workers_[i]->thread.start(&GameExecutor::run, workers_[i]))
+        {
+            throw "WTF couldn't start executor thread";
+        }
+    }
+}
+
+GameExecutor::~GameExecutor()
+{
+    {
+        ScopedLock lock(mutex_);
+        stopping_ = true;
+    }
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        workers_[i]->wakeup.set();
+    }
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        workers_[i]->thread.join();
+        delete workers_[i];
+    }
+}
+
+void GameExecutor::submit(TaskFn fn, void *arg, size_t index)
+{
+    Task task;
+    task.fn = fn;
+    task.arg = arg;
+
+    Worker &worker = *workers_[index % workers_.size()];
+    bool idle;
+    {
+        ScopedLock lock(worker.mutex);
+        worker.tasks.push_back(task);
+        if (worker.tasks.size() > worker.maxQueued)
+        {
+            worker.maxQueued = worker.tasks.size();
+        }
+        idle = worker.idle;
+    }
+    worker.wakeup.set();
+
+    if (!idle)
+    {
+        // the worker is busy, so another one may as well steal the task
+        wakeIdleWorker();
+    }
+}
+
+void GameExecutor::wakeIdleWorker()
+{
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        Worker &worker = *workers_[i];
+        bool idle;
+        {
+            ScopedLock lock(worker.mutex);
+            idle = worker.idle;
+            worker.idle = false;
+        }
+        if (idle)
+        {
+            worker.wakeup.set();
+            return;
+        }
+    }
+}
+
+void GameExecutor::getStats(vector<Stats> &stats)
+{
+    stats.resize(workers_.size());
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        Worker &worker = *workers_[i];
+        ScopedLock lock(worker.mutex);
+        stats[i].queued = worker.tasks.size();
+        stats[i].maxQueued = worker.maxQueued;
+        stats[i].ran = worker.ran;
+        stats[i].stolen = worker.stolen;
+    }
+}
+
+/* Takes the oldest task in the worker's own queue, or else the newest task in the queue
+ * of another worker. Returns false if all the queues are empty.
+ */
+bool GameExecutor::takeTask(Worker &worker, Task &task)
+{
+    {
+        ScopedLock lock(worker.mutex);
+        if (!worker.tasks.empty())
+        {
+            task = worker.tasks.front();
+            worker.tasks.pop_front();
+            worker.ran++;
+            return true;
+        }
+    }
+
+    size_t numWorkers = workers_.size();
+    for (size_t i = 1; i < numWorkers; i++)
+    {
+        Worker &victim = *workers_[(worker.index + i) % numWorkers];
+        bool stole = false;
+        {
+            ScopedLock lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                stole = true;
+            }
+        }
+        if (stole)
+        {
+            ScopedLock lock(worker.mutex);
+            worker.ran++;
+            worker.stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void GameExecutor::run(void *arg)
+{
+    Worker &worker = *(Worker *)arg;
+    GameExecutor *executor = worker.executor;
+
+    while (true)
+    {
+        Task task;
+        if (executor->takeTask(worker, task))
+        {
+            task.fn(task.arg);
+            continue;
+        }
+
+        {
+            ScopedLock lock(worker.mutex);
+            worker.idle = true;
+        }
+
+        // a task may have been submitted before the worker was marked idle
+        bool found = executor->takeTask(worker, task);
+        if (!found)
+        {
+            ScopedLock lock(executor->mutex_);
+            if (executor->stopping_)
+            {
+                break;
+            }
+        }
+
+        if (!found)
+        {
+            worker.wakeup.wait();
+        }
+
+        {
+            ScopedLock lock(worker.mutex);
+            worker.idle = false;
+        }
+
+        if (found)
+        {
+            task.fn(task.arg);
+        }
+    }
+}
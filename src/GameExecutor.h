@@ -0,0 +1,81 @@
+#ifndef _GAME_EXECUTOR_H_
+#define _GAME_EXECUTOR_H_
+
+#include "CraneaThread.h"
+#include <deque>
+#include <vector>
+
+/* GameExecutor
+ * ============
+ * A pool of worker threads that run tasks, with a queue per worker. A task is submitted
+ * to a particular worker, so the tasks of one session keep running on the same thread
+ * (and the same core's cache). A worker that runs out of tasks steals the newest task
+ * from the queue of another worker, so one expensive task (such as a command that
+ * decrypts a large file) doesn't hold up the cheap ones queued behind it.
+ *
+ * Tasks must not assume that tasks submitted to the same worker run in order; a task
+ * that has to follow another should be submitted by it.
+ */
+class GameExecutor
+{
+public:
+    typedef void (*TaskFn)(void *arg);
+
+    struct Stats
+    {
+        size_t queued;          // tasks waiting in the worker's queue right now
+        size_t maxQueued;       // the most tasks that have waited in the queue at once
+        unsigned long ran;      // tasks the worker has run (including the stolen ones)
+        unsigned long stolen;   // tasks the worker took from the queues of other workers
+    };
+
+    GameExecutor(size_t numWorkers);
+
+    // runs the tasks that are still queued, then stops the workers
+    ~GameExecutor();
+
+    size_t numWorkers() { return workers_.size(); }
+
+    // runs fn(arg) on the given worker (or on another one, if that one is busy)
+    void submit(TaskFn fn, void *arg, size_t worker);
+
+    void getStats(std::vector<Stats> &stats);
+
+private:
+    GameExecutor(const GameExecutor &);
+    GameExecutor &operator=(const GameExecutor &);
+
+    struct Task
+    {
+        TaskFn fn;
+        void *arg;
+    };
+
+    struct Worker
+    {
+        Worker() : executor(NULL), index(0), maxQueued(0), ran(0), stolen(0), idle(false) {}
+
+        GameExecutor *executor;
+        size_t index;
+        Thread thread;
+        Event wakeup;
+
+        Mutex mutex; // protects everything below
+        std::deque<Task> tasks;
+        size_t maxQueued;
+        unsigned long ran;
+        unsigned long stolen;
+        bool idle; // waiting for wakeup
+    };
+
+    static void run(void *arg);
+    bool takeTask(Worker &worker, Task &task);
+    void wakeIdleWorker();
+
+    std::vector<Worker *> workers_;
+
+    Mutex mutex_; // protects stopping_
+    bool stopping_;
+};
+
+#endif
@@ -1,119 +1,308 @@
-#include <iostream>
-#include <fstream>
-using namespace std;
-
-#include "CraneaBase.h"
-#include "GameInput.h"
-
-bool GameInput::seekObject(int gid)
-{
-    map<int, off_t>::iterator pos = offsetMap_.find(gid);
-    if (pos == offsetMap_.end())
-    {
-        return false;
-    }
-    off_t offset = pos->second;
-    in_.seekg(offset);
-    return true;
-}
-
-int GameInput::getGid(ObjectType objectType, const byte *key)
-{
-    byte keyhash[KEYHASH_SIZE];
-
-    hashKey(key, keyhash);
-
-    string keyStr((char*)keyhash, KEYHASH_SIZE);
-    map<string, int>::iterator pos = gidMaps_[objectType].find(keyStr);
-    if (pos == gidMaps_[objectType].end())
-    {
-        return -1;
-    }
-    return pos->second;
-}
-
-byte *GameInput::initialKey()
-{
-    return initialKey_;
-}
-
-GameInput::GameInput(const string &infile)
-    : in_(infile.c_str(), ios::in | ios::binary)
-{
-    fail_ = in_.fail();
-    
-    if (!fail_)
-    {
-        // read until first nul byte
-        char ch;
-        do
-        {
-            ch = in_.get();
-        }
-        while (ch != '\0' && !in_.eof());
-
-        off_t offsetTableOffset = readVal<off_t>();
-
-        off_t gidTableOffsets[NUM_GLOBAL_MAPS];
-        for (size_t i = 0; i < NUM_GLOBAL_MAPS; i++)
-        {
-            gidTableOffsets[i] = readVal<off_t>();
-        }
-
-        // read the initial location key
-        in_.read((char *)initialKey_, KEY_SIZE);
-
-        // read the offset table (gid -> file offset)
-        in_.seekg(offsetTableOffset);
-        size_t numEntries = readVal<size_t>();
-
-        //cout << numEntries << " entries in the global offset table" << endl;
-
-        for (size_t i = 0; i < numEntries; i++)
-        {
-            int gid = readVal<int>();
-            off_t offset = readVal<off_t>();
-            offsetMap_[gid] = offset;
-        }
-
-        // read the tables of top-level objects (keyhash -> gid)
-        for (size_t i = 0; i < NUM_GLOBAL_MAPS; i++)
-        {
-            map<string, int> &gidMap = gidMaps_[i];
-
-            in_.seekg(gidTableOffsets[i]);
-            numEntries = readVal<size_t>();
-
-            //cout << numEntries << " entries in map " << i << endl;
-
-            for (size_t j = 0; j < numEntries; j++)
-            {
-                char keyhash[KEYHASH_SIZE];
-                in_.read(keyhash, KEYHASH_SIZE);
-                string keyhashStr(keyhash, KEYHASH_SIZE);
-
-                int gid = readVal<int>();
-                gidMap[keyhashStr] = gid;                
-            }
-        }
-    }
-}
-
-ifstream &GameInput::stream()
-{
-    return in_;
-}
-
-template <typename T>
-T GameInput::readVal()
-{
-    T result;
-    in_.read((char *)&result, sizeof(T));
-    canonicalizeEndianness(result);
-    return result;
-}
-
-bool GameInput::fail()
-{
-    return fail_;
-}
+#include <fstream>
+#include <cstring>
+using namespace std;
+
+#include "CraneaBase.h"
+#include "GameInput.h"
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+template <typename T>
+static T readVal(istream &in)
+{
+    T result;
+    in.read((char *)&result, sizeof(T));
+    canonicalizeEndianness(result);
+    return result;
+}
+
+MemoryStreamBuf::MemoryStreamBuf(const char *data, size_t size)
+{
+    char *begin = const_cast<char *>(data); // never written, since there is no put area
+    setg(begin, begin, begin + size);
+}
+
+streambuf::pos_type MemoryStreamBuf::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which)
+{
+    off_type pos;
+    if (dir == ios_base::beg)
+    {
+        pos = off;
+    }
+    else if (dir == ios_base::cur)
+    {
+        pos = (gptr() - eback()) + off;
+    }
+    else
+    {
+        pos = (egptr() - eback()) + off;
+    }
+
+    if (!(which & ios_base::in) || pos < 0 || pos > egptr() - eback())
+    {
+        return pos_type(off_type(-1));
+    }
+    setg(eback(), eback() + pos, egptr());
+    return pos_type(pos);
+}
+
+streambuf::pos_type MemoryStreamBuf::seekpos(pos_type pos, ios_base::openmode which)
+{
+    return seekoff(off_type(pos), ios_base::beg, which);
+}
+
+GameImage::GameImage(const string &filename)
+    : fail_(true), data_(NULL), size_(0), mapped_(false), flags_(0)
+{
+#ifdef WIN32
+    file_ = INVALID_HANDLE_VALUE;
+    mapping_ = NULL;
+#endif
+    memset(initialKey_, 0, KEY_SIZE);
+
+    if (mapFile(filename))
+    {
+        fail_ = !readTables();
+    }
+}
+
+GameImage::~GameImage()
+{
+    unmapFile();
+}
+
+bool GameImage::mapFile(const string &filename)
+{
+#ifdef WIN32
+    file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    size_ = GetFileSize(file_, NULL);
+    mapping_ = CreateFileMapping(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_)
+    {
+        data_ = (char *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+        if (data_)
+        {
+            mapped_ = true;
+            return true;
+        }
+        CloseHandle(mapping_);
+        mapping_ = NULL;
+    }
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            close(fd);
+            data_ = (char *)addr;
+            size_ = (size_t)st.st_size;
+            mapped_ = true;
+            return true;
+        }
+    }
+    close(fd);
+#endif
+
+    // can't map the file; read it instead
+    ifstream in(filename.c_str(), ios::in | ios::binary);
+    if (in.fail())
+    {
+        return false;
+    }
+    string contents;
+    char block[65536];
+    while (in.read(block, sizeof(block)) || in.gcount() > 0)
+    {
+        contents.append(block, (size_t)in.gcount());
+    }
+    size_ = contents.size();
+    data_ = new char[size_ + 1];
+    memcpy(data_, contents.data(), size_);
+    return true;
+}
+
+void GameImage::unmapFile()
+{
+    if (!data_)
+    {
+        return;
+    }
+    if (!mapped_)
+    {
+        delete[] data_;
+    }
+    else
+    {
+#ifdef WIN32
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+        CloseHandle(file_);
+#else
+        munmap(data_, size_);
+#endif
+    }
+    data_ = NULL;
+}
+
+bool GameImage::readTables()
+{
+    // the header follows the first nul byte
+    const char *nul = (const char *)memchr(data_, '\0', size_);
+    if (!nul)
+    {
+        return false;
+    }
+
+    MemoryStreamBuf buf(data_, size_);
+    istream in(&buf);
+    off_t headerOffset = (nul - data_) + 1;
+    in.seekg(headerOffset);
+
+    char magic[FORMAT_MAGIC_SIZE];
+    in.read(magic, FORMAT_MAGIC_SIZE);
+    if (!in.fail() && !memcmp(magic, FORMAT_MAGIC, FORMAT_MAGIC_SIZE))
+    {
+        flags_ = readVal<int>(in);
+    }
+    else
+    {
+        in.clear();
+        in.seekg(headerOffset);
+    }
+
+    off_t offsetTableOffset = readVal<off_t>(in);
+
+    off_t gidTableOffsets[NUM_GLOBAL_MAPS];
+    for (size_t i = 0; i < NUM_GLOBAL_MAPS; i++)
+    {
+        gidTableOffsets[i] = readVal<off_t>(in);
+    }
+
+    // read the initial location key
+    in.read((char *)initialKey_, KEY_SIZE);
+
+    // read the offset table (gid -> file offset)
+    in.seekg(offsetTableOffset);
+    size_t numEntries = readVal<size_t>(in);
+
+    for (size_t i = 0; i < numEntries && !in.fail(); i++)
+    {
+        int gid = readVal<int>(in);
+        off_t offset = readVal<off_t>(in);
+        offsetMap_[gid] = offset;
+    }
+
+    // read the tables of top-level objects (keyhash -> gid)
+    for (size_t i = 0; i < NUM_GLOBAL_MAPS; i++)
+    {
+        map<string, int> &gidMap = gidMaps_[i];
+
+        in.seekg(gidTableOffsets[i]);
+        numEntries = readVal<size_t>(in);
+
+        for (size_t j = 0; j < numEntries && !in.fail(); j++)
+        {
+            char keyhash[KEYHASH_SIZE];
+            in.read(keyhash, KEYHASH_SIZE);
+            string keyhashStr(keyhash, KEYHASH_SIZE);
+
+            int gid = readVal<int>(in);
+            gidMap[keyhashStr] = gid;
+        }
+    }
+
+    return !in.fail();
+}
+
+int GameImage::getGid(ObjectType objectType, const byte *key) const
+{
+    byte keyhash[KEYHASH_SIZE];
+
+    hashKey(key, keyhash);
+
+    string keyStr((char*)keyhash, KEYHASH_SIZE);
+    map<string, int>::const_iterator pos = gidMaps_[objectType].find(keyStr);
+    if (pos == gidMaps_[objectType].end())
+    {
+        return -1;
+    }
+    return pos->second;
+}
+
+bool GameImage::findObject(int gid, off_t &offset) const
+{
+    map<int, off_t>::const_iterator pos = offsetMap_.find(gid);
+    if (pos == offsetMap_.end())
+    {
+        return false;
+    }
+    offset = pos->second;
+    return true;
+}
+
+GameInput::GameInput(const string &infile)
+    : ownedImage_(new GameImage(infile)), image_(ownedImage_),
+      buf_(ownedImage_->data(), ownedImage_->size()), in_(&buf_)
+{
+}
+
+GameInput::GameInput(const GameImage &image)
+    : ownedImage_(NULL), image_(&image), buf_(image.data(), image.size()), in_(&buf_)
+{
+}
+
+GameInput::~GameInput()
+{
+    delete ownedImage_;
+}
+
+bool GameInput::seekObject(int gid)
+{
+    off_t offset;
+    if (!image_->findObject(gid, offset))
+    {
+        return false;
+    }
+    in_.clear();
+    in_.seekg(offset);
+    return true;
+}
+
+int GameInput::getGid(ObjectType objectType, const byte *key)
+{
+    return image_->getGid(objectType, key);
+}
+
+const byte *GameInput::initialKey()
+{
+    return image_->initialKey();
+}
+
+istream &GameInput::stream()
+{
+    return in_;
+}
+
+bool GameInput::fail()
+{
+    return image_->fail();
+}
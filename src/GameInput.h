@@ -1,36 +1,134 @@
-#ifndef _GAME_INPUT_H_
-#define _GAME_INPUT_H_
-
-#include <iostream>
-#include <fstream>
-#include <string>
-#include "cranea.h"
-
-class CraneaBase;
-
-class GameInput
-{
-public:
-    GameInput(const std::string &infile);
-    bool fail();
-    
-    std::ifstream &stream();
-
-    int getGid(ObjectType objectType, const byte *key);
-
-    bool seekObject(int gid);
-
-    byte *initialKey();
-
-    template <typename T>
-    T readVal();
-
-private:
-    std::ifstream in_;
-    bool fail_;
-    byte initialKey_[KEY_SIZE];
-    std::map<std::string, int> gidMaps_[NUM_GLOBAL_MAPS];
-    std::map<int, off_t> offsetMap_;    
-};
-
-#endif
+#ifndef _GAME_INPUT_H_
+#define _GAME_INPUT_H_
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <map>
+#include "cranea.h"
+
+#ifdef WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h> // for HANDLE
+#endif
+
+class CraneaBase;
+
+/* GameImage
+ * =========
+ * A .cra file mapped into memory, along with its tables (gid -> object offset, and
+ * key hash -> gid for top-level objects). The image is never modified, so any number
+ * of GameInputs (and thus games) can read from one image at the same time.
+ */
+class GameImage
+{
+public:
+    GameImage(const std::string &filename);
+    ~GameImage();
+
+    bool fail() const { return fail_; }
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+    int getGid(ObjectType objectType, const byte *key) const;
+
+    // returns false if there is no object with the given gid
+    bool findObject(int gid, off_t &offset) const;
+
+    const byte *initialKey() const { return initialKey_; }
+
+    int flags() const { return flags_; }
+
+private:
+    GameImage(const GameImage &);
+    GameImage &operator=(const GameImage &);
+
+    bool mapFile(const std::string &filename);
+    void unmapFile();
+    bool readTables();
+
+    bool fail_;
+    char *data_;
+    size_t size_;
+    bool mapped_; // false if the file was read into memory instead
+#ifdef WIN32
+    HANDLE file_;
+    HANDLE mapping_;
+#endif
+
+    int flags_;
+    byte initialKey_[KEY_SIZE];
+    std::map<std::string, int> gidMaps_[NUM_GLOBAL_MAPS];
+    std::map<int, off_t> offsetMap_;
+};
+
+// an input stream over a block of memory
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+    MemoryStreamBuf(const char *data, size_t size);
+
+protected:
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+    virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+};
+
+/* GameInput
+ * =========
+ * Reads the objects of a game from a GameImage. Each game has its own GameInput, since
+ * reading moves the position of its stream.
+ */
+class GameInput
+{
+public:
+    // loads the image from a file
+    GameInput(const std::string &infile);
+
+    // reads from an image that is shared with other games (and must outlive this input)
+    GameInput(const GameImage &image);
+
+    ~GameInput();
+
+    bool fail();
+
+    std::istream &stream();
+
+    int getGid(ObjectType objectType, const byte *key);
+
+    bool seekObject(int gid);
+
+    const byte *initialKey();
+
+    // true if the story strings are encoded as GameTemplate bytecode
+    bool hasCompiledText() { return (image_->flags() & FORMAT_COMPILED_TEXT) != 0; }
+
+    // true if the locations store their synonyms, and commands are looked up in canonical form
+    bool hasCanonicalSynonyms() { return (image_->flags() & FORMAT_CANONICAL_SYNONYMS) != 0; }
+
+private:
+    GameInput(const GameInput &);
+    GameInput &operator=(const GameInput &);
+
+    GameImage *ownedImage_;
+    const GameImage *image_;
+    MemoryStreamBuf buf_;
+    std::istream in_;
+};
+
+/* LineSource
+ * ==========
+ * Where GameContext::playGame() reads the player's commands from (the player reads
+ * them from the console).
+ */
+class LineSource
+{
+public:
+    virtual ~LineSource() {}
+
+    // reads a line of input. returns false at the end of input.
+    virtual bool readLine(std::string &line) = 0;
+};
+
+#endif
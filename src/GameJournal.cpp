@@ -0,0 +1,608 @@
+#include "GameJournal.h"
+#include "GameBase.h"
+
+using namespace std;
+
+GameJournal::~GameJournal()
+{
+    clear();
+}
+
+void GameJournal::beginCommand()
+{
+    // commands that didn't change anything are not kept in the history
+    if (commands_.empty() || !commands_.back().empty())
+    {
+        commands_.push_back(Command());
+        trim();
+    }
+}
+
+size_t GameJournal::mark()
+{
+    if (commands_.empty())
+    {
+        commands_.push_back(Command());
+    }
+    return commands_.back().size();
+}
+
+void GameJournal::rollback(size_t mark)
+{
+    if (commands_.empty())
+    {
+        return;
+    }
+
+    Command &command = commands_.back();
+    while (command.size() > mark)
+    {
+        revert(command.back());
+        if (command.back().state)
+        {
+            delete command.back().state;
+        }
+        command.pop_back();
+    }
+}
+
+bool GameJournal::undo()
+{
+    if (!commands_.empty() && commands_.back().empty())
+    {
+        commands_.pop_back();
+    }
+
+    if (commands_.empty())
+    {
+        commands_.push_back(Command());
+        return false;
+    }
+
+    Command &command = commands_.back();
+    for (size_t i = command.size(); i > 0; i--)
+    {
+        revert(command[i - 1]);
+    }
+
+    redoCommands_.push_back(Command());
+    redoCommands_.back().swap(command);
+    commands_.pop_back();
+
+    commands_.push_back(Command());
+    return true;
+}
+
+bool GameJournal::redo()
+{
+    if (redoCommands_.empty())
+    {
+        return false;
+    }
+
+    if (!commands_.empty() && commands_.back().empty())
+    {
+        commands_.pop_back();
+    }
+
+    commands_.push_back(Command());
+    Command &command = commands_.back();
+    command.swap(redoCommands_.back());
+    redoCommands_.pop_back();
+
+    for (size_t i = 0; i < command.size(); i++)
+    {
+        apply(command[i]);
+    }
+
+    commands_.push_back(Command());
+    trim();
+    return true;
+}
+
+void GameJournal::clear()
+{
+    clearRedo();
+    for (size_t i = 0; i < commands_.size(); i++)
+    {
+        discard(commands_[i]);
+    }
+    commands_.clear();
+}
+
+void GameJournal::clearRedo()
+{
+    for (size_t i = 0; i < redoCommands_.size(); i++)
+    {
+        discard(redoCommands_[i]);
+    }
+    redoCommands_.clear();
+}
+
+void GameJournal::trim()
+{
+    // the current command doesn't count towards the limit
+    while (commands_.size() > limit_ + 1)
+    {
+        discard(commands_.front());
+        commands_.pop_front();
+    }
+}
+
+void GameJournal::discard(Command &command)
+{
+    for (size_t i = 0; i < command.size(); i++)
+    {
+        if (command[i].state)
+        {
+            delete command[i].state;
+        }
+    }
+    command.clear();
+}
+
+void GameJournal::record(const Op &op)
+{
+    clearRedo();
+    if (commands_.empty())
+    {
+        commands_.push_back(Command());
+    }
+    commands_.back().push_back(op);
+}
+
+void GameJournal::pushLocation(GameLocation *loc)
+{
+    Op op(OpPushLocation);
+    op.loc = loc;
+    apply(op);
+    record(op);
+}
+
+void GameJournal::popLocation()
+{
+    Op op(OpPopLocation);
+    op.loc = ctx_->locationStacks_.back().back();
+    apply(op);
+    record(op);
+}
+
+void GameJournal::pushLocationStack()
+{
+    Op op(OpPushLocationStack);
+    apply(op);
+    record(op);
+}
+
+void GameJournal::popLocationStack()
+{
+    Op op(OpPopLocationStack);
+    op.stack = ctx_->locationStacks_.back();
+    apply(op);
+    record(op);
+}
+
+void GameJournal::addToInventory(GameItem *item)
+{
+    Op op(OpAddToInventory);
+    op.item = item;
+    apply(op);
+    record(op);
+}
+
+void GameJournal::removeFromInventory(size_t index)
+{
+    Op op(OpRemoveFromInventory);
+    op.item = ctx_->inventory_[index];
+    op.index = index;
+    apply(op);
+    record(op);
+}
+
+void GameJournal::setDroppedLocation(int gid, GameItem *item, GameLocation *loc)
+{
+    Op op(OpSetDroppedLocation);
+    op.gid = gid;
+    op.item = item;
+    op.loc = loc;
+
+    map<int, pair<GameItem *, GameLocation *> >::const_iterator it = ctx_->droppedItemLocations_.find(gid);
+    if (it != ctx_->droppedItemLocations_.end())
+    {
+        op.oldItem = it->second.first;
+        op.oldLoc = it->second.second;
+    }
+
+    apply(op);
+    record(op);
+}
+
+void GameJournal::addItemKey(GameLocation *loc, const bytestring &itemKey)
+{
+    Op op(OpAddItemKey);
+    op.loc = loc;
+    op.itemKey = itemKey;
+    apply(op);
+    record(op);
+}
+
+void GameJournal::removeItemKey(GameLocation *loc, size_t index)
+{
+    Op op(OpRemoveItemKey);
+    op.loc = loc;
+    op.index = index;
+    op.itemKey = loc->itemKeys_[index];
+    apply(op);
+    record(op);
+}
+
+void GameJournal::enterLocation(GameLocation *loc)
+{
+    Op op(OpEnterLocation);
+    op.loc = loc;
+    apply(op);
+    record(op);
+}
+
+void GameJournal::replaceState(GameStateSnapshot *snapshot)
+{
+    Op op(OpReplaceState);
+    op.state = snapshot;
+    apply(op);
+    record(op);
+}
+
+static void setDropped(map<int, pair<GameItem *, GameLocation *> > &droppedItemLocations,
+                       int gid, GameItem *item, GameLocation *loc)
+{
+    if (item)
+    {
+        droppedItemLocations[gid] = pair<GameItem *, GameLocation *>(item, loc);
+    }
+    else
+    {
+        droppedItemLocations.erase(gid);
+    }
+}
+
+void GameJournal::apply(Op &op)
+{
+    GameContext &ctx = *ctx_;
+
+    switch (op.type)
+    {
+    case OpPushLocation:
+        ctx.locationStacks_.back().push_back(op.loc);
+        break;
+    case OpPopLocation:
+        ctx.locationStacks_.back().pop_back();
+        break;
+    case OpPushLocationStack:
+        // duplicate the previous location stack
+        ctx.locationStacks_.push_back(ctx.locationStacks_.back());
+        break;
+    case OpPopLocationStack:
+        ctx.locationStacks_.pop_back();
+        break;
+    case OpAddToInventory:
+        ctx.inventory_.push_back(op.item);
+        ctx.inventoryByTakeyHash_[bytestring(op.item->takeyhash(), KEYHASH_SIZE)] = op.item;
+        break;
+    case OpRemoveFromInventory:
+        ctx.inventory_.erase(ctx.inventory_.begin() + op.index);
+        ctx.inventoryByTakeyHash_.erase(bytestring(op.item->takeyhash(), KEYHASH_SIZE));
+        break;
+    case OpSetDroppedLocation:
+        setDropped(ctx.droppedItemLocations_, op.gid, op.item, op.loc);
+        break;
+    case OpAddItemKey:
+        op.loc->itemKeys_.push_back(op.itemKey);
+        break;
+    case OpRemoveItemKey:
+        op.loc->itemKeys_.erase(op.loc->itemKeys_.begin() + op.index);
+        break;
+    case OpEnterLocation:
+        op.loc->hasEnteredBefore_ = true;
+        break;
+    case OpReplaceState:
+        ctx.swapState(*op.state);
+        break;
+    }
+}
+
+void GameJournal::revert(Op &op)
+{
+    GameContext &ctx = *ctx_;
+
+    switch (op.type)
+    {
+    case OpPushLocation:
+        ctx.locationStacks_.back().pop_back();
+        break;
+    case OpPopLocation:
+        ctx.locationStacks_.back().push_back(op.loc);
+        break;
+    case OpPushLocationStack:
+        ctx.locationStacks_.pop_back();
+        break;
+    case OpPopLocationStack:
+        ctx.locationStacks_.push_back(op.stack);
+        break;
+    case OpAddToInventory:
+        ctx.inventory_.pop_back();
+        ctx.inventoryByTakeyHash_.erase(bytestring(op.item->takeyhash(), KEYHASH_SIZE));
+        break;
+    case OpRemoveFromInventory:
+        ctx.inventory_.insert(ctx.inventory_.begin() + op.index, op.item);
+        ctx.inventoryByTakeyHash_[bytestring(op.item->takeyhash(), KEYHASH_SIZE)] = op.item;
+        break;
+    case OpSetDroppedLocation:
+        setDropped(ctx.droppedItemLocations_, op.gid, op.oldItem, op.oldLoc);
+        break;
+    case OpAddItemKey:
+        op.loc->itemKeys_.pop_back();
+        break;
+    case OpRemoveItemKey:
+        op.loc->itemKeys_.insert(op.loc->itemKeys_.begin() + op.index, op.itemKey);
+        break;
+    case OpEnterLocation:
+        op.loc->hasEnteredBefore_ = false;
+        break;
+    case OpReplaceState:
+        ctx.swapState(*op.state);
+        break;
+    }
+}
+
+bool GameJournal::captureHistory(HibernatedGame &game)
+{
+    LocationIndexes locationIndexes;
+    ItemIndexes itemIndexes;
+    bool success = true;
+
+    // each change is described in the state it was made in (a load in the history replaces
+    // the objects that the changes before it refer to), so the commands are undone, newest
+    // first, down to the state before the oldest one, and then done again
+    vector<HibernatedGame::Command> undone;
+    for (size_t i = commands_.size(); i > 0; i--)
+    {
+        Command &command = commands_[i - 1];
+        if (command.empty())
+        {
+            continue;
+        }
+
+        undone.push_back(HibernatedGame::Command(command.size()));
+        for (size_t j = command.size(); j > 0; j--)
+        {
+            success = describe(command[j - 1], game, locationIndexes, itemIndexes, undone.back()[j - 1]) && success;
+            revert(command[j - 1]);
+        }
+    }
+
+    ctx_->captureHibernatedState(game.state);
+
+    for (size_t i = 0; i < commands_.size(); i++)
+    {
+        for (size_t j = 0; j < commands_[i].size(); j++)
+        {
+            apply(commands_[i][j]);
+        }
+    }
+
+    game.commands.assign(undone.rbegin(), undone.rend());
+    game.current = game.commands.size();
+
+    // and the other way around for the commands that can be redone (the next one first)
+    for (size_t i = redoCommands_.size(); i > 0; i--)
+    {
+        Command &command = redoCommands_[i - 1];
+        game.commands.push_back(HibernatedGame::Command(command.size()));
+        for (size_t j = 0; j < command.size(); j++)
+        {
+            apply(command[j]);
+            success = describe(command[j], game, locationIndexes, itemIndexes, game.commands.back()[j]) && success;
+        }
+    }
+
+    for (size_t i = 0; i < redoCommands_.size(); i++)
+    {
+        Command &command = redoCommands_[i];
+        for (size_t j = command.size(); j > 0; j--)
+        {
+            revert(command[j - 1]);
+        }
+    }
+
+    return success;
+}
+
+// called with the game in the state right after op was applied
+bool GameJournal::describe(const Op &op, HibernatedGame &game, LocationIndexes &locationIndexes, 
+                           ItemIndexes &itemIndexes, HibernatedGame::Op &described)
+{
+    GameContext &ctx = *ctx_;
+
+    described.type = op.type;
+
+    switch (op.type)
+    {
+    case OpPushLocation:
+    case OpEnterLocation:
+        described.location = ctx.addHibernatedLocation(game, locationIndexes, op.loc) + 1;
+        break;
+    case OpAddToInventory:
+        if (!ctx.addHibernatedItem(game, locationIndexes, itemIndexes, op.item, described.item))
+        {
+            return false;
+        }
+        described.item++;
+        break;
+    case OpRemoveFromInventory:
+        described.index = op.index;
+        break;
+    case OpSetDroppedLocation:
+        described.gid = op.gid;
+        if (op.item)
+        {
+            if (!ctx.addHibernatedItem(game, locationIndexes, itemIndexes, op.item, described.item))
+            {
+                return false;
+            }
+            described.item++;
+            described.location = ctx.addHibernatedLocation(game, locationIndexes, op.loc) + 1;
+        }
+        break;
+    case OpAddItemKey:
+        described.location = ctx.addHibernatedLocation(game, locationIndexes, op.loc) + 1;
+        described.itemKey = op.itemKey;
+        break;
+    case OpRemoveItemKey:
+        described.location = ctx.addHibernatedLocation(game, locationIndexes, op.loc) + 1;
+        described.index = op.index;
+        break;
+    case OpReplaceState:
+        // the parts of the new state that loading doesn't make through the journal
+        described.index = game.loads.size();
+        game.loads.push_back(SaveData());
+        ctx.captureHibernatedState(game.loads.back());
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+bool GameJournal::replayHistory(const HibernatedGame &game)
+{
+    clear();
+
+    // restoring the oldest state isn't a command that can be undone
+    if (!ctx_->restoreHibernatedState(game.state))
+    {
+        return false;
+    }
+    clear();
+
+    for (size_t i = 0; i < game.commands.size(); i++)
+    {
+        beginCommand();
+        for (size_t j = 0; j < game.commands[i].size(); j++)
+        {
+            if (!replay(game.commands[i][j], game))
+            {
+                return false;
+            }
+        }
+    }
+
+    // the commands after the current one can be redone
+    for (size_t i = game.current; i < game.commands.size(); i++)
+    {
+        undo();
+    }
+    return true;
+}
+
+// makes a described change again, checking that it can be made in the current state
+bool GameJournal::replay(const HibernatedGame::Op &op, const HibernatedGame &game)
+{
+    GameContext &ctx = *ctx_;
+
+    GameLocation *loc = op.location ? ctx.getHibernatedLocation(game.locations, op.location - 1) : NULL;
+    GameItem *item = op.item ? ctx.getHibernatedItem(game, op.item - 1) : NULL;
+    if ((op.location && !loc) || (op.item && !item))
+    {
+        return false;
+    }
+
+    switch (op.type)
+    {
+    case OpPushLocation:
+        if (!loc || ctx.locationStacks_.empty())
+        {
+            return false;
+        }
+        pushLocation(loc);
+        break;
+    case OpPopLocation:
+        if (ctx.locationStacks_.empty() || ctx.locationStacks_.back().empty())
+        {
+            return false;
+        }
+        popLocation();
+        break;
+    case OpPushLocationStack:
+        if (ctx.locationStacks_.empty())
+        {
+            return false;
+        }
+        pushLocationStack();
+        break;
+    case OpPopLocationStack:
+        if (ctx.locationStacks_.empty())
+        {
+            return false;
+        }
+        popLocationStack();
+        break;
+    case OpAddToInventory:
+        if (!item)
+        {
+            return false;
+        }
+        addToInventory(item);
+        break;
+    case OpRemoveFromInventory:
+        if (op.index >= ctx.inventory_.size())
+        {
+            return false;
+        }
+        removeFromInventory(op.index);
+        break;
+    case OpSetDroppedLocation:
+        if (!item != !loc)
+        {
+            return false;
+        }
+        setDroppedLocation(op.gid, item, loc);
+        break;
+    case OpAddItemKey:
+        if (!loc || op.itemKey.empty())
+        {
+            return false;
+        }
+        loc->ensureDecrypted();
+        addItemKey(loc, op.itemKey);
+        break;
+    case OpRemoveItemKey:
+        if (!loc)
+        {
+            return false;
+        }
+        loc->ensureDecrypted();
+        if (op.index >= loc->itemKeys_.size())
+        {
+            return false;
+        }
+        removeItemKey(loc, op.index);
+        break;
+    case OpEnterLocation:
+        if (!loc)
+        {
+            return false;
+        }
+        enterLocation(loc);
+        break;
+    case OpReplaceState:
+        if (op.index >= game.loads.size())
+        {
+            return false;
+        }
+        replaceState(new GameStateSnapshot());
+        return ctx.restoreHibernatedState(game.loads[op.index]);
+    default:
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,128 @@
+#ifndef _GAME_JOURNAL_H_
+#define _GAME_JOURNAL_H_
+
+#include "CraneaBase.h"
+#include "GameSave.h"
+#include <vector>
+#include <deque>
+#include <map>
+
+class GameContext;
+class GameLocation;
+class GameItem;
+struct GameStateSnapshot;
+
+#define DEFAULT_UNDO_LIMIT 100
+
+/* GameJournal
+ * ===========
+ * Records every mutation of the game state (location stacks, inventory, item locations)
+ * as a reversible operation, grouped by player command. Rolling back, undoing or redoing
+ * a command costs time proportional to the number of changes it made, not to the size
+ * of the game state.
+ */
+class GameJournal
+{
+public:
+    GameJournal(GameContext &ctx, size_t limit = DEFAULT_UNDO_LIMIT)
+        : ctx_(&ctx), limit_(limit) {}
+    ~GameJournal();
+
+    // starts a new group of operations for a player command
+    void beginCommand();
+
+    // returns a checkpoint within the current command that can be passed to rollback()
+    size_t mark();
+    void rollback(size_t mark);
+
+    // reverts the most recent command that changed the game state
+    bool undo();
+    // re-applies the most recently undone command
+    bool redo();
+
+    // forgets all history (the current state is kept)
+    void clear();
+
+    // maximum number of commands that can be undone
+    void setLimit(size_t limit) { limit_ = limit; trim(); }
+
+    // each of the following performs a change to the game state and records it
+    void pushLocation(GameLocation *loc);
+    void popLocation();
+    void pushLocationStack();
+    void popLocationStack();
+    void addToInventory(GameItem *item);
+    void removeFromInventory(size_t index);
+    void setDroppedLocation(int gid, GameItem *item, GameLocation *loc); // item == NULL to clear
+    void addItemKey(GameLocation *loc, const bytestring &itemKey);
+    void removeItemKey(GameLocation *loc, size_t index);
+    void enterLocation(GameLocation *loc);
+
+    // swaps the entire live state with *snapshot, and takes ownership of snapshot.
+    void replaceState(GameStateSnapshot *snapshot);
+
+    // describes the history in game (see HibernatedGame), capturing the state before the oldest
+    // command in game.state. the history and the game state are left as they were.
+    // returns false if the history refers to an item that can't be described.
+    bool captureHistory(HibernatedGame &game);
+
+    // replaces the history (and the game state, which must be empty) with the one in game.
+    // returns false if game doesn't describe a history that can be replayed.
+    bool replayHistory(const HibernatedGame &game);
+
+private:
+    enum OpType
+    {
+        OpPushLocation,
+        OpPopLocation,
+        OpPushLocationStack,
+        OpPopLocationStack,
+        OpAddToInventory,
+        OpRemoveFromInventory,
+        OpSetDroppedLocation,
+        OpAddItemKey,
+        OpRemoveItemKey,
+        OpEnterLocation,
+        OpReplaceState
+    };
+
+    struct Op
+    {
+        Op(OpType type) : type(type), loc(NULL), item(NULL), index(0), gid(-1),
+            oldItem(NULL), oldLoc(NULL), state(NULL) {}
+
+        OpType type;
+        GameLocation *loc;
+        GameItem *item;
+        size_t index;
+        bytestring itemKey;
+        int gid;
+        GameItem *oldItem; // previous value of a dropped item location (NULL if it was not set)
+        GameLocation *oldLoc;
+        std::vector<GameLocation *> stack;
+        GameStateSnapshot *state;
+    };
+
+    typedef std::vector<Op> Command;
+
+    void record(const Op &op);
+    void apply(Op &op);
+    void revert(Op &op);
+    void discard(Command &command);
+    void clearRedo();
+    void trim();
+
+    typedef std::map<GameLocation *, size_t> LocationIndexes;
+    typedef std::map<GameItem *, size_t> ItemIndexes;
+    bool describe(const Op &op, HibernatedGame &game, LocationIndexes &locationIndexes, 
+                  ItemIndexes &itemIndexes, HibernatedGame::Op &described);
+    bool replay(const HibernatedGame::Op &op, const HibernatedGame &game);
+
+    GameContext *ctx_;
+    size_t limit_;
+
+    std::deque<Command> commands_; // commands_.back() is the command currently executing
+    std::vector<Command> redoCommands_;
+};
+
+#endif
@@ -0,0 +1,538 @@
+#include "GameMaster.h"
+#include "GameServer.h"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+#define MAX_EVENTS 64
+
+// the connections that can wait for a worker that is slow to take them (see handOff)
+#define MAX_QUEUED_CONNECTIONS 1024
+
+GameMaster::GameMaster(GameServer &server, const string &socketPath, size_t numProcesses)
+    : server_(&server), socketPath_(socketPath), masterPid_(0), listenFd_(-1), epollFd_(-1), stopping_(false),
+      processes_(numProcesses ? numProcesses : 1), nextProcess_(0)
+{
+    wakeFds_[0] = wakeFds_[1] = -1;
+    for (size_t i = 0; i < processes_.size(); i++)
+    {
+        processes_[i].pid = -1;
+        processes_[i].channelFd = -1;
+        processes_[i].watchingOutput = false;
+    }
+}
+
+#ifdef WIN32
+
+GameMaster::~GameMaster()
+{
+}
+
+bool GameMaster::run()
+{
+    cerr << "Worker processes are not supported on this platform." << endl;
+    return false;
+}
+
+void GameMaster::stop()
+{
+}
+
+#else
+
+GameMaster::~GameMaster()
+{
+    if (listenFd_ >= 0)
+    {
+        close(listenFd_);
+        unlink(socketPath_.c_str());
+    }
+    if (epollFd_ >= 0)
+    {
+        close(epollFd_);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (wakeFds_[i] >= 0)
+        {
+            close(wakeFds_[i]);
+        }
+    }
+}
+
+bool GameMaster::run()
+{
+    masterPid_ = getpid();
+
+    if (pipe(wakeFds_) != 0 || !setNonBlocking(wakeFds_[0]) || !setNonBlocking(wakeFds_[1]))
+    {
+        cerr << "Error creating pipe: " << strerror(errno) << endl;
+        return false;
+    }
+
+    epollFd_ = epoll_create(MAX_EVENTS);
+    if (epollFd_ < 0)
+    {
+        cerr << "Error creating epoll: " << strerror(errno) << endl;
+        return false;
+    }
+
+    listenFd_ = listenOnSocket(socketPath_);
+    if (listenFd_ < 0)
+    {
+        return false;
+    }
+
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listenFd_;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &ev) != 0)
+    {
+        cerr << "Error adding socket to epoll: " << strerror(errno) << endl;
+        return false;
+    }
+    ev.data.fd = wakeFds_[0];
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFds_[0], &ev) != 0)
+    {
+        cerr << "Error adding pipe to epoll: " << strerror(errno) << endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < processes_.size(); i++)
+    {
+        if (!startProcess(i))
+        {
+            stopping_ = true;
+            break;
+        }
+    }
+
+    while (!stopping_)
+    {
+        epoll_event events[MAX_EVENTS];
+        int numEvents = epoll_wait(epollFd_, events, MAX_EVENTS, -1);
+        if (numEvents < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            cerr << "Error waiting for connections: " << strerror(errno) << endl;
+            break;
+        }
+
+        for (int i = 0; i < numEvents; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == wakeFds_[0])
+            {
+                char buf[64];
+                while (read(wakeFds_[0], buf, sizeof(buf)) > 0)
+                {
+                    stopping_ = true;
+                }
+                continue;
+            }
+            if (fd == listenFd_)
+            {
+                acceptConnections();
+                continue;
+            }
+
+            bool isChannel = false;
+            for (size_t j = 0; j < processes_.size(); j++)
+            {
+                if (processes_[j].channelFd == fd)
+                {
+                    isChannel = true;
+                    if (stopping_)
+                    {
+                        break;
+                    }
+                    // a worker never writes to its socket, so anything but room to write means it has exited
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    {
+                        processExited(j);
+                    }
+                    else
+                    {
+                        sendQueued(j);
+                    }
+                    break;
+                }
+            }
+            if (!isChannel && connections_.count(fd))
+            {
+                readFirstLine(fd);
+            }
+        }
+    }
+
+    // no more connections
+    close(listenFd_);
+    listenFd_ = -1;
+    unlink(socketPath_.c_str());
+    while (!connections_.empty())
+    {
+        closeConnection(connections_.begin()->first);
+    }
+
+    // closing the channels tells the workers to end their games and exit
+    for (size_t i = 0; i < processes_.size(); i++)
+    {
+        closeQueued(i);
+        if (processes_[i].channelFd >= 0)
+        {
+            close(processes_[i].channelFd);
+            processes_[i].channelFd = -1;
+        }
+    }
+    for (size_t i = 0; i < processes_.size(); i++)
+    {
+        if (processes_[i].pid > 0)
+        {
+            while (waitpid(processes_[i].pid, NULL, 0) < 0 && errno == EINTR)
+            {
+            }
+            processes_[i].pid = -1;
+        }
+    }
+    return true;
+}
+
+void GameMaster::stop()
+{
+    if (getpid() != masterPid_)
+    {
+        // a worker process
+        server_->stop();
+        return;
+    }
+
+    char ch = 0;
+    if (write(wakeFds_[1], &ch, 1) < 0)
+    {
+        // the pipe is full, so the master will wake up anyway
+        return;
+    }
+}
+
+bool GameMaster::startProcess(size_t index)
+{
+    Process &process = processes_[index];
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0)
+    {
+        cerr << "Error creating socket for worker process: " << strerror(errno) << endl;
+        return false;
+    }
+
+    // a worker that stops reading its socket mustn't stall the master (see handOff)
+    if (!setNonBlocking(fds[0]))
+    {
+        cerr << "Error creating socket for worker process: " << strerror(errno) << endl;
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    // output that hasn't been written yet would be written by both processes
+    cout.flush();
+    cerr.flush();
+
+    int pid = fork();
+    if (pid < 0)
+    {
+        cerr << "Error starting worker process: " << strerror(errno) << endl;
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        closeInherited();
+
+        // the master stops the workers when it is interrupted (by closing their channels)
+        signal(SIGINT, SIG_IGN);
+        exit(server_->runProcess(fds[1], index, processes_.size()) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    process.pid = pid;
+    process.channelFd = fds[0];
+    process.watchingOutput = false;
+
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = process.channelFd;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, process.channelFd, &ev) != 0)
+    {
+        cerr << "Error adding worker process to epoll: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+/* Closes the master's descriptors in a new worker process. Otherwise a worker would keep
+ * the other workers' channels open after the master closes them, and the sockets of the
+ * connections that the master is reading.
+ */
+void GameMaster::closeInherited()
+{
+    close(listenFd_);
+    listenFd_ = -1;
+    close(epollFd_);
+    epollFd_ = -1;
+    for (int i = 0; i < 2; i++)
+    {
+        close(wakeFds_[i]);
+        wakeFds_[i] = -1;
+    }
+    for (size_t i = 0; i < processes_.size(); i++)
+    {
+        if (processes_[i].channelFd >= 0)
+        {
+            close(processes_[i].channelFd);
+            processes_[i].channelFd = -1;
+        }
+        closeQueued(i);
+    }
+    for (map<int, string>::iterator it = connections_.begin(); it != connections_.end(); ++it)
+    {
+        close(it->first);
+    }
+    connections_.clear();
+}
+
+// starts a worker again once its channel has closed
+void GameMaster::processExited(size_t index)
+{
+    Process &process = processes_[index];
+
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, process.channelFd, NULL);
+    close(process.channelFd);
+    process.channelFd = -1;
+
+    // the connections waiting for the worker are lost with its sessions
+    closeQueued(index);
+
+    int status = 0;
+    while (waitpid(process.pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    if (WIFSIGNALED(status))
+    {
+        cerr << "Worker process " << index << " was killed by signal " << WTERMSIG(status) << "; restarting it." << endl;
+    }
+    else
+    {
+        cerr << "Worker process " << index << " exited with status " << WEXITSTATUS(status) << "; restarting it." << endl;
+    }
+    process.pid = -1;
+
+    startProcess(index);
+}
+
+void GameMaster::acceptConnections()
+{
+    while (true)
+    {
+        int fd = accept(listenFd_, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            return;
+        }
+
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (!setNonBlocking(fd) || epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        connections_[fd] = string();
+    }
+}
+
+// reads a connection until it has sent its first line, which decides the worker that plays it
+void GameMaster::readFirstLine(int fd)
+{
+    string &input = connections_[fd];
+    char buf[SERVER_MAX_LINE];
+    while (true)
+    {
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (len <= 0)
+        {
+            // a first line without a newline still counts (the worker sees the end too)
+            if (input.empty())
+            {
+                closeConnection(fd);
+            }
+            else
+            {
+                handOff(fd, input);
+            }
+            return;
+        }
+
+        bool newline = memchr(buf, '\n', len) != NULL;
+        input.append(buf, len);
+        if (newline)
+        {
+            handOff(fd, input);
+            return;
+        }
+        if (input.size() > SERVER_MAX_LINE)
+        {
+            closeConnection(fd);
+            return;
+        }
+    }
+}
+
+// passes a connection and the input read from it to the worker that plays its session
+void GameMaster::handOff(int fd, const string &input)
+{
+    size_t index;
+    string line = input.substr(0, input.find('\n'));
+    if (!line.empty() && line[line.size() - 1] == '\r')
+    {
+        line.erase(line.size() - 1);
+    }
+    if (line.compare(0, strlen(SESSION_COMMAND), SESSION_COMMAND) == 0)
+    {
+        index = GameServer::sessionProcess(line.substr(strlen(SESSION_COMMAND)), processes_.size());
+    }
+    else
+    {
+        index = nextProcess_++ % processes_.size();
+    }
+
+    // the master has read all it needs from the connection
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, NULL);
+    connections_.erase(fd);
+
+    Process &process = processes_[index];
+    if (process.channelFd < 0 || process.queued.size() >= MAX_QUEUED_CONNECTIONS)
+    {
+        if (process.channelFd >= 0)
+        {
+            cerr << "Worker process " << index << " is not taking connections; closed one." << endl;
+        }
+        close(fd);
+        return;
+    }
+
+    // the connections go to the worker in the order they were read
+    process.queued.push_back(make_pair(fd, input));
+    sendQueued(index);
+}
+
+// passes the queued connections to a worker until its socket is full
+void GameMaster::sendQueued(size_t index)
+{
+    Process &process = processes_[index];
+    while (!process.queued.empty())
+    {
+        int fd = process.queued.front().first;
+        const string &input = process.queued.front().second;
+
+        iovec iov;
+        iov.iov_base = (void *)input.data();
+        iov.iov_len = input.size();
+
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+        ssize_t sent;
+        while ((sent = sendmsg(process.channelFd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        {
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+        {
+            break;
+        }
+
+        // if the worker has just exited, the connection is closed (as it would have been anyway)
+        close(fd);
+        process.queued.pop_front();
+    }
+
+    // waits for room in the socket only while there are connections to send
+    bool watchOutput = !process.queued.empty();
+    if (watchOutput != process.watchingOutput)
+    {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = watchOutput ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        ev.data.fd = process.channelFd;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, process.channelFd, &ev) == 0)
+        {
+            process.watchingOutput = watchOutput;
+        }
+    }
+}
+
+void GameMaster::closeQueued(size_t index)
+{
+    Process &process = processes_[index];
+    for (size_t i = 0; i < process.queued.size(); i++)
+    {
+        close(process.queued[i].first);
+    }
+    process.queued.clear();
+}
+
+void GameMaster::closeConnection(int fd)
+{
+    // the worker's copy of the socket would keep it in the epoll set
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    connections_.erase(fd);
+}
+
+#endif
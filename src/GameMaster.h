@@ -0,0 +1,81 @@
+#ifndef _GAME_MASTER_H_
+#define _GAME_MASTER_H_
+
+#include <string>
+#include <map>
+#include <vector>
+#include <deque>
+
+class GameServer;
+
+/* GameMaster
+ * ==========
+ * Runs a GameServer in each of several worker processes, so that a crash only ends the
+ * sessions of one process. The master is forked after the data file has been mapped
+ * (see GameImage), so the workers share its pages, and its tables of objects, until one
+ * of them writes to them.
+ *
+ * The master accepts the connections on the socket and reads each one's first line. A
+ * session that names itself with "@session NAME" always goes to the same worker (see
+ * GameServer::sessionProcess), and the others go to the workers in turn. The master
+ * passes the connection and the input it read to the worker over a Unix socket, and the
+ * worker plays the session from then on. A worker that exits is started again; the
+ * sessions it was playing are lost, but the other workers don't notice.
+ *
+ * The master never waits for a worker: while a worker's socket is full, its connections
+ * wait in a queue of their own (and the ones that don't fit are closed), so a worker that
+ * is stuck only holds up its own sessions.
+ *
+ * Only available on Linux; run() fails elsewhere.
+ */
+class GameMaster
+{
+public:
+    GameMaster(GameServer &server, const std::string &socketPath, size_t numProcesses);
+    ~GameMaster();
+
+    // serves sessions until stop() is called. returns false if the socket can't be opened.
+    bool run();
+
+    // makes run() return once the workers have ended their games.
+    // safe to call from another thread or from a signal handler (in a worker, it stops the worker's server).
+    void stop();
+
+private:
+    GameMaster(const GameMaster &);
+    GameMaster &operator=(const GameMaster &);
+
+    struct Process
+    {
+        int pid;
+        int channelFd; // the master's end of the socket that connections are passed on
+        std::deque<std::pair<int, std::string> > queued; // connections (and their input) waiting for room in the socket
+        bool watchingOutput; // whether epoll tells the master when there is room again
+    };
+
+    bool startProcess(size_t index);
+    void closeInherited();
+    void processExited(size_t index);
+    void acceptConnections();
+    void readFirstLine(int fd);
+    void handOff(int fd, const std::string &input);
+    void sendQueued(size_t index);
+    void closeQueued(size_t index);
+    void closeConnection(int fd);
+
+    GameServer *server_;
+    std::string socketPath_;
+    int masterPid_;
+
+    int listenFd_;
+    int epollFd_;
+    int wakeFds_[2]; // a pipe that wakes up the master (see stop())
+    bool stopping_;
+
+    std::vector<Process> processes_;
+    size_t nextProcess_; // the worker for the next unnamed session
+
+    std::map<int, std::string> connections_; // the input of connections that haven't sent a whole line yet
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "GameOutput.h"
+
+#ifdef WIN32
+#include <winsock2.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+void StdoutOutputSink::write(const char *data, size_t len)
+{
+    fwrite(data, 1, len, stdout);
+    fflush(stdout);
+}
+
+void MemoryOutputSink::write(const char *data, size_t len)
+{
+    contents_.append(data, len);
+}
+
+FileOutputSink::FileOutputSink(const string &filename)
+{
+    file_ = fopen(filename.c_str(), "wb");
+}
+
+FileOutputSink::~FileOutputSink()
+{
+    if (file_)
+    {
+        fclose(file_);
+    }
+}
+
+void FileOutputSink::write(const char *data, size_t len)
+{
+    if (file_)
+    {
+        fwrite(data, 1, len, file_);
+        fflush(file_);
+    }
+}
+
+void SocketOutputSink::write(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+#ifdef WIN32
+        int sent = send((SOCKET)socket_, data, (int)len, 0);
+        if (sent == SOCKET_ERROR)
+        {
+            return;
+        }
+#else
+#ifdef MSG_NOSIGNAL
+        ssize_t sent = send(socket_, data, len, MSG_NOSIGNAL); // a closed connection shouldn't kill the player
+#else
+        ssize_t sent = send(socket_, data, len, 0);
+#endif
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+#endif
+        data += sent;
+        len -= sent;
+    }
+}
+
+void OutputBuffer::flushTo(OutputSink *sink)
+{
+    if (sink && !buffer_.empty())
+    {
+        sink->write(buffer_.data(), buffer_.size());
+    }
+    buffer_.clear();
+}
+
+void OutputBuffer::moveTo(string &text)
+{
+    text.assign(buffer_);
+    buffer_.clear();
+}
+
+int OutputBuffer::overflow(int c)
+{
+    if (c != EOF)
+    {
+        buffer_ += (char)c;
+    }
+    return traits_type::not_eof(c);
+}
+
+streamsize OutputBuffer::xsputn(const char *s, streamsize n)
+{
+    buffer_.append(s, (size_t)n);
+    return n;
+}
@@ -0,0 +1,102 @@
+#ifndef _GAME_OUTPUT_H_
+#define _GAME_OUTPUT_H_
+
+#include <string>
+#include <streambuf>
+#include <cstdio>
+
+/* OutputSink
+ * ==========
+ * Where the output of a game goes. The game collects the output of each command in an
+ * OutputBuffer and writes it to the sink in one piece when it waits for input
+ * (see GameContext::flushOutput), so a sink sees one write per prompt.
+ */
+class OutputSink
+{
+public:
+    virtual ~OutputSink() {}
+
+    virtual void write(const char *data, size_t len) = 0;
+};
+
+// discards the output (the sink of a game until it is given another one)
+class NullOutputSink : public OutputSink
+{
+public:
+    virtual void write(const char * /* data */, size_t /* len */) {}
+};
+
+class StdoutOutputSink : public OutputSink
+{
+public:
+    virtual void write(const char *data, size_t len);
+};
+
+// keeps all output in memory (for tests and for running games without a console)
+class MemoryOutputSink : public OutputSink
+{
+public:
+    virtual void write(const char *data, size_t len);
+
+    const std::string &contents() { return contents_; }
+    void clear() { contents_.clear(); }
+
+private:
+    std::string contents_;
+};
+
+class FileOutputSink : public OutputSink
+{
+public:
+    FileOutputSink(const std::string &filename);
+    ~FileOutputSink();
+
+    bool fail() { return file_ == NULL; }
+
+    virtual void write(const char *data, size_t len);
+
+private:
+    FileOutputSink(const FileOutputSink &);
+    FileOutputSink &operator=(const FileOutputSink &);
+
+    FILE *file_;
+};
+
+// writes to a connected socket (which is not closed by the sink)
+class SocketOutputSink : public OutputSink
+{
+public:
+    SocketOutputSink(int socket) : socket_(socket) {}
+
+    virtual void write(const char *data, size_t len);
+
+private:
+    int socket_;
+};
+
+/* OutputBuffer
+ * ============
+ * A stream buffer that collects everything written to it in memory, until it is taken
+ * with flushTo(). Flushing the stream (std::endl, std::flush) does not write anything,
+ * and the memory is reused for the output of the next command.
+ */
+class OutputBuffer : public std::streambuf
+{
+public:
+    bool empty() const { return buffer_.empty(); }
+
+    // writes the contents to the sink (or discards them if sink is NULL) and clears the buffer
+    void flushTo(OutputSink *sink);
+
+    // moves the contents to text and clears the buffer
+    void moveTo(std::string &text);
+
+protected:
+    virtual int overflow(int c);
+    virtual std::streamsize xsputn(const char *s, std::streamsize n);
+
+private:
+    std::string buffer_;
+};
+
+#endif
@@ -0,0 +1,249 @@
+#include "GameRecoveryLog.h"
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+#define RECORD_INPUT 'I'
+#define RECORD_CHECKPOINT 'C'
+
+static bool writeRecord(FILE *file, char type, const string &data)
+{
+    unsigned int size = (unsigned int)data.size();
+    canonicalizeEndianness(size);
+
+    return fputc(type, file) != EOF
+        && fwrite(&size, sizeof(size), 1, file) == 1
+        && fwrite(data.data(), 1, data.size(), file) == data.size();
+}
+
+GameRecoveryLog::GameRecoveryLog(const string &filename)
+    : filename_(filename), file_(NULL), ring_(RECOVERY_RING_SIZE), head_(0), count_(0),
+      stopping_(false), discard_(false)
+{
+    fail_ = !thread_.start(&GameRecoveryLog::run, this);
+}
+
+GameRecoveryLog::~GameRecoveryLog()
+{
+    {
+        ScopedLock lock(mutex_);
+        stopping_ = true;
+    }
+    dataAvailable_.set();
+    thread_.join();
+
+    if (file_)
+    {
+        fclose(file_);
+    }
+
+    if (discard_)
+    {
+        remove(filename_.c_str());
+    }
+}
+
+bool GameRecoveryLog::read(const string &filename, SaveData &checkpoint, bool &hasCheckpoint, vector<string> &lines)
+{
+    ifstream in(filename.c_str(), ios::binary | ios::in);
+    if (in.fail())
+    {
+        return false;
+    }
+
+    hasCheckpoint = false;
+    lines.clear();
+
+    while (in.peek() != EOF)
+    {
+        char type = (char)in.get();
+
+        unsigned int size;
+        in.read((char *)&size, sizeof(size));
+        canonicalizeEndianness(size);
+
+        string data(size, '\0');
+        if (size)
+        {
+            in.read(&data[0], size);
+        }
+
+        if (in.fail())
+        {
+            // the last record is incomplete
+            break;
+        }
+
+        if (type == RECORD_CHECKPOINT)
+        {
+            istringstream checkpointIn(data, ios::in | ios::binary);
+            if (!checkpoint.read(checkpointIn))
+            {
+                return false;
+            }
+            hasCheckpoint = true;
+            lines.clear();
+        }
+        else if (type == RECORD_INPUT)
+        {
+            lines.push_back(data);
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void GameRecoveryLog::addLine(const string &line)
+{
+    Entry entry;
+    entry.line = line;
+    add(entry);
+}
+
+void GameRecoveryLog::addCheckpoint(SaveData *checkpoint)
+{
+    Entry entry;
+    entry.checkpoint = checkpoint;
+    add(entry);
+}
+
+void GameRecoveryLog::discard()
+{
+    ScopedLock lock(mutex_);
+    discard_ = true;
+}
+
+void GameRecoveryLog::add(Entry &entry)
+{
+    if (fail_)
+    {
+        delete entry.checkpoint;
+        return;
+    }
+
+    while (true)
+    {
+        {
+            ScopedLock lock(mutex_);
+            if (count_ < ring_.size())
+            {
+                Entry &slot = ring_[(head_ + count_) % ring_.size()];
+                slot.line.swap(entry.line);
+                slot.checkpoint = entry.checkpoint;
+                count_++;
+                break;
+            }
+        }
+
+        // the ring buffer is full, so wait for the background thread to empty it
+        dataAvailable_.set();
+        spaceAvailable_.wait();
+    }
+
+    dataAvailable_.set();
+}
+
+void GameRecoveryLog::run(void *self)
+{
+    GameRecoveryLog *log = (GameRecoveryLog *)self;
+
+    while (true)
+    {
+        log->dataAvailable_.wait();
+
+        vector<Entry> entries;
+        bool stopping;
+        {
+            ScopedLock lock(log->mutex_);
+            while (log->count_ > 0)
+            {
+                Entry &slot = log->ring_[log->head_];
+                entries.push_back(Entry());
+                entries.back().line.swap(slot.line);
+                entries.back().checkpoint = slot.checkpoint;
+                slot.checkpoint = NULL;
+
+                log->head_ = (log->head_ + 1) % log->ring_.size();
+                log->count_--;
+            }
+            stopping = log->stopping_;
+        }
+        log->spaceAvailable_.set();
+
+        log->writeEntries(entries);
+
+        if (stopping)
+        {
+            break;
+        }
+    }
+}
+
+void GameRecoveryLog::writeEntries(vector<Entry> &entries)
+{
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        Entry &entry = entries[i];
+        if (entry.checkpoint)
+        {
+            writeCheckpoint(*entry.checkpoint);
+            delete entry.checkpoint;
+        }
+        else
+        {
+            if (!file_)
+            {
+                file_ = fopen(filename_.c_str(), "ab");
+            }
+            if (file_)
+            {
+                writeRecord(file_, RECORD_INPUT, entry.line);
+            }
+        }
+    }
+
+    if (file_)
+    {
+        fflush(file_);
+    }
+}
+
+bool GameRecoveryLog::writeCheckpoint(const SaveData &checkpoint)
+{
+    ostringstream out(ios::out | ios::binary);
+    if (!checkpoint.write(out))
+    {
+        return false;
+    }
+
+    // the new log replaces the old one only once the checkpoint is on disk
+    string tempFilename = filename_ + ".tmp";
+    FILE *temp = fopen(tempFilename.c_str(), "wb");
+    if (!temp)
+    {
+        return false;
+    }
+
+    bool success = writeRecord(temp, RECORD_CHECKPOINT, out.str()) && syncFile(temp);
+    fclose(temp);
+
+    if (file_)
+    {
+        fclose(file_);
+        file_ = NULL;
+    }
+
+    if (!success || !replaceFile(tempFilename, filename_))
+    {
+        remove(tempFilename.c_str());
+        return false;
+    }
+
+    file_ = fopen(filename_.c_str(), "ab");
+    return file_ != NULL;
+}
@@ -0,0 +1,81 @@
+#ifndef _GAME_RECOVERY_LOG_H_
+#define _GAME_RECOVERY_LOG_H_
+
+#include "GameSave.h"
+#include "CraneaThread.h"
+#include <cstdio>
+
+#define RECOVERY_LOG_EXTENSION ".crr"
+#define RECOVERY_RING_SIZE 256
+
+/* GameRecoveryLog
+ * ===============
+ * Logs every line of input that the player types, so that a game in progress can be
+ * rebuilt after a crash by replaying the input. To keep replays short, the game
+ * periodically adds a checkpoint (the SaveData of the game at that point); the log
+ * then only needs the checkpoint and the input since it.
+ *
+ * The game only copies lines and checkpoints into a ring buffer in memory. A background
+ * thread writes them to the log file: lines are appended and flushed in batches, and each
+ * checkpoint replaces the file with a new one that starts with the checkpoint.
+ *
+ * Log records: type ('I' input line or 'C' checkpoint), length (4 bytes), data.
+ */
+class GameRecoveryLog
+{
+public:
+    GameRecoveryLog(const std::string &filename);
+
+    // writes everything in the ring buffer to the file.
+    // if the game ended normally (see discard()), deletes the file instead.
+    ~GameRecoveryLog();
+
+    bool fail() { return fail_; }
+
+    // reads an existing log. returns false if there is no log to recover.
+    static bool read(const std::string &filename, SaveData &checkpoint, bool &hasCheckpoint,
+        std::vector<std::string> &lines);
+
+    void addLine(const std::string &line);
+
+    // takes ownership of checkpoint
+    void addCheckpoint(SaveData *checkpoint);
+
+    // the game has ended normally, so there will be nothing to recover
+    void discard();
+
+private:
+    GameRecoveryLog(const GameRecoveryLog &);
+    GameRecoveryLog &operator=(const GameRecoveryLog &);
+
+    struct Entry
+    {
+        Entry() : checkpoint(NULL) {}
+
+        std::string line;
+        SaveData *checkpoint; // NULL for input lines
+    };
+
+    void add(Entry &entry);
+
+    static void run(void *self);
+    void writeEntries(std::vector<Entry> &entries);
+    bool writeCheckpoint(const SaveData &checkpoint);
+
+    std::string filename_;
+    FILE *file_; // only used by the background thread after construction
+    bool fail_;
+
+    Thread thread_;
+    Event dataAvailable_;
+    Event spaceAvailable_;
+
+    Mutex mutex_; // protects everything below
+    std::vector<Entry> ring_;
+    size_t head_;
+    size_t count_;
+    bool stopping_;
+    bool discard_;
+};
+
+#endif
@@ -0,0 +1,757 @@
+#include "GameSave.h"
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+#ifdef WIN32
+#include <io.h> // for _commit
+#include <process.h> // for _getpid
+#define getpid _getpid
+#else
+#include <unistd.h> // for fsync, getpid
+#endif
+
+using namespace std;
+
+#define SAVE_MAGIC "CRS2"
+#define SAVE_MAGIC_SIZE 4
+#define MAX_VARINT_SIZE 10
+
+template <typename ElemType>
+static ElemType readVal(istream &in)
+{
+    ElemType val;
+    in.read((char *)&val, sizeof(ElemType));
+    canonicalizeEndianness(val);
+    return val;
+}
+
+/* Variable-length integers: 7 bits per byte, least significant bits first,
+ * with the high bit set on every byte except the last.
+ */
+static void writeVarint(ostream &out, size_t val)
+{
+    while (val >= 0x80)
+    {
+        out.put((char)((val & 0x7F) | 0x80));
+        val >>= 7;
+    }
+    out.put((char)val);
+}
+
+static bool readVarint(istream &in, size_t &val)
+{
+    val = 0;
+    for (size_t i = 0; i < MAX_VARINT_SIZE; i++)
+    {
+        int ch = in.get();
+        if (ch == EOF)
+        {
+            return false;
+        }
+        val |= (size_t)(ch & 0x7F) << (7 * i);
+        if (!(ch & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// item keys are always KEY_SIZE bytes
+static void writeKeys(ostream &out, const vector<bytestring> &keys)
+{
+    writeVarint(out, keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        out.write((const char *)keys[i].data(), KEY_SIZE);
+    }
+}
+
+static bool readKeys(istream &in, vector<bytestring> &keys)
+{
+    size_t numKeys;
+    if (!readVarint(in, numKeys))
+    {
+        return false;
+    }
+
+    keys.clear();
+    byte key[KEY_SIZE];
+    for (size_t i = 0; i < numKeys; i++)
+    {
+        in.read((char *)key, KEY_SIZE);
+        if (in.fail())
+        {
+            return false;
+        }
+        keys.push_back(bytestring(key, KEY_SIZE));
+    }
+    return true;
+}
+
+static bool readGid(istream &in, int &gid)
+{
+    size_t val;
+    if (!readVarint(in, val) || val > 0x7FFFFFFF)
+    {
+        return false;
+    }
+    gid = (int)val;
+    return true;
+}
+
+void SaveData::clear()
+{
+    locations.clear();
+    locationStacks.clear();
+    inventory.clear();
+    droppedItems.clear();
+    enteredLocations.clear();
+    locationItems.clear();
+}
+
+void SaveData::writeItem(ostream &out, const Item &item) const
+{
+    writeVarint(out, item.gid);
+    out.write((const char *)item.key, KEY_SIZE);
+    out.write((const char *)item.takey, KEY_SIZE);
+    writeVarint(out, item.originalLocation);
+}
+
+bool SaveData::write(ostream &out) const
+{
+    out.write(SAVE_MAGIC, SAVE_MAGIC_SIZE);
+
+    // location table: (parent index + 1, gid, key)*
+    writeVarint(out, locations.size());
+    for (size_t i = 0; i < locations.size(); i++)
+    {
+        const Location &loc = locations[i];
+        writeVarint(out, loc.parent);
+        writeVarint(out, loc.gid);
+        out.write((const char *)loc.key, KEY_SIZE);
+    }
+
+    // location stacks: (innermost location index + 1)*
+    writeVarint(out, locationStacks.size());
+    for (size_t i = 0; i < locationStacks.size(); i++)
+    {
+        writeVarint(out, locationStacks[i]);
+    }
+
+    // inventory: (gid, key, takey, original location index)*
+    writeVarint(out, inventory.size());
+    for (size_t i = 0; i < inventory.size(); i++)
+    {
+        writeItem(out, inventory[i]);
+    }
+
+    // dropped items: (gid, key, takey, original location index, dropped location index)*
+    writeVarint(out, droppedItems.size());
+    for (size_t i = 0; i < droppedItems.size(); i++)
+    {
+        writeItem(out, droppedItems[i]);
+        writeVarint(out, droppedItems[i].droppedLocation);
+    }
+
+    return !out.fail();
+}
+
+bool SaveData::read(istream &in)
+{
+    clear();
+
+    if (in.fail())
+    {
+        return false;
+    }
+
+    char magic[SAVE_MAGIC_SIZE];
+    in.read(magic, SAVE_MAGIC_SIZE);
+
+    if (!in.fail() && !memcmp(magic, SAVE_MAGIC, SAVE_MAGIC_SIZE))
+    {
+        return readV2(in);
+    }
+
+    // files without the magic number are from before version 2
+    in.clear();
+    in.seekg(0, ios::beg);
+    return readV1(in);
+}
+
+bool SaveData::writeHibernated(ostream &out) const
+{
+    if (!write(out))
+    {
+        return false;
+    }
+
+    writeVarint(out, enteredLocations.size());
+    for (size_t i = 0; i < enteredLocations.size(); i++)
+    {
+        writeVarint(out, enteredLocations[i]);
+    }
+
+    // (location index, decrypted, item keys, removed item keys)*
+    writeVarint(out, locationItems.size());
+    for (size_t i = 0; i < locationItems.size(); i++)
+    {
+        const LocationItems &items = locationItems[i];
+        writeVarint(out, items.location);
+        out.put(items.decrypted ? 1 : 0);
+        writeKeys(out, items.itemKeys);
+        writeKeys(out, items.removedItemKeys);
+    }
+    return !out.fail();
+}
+
+bool SaveData::readHibernated(istream &in)
+{
+    if (!read(in))
+    {
+        return false;
+    }
+
+    size_t numEntered;
+    if (!readVarint(in, numEntered))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < numEntered; i++)
+    {
+        size_t index;
+        if (!readVarint(in, index) || !isValidLocation(index))
+        {
+            return false;
+        }
+        enteredLocations.push_back(index);
+    }
+
+    size_t numLocationItems;
+    if (!readVarint(in, numLocationItems))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < numLocationItems; i++)
+    {
+        LocationItems items;
+        int decrypted;
+        if (!readVarint(in, items.location) || !isValidLocation(items.location) || (decrypted = in.get()) == EOF
+            || !readKeys(in, items.itemKeys) || !readKeys(in, items.removedItemKeys))
+        {
+            return false;
+        }
+        items.decrypted = decrypted != 0;
+        locationItems.push_back(items);
+    }
+    return true;
+}
+
+bool HibernatedGame::write(ostream &out) const
+{
+    // the tables of the locations and items that the changes refer to, as in a saved game
+    writeVarint(out, locations.size());
+    for (size_t i = 0; i < locations.size(); i++)
+    {
+        writeVarint(out, locations[i].parent);
+        writeVarint(out, locations[i].gid);
+        out.write((const char *)locations[i].key, KEY_SIZE);
+    }
+
+    writeVarint(out, items.size());
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        writeVarint(out, items[i].gid);
+        out.write((const char *)items[i].key, KEY_SIZE);
+        out.write((const char *)items[i].takey, KEY_SIZE);
+        writeVarint(out, items[i].originalLocation);
+    }
+
+    if (!state.writeHibernated(out))
+    {
+        return false;
+    }
+
+    writeVarint(out, loads.size());
+    for (size_t i = 0; i < loads.size(); i++)
+    {
+        if (!loads[i].writeHibernated(out))
+        {
+            return false;
+        }
+    }
+
+    // commands: (# ops, (type, location index + 1, item index + 1, index, gid, 0 or 1 item keys)*)*
+    writeVarint(out, commands.size());
+    writeVarint(out, current);
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        const Command &command = commands[i];
+        writeVarint(out, command.size());
+        for (size_t j = 0; j < command.size(); j++)
+        {
+            const Op &op = command[j];
+            writeVarint(out, op.type);
+            writeVarint(out, op.location);
+            writeVarint(out, op.item);
+            writeVarint(out, op.index);
+            writeVarint(out, op.gid);
+            writeKeys(out, op.itemKey.empty() ? vector<bytestring>() : vector<bytestring>(1, op.itemKey));
+        }
+    }
+    return !out.fail();
+}
+
+bool HibernatedGame::read(istream &in)
+{
+    size_t numLocations;
+    if (!readVarint(in, numLocations))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < numLocations; i++)
+    {
+        SaveData::Location loc;
+        // parents must come before their children
+        if (!readVarint(in, loc.parent) || loc.parent > i || !readGid(in, loc.gid))
+        {
+            return false;
+        }
+        in.read((char *)loc.key, KEY_SIZE);
+        locations.push_back(loc);
+    }
+
+    size_t numItems;
+    if (!readVarint(in, numItems))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < numItems; i++)
+    {
+        SaveData::Item item;
+        if (!readGid(in, item.gid))
+        {
+            return false;
+        }
+        in.read((char *)item.key, KEY_SIZE);
+        in.read((char *)item.takey, KEY_SIZE);
+        if (!readVarint(in, item.originalLocation) || item.originalLocation >= numLocations)
+        {
+            return false;
+        }
+        item.droppedLocation = 0;
+        items.push_back(item);
+    }
+
+    size_t numLoads;
+    if (!state.readHibernated(in) || !readVarint(in, numLoads))
+    {
+        return false;
+    }
+
+    loads.resize(numLoads);
+    for (size_t i = 0; i < numLoads; i++)
+    {
+        if (!loads[i].readHibernated(in))
+        {
+            return false;
+        }
+    }
+
+    size_t numCommands;
+    if (!readVarint(in, numCommands) || !readVarint(in, current) || current > numCommands)
+    {
+        return false;
+    }
+
+    commands.resize(numCommands);
+    for (size_t i = 0; i < numCommands; i++)
+    {
+        size_t numOps;
+        if (!readVarint(in, numOps))
+        {
+            return false;
+        }
+
+        for (size_t j = 0; j < numOps; j++)
+        {
+            Op op;
+            vector<bytestring> itemKey;
+            if (!readVarint(in, op.type) || !readVarint(in, op.location) || op.location > numLocations
+                || !readVarint(in, op.item) || op.item > numItems || !readVarint(in, op.index) 
+                || !readGid(in, op.gid) || !readKeys(in, itemKey) || itemKey.size() > 1)
+            {
+                return false;
+            }
+            if (!itemKey.empty())
+            {
+                op.itemKey = itemKey[0];
+            }
+            commands[i].push_back(op);
+        }
+    }
+    return true;
+}
+
+bool SaveData::readItem(istream &in, Item &item)
+{
+    if (!readGid(in, item.gid))
+    {
+        return false;
+    }
+    in.read((char *)item.key, KEY_SIZE);
+    in.read((char *)item.takey, KEY_SIZE);
+    return readVarint(in, item.originalLocation) && isValidLocation(item.originalLocation);
+}
+
+bool SaveData::readV2(istream &in)
+{
+    size_t numLocations;
+    if (!readVarint(in, numLocations))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < numLocations; i++)
+    {
+        Location loc;
+        // parents must come before their children
+        if (!readVarint(in, loc.parent) || loc.parent > i || !readGid(in, loc.gid))
+        {
+            return false;
+        }
+        in.read((char *)loc.key, KEY_SIZE);
+        locations.push_back(loc);
+    }
+
+    size_t numLocationStacks;
+    if (!readVarint(in, numLocationStacks) || numLocationStacks == 0)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < numLocationStacks; i++)
+    {
+        size_t leaf;
+        if (!readVarint(in, leaf) || leaf > numLocations)
+        {
+            return false;
+        }
+        locationStacks.push_back(leaf);
+    }
+
+    size_t inventorySize;
+    if (!readVarint(in, inventorySize))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < inventorySize; i++)
+    {
+        Item item;
+        if (!readItem(in, item))
+        {
+            return false;
+        }
+        item.droppedLocation = 0;
+        inventory.push_back(item);
+    }
+
+    size_t numDroppedItems;
+    if (!readVarint(in, numDroppedItems))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < numDroppedItems; i++)
+    {
+        Item item;
+        if (!readItem(in, item) || !readVarint(in, item.droppedLocation) || !isValidLocation(item.droppedLocation))
+        {
+            return false;
+        }
+        droppedItems.push_back(item);
+    }
+
+    return !in.fail();
+}
+
+size_t SaveData::addLocationV1(map<int, size_t> &indexes, size_t parent, int gid, const byte *key)
+{
+    map<int, size_t>::const_iterator it = indexes.find(gid);
+    if (it != indexes.end())
+    {
+        return it->second;
+    }
+
+    locations.push_back(Location());
+    Location &loc = locations.back();
+    loc.parent = parent;
+    loc.gid = gid;
+    memcpy(loc.key, key, KEY_SIZE);
+
+    size_t index = locations.size() - 1;
+    indexes[gid] = index;
+    return index;
+}
+
+bool SaveData::readLocationChainV1(istream &in, map<int, size_t> &indexes, size_t &index)
+{
+    size_t numAncestors = readVal<size_t>(in);
+    if (in.fail() || numAncestors == 0)
+    {
+        return false;
+    }
+
+    size_t parent = 0;
+    for (size_t i = 0; i < numAncestors; i++)
+    {
+        int gid = readVal<int>(in);
+        byte key[KEY_SIZE];
+        in.read((char *)key, KEY_SIZE);
+
+        if (in.fail())
+        {
+            return false;
+        }
+
+        index = addLocationV1(indexes, parent, gid, key);
+        parent = index + 1;
+    }
+    return true;
+}
+
+bool SaveData::readV1(istream &in)
+{
+    map<int, size_t> indexes; // gid -> index in locations
+
+    // # locationStacks (# locations in stack, (gid, location key)+)+
+    size_t numLocationStacks = readVal<size_t>(in);
+
+    for (size_t i = 0; i < numLocationStacks && !in.fail(); i++)
+    {
+        size_t locationsInStack = readVal<size_t>(in);
+
+        size_t parent = 0;
+        for (size_t j = 0; j < locationsInStack; j++)
+        {
+            int gid = readVal<int>(in);
+            byte key[KEY_SIZE];
+            in.read((char *)key, KEY_SIZE);
+
+            if (in.fail())
+            {
+                return false;
+            }
+
+            parent = addLocationV1(indexes, parent, gid, key) + 1;
+        }
+        locationStacks.push_back(parent);
+    }
+
+    // items to take from original location (from inventory):
+    // (gid, item key, item takey, (original loc gid, original loc key)+)+
+    size_t inventorySize = readVal<size_t>(in);
+
+    for (size_t i = 0; i < inventorySize && !in.fail(); i++)
+    {
+        Item item;
+        item.gid = readVal<int>(in);
+        in.read((char *)item.key, KEY_SIZE);
+        in.read((char *)item.takey, KEY_SIZE);
+        item.droppedLocation = 0;
+
+        if (!readLocationChainV1(in, indexes, item.originalLocation))
+        {
+            return false;
+        }
+        inventory.push_back(item);
+    }
+
+    // items to take from some location and drop on a new location (from droppedItemLocations):
+    // (gid, item key, item takey, (original loc gid, original loc key)+, (dropped loc gid, dropped loc key)+)+
+    size_t numMovedItems = readVal<size_t>(in);
+
+    for (size_t i = 0; i < numMovedItems && !in.fail(); i++)
+    {
+        Item item;
+        item.gid = readVal<int>(in);
+        in.read((char *)item.key, KEY_SIZE);
+        in.read((char *)item.takey, KEY_SIZE);
+
+        if (!readLocationChainV1(in, indexes, item.originalLocation)
+            || !readLocationChainV1(in, indexes, item.droppedLocation))
+        {
+            return false;
+        }
+        droppedItems.push_back(item);
+    }
+
+    return !in.fail();
+}
+
+bool syncFile(FILE *file)
+{
+    if (fflush(file) != 0)
+    {
+        return false;
+    }
+#ifdef WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// numbers the temporary files of the saves in progress, so that two saves of the same name
+// (say, an autosave and the player's save) never write to the same one
+static Mutex tempFileMutex;
+static unsigned int nextTempFile = 0;
+
+bool FileSaveStore::save(const string &name, const SaveData &data)
+{
+    ostringstream out;
+    if (!data.write(out))
+    {
+        return false;
+    }
+    string str = out.str();
+
+    // write to a temporary file first so that a crash never leaves a partially written save
+    string filename = prefix_ + name + SAVE_FILE_EXTENSION;
+    ostringstream tempFilename;
+    {
+        ScopedLock lock(tempFileMutex);
+        tempFilename << filename << "." << getpid() << "." << nextTempFile++ << ".tmp";
+    }
+
+    FILE *file = fopen(tempFilename.str().c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    bool success = fwrite(str.data(), 1, str.length(), file) == str.length() && syncFile(file);
+    fclose(file);
+
+    // the save is on disk before it replaces the old one
+    if (success && replaceFile(tempFilename.str(), filename))
+    {
+        return true;
+    }
+
+    remove(tempFilename.str().c_str());
+    return false;
+}
+
+bool FileSaveStore::load(const string &name, SaveData &data)
+{
+    string filename = prefix_ + name + SAVE_FILE_EXTENSION;
+    ifstream in(filename.c_str(), ios::binary | ios::in);
+    return data.read(in);
+}
+
+bool MemorySaveStore::save(const string &name, const SaveData &data)
+{
+    ostringstream out;
+    if (!data.write(out))
+    {
+        return false;
+    }
+
+    ScopedLock lock(mutex_);
+    saves_[name] = out.str();
+    return true;
+}
+
+bool MemorySaveStore::load(const string &name, SaveData &data)
+{
+    string saved;
+    {
+        ScopedLock lock(mutex_);
+        map<string, string>::const_iterator it = saves_.find(name);
+        if (it == saves_.end())
+        {
+            return false;
+        }
+        saved = it->second;
+    }
+
+    istringstream in(saved);
+    return data.read(in);
+}
+
+GameAutosave::GameAutosave(GameSaveStore &store, const string &name)
+    : store_(&store), name_(name), pending_(NULL), stopping_(false)
+{
+    threaded_ = thread_.start(&GameAutosave::run, this);
+}
+
+GameAutosave::~GameAutosave()
+{
+    {
+        ScopedLock lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.set();
+    thread_.join();
+
+    delete pending_;
+}
+
+void GameAutosave::submit(SaveData *data)
+{
+    if (!threaded_)
+    {
+        saveData(*data);
+        delete data;
+        return;
+    }
+
+    {
+        ScopedLock lock(mutex_);
+        delete pending_;
+        pending_ = data;
+    }
+    wakeup_.set();
+}
+
+void GameAutosave::run(void *self)
+{
+    GameAutosave *autosave = (GameAutosave *)self;
+
+    while (true)
+    {
+        autosave->wakeup_.wait();
+
+        SaveData *data;
+        bool stopping;
+        {
+            ScopedLock lock(autosave->mutex_);
+            data = autosave->pending_;
+            autosave->pending_ = NULL;
+            stopping = autosave->stopping_;
+        }
+
+        if (data)
+        {
+            autosave->saveData(*data);
+            delete data;
+        }
+
+        if (stopping)
+        {
+            break;
+        }
+    }
+}
+
+void GameAutosave::saveData(const SaveData &data)
+{
+    store_->save(name_, data);
+}
@@ -0,0 +1,211 @@
+#ifndef _GAME_SAVE_H_
+#define _GAME_SAVE_H_
+
+#include "CraneaBase.h"
+#include "CraneaThread.h"
+#include <iostream>
+#include <cstdio>
+#include <map>
+
+#define SAVE_FILE_EXTENSION ".crs"
+#define AUTOSAVE_NAME "autosave"
+
+/* SaveData
+ * ========
+ * A copy of the keys that are needed to restore a game in progress, captured by
+ * GameContext::captureSaveData. It doesn't refer to any game objects, so it can be
+ * written by another thread while the game goes on.
+ *
+ * Each location is stored once in a table, in an order where parents come before
+ * their children. Location stacks and item locations refer to locations by their
+ * index in the table.
+ */
+struct SaveData
+{
+    struct Location
+    {
+        size_t parent; // index + 1 of the parent location, 0 for a top-level location
+        int gid;
+        byte key[KEY_SIZE];
+    };
+
+    struct Item
+    {
+        int gid;
+        byte key[KEY_SIZE];
+        byte takey[KEY_SIZE];
+        size_t originalLocation;
+        size_t droppedLocation; // only used for dropped items
+    };
+
+    std::vector<Location> locations;
+    std::vector<size_t> locationStacks; // index + 1 of the innermost location on each stack, 0 if empty
+    std::vector<Item> inventory;
+    std::vector<Item> droppedItems;
+
+    // index of each location that the player has entered. saved games don't keep it (a
+    // loaded game shows the first-visit text again), but a hibernating game does.
+    std::vector<size_t> enteredLocations;
+
+    // the items at a location, exactly as they were (so that the changes in the history of a
+    // hibernating game can be replayed on them). for a location that hasn't been decrypted,
+    // they are the changes to the items in the data file.
+    struct LocationItems
+    {
+        size_t location;
+        bool decrypted;
+        std::vector<bytestring> itemKeys; // all of the items, or the ones added if not decrypted
+        std::vector<bytestring> removedItemKeys; // only if not decrypted
+    };
+    std::vector<LocationItems> locationItems; // also only kept by a hibernating game
+
+    void clear();
+
+    // version 2 save format (varint counts and indexes, each location key stored once)
+    bool write(std::ostream &out) const;
+
+    // reads either version of the save format
+    bool read(std::istream &in);
+
+    // the version 2 save format followed by enteredLocations and locationItems (see GameContext::hibernate)
+    bool writeHibernated(std::ostream &out) const;
+    bool readHibernated(std::istream &in);
+
+private:
+    bool readV1(std::istream &in);
+    bool readV2(std::istream &in);
+
+    // version 1 stored the full chain of ancestors for each location
+    bool readLocationChainV1(std::istream &in, std::map<int, size_t> &indexes, size_t &index);
+    size_t addLocationV1(std::map<int, size_t> &indexes, size_t parent, int gid, const byte *key);
+    void writeItem(std::ostream &out, const Item &item) const;
+    bool readItem(std::istream &in, Item &item);
+    bool isValidLocation(size_t index) { return index < locations.size(); }
+};
+
+/* HibernatedGame
+ * ==============
+ * A hibernating game (see GameContext::hibernate). The game is kept as the state it was in
+ * before the oldest command that can be undone, and the changes that each command made from
+ * there (see GameJournal), including the commands that can be redone. The changes refer to
+ * the locations and items in tables of their own, stored like those of a saved game. A load
+ * in the history starts over with new locations, so it also keeps the state right after the
+ * load replaced the old one: the location stacks and the items at each location (the rest
+ * of what loading did is in the command, like any other change).
+ */
+struct HibernatedGame
+{
+    HibernatedGame() : current(0) {}
+
+    // a change made by a command, as passed to GameJournal
+    struct Op
+    {
+        Op() : type(0), location(0), item(0), index(0), gid(0) {}
+
+        size_t type;
+        size_t location; // index + 1 in locations, 0 for none
+        size_t item; // index + 1 in items, 0 for none
+        size_t index; // of an inventory item or item key, or in loads
+        int gid; // of a dropped item
+        bytestring itemKey;
+    };
+    typedef std::vector<Op> Command;
+
+    std::vector<SaveData::Location> locations;
+    std::vector<SaveData::Item> items; // originalLocation is an index in locations
+    SaveData state; // before the oldest command
+    std::vector<SaveData> loads; // right after each load in the history
+    std::vector<Command> commands; // in the order they were made
+    size_t current; // the number of commands that are done (the others can be redone)
+
+    bool write(std::ostream &out) const;
+    bool read(std::istream &in);
+};
+
+/* GameSaveStore
+ * =============
+ * Where saved games are kept, by name. Implementations must be safe to call from
+ * multiple threads (the autosave thread saves to the same store as the game).
+ */
+class GameSaveStore
+{
+public:
+    virtual ~GameSaveStore() {}
+
+    virtual bool save(const std::string &name, const SaveData &data) = 0;
+    virtual bool load(const std::string &name, SaveData &data) = 0;
+};
+
+/* FileSaveStore
+ * =============
+ * Keeps each saved game in its own <name>.crs file in the current directory.
+ * With a prefix, the file is <prefix><name>.crs (so that sessions don't share saves).
+ */
+class FileSaveStore : public GameSaveStore
+{
+public:
+    FileSaveStore(const std::string &prefix = "") : prefix_(prefix) {}
+
+    virtual bool save(const std::string &name, const SaveData &data);
+    virtual bool load(const std::string &name, SaveData &data);
+
+private:
+    std::string prefix_;
+};
+
+/* MemorySaveStore
+ * ===============
+ * Keeps saved games in memory, as they would be written to a file. They last as long
+ * as the store (used by libcranea, whose host decides where games are kept).
+ */
+class MemorySaveStore : public GameSaveStore
+{
+public:
+    virtual bool save(const std::string &name, const SaveData &data);
+    virtual bool load(const std::string &name, SaveData &data);
+
+private:
+    Mutex mutex_;
+    std::map<std::string, std::string> saves_;
+};
+
+// flushes file and waits until its contents are on disk. returns true on success.
+bool syncFile(FILE *file);
+
+/* GameAutosave
+ * ============
+ * Saves SaveData to a store on a background thread. If the game submits new data
+ * before the previous data was saved, only the newest data is saved.
+ */
+class GameAutosave
+{
+public:
+    GameAutosave(GameSaveStore &store, const std::string &name);
+
+    // writes any data that was submitted but not yet written
+    ~GameAutosave();
+
+    // takes ownership of data
+    void submit(SaveData *data);
+
+private:
+    GameAutosave(const GameAutosave &);
+    GameAutosave &operator=(const GameAutosave &);
+
+    static void run(void *self);
+    void saveData(const SaveData &data);
+
+    GameSaveStore *store_;
+    std::string name_;
+
+    Mutex mutex_;
+    Event wakeup_;
+    Thread thread_;
+    bool threaded_;
+
+    // protected by mutex_
+    SaveData *pending_;
+    bool stopping_;
+};
+
+#endif
@@ -0,0 +1,507 @@
+#include "GameSaveLog.h"
+#include "crc.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+using namespace CryptoPP;
+
+// each record is: magic, payload size, CRC32 of payload, payload (session \0 save name \0 save data)
+#define RECORD_MAGIC "CRSR"
+#define RECORD_MAGIC_SIZE 4
+#define RECORD_HEADER_SIZE (RECORD_MAGIC_SIZE + 4 + CRC32::DIGESTSIZE)
+#define MAX_RECORD_SIZE (64 * 1024 * 1024)
+
+GameSaveLog::GameSaveLog(const string &path)
+    : path_(path), fail_(false), stopping_(false), active_(NULL), activeSize_(0)
+{
+    if (!readManifest())
+    {
+        fail_ = true;
+        return;
+    }
+
+    bool complete = true;
+    long end = 0;
+    for (size_t i = 0; i < segments_.size(); i++)
+    {
+        complete = scanSegment(segments_[i], end);
+    }
+
+    // never append after an incomplete record (left by a crash), so that the segment can still be scanned
+    if (segments_.empty() || !complete)
+    {
+        segments_.push_back(segments_.empty() ? 1 : segments_.back() + 1);
+        end = 0;
+        if (!writeManifest())
+        {
+            fail_ = true;
+            return;
+        }
+    }
+
+    if (!openSegment(segments_.back()))
+    {
+        fail_ = true;
+        return;
+    }
+    activeSize_ = end;
+
+    fail_ = !syncThread_.start(&GameSaveLog::run, this);
+}
+
+GameSaveLog::~GameSaveLog()
+{
+    {
+        ScopedLock lock(mutex_);
+        stopping_ = true;
+    }
+    syncNeeded_.set();
+    syncThread_.join();
+
+    if (active_)
+    {
+        fclose(active_);
+    }
+}
+
+string GameSaveLog::segmentPath(int segment)
+{
+    char suffix[16];
+    sprintf(suffix, ".%06d", segment);
+    return path_ + suffix;
+}
+
+bool GameSaveLog::readManifest()
+{
+    ifstream in(path_.c_str());
+    if (in.fail())
+    {
+        // new log
+        return true;
+    }
+
+    int segment;
+    while (in >> segment)
+    {
+        segments_.push_back(segment);
+    }
+    return in.eof();
+}
+
+bool GameSaveLog::writeManifest()
+{
+    string tempPath = path_ + ".tmp";
+    FILE *out = fopen(tempPath.c_str(), "w");
+    if (!out)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < segments_.size(); i++)
+    {
+        fprintf(out, "%d\n", segments_[i]);
+    }
+
+    bool success = syncFile(out);
+    fclose(out);
+
+    return success && replaceFile(tempPath, path_);
+}
+
+bool GameSaveLog::openSegment(int segment)
+{
+    active_ = fopen(segmentPath(segment).c_str(), "ab");
+    return active_ != NULL;
+}
+
+// parses a record payload into its key and save data. returns false if it is malformed.
+static bool parsePayload(const string &payload, pair<string, string> &key, string *data)
+{
+    size_t sessionEnd = payload.find('\0');
+    size_t nameEnd = (sessionEnd == string::npos) ? string::npos : payload.find('\0', sessionEnd + 1);
+    if (nameEnd == string::npos)
+    {
+        return false;
+    }
+
+    key.first = payload.substr(0, sessionEnd);
+    key.second = payload.substr(sessionEnd + 1, nameEnd - sessionEnd - 1);
+    if (data)
+    {
+        *data = payload.substr(nameEnd + 1);
+    }
+    return true;
+}
+
+// reads the record at the current position of in. returns false if it is incomplete or corrupt.
+static bool readRecord(istream &in, string &payload)
+{
+    char header[RECORD_HEADER_SIZE];
+    in.read(header, RECORD_HEADER_SIZE);
+    if (in.gcount() != RECORD_HEADER_SIZE || memcmp(header, RECORD_MAGIC, RECORD_MAGIC_SIZE))
+    {
+        return false;
+    }
+
+    unsigned int size;
+    memcpy(&size, header + RECORD_MAGIC_SIZE, sizeof(size));
+    canonicalizeEndianness(size);
+    if (size == 0 || size > MAX_RECORD_SIZE)
+    {
+        return false;
+    }
+
+    payload.resize(size);
+    in.read(&payload[0], size);
+    if ((size_t)in.gcount() != size)
+    {
+        return false;
+    }
+
+    byte crc[CRC32::DIGESTSIZE];
+    CRC32().CalculateDigest(crc, (const byte *)payload.data(), payload.size());
+    return !memcmp(crc, header + RECORD_MAGIC_SIZE + 4, CRC32::DIGESTSIZE);
+}
+
+bool GameSaveLog::scanSegment(int segment, long &end)
+{
+    end = 0;
+
+    ifstream in(segmentPath(segment).c_str(), ios::binary | ios::in);
+    if (in.fail())
+    {
+        return false;
+    }
+
+    string payload;
+    while (in.peek() != EOF)
+    {
+        RecordKey key;
+        if (!readRecord(in, payload) || !parsePayload(payload, key, NULL))
+        {
+            return false;
+        }
+
+        RecordPos pos;
+        pos.segment = segment;
+        pos.offset = end;
+        pos.size = RECORD_HEADER_SIZE + payload.size();
+
+        indexRecord(key, pos);
+        segmentSizes_[segment] += pos.size;
+        end += (long)pos.size;
+    }
+    return true;
+}
+
+void GameSaveLog::indexRecord(const RecordKey &key, const RecordPos &pos)
+{
+    map<RecordKey, RecordPos>::iterator it = index_.find(key);
+    if (it != index_.end())
+    {
+        liveSizes_[it->second.segment] -= it->second.size;
+    }
+    index_[key] = pos;
+    liveSizes_[pos.segment] += pos.size;
+}
+
+bool GameSaveLog::append(const string &session, const string &name, const string &data)
+{
+    string payload = session + '\0' + name + '\0' + data;
+
+    byte crc[CRC32::DIGESTSIZE];
+    CRC32().CalculateDigest(crc, (const byte *)payload.data(), payload.size());
+
+    unsigned int size = (unsigned int)payload.size();
+    canonicalizeEndianness(size);
+
+    string record(RECORD_MAGIC, RECORD_MAGIC_SIZE);
+    record.append((const char *)&size, sizeof(size));
+    record.append((const char *)crc, CRC32::DIGESTSIZE);
+    record += payload;
+
+    Event committed;
+    bool success = false;
+    {
+        ScopedLock lock(mutex_);
+        if (fail_)
+        {
+            return false;
+        }
+
+        if (fwrite(record.data(), 1, record.size(), active_) != record.size())
+        {
+            // the segment now ends with an incomplete record
+            fail_ = true;
+            return false;
+        }
+
+        RecordPos pos;
+        pos.segment = segments_.back();
+        pos.offset = activeSize_;
+        pos.size = record.size();
+
+        indexRecord(RecordKey(session, name), pos);
+        segmentSizes_[pos.segment] += pos.size;
+        activeSize_ += (long)pos.size;
+
+        Waiter waiter;
+        waiter.committed = &committed;
+        waiter.success = &success;
+        waiters_.push_back(waiter);
+    }
+
+    syncNeeded_.set();
+    committed.wait();
+    return success;
+}
+
+bool GameSaveLog::find(const string &session, const string &name, string &data)
+{
+    ScopedLock lock(mutex_);
+
+    map<RecordKey, RecordPos>::const_iterator it = index_.find(RecordKey(session, name));
+    if (it == index_.end())
+    {
+        return false;
+    }
+    const RecordPos &pos = it->second;
+
+    if (pos.segment == segments_.back() && active_)
+    {
+        fflush(active_);
+    }
+
+    ifstream in(segmentPath(pos.segment).c_str(), ios::binary | ios::in);
+    in.seekg(pos.offset);
+
+    string payload;
+    RecordKey key;
+    return readRecord(in, payload) && parsePayload(payload, key, &data);
+}
+
+void GameSaveLog::run(void *self)
+{
+    GameSaveLog *log = (GameSaveLog *)self;
+
+    while (true)
+    {
+        log->syncNeeded_.wait();
+        log->sync();
+
+        ScopedLock lock(log->mutex_);
+        if (log->stopping_)
+        {
+            break;
+        }
+    }
+}
+
+void GameSaveLog::sync()
+{
+    // every record appended before this point is committed by a single fsync
+    vector<Waiter> waiters;
+    FILE *file;
+    bool fail;
+    {
+        ScopedLock lock(mutex_);
+        waiters.swap(waiters_);
+        file = active_;
+        fail = fail_;
+    }
+
+    if (waiters.empty())
+    {
+        return;
+    }
+
+    bool success = !fail && file && syncFile(file);
+
+    for (size_t i = 0; i < waiters.size(); i++)
+    {
+        *waiters[i].success = success;
+        waiters[i].committed->set();
+    }
+
+    bool roll;
+    size_t sealedSize = 0, sealedLiveSize = 0;
+    {
+        ScopedLock lock(mutex_);
+        roll = !fail_ && activeSize_ >= SAVE_LOG_SEGMENT_SIZE;
+
+        for (size_t i = 0; i + 1 < segments_.size(); i++)
+        {
+            sealedSize += segmentSizes_[segments_[i]];
+            sealedLiveSize += liveSizes_[segments_[i]];
+        }
+    }
+
+    if (roll)
+    {
+        rollSegment();
+    }
+
+    // compact the older segments once most of their records have been replaced
+    if (sealedSize - sealedLiveSize > sealedSize / 2)
+    {
+        compact();
+    }
+}
+
+void GameSaveLog::rollSegment()
+{
+    ScopedLock lock(mutex_);
+
+    // records appended since sync() looked at the waiters are still waiting to be committed
+    if (!syncFile(active_))
+    {
+        fail_ = true;
+    }
+    fclose(active_);
+    active_ = NULL;
+
+    segments_.push_back(segments_.back() + 1);
+    activeSize_ = 0;
+
+    if (!writeManifest() || !openSegment(segments_.back()))
+    {
+        fail_ = true;
+    }
+}
+
+bool GameSaveLog::compareRecordPos(const pair<RecordKey, RecordPos> &a, const pair<RecordKey, RecordPos> &b)
+{
+    if (a.second.segment != b.second.segment)
+    {
+        return a.second.segment < b.second.segment;
+    }
+    return a.second.offset < b.second.offset;
+}
+
+/* Copies the records in the index that are in the older segments into a new segment,
+ * which replaces the newest of the older segments. The older segments are immutable,
+ * so they are read without holding the lock; records that are replaced while this is
+ * in progress are left in the new segment, but not in the index.
+ */
+void GameSaveLog::compact()
+{
+    vector<int> sealed;
+    vector<pair<RecordKey, RecordPos> > records;
+    {
+        ScopedLock lock(mutex_);
+        sealed.assign(segments_.begin(), segments_.end() - 1);
+
+        for (map<RecordKey, RecordPos>::const_iterator it = index_.begin(); it != index_.end(); ++it)
+        {
+            if (it->second.segment != segments_.back())
+            {
+                records.push_back(*it);
+            }
+        }
+    }
+
+    if (sealed.empty())
+    {
+        return;
+    }
+
+    sort(records.begin(), records.end(), compareRecordPos);
+
+    int target = sealed.back();
+    string tempPath = segmentPath(target) + ".tmp";
+
+    FILE *out = fopen(tempPath.c_str(), "wb");
+    if (!out)
+    {
+        return;
+    }
+
+    vector<RecordPos> newPositions;
+    ifstream in;
+    int inSegment = -1;
+    long offset = 0;
+    bool success = true;
+
+    for (size_t i = 0; i < records.size() && success; i++)
+    {
+        const RecordPos &pos = records[i].second;
+        if (pos.segment != inSegment)
+        {
+            in.close();
+            in.clear();
+            in.open(segmentPath(pos.segment).c_str(), ios::binary | ios::in);
+            inSegment = pos.segment;
+        }
+
+        string record(pos.size, '\0');
+        in.seekg(pos.offset);
+        in.read(&record[0], pos.size);
+
+        success = !in.fail() && fwrite(record.data(), 1, record.size(), out) == record.size();
+
+        RecordPos newPos;
+        newPos.segment = target;
+        newPos.offset = offset;
+        newPos.size = pos.size;
+        newPositions.push_back(newPos);
+        offset += (long)pos.size;
+    }
+    in.close();
+
+    success = syncFile(out) && success;
+    fclose(out);
+
+    ScopedLock lock(mutex_);
+
+    if (!success || !replaceFile(tempPath, segmentPath(target)))
+    {
+        remove(tempPath.c_str());
+        return;
+    }
+
+    for (size_t i = 0; i < sealed.size(); i++)
+    {
+        liveSizes_.erase(sealed[i]);
+        segmentSizes_.erase(sealed[i]);
+    }
+    segmentSizes_[target] = offset;
+
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        RecordPos &pos = index_[records[i].first];
+        const RecordPos &oldPos = records[i].second;
+        if (pos.segment == oldPos.segment && pos.offset == oldPos.offset)
+        {
+            pos = newPositions[i];
+            liveSizes_[target] += pos.size;
+        }
+    }
+
+    segments_.erase(segments_.begin(), segments_.end() - 2);
+    writeManifest();
+
+    for (size_t i = 0; i + 1 < sealed.size(); i++)
+    {
+        remove(segmentPath(sealed[i]).c_str());
+    }
+}
+
+bool LogSaveStore::save(const string &name, const SaveData &data)
+{
+    ostringstream out(ios::out | ios::binary);
+    return data.write(out) && log_->append(session_, name, out.str());
+}
+
+bool LogSaveStore::load(const string &name, SaveData &data)
+{
+    string record;
+    if (!log_->find(session_, name, record))
+    {
+        return false;
+    }
+
+    istringstream in(record, ios::in | ios::binary);
+    return data.read(in);
+}
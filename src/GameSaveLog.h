@@ -0,0 +1,115 @@
+#ifndef _GAME_SAVE_LOG_H_
+#define _GAME_SAVE_LOG_H_
+
+#include "GameSave.h"
+#include "CraneaThread.h"
+#include <cstdio>
+
+#ifndef SAVE_LOG_SEGMENT_SIZE
+#define SAVE_LOG_SEGMENT_SIZE (4 * 1024 * 1024)
+#endif
+
+/* GameSaveLog
+ * ===========
+ * Keeps the saved games of many sessions in one append-only log, as an alternative to
+ * creating a .crs file per saved game. Each record holds one saved game, identified by
+ * session and save name; a newer record for the same session and name replaces the older
+ * one. The position of the newest record of each saved game is kept in an index in memory,
+ * which is rebuilt by scanning the log when it is opened.
+ *
+ * The log is split into segment files (<path>.000001, <path>.000002, ...), listed in a
+ * manifest file at <path>. Records are only appended to the newest segment. When the older
+ * segments are mostly made of replaced records, they are compacted into a single segment
+ * that holds only the records that are still current.
+ *
+ * append() returns once the record is on disk. Records are synced by a background thread,
+ * so records appended by many sessions while a sync is in progress are all committed by
+ * the next fsync.
+ */
+class GameSaveLog
+{
+public:
+    GameSaveLog(const std::string &path);
+    ~GameSaveLog();
+
+    bool fail() { return fail_; }
+
+    bool append(const std::string &session, const std::string &name, const std::string &data);
+    bool find(const std::string &session, const std::string &name, std::string &data);
+
+private:
+    GameSaveLog(const GameSaveLog &);
+    GameSaveLog &operator=(const GameSaveLog &);
+
+    typedef std::pair<std::string, std::string> RecordKey; // (session, save name)
+
+    struct RecordPos
+    {
+        int segment;
+        long offset;
+        size_t size;
+    };
+
+    struct Waiter
+    {
+        Event *committed;
+        bool *success;
+    };
+
+    std::string segmentPath(int segment);
+    bool readManifest();
+    bool writeManifest();
+
+    // adds the records in a segment to the index, and sets end to the end of the last complete record.
+    // returns false if the segment ends with an incomplete record.
+    bool scanSegment(int segment, long &end);
+    void indexRecord(const RecordKey &key, const RecordPos &pos);
+
+    bool openSegment(int segment);
+
+    // called on the sync thread
+    static void run(void *self);
+    void sync();
+    void rollSegment();
+    void compact();
+
+    static bool compareRecordPos(const std::pair<RecordKey, RecordPos> &a, const std::pair<RecordKey, RecordPos> &b);
+
+    std::string path_;
+
+    Thread syncThread_;
+    Event syncNeeded_;
+
+    Mutex mutex_; // protects everything below
+    bool fail_;
+    bool stopping_;
+
+    std::vector<int> segments_; // oldest first. records are appended to segments_.back()
+    FILE *active_;
+    long activeSize_;
+
+    std::map<RecordKey, RecordPos> index_;
+    std::map<int, size_t> segmentSizes_;
+    std::map<int, size_t> liveSizes_; // total size of the records in each segment that are in the index
+
+    std::vector<Waiter> waiters_; // appends that haven't been synced yet
+};
+
+/* LogSaveStore
+ * ============
+ * The saved games of one session in a GameSaveLog.
+ */
+class LogSaveStore : public GameSaveStore
+{
+public:
+    LogSaveStore(GameSaveLog &log, const std::string &session) : log_(&log), session_(session) {}
+
+    virtual bool save(const std::string &name, const SaveData &data);
+    virtual bool load(const std::string &name, SaveData &data);
+
+private:
+    GameSaveLog *log_;
+    std::string session_;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "GameScheduler.h"
+
+#ifdef WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h> // for GetTickCount
+#else
+#include <time.h> // for clock_gettime
+#endif
+
+using namespace std;
+
+void GameScheduler::add(OutputBuffer &buffer, Wait wait, unsigned int delay)
+{
+    if (buffer.empty() && wait == WaitNone)
+    {
+        return;
+    }
+
+    chunks_.push_back(Chunk());
+    Chunk &chunk = chunks_.back();
+    buffer.moveTo(chunk.text);
+    chunk.wait = wait;
+    chunk.delay = delay;
+
+    if (state_ == Idle)
+    {
+        state_ = Ready;
+    }
+}
+
+GameScheduler::State GameScheduler::deliver(OutputSink &sink)
+{
+    unsigned long cur = now();
+
+    if (state_ == Delayed && (long)(cur - due_) >= 0)
+    {
+        state_ = Ready;
+    }
+
+    while (state_ == Ready)
+    {
+        if (chunks_.empty())
+        {
+            state_ = Idle;
+            break;
+        }
+
+        Chunk &chunk = chunks_.front();
+        if (!chunk.text.empty())
+        {
+            sink.write(chunk.text.data(), chunk.text.size());
+        }
+
+        if (chunk.wait == WaitInput)
+        {
+            state_ = AwaitingInput;
+        }
+        else if (chunk.wait == WaitDelay)
+        {
+            state_ = Delayed;
+            due_ = cur + chunk.delay;
+        }
+        chunks_.pop_front();
+    }
+
+    return state_;
+}
+
+unsigned int GameScheduler::dueIn() const
+{
+    if (state_ != Delayed)
+    {
+        return 0;
+    }
+
+    long left = (long)(due_ - now());
+    return left > 0 ? (unsigned int)left : 0;
+}
+
+void GameScheduler::inputReceived()
+{
+    if (state_ == AwaitingInput)
+    {
+        state_ = Ready;
+    }
+}
+
+void GameScheduler::clear()
+{
+    chunks_.clear();
+    state_ = Idle;
+}
+
+unsigned long GameScheduler::now()
+{
+#ifdef WIN32
+    return GetTickCount();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
@@ -0,0 +1,72 @@
+#ifndef _GAME_SCHEDULER_H_
+#define _GAME_SCHEDULER_H_
+
+#include "GameOutput.h"
+#include <string>
+#include <deque>
+
+#define DELAY_MS 500 // the length of a {d} delay
+
+/* GameScheduler
+ * =============
+ * Delivers the output of one game session to its output sink, honoring the delays ({d})
+ * and pauses ({p}) in it. Rendering never waits: it splits the output into chunks, each
+ * of which can be followed by a delay or by a pause until the player enters a line.
+ * deliver() writes every chunk that is due and returns as soon as one has to wait, so
+ * whoever runs the session decides how to wait (sleeping until dueIn() for a single
+ * player on the console, or serving other sessions in the meantime).
+ */
+class GameScheduler
+{
+public:
+    enum Wait
+    {
+        WaitNone,
+        WaitDelay,
+        WaitInput
+    };
+
+    enum State
+    {
+        Idle,           // all output has been delivered
+        Ready,          // there is output that can be delivered now
+        Delayed,        // waiting until dueIn() milliseconds from now
+        AwaitingInput   // waiting for the player to enter a line (see inputReceived())
+    };
+
+    GameScheduler() : state_(Idle), due_(0) {}
+
+    // adds the contents of buffer (which is cleared) as a chunk that is followed by wait
+    void add(OutputBuffer &buffer, Wait wait, unsigned int delay = 0);
+
+    // writes all the chunks that are due to sink
+    State deliver(OutputSink &sink);
+
+    State state() const { return state_; }
+
+    // milliseconds until a delayed session can continue
+    unsigned int dueIn() const;
+
+    // continues after a pause
+    void inputReceived();
+
+    // forgets all output that hasn't been delivered yet
+    void clear();
+
+    // a clock in milliseconds
+    static unsigned long now();
+
+private:
+    struct Chunk
+    {
+        std::string text;
+        Wait wait;
+        unsigned int delay;
+    };
+
+    std::deque<Chunk> chunks_;
+    State state_;
+    unsigned long due_;
+};
+
+#endif
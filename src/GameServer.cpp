@@ -0,0 +1,1078 @@
+#include "GameServer.h"
+#include "GameBase.h"
+#include "GameSaveLog.h"
+#include "GameRecoveryLog.h"
+#include "GameExecutor.h"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <deque>
+#include <climits>
+#include <new>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+#define STATS_COMMAND "@stats"
+#define MAX_EVENTS 64
+
+// a call to make on a session's game
+struct GameServer::Work
+{
+    enum Type { Start, Line, Resume, EndInput, Hibernate };
+
+    Work(Type type, const std::string &line = "") : type(type), line(line) {}
+
+    Type type;
+    std::string line;
+};
+
+// collects the output of a session's game and sends it to the client as far as it can
+class GameServer::SessionSink : public OutputSink
+{
+public:
+    SessionSink(Session &session) : session_(&session) {}
+
+    virtual void write(const char *data, size_t len);
+
+private:
+    Session *session_;
+};
+
+/* The server thread owns a session, except for the members protected by its mutex, which
+ * the worker running the session's game also uses.
+ */
+class GameServer::Session
+{
+public:
+    Session(GameServer &server, unsigned int id, int fd)
+        : server(&server), id(id), worker(id), fd(fd), events(0), started(false), eof(false), timed(false), idleTimed(false),
+          in(NULL), ctx(NULL), fileSaveStore(NULL), logSaveStore(NULL), sink(*this),
+          scheduled(false), broken(false), failed(false), closed(false), status(GameContext::WaitingForInput), dueAt(0),
+          hibernating(false) {}
+
+    ~Session()
+    {
+        delete ctx;
+        delete in;
+        delete fileSaveStore;
+        delete logSaveStore;
+    }
+
+    GameServer *server;
+    unsigned int id;
+    size_t worker;          // the worker that runs the game (if it isn't stolen)
+    int fd;
+    unsigned int events;    // the epoll events that the server waits for (0 if none)
+    std::string name;
+    std::string partial;    // the start of a line of input that hasn't been completed yet
+
+    bool started;   // true once the game has been created
+    bool eof;       // true once the client has closed its end
+
+    bool timed;     // true if the session is in the server's timers
+    std::multimap<unsigned long, Session *>::iterator timer;
+    bool idleTimed; // true if the session is in the server's idle timers
+    std::multimap<unsigned long, Session *>::iterator idleTimer;
+
+    GameInput *in;
+    GameContext *ctx;
+    FileSaveStore *fileSaveStore;
+    LogSaveStore *logSaveStore;
+    SessionSink sink;
+
+    Mutex mutex; // protects everything below
+    std::deque<Work> pending;   // calls to make on the game, in order
+    bool scheduled; // true while a task for the session is queued or running
+    std::string unsent;     // output that the client wasn't ready to receive yet
+    bool broken;    // true if the client can't be sent the output
+    bool failed;    // true if the game stopped with an error
+    bool closed;
+    GameContext::Status status; // as of the last task
+    unsigned long dueAt;        // when a delayed game is due (see GameScheduler::now)
+    bool hibernating;
+};
+
+GameServer::GameServer(const GameImage &image, const string &socketPath)
+    : image_(&image), socketPath_(socketPath), saveLog_(NULL), autosaveInterval_(0), checkpointInterval_(0),
+      numWorkers_(1), hibernateMs_(0), process_(0), numProcesses_(1), listenFd_(-1), channelFd_(-1), epollFd_(-1),
+      nextSessionId_(1), numAccepted_(0), executor_(NULL)
+{
+    wakeFds_[0] = wakeFds_[1] = -1;
+}
+
+GameServer::~GameServer()
+{
+#ifndef WIN32
+    if (listenFd_ >= 0)
+    {
+        close(listenFd_);
+        unlink(socketPath_.c_str());
+    }
+    if (channelFd_ >= 0)
+    {
+        close(channelFd_);
+    }
+    if (epollFd_ >= 0)
+    {
+        close(epollFd_);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (wakeFds_[i] >= 0)
+        {
+            close(wakeFds_[i]);
+        }
+    }
+#endif
+}
+
+#ifdef WIN32
+
+void GameServer::SessionSink::write(const char *data, size_t len)
+{
+}
+
+bool GameServer::run()
+{
+    cerr << "The server is not supported on this platform." << endl;
+    return false;
+}
+
+bool GameServer::runProcess(int channelFd, size_t process, size_t numProcesses)
+{
+    return false;
+}
+
+void GameServer::stop()
+{
+}
+
+#else
+
+bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/* Sends as much of data as the socket takes without blocking. Returns the number of bytes
+ * sent, or -1 if the client can't be sent anything anymore.
+ */
+static ssize_t sendSome(int fd, const char *data, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t res = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        sent += res;
+    }
+    return (ssize_t)sent;
+}
+
+void GameServer::SessionSink::write(const char *data, size_t len)
+{
+    Session *session = session_;
+    ScopedLock lock(session->mutex);
+    if (session->closed || session->broken)
+    {
+        return;
+    }
+
+    if (session->unsent.empty())
+    {
+        ssize_t sent = sendSome(session->fd, data, len);
+        if (sent < 0)
+        {
+            session->broken = true;
+            return;
+        }
+        data += sent;
+        len -= sent;
+    }
+
+    // the rest is sent when the socket is writable (see GameServer::writeOutput)
+    session->unsent.append(data, len);
+    if (session->unsent.size() > SERVER_MAX_UNSENT)
+    {
+        session->broken = true;
+    }
+}
+
+int listenOnSocket(const string &path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        cerr << "Socket path " << path << " is too long." << endl;
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        cerr << "Error creating socket: " << strerror(errno) << endl;
+        return -1;
+    }
+
+    // a socket left over from a server that didn't exit cleanly
+    unlink(path.c_str());
+
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0 || !setNonBlocking(fd))
+    {
+        cerr << "Error listening on " << path << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// creates the wake pipe and the epoll set, and adds fd (the listening socket or the channel) to it
+bool GameServer::prepare(int fd)
+{
+    if (pipe(wakeFds_) != 0 || !setNonBlocking(wakeFds_[0]) || !setNonBlocking(wakeFds_[1]))
+    {
+        cerr << "Error creating pipe: " << strerror(errno) << endl;
+        return false;
+    }
+
+    epollFd_ = epoll_create(MAX_EVENTS);
+    if (epollFd_ < 0)
+    {
+        cerr << "Error creating epoll: " << strerror(errno) << endl;
+        return false;
+    }
+
+    // the listening socket (or channel) and the wake pipe are told apart from sessions by a NULL ptr
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) != 0
+        || epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFds_[0], &ev) != 0)
+    {
+        cerr << "Error adding socket to epoll: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+bool GameServer::run()
+{
+    listenFd_ = listenOnSocket(socketPath_);
+    if (listenFd_ < 0 || !prepare(listenFd_))
+    {
+        return false;
+    }
+    return serve();
+}
+
+bool GameServer::runProcess(int channelFd, size_t process, size_t numProcesses)
+{
+    channelFd_ = channelFd;
+    process_ = process;
+    numProcesses_ = numProcesses;
+    if (!setNonBlocking(channelFd_) || !prepare(channelFd_))
+    {
+        return false;
+    }
+    return serve();
+}
+
+bool GameServer::serve()
+{
+    executor_ = new GameExecutor(numWorkers_);
+
+    bool stopping = false;
+    while (!stopping)
+    {
+        epoll_event events[MAX_EVENTS];
+        int numEvents = epoll_wait(epollFd_, events, MAX_EVENTS, nextTimeout());
+        if (numEvents < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            cerr << "Error waiting for input: " << strerror(errno) << endl;
+            break;
+        }
+
+        bool woken = false;
+        for (int i = 0; i < numEvents; i++)
+        {
+            Session *session = (Session *)events[i].data.ptr;
+            if (!session)
+            {
+                woken = true;
+                continue;
+            }
+
+            unsigned int ev = events[i].events;
+            if (!session->closed && (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                writeOutput(session);
+            }
+            if (!session->closed && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            {
+                readInput(session);
+            }
+        }
+
+        runTimers();
+
+        // the listening socket (or channel) and the wake pipe are all checked whenever one is ready
+        if (woken)
+        {
+            char buf[64];
+            ssize_t len;
+            while ((len = read(wakeFds_[0], buf, sizeof(buf))) > 0)
+            {
+                stopping = stopping || memchr(buf, 's', len) != NULL;
+            }
+            updateSessions();
+            if (listenFd_ >= 0)
+            {
+                acceptSessions();
+            }
+            else if (!receiveSessions())
+            {
+                // the master process has stopped
+                stopping = true;
+            }
+        }
+
+        deleteClosedSessions();
+    }
+
+    for (map<unsigned int, Session *>::iterator it = sessions_.begin(); it != sessions_.end(); ++it)
+    {
+        if (it->second->started)
+        {
+            // the rest of the output is sent if the socket takes it; delays are cut short
+            addWork(it->second, Work(Work::EndInput));
+        }
+    }
+
+    // waits for the games to end
+    delete executor_;
+    executor_ = NULL;
+
+    map<unsigned int, Session *> sessions = sessions_;
+    for (map<unsigned int, Session *>::iterator it = sessions.begin(); it != sessions.end(); ++it)
+    {
+        closeSession(it->second);
+    }
+    deleteClosedSessions();
+    return true;
+}
+
+void GameServer::stop()
+{
+    char ch = 's';
+    if (write(wakeFds_[1], &ch, 1) < 0)
+    {
+        // the pipe is full, so the server will wake up anyway
+        return;
+    }
+}
+
+void GameServer::acceptSessions()
+{
+    while (true)
+    {
+        int fd = accept(listenFd_, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            return;
+        }
+
+        if (!setNonBlocking(fd))
+        {
+            close(fd);
+            continue;
+        }
+
+        Session *session = new Session(*this, ++numAccepted_, fd);
+        sessions_[session->id] = session;
+        watch(session);
+    }
+}
+
+/* Takes the connections that the master process has handed to this process, each with
+ * the input that the master read from it. Returns false once the master has closed the
+ * channel.
+ */
+bool GameServer::receiveSessions()
+{
+    char buf[SERVER_MAX_HANDOFF];
+    while (true)
+    {
+        iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+
+        char control[CMSG_SPACE(sizeof(int))];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t len = recvmsg(channelFd_, &msg, 0);
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return true;
+        }
+        if (len <= 0)
+        {
+            return false;
+        }
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+        if (!setNonBlocking(fd))
+        {
+            close(fd);
+            continue;
+        }
+
+        Session *session = new Session(*this, ++numAccepted_, fd);
+        sessions_[session->id] = session;
+        watch(session);
+        addInput(session, buf, len);
+    }
+}
+
+void GameServer::readInput(Session *session)
+{
+    char buf[4096];
+    while (!session->closed)
+    {
+        ssize_t len = recv(session->fd, buf, sizeof(buf), 0);
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (len <= 0)
+        {
+            // a last line without a newline still counts
+            if (!session->partial.empty())
+            {
+                string line;
+                line.swap(session->partial);
+                if (!addLine(session, line))
+                {
+                    return;
+                }
+            }
+
+            session->eof = true;
+            if (!session->started)
+            {
+                closeSession(session);
+                return;
+            }
+            addWork(session, Work(Work::EndInput));
+            watch(session);
+            return;
+        }
+
+        if (!addInput(session, buf, len))
+        {
+            return;
+        }
+    }
+}
+
+// splits input into lines for the session's game. returns false if the session was closed instead.
+bool GameServer::addInput(Session *session, const char *buf, size_t len)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (buf[i] == '\n')
+        {
+            string line = session->partial;
+            line.append(buf + start, i - start);
+            session->partial.clear();
+            start = i + 1;
+
+            if (!line.empty() && line[line.size() - 1] == '\r')
+            {
+                line.erase(line.size() - 1);
+            }
+            if (!addLine(session, line))
+            {
+                return false;
+            }
+        }
+    }
+    session->partial.append(buf + start, len - start);
+
+    if (session->partial.size() > SERVER_MAX_LINE)
+    {
+        closeSession(session);
+        return false;
+    }
+    return true;
+}
+
+/* Passes a line of input to the session's game, creating the game with the first line.
+ * Returns false if the session was closed instead.
+ */
+bool GameServer::addLine(Session *session, const string &line)
+{
+    if (session->started)
+    {
+        addWork(session, Work(Work::Line, line));
+        return true;
+    }
+
+    if (line == STATS_COMMAND)
+    {
+        writeStats(session);
+        closeSession(session);
+        return false;
+    }
+
+    if (line.compare(0, strlen(SESSION_COMMAND), SESSION_COMMAND) == 0)
+    {
+        string name = line.substr(strlen(SESSION_COMMAND));
+        bool ok = !name.empty();
+        for (size_t i = 0; i < name.size(); i++)
+        {
+            ok = ok && isOkFilenameChar(name[i]);
+        }
+
+        string error;
+        if (!ok)
+        {
+            error = "Invalid session name.\n";
+        }
+        else if (sessionNames_.count(name))
+        {
+            error = "Session " + name + " is already in progress.\n";
+        }
+
+        if (!error.empty())
+        {
+            session->sink.write(error.data(), error.size());
+            closeSession(session);
+            return false;
+        }
+
+        session->name = name;
+        return startSession(session);
+    }
+
+    // an unnamed session; the line is the first command. the name belongs to this
+    // process, so that no other process can give it to a session too.
+    do
+    {
+        ostringstream name;
+        name << "session" << nextSessionId_++;
+        session->name = name.str();
+    }
+    while (sessionNames_.count(session->name) || sessionProcess(session->name, numProcesses_) != process_);
+
+    if (!startSession(session))
+    {
+        return false;
+    }
+    return addLine(session, line);
+}
+
+/* The worker process that plays the sessions with the given name, so that a player who
+ * reconnects finds the session (and its recovery log) where it was.
+ */
+size_t GameServer::sessionProcess(const string &name, size_t numProcesses)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < name.size(); i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash % numProcesses;
+}
+
+bool GameServer::startSession(Session *session)
+{
+    sessionNames_.insert(session->name);
+
+    session->in = new GameInput(*image_);
+    GameContext *ctx = session->ctx = new GameContext(*session->in);
+    session->started = true;
+
+    ctx->setOutputSink(session->sink);
+    if (saveLog_)
+    {
+        session->logSaveStore = new LogSaveStore(*saveLog_, session->name);
+        ctx->setSaveStore(*session->logSaveStore);
+    }
+    else
+    {
+        session->fileSaveStore = new FileSaveStore(session->name + "-");
+        ctx->setSaveStore(*session->fileSaveStore);
+    }
+    ctx->setAutosave(autosaveInterval_, AUTOSAVE_NAME);
+    if (checkpointInterval_)
+    {
+        ctx->setRecoveryLog(session->name + RECOVERY_LOG_EXTENSION, checkpointInterval_);
+    }
+
+    addWork(session, Work(Work::Start));
+    return true;
+}
+
+// sends the client the queues of the workers, one line per worker
+void GameServer::writeStats(Session *session)
+{
+    vector<GameExecutor::Stats> stats;
+    executor_->getStats(stats);
+
+    size_t numHibernating = 0;
+    for (map<unsigned int, Session *>::iterator it = sessions_.begin(); it != sessions_.end(); ++it)
+    {
+        ScopedLock lock(it->second->mutex);
+        numHibernating += it->second->hibernating;
+    }
+
+    ostringstream out;
+    out << "sessions " << sessions_.size() << ", hibernating " << numHibernating << "\n";
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        out << "worker " << i << ": queued " << stats[i].queued << ", max queued " << stats[i].maxQueued
+            << ", ran " << stats[i].ran << ", stolen " << stats[i].stolen << "\n";
+    }
+    string str = out.str();
+    session->sink.write(str.data(), str.size());
+}
+
+// queues a call to the session's game, and a task to make it if the session has none
+void GameServer::addWork(Session *session, const Work &work)
+{
+    if (work.type != Work::Hibernate)
+    {
+        // the session is busy again
+        cancelIdleTimer(session);
+    }
+
+    ScopedLock lock(session->mutex);
+    if (session->closed)
+    {
+        return;
+    }
+
+    session->pending.push_back(work);
+    if (!session->scheduled)
+    {
+        session->scheduled = true;
+        executor_->submit(&GameServer::runSession, session, session->worker);
+    }
+}
+
+/* Makes the next call queued for a session, on one of the executor's workers. Only one
+ * task for a session is queued or running at a time, so the calls are made in order.
+ */
+void GameServer::runSession(void *arg)
+{
+    Session *session = (Session *)arg;
+    GameServer *server = session->server;
+    unsigned int id = session->id;
+
+    Work work(Work::Start);
+    bool skip;
+    {
+        ScopedLock lock(session->mutex);
+        work = session->pending.front();
+        session->pending.pop_front();
+        skip = session->closed || session->failed;
+    }
+
+    GameContext *ctx = session->ctx;
+    bool failed = false;
+    if (!skip)
+    {
+        try
+        {
+            switch (work.type)
+            {
+            case Work::Start:
+                ctx->start();
+                break;
+            case Work::Line:
+                ctx->submitLine(work.line);
+                break;
+            case Work::Resume:
+                ctx->resume();
+                break;
+            case Work::EndInput:
+                ctx->endInput();
+                break;
+            case Work::Hibernate:
+                ctx->hibernate();
+                break;
+            }
+        }
+        catch (const char *err)
+        {
+            // a broken data file ends this session, not the server
+            cerr << "Session " << session->name << ": " << err << endl;
+            failed = true;
+        }
+        catch (const bad_alloc &)
+        {
+            cerr << "Session " << session->name << ": out of memory" << endl;
+            failed = true;
+        }
+        catch (const exception &ex)
+        {
+            cerr << "Session " << session->name << ": " << ex.what() << endl;
+            failed = true;
+        }
+        catch (...)
+        {
+            // nothing may leave a worker, since that would end every session
+            cerr << "Session " << session->name << ": unexpected error" << endl;
+            failed = true;
+        }
+    }
+
+    {
+        ScopedLock lock(session->mutex);
+        if (!skip)
+        {
+            session->failed = session->failed || failed;
+            session->status = ctx->status();
+            session->dueAt = GameScheduler::now() + ctx->scheduler().dueIn();
+            session->hibernating = ctx->isHibernating();
+        }
+
+        if (!session->pending.empty())
+        {
+            // the next call is another task, so that a session with a lot of input
+            // takes turns with the other sessions on its worker
+            server->executor_->submit(&GameServer::runSession, session, session->worker);
+        }
+        else
+        {
+            // the server may delete the session from here on
+            session->scheduled = false;
+        }
+    }
+    server->sessionRan(id);
+}
+
+// tells the server thread to look at a session once its task has run
+void GameServer::sessionRan(unsigned int id)
+{
+    bool wake;
+    {
+        ScopedLock lock(ranMutex_);
+        wake = ran_.empty();
+        ran_.push_back(id);
+    }
+
+    char ch = 'r';
+    if (wake && write(wakeFds_[1], &ch, 1) < 0)
+    {
+        // the pipe is full, so the server will wake up anyway
+        return;
+    }
+}
+
+// looks at the sessions whose tasks have run (after the wake pipe has been emptied)
+void GameServer::updateSessions()
+{
+    vector<unsigned int> ran;
+    {
+        ScopedLock lock(ranMutex_);
+        ran.swap(ran_);
+    }
+
+    for (size_t i = 0; i < ran.size(); i++)
+    {
+        map<unsigned int, Session *>::iterator it = sessions_.find(ran[i]);
+        if (it != sessions_.end())
+        {
+            update(it->second);
+        }
+    }
+}
+
+// keeps track of what the session's game is waiting for, after the game has run
+void GameServer::update(Session *session)
+{
+    bool scheduled, broken, unsent, hibernating;
+    GameContext::Status status;
+    unsigned long dueAt;
+    {
+        ScopedLock lock(session->mutex);
+        scheduled = session->scheduled;
+        broken = session->broken || session->failed;
+        unsent = !session->unsent.empty();
+        status = session->status;
+        dueAt = session->dueAt;
+        hibernating = session->hibernating;
+    }
+
+    if (broken)
+    {
+        closeSession(session);
+        return;
+    }
+
+    // a session with more work to do is looked at again once that is done
+    if (!scheduled)
+    {
+        if (session->timed)
+        {
+            timers_.erase(session->timer);
+            session->timed = false;
+        }
+
+        switch (status)
+        {
+        case GameContext::Delayed:
+            session->timer = timers_.insert(make_pair(dueAt, session));
+            session->timed = true;
+            break;
+        case GameContext::WaitingForInput:
+            cancelIdleTimer(session);
+            if (hibernateMs_ && !hibernating)
+            {
+                session->idleTimer = idleTimers_.insert(make_pair(GameScheduler::now() + hibernateMs_, session));
+                session->idleTimed = true;
+            }
+            break;
+        case GameContext::Ended:
+            if (!unsent)
+            {
+                closeSession(session);
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    watch(session);
+}
+
+void GameServer::writeOutput(Session *session)
+{
+    bool ended;
+    {
+        ScopedLock lock(session->mutex);
+        if (!session->unsent.empty())
+        {
+            ssize_t sent = sendSome(session->fd, session->unsent.data(), session->unsent.size());
+            if (sent < 0)
+            {
+                session->broken = true;
+            }
+            else
+            {
+                session->unsent.erase(0, sent);
+            }
+        }
+
+        ended = session->broken || (session->unsent.empty() && session->started && !session->scheduled
+            && session->status == GameContext::Ended);
+    }
+
+    if (ended)
+    {
+        closeSession(session);
+        return;
+    }
+    watch(session);
+}
+
+// waits for input until the client closes its end, and for the socket to be writable while there is unsent output
+void GameServer::watch(Session *session)
+{
+    bool unsent;
+    {
+        ScopedLock lock(session->mutex);
+        unsent = !session->unsent.empty();
+    }
+
+    unsigned int events = (session->eof ? 0u : (unsigned int)EPOLLIN) | (unsent ? (unsigned int)EPOLLOUT : 0u);
+    if (events == session->events)
+    {
+        return;
+    }
+
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = session;
+
+    int op = !session->events ? EPOLL_CTL_ADD : (events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+    if (epoll_ctl(epollFd_, op, session->fd, &ev) != 0)
+    {
+        closeSession(session);
+        return;
+    }
+    session->events = events;
+}
+
+// resumes the sessions whose delays are over
+void GameServer::runTimers()
+{
+    unsigned long now = GameScheduler::now();
+    while (!timers_.empty() && (long)(timers_.begin()->first - now) <= 0)
+    {
+        Session *session = timers_.begin()->second;
+        timers_.erase(timers_.begin());
+        session->timed = false;
+
+        addWork(session, Work(Work::Resume));
+    }
+
+    while (!idleTimers_.empty() && (long)(idleTimers_.begin()->first - now) <= 0)
+    {
+        Session *session = idleTimers_.begin()->second;
+        idleTimers_.erase(idleTimers_.begin());
+        session->idleTimed = false;
+
+        addWork(session, Work(Work::Hibernate));
+    }
+}
+
+void GameServer::cancelIdleTimer(Session *session)
+{
+    if (session->idleTimed)
+    {
+        idleTimers_.erase(session->idleTimer);
+        session->idleTimed = false;
+    }
+}
+
+// milliseconds until the next delay is over or the next idle session hibernates (-1 if there is none)
+int GameServer::nextTimeout()
+{
+    if (timers_.empty() && idleTimers_.empty())
+    {
+        return -1;
+    }
+
+    unsigned long now = GameScheduler::now();
+    long left = timers_.empty() ? LONG_MAX : (long)(timers_.begin()->first - now);
+    if (!idleTimers_.empty())
+    {
+        long idleLeft = (long)(idleTimers_.begin()->first - now);
+        left = idleLeft < left ? idleLeft : left;
+    }
+    return left > 0 ? (int)left : 0;
+}
+
+void GameServer::closeSession(Session *session)
+{
+    {
+        // the session's worker stops sending its output before the socket is closed
+        ScopedLock lock(session->mutex);
+        if (session->closed)
+        {
+            return;
+        }
+        session->closed = true;
+    }
+
+    if (session->events)
+    {
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, session->fd, NULL);
+        session->events = 0;
+    }
+    if (session->timed)
+    {
+        timers_.erase(session->timer);
+        session->timed = false;
+    }
+    cancelIdleTimer(session);
+
+    // the name is released by deleteClosedSessions, once the game has stopped using its files
+    sessions_.erase(session->id);
+    close(session->fd);
+    closed_.push_back(session);
+}
+
+/* Deletes the closed sessions that have no task left (and their games, which keeps their
+ * recovery logs if they didn't end normally), and releases their names. Until then, a new
+ * session can't take the name and play the same saved games and recovery log at once.
+ */
+void GameServer::deleteClosedSessions()
+{
+    vector<Session *> running;
+    for (size_t i = 0; i < closed_.size(); i++)
+    {
+        bool scheduled;
+        {
+            ScopedLock lock(closed_[i]->mutex);
+            scheduled = closed_[i]->scheduled;
+        }
+
+        if (scheduled)
+        {
+            running.push_back(closed_[i]);
+        }
+        else
+        {
+            if (closed_[i]->started)
+            {
+                sessionNames_.erase(closed_[i]->name);
+            }
+            delete closed_[i];
+        }
+    }
+    closed_.swap(running);
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef _GAME_SERVER_H_
+#define _GAME_SERVER_H_
+
+#include "GameInput.h"
+#include "CraneaThread.h"
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+
+#define SERVER_MAX_LINE 4096            // longer lines of input end the session
+#define SERVER_MAX_UNSENT (1 << 20)     // so does falling this far behind in reading the output
+#define SERVER_MAX_HANDOFF (2 * SERVER_MAX_LINE) // the most input a master process reads before handing off a session
+
+#define SESSION_COMMAND "@session "
+
+class GameSaveLog;
+class GameExecutor;
+
+/* GameServer
+ * ==========
+ * Plays many games at once over a Unix-domain socket, all reading from one GameImage.
+ * Each connection is a session with its own GameContext. The protocol is line based:
+ * the client sends commands, one per line, and receives the game's output as it is
+ * written. The first line may be "@session NAME" to name the session (otherwise the
+ * server picks a name); the name keeps the session's saved games apart from the others
+ * and lets a reconnecting player recover a game that was cut off (see setRecoveryLog).
+ *
+ * One thread waits on all the sockets with epoll and hands the sessions' work (each line
+ * of input, see GameContext::submitLine, and resuming a game whose delay is over) to a
+ * pool of workers (see GameExecutor). Each session runs on the same worker every time,
+ * one command per task, so a slow command (such as one that decrypts a large file) only
+ * holds up the sessions queued behind it until an idle worker steals them. A session
+ * that is waiting for its player holds no thread, so idle sessions cost only their
+ * memory. Output that a client isn't ready to receive is kept until its socket is
+ * writable again.
+ *
+ * A session that has been waiting for its player for a while can hibernate (see
+ * setHibernate), so that the memory of the server follows the active players.
+ *
+ * A first line of "@stats" gets the queue of each worker instead of a game.
+ *
+ * The server can also run in one of several worker processes behind a GameMaster, which
+ * accepts the connections and hands each one to the process that plays its session
+ * (see runProcess).
+ *
+ * Only available on Linux; run() fails elsewhere.
+ */
+class GameServer
+{
+public:
+    GameServer(const GameImage &image, const std::string &socketPath);
+    ~GameServer();
+
+    // keeps the sessions' saved games in the save log (by default, <session>-<name>.crs files)
+    void setSaveLog(GameSaveLog &log) { saveLog_ = &log; }
+
+    void setAutosave(size_t interval) { autosaveInterval_ = interval; }
+
+    // logs the input of each session to <session>.crr (see GameContext::setRecoveryLog)
+    void setRecoveryLog(size_t checkpointInterval) { checkpointInterval_ = checkpointInterval; }
+
+    // the number of threads that run the games (1 by default)
+    void setWorkers(size_t numWorkers) { numWorkers_ = numWorkers; }
+
+    // hibernates the games that have waited for a command for idleMs milliseconds (0 never does)
+    // (see GameContext::hibernate)
+    void setHibernate(unsigned long idleMs) { hibernateMs_ = idleMs; }
+
+    // serves sessions until stop() is called. returns false if the socket can't be opened.
+    bool run();
+
+    /* Serves the sessions that the master process hands over the channel (a Unix socket,
+     * see GameMaster), as worker process number process of numProcesses, until the
+     * master closes the channel or stop() is called.
+     */
+    bool runProcess(int channelFd, size_t process, size_t numProcesses);
+
+    // makes run() return, ending the games in progress as if their players had left.
+    // safe to call from another thread or from a signal handler.
+    void stop();
+
+    static size_t sessionProcess(const std::string &name, size_t numProcesses);
+
+private:
+    GameServer(const GameServer &);
+    GameServer &operator=(const GameServer &);
+
+    class Session;
+    class SessionSink;
+    struct Work;
+
+    bool prepare(int fd);
+    bool serve();
+    void acceptSessions();
+    bool receiveSessions();
+    void readInput(Session *session);
+    bool addInput(Session *session, const char *buf, size_t len);
+    bool addLine(Session *session, const std::string &line);
+    bool startSession(Session *session);
+    void writeStats(Session *session);
+    void addWork(Session *session, const Work &work);
+    static void runSession(void *arg);
+    void sessionRan(unsigned int id);
+    void updateSessions();
+    void update(Session *session);
+    void writeOutput(Session *session);
+    void watch(Session *session);
+    void runTimers();
+    void cancelIdleTimer(Session *session);
+    int nextTimeout();
+    void closeSession(Session *session);
+    void deleteClosedSessions();
+
+    const GameImage *image_;
+    std::string socketPath_;
+    GameSaveLog *saveLog_;
+    size_t autosaveInterval_;
+    size_t checkpointInterval_;
+    size_t numWorkers_;
+    unsigned long hibernateMs_;
+    size_t process_;
+    size_t numProcesses_;
+
+    int listenFd_;
+    int channelFd_; // instead of listenFd_ in a worker process
+    int epollFd_;
+    int wakeFds_[2]; // a pipe that wakes up the server (see stop() and sessionRan())
+    unsigned int nextSessionId_;
+    unsigned int numAccepted_; // also the id of the last session accepted
+    GameExecutor *executor_;
+
+    std::map<unsigned int, Session *> sessions_; // by id
+    std::set<std::string> sessionNames_;
+    std::multimap<unsigned long, Session *> timers_; // delayed sessions, by the time they are due
+    std::multimap<unsigned long, Session *> idleTimers_; // sessions waiting for a command, by the time they hibernate
+    std::vector<Session *> closed_; // deleted once the events and the tasks that refer to them are done
+
+    Mutex ranMutex_; // protects ran_
+    std::vector<unsigned int> ran_; // sessions whose tasks have run since the server last looked
+};
+
+// opens a Unix-domain socket at path for connections (returns -1 if it can't)
+int listenOnSocket(const std::string &path);
+
+bool setNonBlocking(int fd);
+
+#endif
@@ -0,0 +1,255 @@
+#include "GameTemplate.h"
+#include "CraneaBase.h"
+
+using namespace std;
+
+static void trim(string &str)
+{
+    size_t start = str.find_first_not_of(' ');
+    if (start != string::npos)
+    {
+        str = str.substr(start, str.find_last_not_of(' ') - start + 1);
+    }
+    else
+    {
+        str = "";
+    }
+}
+
+static void splitVariable(const string &var, string &first, string &rest)
+{
+    size_t dot = var.find('.');
+    if (dot == string::npos)
+    {
+        first = var;
+        rest = "";
+    }
+    else
+    {
+        first = var.substr(0, dot);
+        rest = var.substr(dot + 1);
+    }
+}
+
+// returns false for variables that don't print anything
+static bool lookupVariable(const string &var, GameTemplate::Op &op)
+{
+    if (var == "d")
+    {
+        op = GameTemplate::OpDelay;
+    }
+    else if (var == "p")
+    {
+        op = GameTemplate::OpPause;
+    }
+    else if (var == "cmd")
+    {
+        op = GameTemplate::OpCommand;
+    }
+    else if (var == "args")
+    {
+        op = GameTemplate::OpArgs;
+    }
+    else if (var == "s")
+    {
+        op = GameTemplate::OpSpace;
+    }
+    else if (var == "br")
+    {
+        op = GameTemplate::OpBreak;
+    }
+    else if (var == "time")
+    {
+        op = GameTemplate::OpTime;
+    }
+    else
+    {
+        string first, rest;
+        splitVariable(var, first, rest);
+
+        if (first != "location")
+        {
+            return false;
+        }
+
+        if (rest == "title")
+        {
+            op = GameTemplate::OpLocationTitle;
+        }
+        else if (rest == "desc")
+        {
+            op = GameTemplate::OpLocationDesc;
+        }
+        else if (rest == "gid")
+        {
+            op = GameTemplate::OpLocationGid;
+        }
+        else if (rest == "prompt")
+        {
+            op = GameTemplate::OpLocationPrompt;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void GameTemplate::addLiteral(const string &story, size_t start, size_t end)
+{
+    if (start >= end)
+    {
+        return;
+    }
+
+    if (segments_.empty() || segments_.back().op != OpLiteral)
+    {
+        segments_.push_back(Segment());
+        segments_.back().op = OpLiteral;
+    }
+    segments_.back().text.append(story, start, end - start);
+}
+
+bool GameTemplate::parse(const string &story, string *invalidVariable)
+{
+    segments_.clear();
+    parsed_ = true;
+    empty_ = story.empty();
+
+    bool valid = true;
+
+    size_t start = 0; // where to start looking for open brackets {
+    size_t nextLiteral = 0; // the first character that isn't in a segment yet
+    size_t len = story.length();
+
+    while (true)
+    {
+        size_t bracket = story.find("{", start);
+
+        if (bracket == string::npos)
+        {
+            addLiteral(story, nextLiteral, len);
+            return valid;
+        }
+
+        size_t endBracket = string::npos;
+        size_t cur = bracket + 1;
+        while (cur < len)
+        {
+            char ch = story[cur];
+            if (ch == '}')
+            {
+                endBracket = cur;
+                break;
+            }
+            if (ch == ' ' || (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || ch == '_' || ch == '.' || (ch >= '0' && ch <= '9'))
+            {
+                cur++;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        if (endBracket != string::npos)
+        {
+            addLiteral(story, nextLiteral, bracket);
+
+            string var = story.substr(bracket + 1, endBracket - bracket - 1);
+            trim(var);
+            transformLower(var);
+
+            Op op;
+            if (lookupVariable(var, op))
+            {
+                segments_.push_back(Segment());
+                segments_.back().op = op;
+            }
+            else if (valid)
+            {
+                valid = false;
+                if (invalidVariable)
+                {
+                    *invalidVariable = var;
+                }
+            }
+            start = nextLiteral = endBracket + 1;
+        }
+        else
+        {
+            start = bracket + 1;
+        }
+    }
+}
+
+void GameTemplate::encode(string &bytecode) const
+{
+    bytecode.clear();
+    for (size_t i = 0; i < segments_.size(); i++)
+    {
+        const Segment &segment = segments_[i];
+        bytecode += (char)segment.op;
+
+        if (segment.op == OpLiteral)
+        {
+            size_t len = segment.text.length();
+            while (len >= 0x80)
+            {
+                bytecode += (char)((len & 0x7F) | 0x80);
+                len >>= 7;
+            }
+            bytecode += (char)len;
+            bytecode += segment.text;
+        }
+    }
+}
+
+bool GameTemplate::decode(const string &bytecode)
+{
+    segments_.clear();
+    parsed_ = true;
+    empty_ = bytecode.empty();
+
+    size_t pos = 0;
+    size_t end = bytecode.length();
+    while (pos < end)
+    {
+        byte op = (byte)bytecode[pos++];
+        if (op >= NumOps)
+        {
+            return false;
+        }
+
+        segments_.push_back(Segment());
+        Segment &segment = segments_.back();
+        segment.op = (Op)op;
+
+        if (segment.op == OpLiteral)
+        {
+            size_t len = 0;
+            for (size_t shift = 0; ; shift += 7)
+            {
+                if (pos >= end || shift >= 8 * sizeof(size_t))
+                {
+                    return false;
+                }
+                byte ch = (byte)bytecode[pos++];
+                len |= (size_t)(ch & 0x7F) << shift;
+                if (!(ch & 0x80))
+                {
+                    break;
+                }
+            }
+
+            if (len > end - pos)
+            {
+                return false;
+            }
+            segment.text.assign(bytecode, pos, len);
+            pos += len;
+        }
+    }
+    return true;
+}
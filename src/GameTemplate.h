@@ -0,0 +1,71 @@
+#ifndef _GAME_TEMPLATE_H_
+#define _GAME_TEMPLATE_H_
+
+#include <string>
+#include <vector>
+
+/* GameTemplate
+ * ============
+ * A story string (title, description, prompt, ...) parsed into a list of literal text
+ * and variables such as {location.title} or {br}. Each object that owns a story string
+ * parses it the first time it is printed and keeps the result, so printing it again is
+ * just a walk over the segments (see GameContext::printExpansion).
+ *
+ * The compiler parses the story strings of the adventure and writes them to the .cra file
+ * encoded as bytecode, so that the player only has to decode them.
+ * Bytecode: (op (1 byte), [for OpLiteral: length (varint), text])*
+ */
+class GameTemplate
+{
+public:
+    // the values are part of the .cra file format
+    enum Op
+    {
+        OpLiteral = 0,
+        OpDelay = 1,            // {d}
+        OpPause = 2,            // {p}
+        OpCommand = 3,          // {cmd}
+        OpArgs = 4,             // {args}
+        OpSpace = 5,            // {s}
+        OpBreak = 6,            // {br}
+        OpLocationTitle = 7,    // {location.title}
+        OpLocationDesc = 8,     // {location.desc}
+        OpLocationGid = 9,      // {location.gid}
+        OpLocationPrompt = 10,  // {location.prompt}
+        OpTime = 11,            // {time}
+        NumOps
+    };
+
+    struct Segment
+    {
+        Op op;
+        std::string text; // for OpLiteral
+    };
+
+    GameTemplate() : parsed_(false), empty_(true) {}
+    explicit GameTemplate(const std::string &story) : parsed_(false) { parse(story); }
+
+    bool isParsed() const { return parsed_; }
+
+    // parses a story string. returns false if it has a variable that doesn't exist
+    // (the name is stored in invalidVariable); such variables don't print anything.
+    bool parse(const std::string &story, std::string *invalidVariable = NULL);
+
+    void encode(std::string &bytecode) const;
+    // returns false if the bytecode is invalid
+    bool decode(const std::string &bytecode);
+
+    // true if the story string was empty
+    bool empty() const { return empty_; }
+
+    const std::vector<Segment> &segments() const { return segments_; }
+
+private:
+    void addLiteral(const std::string &story, size_t start, size_t end);
+
+    bool parsed_;
+    bool empty_;
+    std::vector<Segment> segments_;
+};
+
+#endif
@@ -1,1292 +1,2254 @@
-#include "SourceBase.h"
-#include "SourceOutput.h"
-
-using namespace std;
-using namespace CryptoPP;
-
-#include "cryptlib.h"
-#include "filters.h"
-#include "files.h"
-#include "modes.h"
-#include "aes.h"
-#include <fstream>
-
-/* xml parsing */
-static const string validNestings[][2] = {
-    /* {child, parent} */
-    { "s" , "synonyms" },
-    { "synonyms" , "location" },
-    { "ignored" , "location" },
-    { "action" , "location" },
-    { "item" , "location" },
-    { "location" , "location" },
-    { "location" , "adventure" },
-    { "cleartext" , "adventure" },
-    { "file" , "adventure" },
-    { "takes" , "action" },
-    { "needs" , "action" },
-    { "drops" , "action" },
-    { "extracts" , "action" },
-    { "aux" , "action" },
-    { "alt", "action" },
-    { "or" , "action" },
-    { "needs" , "or" },
-    { "alt", "item" },
-};
-
-struct ActionTypePair
-{
-    string str;
-    ActionType val;
-};
-
-static const ActionTypePair validActionTypes[] = {
-    { "", ActionTypeDefault },
-    { "default", ActionTypeDefault },
-    { "look", ActionTypeLook },
-    { "take", ActionTypeTake },
-    { "drop", ActionTypeDrop },
-    { "call", ActionTypeCall },
-    { "return", ActionTypeReturn },
-    { "inventory", ActionTypeInventory },
-    { "quit", ActionTypeQuit },
-    { "save", ActionTypeSave },
-    { "load", ActionTypeLoad },
-};
-
-SourceContext::~SourceContext()
-{
-    for (size_t i = 0; i < topLevelObjects_.size(); i++)
-    {
-        delete topLevelObjects_[i];
-    }
-}
-
-bool SourceContext::getBoolAttribute(const std::map<std::string, std::string> &attributes, const std::string &key, bool required, bool def)
-{
-    string str = getAttribute(attributes, key, required, "");
-    if (str.empty())
-    {
-        return def;
-    }
-    else
-    {
-        transformLower(str);
-        if (str == "false" || str == "0" || str == "no") 
-            return false;
-        else if (str == "true" || str == "1" || str == "yes") 
-            return true;
-        else 
-            throw InvalidSourceException(string() + "'" + str + "' is not a valid boolean value.");
-    }
-}
-
-const std::string &SourceContext::getAttribute(const std::map<std::string, std::string> &attributes, const std::string &key, bool required, const std::string &def)
-{
-    map<string, string>::const_iterator it = attributes.find(key);
-    if (it != attributes.end())
-    {
-        return it->second;
-    }
-    else
-    {
-        if (required)
-        {
-            throw InvalidSourceException(string() + "Missing required attribute '" + key + "' for element '" + elemStack_.back() + "'");
-        }
-
-        return def;
-    }
-}
-
-void SourceContext::startElement(const string &_name, const map<string, string> &_attributes)
-{
-    string name = _name;
-    transformLower(name);
-    
-    map<string,string> attributes;
-    for (map<string,string>::const_iterator it = _attributes.begin(); it != _attributes.end(); ++it)
-    {
-        string key = it->first;
-        transformLower(key);
-        attributes[key] = it->second;
-    }
-
-    string parentElem;
-
-    if (elemStack_.empty())
-    {
-        if (name != "adventure")
-        {
-            throw InvalidSourceException("The root element was not named 'adventure'");
-        }
-    }
-    else
-    {
-        parentElem = elemStack_.back();
-        bool isValidNesting = false;
-        for (size_t i = 0; i < sizeof(validNestings)/sizeof(validNestings[0]); i++)
-        {
-            if (validNestings[i][0] == name && validNestings[i][1] == parentElem)
-            {
-                isValidNesting = true;
-                break;
-            }
-        }
-        if (!isValidNesting)
-        {
-            throw InvalidSourceException(string() + "The '" + name + "' tag cannot appear under a '"+ parentElem +"' tag.");
-        }
-    }
-
-    elemStack_.push_back(name);
-
-    SourceBase *topObject = objectStack_.empty() ? NULL : objectStack_.back();
-
-    SourceLocation *parentLoc = topObject ? dynamic_cast<SourceLocation *>(topObject) : NULL;
-    SourceItem *parentItem = topObject ? dynamic_cast<SourceItem *>(topObject) : NULL;
-    SourceAction *parentAction = topObject ? dynamic_cast<SourceAction *>(topObject) : NULL;
-
-    if (name == "location")
-    {
-        SourceLocation *newLoc;
-        if (parentLoc)
-        {
-            newLoc = parentLoc->newChildLocation();            
-        }
-        else
-        {
-            newLoc = new SourceLocation(*this);
-            topLevelObjects_.push_back(newLoc);
-        }
-
-        newLoc->id = getAttribute(attributes, "id");
-        newLoc->prompt = getAttribute(attributes, "prompt", false);
-        newLoc->startId = getAttribute(attributes, "start", false);
-        newLoc->title = getAttribute(attributes, "title", false);
-
-        objectStack_.push_back(newLoc);
-        allLocations_.push_back(newLoc);
-    }
-    else if (name == "synonyms")
-    {
-        assert(parentLoc);
-        parentLoc->synonyms.push_back(set<string>());
-    }
-    else if (name == "s")
-    {
-        // nothing to do here, wait for text
-    }
-    else if (name == "adventure")
-    {
-        gameName = getAttribute(attributes, "name");
-        startId_ = getAttribute(attributes, "start", false);
-    }
-    else if (name == "ignored")
-    {
-        const std::string &token = getAttribute(attributes, "token");
-        assert(parentLoc);
-        parentLoc->addIgnored(token);
-    }
-    else if (name == "action")
-    {
-        assert(parentLoc);
-        SourceAction *action = parentLoc->newChildAction();       
-
-        bool allowBlankCommand = true;
-        if (getBoolAttribute(attributes, "forced", false, false))
-        {
-            action->commands.push_back(FORCED_COMMAND);
-            allowBlankCommand = false;
-        }
-
-        if (getBoolAttribute(attributes, "firstvisit", false, false))
-        {
-            action->commands.push_back(FIRST_VISIT_COMMAND);
-            allowBlankCommand = false;
-        }
-
-        if (getBoolAttribute(attributes, "returnvisit", false, false))
-        {
-            action->commands.push_back(RETURN_VISIT_COMMAND);
-            allowBlankCommand = false;
-        }
-
-        const string &cmd = getAttribute(attributes, "cmd", false);
-
-        if (allowBlankCommand || !cmd.empty())
-        {
-            action->commands.push_back(cmd);
-        }
-
-        action->exact = getBoolAttribute(attributes, "exact", false, false);
-        action->destId = getAttribute(attributes, "dest", false);
-
-        string actionTypeStr = getAttribute(attributes, "type", false);
-        transformLower(actionTypeStr);
-
-        bool validActionType = false;
-        for (size_t i = 0; i < sizeof(validActionTypes)/sizeof(validActionTypes[0]); i++)
-        {
-            if (validActionTypes[i].str == actionTypeStr)
-            {
-                action->actionType = validActionTypes[i].val;
-                validActionType = true;
-            }
-        }
-        if (!validActionType)
-        {
-            throw InvalidSourceException(string() + "'" + actionTypeStr + "' is not a valid action type.");            
-        }
-
-        // make a conjunction for all the "needs" tags that aren't inside an "or" tag
-        action->predicateIds.push_back(UnresolvedConjunction());
-
-        objectStack_.push_back(action);
-    }
-    else if (name == "or")
-    {
-        assert(parentAction);
-
-        parentAction->predicateIds.push_back(UnresolvedConjunction());
-    }
-    else if (name == "aux")
-    {
-        assert(parentAction);
-
-        curAuxKey_ = getAttribute(attributes, "key");
-    }
-    else if (name == "needs")
-    {
-        assert(parentAction);
-
-        UnresolvedConjunction &conj = (parentElem == "action") 
-            ? parentAction->predicateIds[0] : parentAction->predicateIds.back();
-
-        conj.push_back(getAttribute(attributes, "item"));
-    }
-    else if (name == "takes")
-    {
-        assert(parentAction);
-
-        parentAction->takesIds.push_back(getAttribute(attributes, "item"));
-    }
-    else if (name == "drops")
-    {
-        assert(parentAction);
-
-        parentAction->dropsIds.push_back(getAttribute(attributes, "item"));
-    }
-    else if (name == "item")
-    {
-        assert(parentLoc);
-    
-        SourceItem *item = parentLoc->newChildItem();       
-
-        item->id = getAttribute(attributes, "id");
-
-        item->title = getAttribute(attributes, "title", false);
-
-        if (!item->title.empty())
-        {
-            item->titles.push_back(item->title);
-        }
-        item->restrictTake = getBoolAttribute(attributes, "restricttake", false, true);
-        item->visible = getBoolAttribute(attributes, "visible", false, true);
-
-        objectStack_.push_back(item);
-        allItems_.push_back(item);
-    }
-    else if (name == "alt")
-    {
-        if (parentElem == "item")
-        {
-            assert(parentItem);
-            parentItem->titles.push_back(getAttribute(attributes, "title"));
-        }
-        else if (parentElem == "action")
-        {
-            assert(parentAction);
-            parentAction->commands.push_back(getAttribute(attributes, "cmd"));
-        }
-    }
-    else if (name == "file")
-    {
-        SourceFile *file = new SourceFile(*this);
-
-        file->id = getAttribute(attributes, "id");
-        file->src = getAttribute(attributes, "src");
-        file->dest = getAttribute(attributes, "dest", false);
-
-        topLevelObjects_.push_back(file);
-        objectStack_.push_back(file);
-        allFiles_.push_back(file);
-    }   
-    else if (name == "extracts")
-    {
-        assert(parentAction);
-
-        const string &fileId = getAttribute(attributes, "file");
-        bool launch = getBoolAttribute(attributes, "launch", false, true);
-        
-        parentAction->fileIds.push_back(pair<string, bool>(fileId, launch));
-    }
-}
-
-template <typename SourceType>
-SourceType *resolveId(const map<string, SourceType *> &map, const string &typeDesc, const string &id)
-{
-    if (id.empty())
-    {  
-        return NULL;
-    }
-
-    // typename map<string, SourceType *>::const_iterator it = map.find(id); // why doesn't this compile?
-    if (map.find(id) == map.end())
-    {
-        throw InvalidSourceException(string() + "Could not resolve reference to "+typeDesc+" '"+id+"'");
-    }
-    return map.find(id)->second;
-}
-
-SourceLocation *SourceContext::getLocationById(const std::string &id)
-{
-    return resolveId(locationsMap_, "location", id);
-}
-
-SourceItem *SourceContext::getItemById(const std::string &id)
-{
-    return resolveId(itemsMap_, "item", id);
-}
-
-SourceFile *SourceContext::getFileById(const std::string &id)
-{
-    return resolveId(filesMap_, "file", id);
-}
-
-void SourceContext::endElement()
-{
-    string &elemName = elemStack_.back();
-
-    if (elemName == "location" || elemName == "action" || elemName == "item" || elemName == "file")
-    {
-        objectStack_.pop_back();
-    }
-
-    elemStack_.pop_back();
-}
-
-void trimTabs(string &str)
-{
-    // split lines.
-
-    vector<string> lines;
-
-    size_t start = 0;
-    while (true)
-    {
-        size_t newLine = str.find_first_of("\n", start);
-
-        if (newLine == string::npos)
-        {
-            lines.push_back(str.substr(start));
-            break;
-        }
-
-        lines.push_back(str.substr(start, newLine - start + 1));        
-        start = newLine + 1;
-    }
-
-    // count # of whitespace characters at the start of each line that contains non-whitespace. 
-    // find the minimum of these counts.
-
-    bool dedent = false;
-    size_t minSpaces = 999999;
-    for (size_t i = 0; i < lines.size(); i++)
-    {
-        size_t numSpaces = lines[i].find_first_not_of("\t\r\n ");
-        if (numSpaces != string::npos)
-        {
-            if (numSpaces < minSpaces)
-            {
-                dedent = true;
-                minSpaces = numSpaces;
-            }
-        }
-    }
-
-    // trim that number of characters off the beginning of each line, and any whitespace from the end.
-    str = "";
-    for (size_t i = 0; i < lines.size(); i++)
-    {
-        size_t lastNonWhitespace = lines[i].find_last_not_of(" \r\n\t");
-
-        if (lastNonWhitespace != string::npos && lastNonWhitespace >= minSpaces)
-        {
-            str.append(lines[i].substr(minSpaces, lastNonWhitespace - minSpaces + 1));
-        }
-        str.append("\n");
-    }
-
-    // strip newlines at beginning and end
-    size_t lastNonNewLine = str.find_last_not_of('\n');
-    if (lastNonNewLine != string::npos)
-    {
-        str.erase(lastNonNewLine + 1);
-        
-        size_t firstNonNewLine = str.find_first_not_of('\n');
-        if (firstNonNewLine != string::npos)
-        {
-            str.erase(0, firstNonNewLine);
-        }
-    }
-    else 
-    {
-        str = "";
-    }
-}
-
-bool isWhitespace(const string &str)
-{
-    return str.find_first_not_of("\t\r\n ") == string::npos;
-}
-
-void SourceContext::handleText(const string &str)
-{
-    const string &text = str;
-    
-    if (elemStack_.empty())
-    {        
-        if (isWhitespace(text))
-        {
-            return;
-        }
-        else
-        {
-            throw InvalidSourceException(string() + "Unexpected text outside of 'adventure' tag: '"+text+"'");
-        }
-    }
-
-    string &parentElem = elemStack_.back();
-
-    SourceBase *topObject = objectStack_.empty() ? NULL : objectStack_.back();
-    SourceLocation *parentLoc = topObject ? dynamic_cast<SourceLocation *>(topObject) : NULL;
-
-    if (parentElem == "cleartext")
-    {
-        this->gameDesc_.append(text);
-    }
-    else if (parentElem == "s")
-    {
-        assert(parentLoc);
-        
-        parentLoc->synonyms.back().insert(text);
-    }
-    else if (parentElem == "action")
-    {
-        SourceAction *parentAction = topObject ? dynamic_cast<SourceAction *>(topObject) : NULL;
-
-        assert(parentAction);
-        parentAction->desc.append(text);
-    }
-    else if (parentElem == "location")
-    {
-        assert(parentLoc);
-
-        parentLoc->desc.append(text);
-    }
-    else if (parentElem == "item")
-    {
-        SourceItem *parentItem = topObject ? dynamic_cast<SourceItem *>(topObject) : NULL;
-        assert(parentItem);
-
-        parentItem->desc.append(text);
-    }
-    else if (parentElem == "aux")
-    {
-        SourceAction *parentAction = topObject ? dynamic_cast<SourceAction *>(topObject) : NULL;
-        assert(parentAction);
-
-        parentAction->auxData[curAuxKey_].append(text);
-    }
-    else if (!isWhitespace(text))
-    {
-        throw InvalidSourceException(string() + "Unexpected text inside '"+parentElem+"' tag: '"+text+"'");
-    }
-}
-
-template <typename SourceType>
-void insertInIdMap(const vector<SourceType *> &objs, map<string, SourceType *> &map)
-{
-    map.clear();
-    for (size_t i = 0; i < objs.size(); i++)
-    {
-        SourceType *obj = objs[i];
-        const string &id = obj->id;
-
-        if (map.find(id) != map.end())
-        {
-            throw InvalidSourceException(string() + "Duplicate id: " + id);
-        }
-        map[id] = obj;
-    }
-}
-
-void SourceContext::write(SourceOutput &out)
-{
-    out.writePlaintext(this->gameDesc_);
-
-    out.startEncryptedBlock();
-
-    for (size_t i = 0; i < topLevelObjects_.size(); i++)
-    {
-        topLevelObjects_[i]->write(out);
-    }
-
-    out.setInitialLocation(start_);
-    out.finalize();
-}
-
-
-bool isOkGameNameChar(char c)
-{
-    return isOkFilenameChar(c) && c != '.';
-}
-
-void SourceContext::resolve()
-{
-    if (allLocations_.empty())
-    {
-        throw InvalidSourceException("The adventure requires at least one location.");
-    }    
-
-    insertInIdMap(allLocations_, locationsMap_);
-    insertInIdMap(allItems_, itemsMap_);
-    insertInIdMap(allFiles_, filesMap_);
-
-    for (size_t i = 0; i < gameName.size(); i++)
-    {
-        if (!isOkGameNameChar(gameName[i]))
-            throw InvalidSourceException(string() + "Invalid character in adventure name: " + gameName[i]);
-    }
-
-    start_ = getLocationById(startId_);
-
-    bool startIsTopLevel = false;
-
-    for (size_t i = 0; i < topLevelObjects_.size(); i++)
-    {
-        SourceLocation *loc = dynamic_cast<SourceLocation *>(topLevelObjects_[i]);
-
-        if (loc)
-        {
-            if (!start_)
-            {
-                start_ = loc;
-            }
-
-            if (loc == start_)
-            {
-                startIsTopLevel = true;
-                break;
-            }
-        }
-    }
-
-    if (!startIsTopLevel)
-    {
-        throw InvalidSourceException(string() + "Start location " +startId_+ " is not a direct child of the <adventure> tag");
-    }
-
-    trimTabs(gameDesc_);
-    for (size_t i = 0; i < topLevelObjects_.size(); i++)
-    {
-        topLevelObjects_[i]->resolve();
-    }    
-}
-
-byte *SourceBase::key()
-{
-    if (!key_)
-    {
-        key_ = new byte[KEY_SIZE];
-        generateKey(key_);
-    }
-    return key_;
-}
-
-void SourceBase::write(SourceOutput &out)
-{
-    if (out.isRecorded(this))
-    {
-        return;
-    }
-    out.recordObject(this);
-
-    byte iv[AES::BLOCKSIZE];
-   
-    ctx_->makerand(iv, AES::BLOCKSIZE);
-
-    //cout << "writing object with gid " << this->gid_ << " at offset " << out.stream().tellp() << endl;
-
-    out.stream().write((char *)iv, AES::BLOCKSIZE);   
-
-    //cout << "write iv: ";
-    //debugBinary(iv, AES::BLOCKSIZE);
-
-    //cout << "write key: ";
-    //debugBinary(this->key(), KEY_SIZE);
-
-    CFB_Mode<AES>::Encryption cfbEncryption(this->key(), KEY_SIZE, iv);
-
-    StreamTransformationFilter encryptor(cfbEncryption, new FileSink(out.stream()));
-
-    encryptVal<int>(encryptor, DEBUG_MAGIC);
-
-    this->encrypt(encryptor);
-
-    encryptor.MessageEnd();
-
-    writeChildren(out);
-}
-
-template <typename T>
-void SourceBase::encryptVal(StreamTransformationFilter &encryptor, T val)
-{
-    canonicalizeEndianness(val);
-    encryptor.Put((byte *)&val, sizeof(T));
-}
-
-void SourceBase::encryptString(StreamTransformationFilter &encryptor, const string &str)
-{
-    size_t len = str.length();
-    encryptVal<size_t>(encryptor, len);
-    encryptor.Put((byte*)str.c_str(), len);
-}
-
-void SourceBase::writeChildren(SourceOutput &out)
-{
-}
-
-
-void SourceBase::generateKey(byte *outputKey)
-{    
-    ctx_->makerand(outputKey, KEY_SIZE); 
-    // we hope that this key and its hash are unique for this game (TODO: verify this)
-}
-
-SourceLocation::~SourceLocation()
-{
-    for (size_t i = 0; i < locations_.size(); i++)
-    {
-        delete locations_[i];
-    }
-    for (size_t i = 0; i < actions_.size(); i++)
-    {
-        delete actions_[i];
-    }
-    for (map<string, set<string> *>::iterator it = mergedSynonymsMap_.begin(); it != mergedSynonymsMap_.end(); ++it)
-    {
-        delete it->second;
-    }
-}
-
-SourceLocation *SourceLocation::newChildLocation()
-{
-    SourceLocation *loc = new SourceLocation(*ctx_, this);
-    locations_.push_back(loc);
-    return loc;
-}
-
-SourceAction *SourceLocation::newChildAction()
-{
-    SourceAction *act = new SourceAction(*ctx_, this);
-    actions_.push_back(act);
-    return act;
-}
-
-SourceItem *SourceLocation::newChildItem()
-{
-    SourceItem *item = new SourceItem(*ctx_, this);
-    items_.push_back(item);
-    return item;
-}
-
-set<string> *SourceLocation::getLocalSynonyms(const string &token)
-{
-    size_t numSynonymGroups = synonyms.size();
-    for (size_t i = 0; i < numSynonymGroups; i++)
-    {
-        set<string> &synonymGroup = synonyms[i];
-        if (synonymGroup.find(token) != synonymGroup.end())
-        {
-            return &synonymGroup;
-        }
-    }
-    return NULL;
-}
-
-set<string> *SourceLocation::getSynonyms(const string &token)
-{
-    map<string, set<string> *>::iterator it = mergedSynonymsMap_.find(token);
-    if (it != mergedSynonymsMap_.end())
-    {
-        return it->second;
-    }
-
-    set<string> *localSynonyms = getLocalSynonyms(token);
-    SourceLocation *parentLoc = this->sourceParent();
-
-    set<string> *parentSynonyms = parentLoc ? parentLoc->getSynonyms(token) : NULL;
-    if (parentSynonyms && localSynonyms)
-    {
-        set<string> *mergedSynonyms = new set<string>(*localSynonyms);
-        for (set<string>::const_iterator pit = parentSynonyms->begin(); pit != parentSynonyms->end(); ++pit)
-        {
-            mergedSynonyms->insert(*pit);
-        }
-
-        mergedSynonymsMap_[token] = mergedSynonyms;
-
-        return mergedSynonyms;
-    }
-    else if (parentSynonyms)
-    {
-        return parentSynonyms;
-    }
-    else
-    {
-        return localSynonyms;
-    }
-}
-
-void SourceLocation::resolve()
-{
-    trimTabs(desc);
-    for (size_t i = 0; i < synonyms.size(); i++)
-    {
-        set<string> &synonymsSet = synonyms[i];
-        set<string> synonymsCopy = synonymsSet;
-        synonymsSet.clear();
-        for (set<string>::const_iterator it = synonymsCopy.begin(); it != synonymsCopy.end(); ++it)
-        {
-            string syn = *it;
-            trimTabs(syn);
-            transformLower(syn);
-            synonymsSet.insert(syn);
-        }
-    }
-
-    start = ctx_->getLocationById(startId);
-    if (start)
-    {
-        bool startAtImmediateChild = false;
-        for (size_t i = 0; i < locations_.size(); i++)
-        {
-            if (start == locations_[i])
-            {
-                startAtImmediateChild = true;
-                break;
-            }
-        }
-        if (!startAtImmediateChild)
-        {
-            throw InvalidSourceException(string() + " start id '" + startId + "' is not an immediate child of '" +id+ "'");
-        }
-    }
-
-    for (size_t i = 0; i < items_.size(); i++)
-    {
-        items_[i]->resolve();
-    }
-    for (size_t i = 0; i < actions_.size(); i++)
-    {
-        actions_[i]->resolve();
-    }
-    for (size_t i = 0; i < locations_.size(); i++)
-    {
-        locations_[i]->resolve();
-    }
-}
-
-void SourceLocation::addIgnored(const string &token)
-{
-    string lowerToken = token;
-    // TODO: normalize spaces
-    transformLower(lowerToken);
-    ignoredSet_.insert(lowerToken);
-}
-
-
-void SourceLocation::encrypt(StreamTransformationFilter &encryptor)
-{
-    char hasStart = (this->start) ? 1 : 0;
-    encryptor.Put(hasStart);
-
-    if (hasStart)
-    {
-        byte *key = this->start->key();
-        encryptor.Put(key, KEY_SIZE);
-    }
-    encryptString(encryptor, title);
-    encryptString(encryptor, desc);
-    encryptString(encryptor, prompt);
-    
-    size_t numIgnored = ignoredSet_.size();
-    encryptVal<size_t>(encryptor, numIgnored);
-    for (set<string>::const_iterator it = ignoredSet_.begin(); it != ignoredSet_.end(); ++it)
-    {
-        encryptString(encryptor, *it);
-    }
-
-    size_t numChildLocations = locations_.size();
-    encryptVal<size_t>(encryptor, numChildLocations);
-    for (size_t i = 0; i < numChildLocations; i++)
-    {
-        //cout << "location " << this->gid() << " has child with keyhash ";
-        //debugBinary(locations_[i]->keyhash(), KEYHASH_SIZE);
-
-        encryptor.Put(locations_[i]->keyhash(), KEYHASH_SIZE);
-        encryptVal<int>(encryptor, locations_[i]->gid());
-    }
-
-    size_t numItems = items_.size();
-    encryptVal<size_t>(encryptor, numItems);
-    for (size_t i = 0; i < numItems; i++)
-    {
-        encryptor.Put(items_[i]->key(), KEY_SIZE);
-    }
-
-    vector<ExpandedAction> expandedActions;
-    this->getExpandedActions(expandedActions);
-    size_t numExpandedActions = expandedActions.size();
-    encryptVal<size_t>(encryptor, numExpandedActions);
-
-    for (size_t i = 0; i < numExpandedActions; i++)
-    {
-        ExpandedAction &expAction = expandedActions[i];
-        byte cmdKey[KEY_SIZE];
-        byte cmdKeyHash[KEYHASH_SIZE];
-        commandKey(expAction.cmd, cmdKey);
-
-        //cout << expAction.cmd << endl;
-
-        hashKey(cmdKey, cmdKeyHash);
-        encryptor.Put(cmdKeyHash, KEYHASH_SIZE);
-
-        byte iv[AES::BLOCKSIZE];
-        ctx_->makerand(iv, AES::BLOCKSIZE);
-        
-        encryptor.Put(iv, AES::BLOCKSIZE);
-
-        CFB_Mode<AES>::Encryption cfbEncryption(cmdKey, KEY_SIZE, iv);
-
-        byte gidBlock[AES::BLOCKSIZE];
-        memset(gidBlock, 0, AES::BLOCKSIZE);
-        int gid = expAction.action->gid();
-        canonicalizeEndianness(gid);
-
-        byte exact = expAction.action->exact ? 1 : 0;
-
-        *gidBlock = exact;
-        *((int *)gidBlock + 1) = gid;        
-        
-        byte encBuf[AES::BLOCKSIZE];
-        cfbEncryption.ProcessData(encBuf, gidBlock, AES::BLOCKSIZE);
-        encryptor.Put(encBuf, AES::BLOCKSIZE);
-
-        cfbEncryption.ProcessData(encBuf, expAction.action->key(), AES::BLOCKSIZE);
-        encryptor.Put(encBuf, AES::BLOCKSIZE);
-    }
-}
-
-void SourceLocation::writeChildren(SourceOutput &out)
-{
-    for (size_t i = 0; i < locations_.size(); i++)
-    {
-        locations_[i]->write(out);
-    }
-
-    for (size_t i = 0; i < items_.size(); i++)
-    {
-        items_[i]->write(out);
-    }
-    
-    for (size_t i = 0; i < actions_.size(); i++)
-    {
-        actions_[i]->write(out);
-    }
-}
-
-void SourceLocation::getPath(SourceLocation *other, size_t &levelsUp, vector<SourceLocation *> &locationsDown)
-{
-    vector<SourceLocation *> thisAncestors, otherAncestors;
-    this->getAncestors(thisAncestors);
-    other->getAncestors(otherAncestors);
-
-    while (thisAncestors.size() && otherAncestors.size())
-    {
-        SourceLocation *thisAncestor = thisAncestors.back();
-        SourceLocation *otherAncestor = otherAncestors.back();
-
-        if (thisAncestor != otherAncestor)
-            break;
-
-        thisAncestors.pop_back();
-        otherAncestors.pop_back();
-    }
-
-    levelsUp = thisAncestors.size();
-
-    while (otherAncestors.size())
-    {
-        locationsDown.push_back(otherAncestors.back());
-        otherAncestors.pop_back();
-    }
-}
-
-void SourceLocation::expandStringInternal(vector<string> &tokens, size_t i, vector<string> &commands)
-{
-    if (i >= tokens.size())
-    {
-        // concatenate tokens, joined by space, and append to commands array
-        
-        string cmd;
-        concatenateTokens(tokens, cmd);
-        commands.push_back(cmd);
-    }
-    else
-    {
-        string &token = tokens[i];
-
-        set<string> *synonyms = getSynonyms(token);
-        if (synonyms)
-        {
-            string origToken = tokens[i];
-            
-            for (set<string>::const_iterator it = synonyms->begin(); it != synonyms->end(); ++it)
-            {
-                tokens[i] = *it;
-                expandStringInternal(tokens, i+1, commands);
-            }
-            tokens[i] = origToken;
-        }
-        else
-        {
-            expandStringInternal(tokens, i+1, commands);
-        }
-    }
-}
-
-void SourceLocation::expandString(const string &str, vector<string> &expanded)
-{
-    vector<string> tokens;
-    tokenize(str, tokens);
-    expandStringInternal(tokens, 0, expanded);
-}
-
-
-void SourceLocation::getExpandedActions(std::vector<ExpandedAction> &expandedActions)
-{
-    size_t numActions = actions_.size();
-    for (size_t i = 0; i < numActions; i++)
-    {
-        SourceAction *action = actions_[i];
-
-        vector<string> &actionCommands = action->commands;
-        for (size_t k = 0; k < actionCommands.size(); k++)
-        {
-            vector<string> expandedCommands;            
-            expandString(actionCommands[k], expandedCommands);
-
-            for (size_t j = 0; j < expandedCommands.size(); j++)
-            {
-                expandedActions.push_back(ExpandedAction(action, expandedCommands[j]));
-            }
-        }
-    }
-}
-
-void SourceLocation::getAncestors(vector<SourceLocation *> &ancestors)
-{
-    SourceLocation *cur = this;
-    while (cur != NULL)
-    {
-        ancestors.push_back(cur);
-        cur = cur->sourceParent();
-    }
-}
-
-void SourceAction::resolveConjunction(const UnresolvedConjunction &ids, Conjunction &conj)
-{
-    conj.clear();
-    for (size_t i = 0; i < ids.size(); i++)
-    {
-        conj.push_back(ctx_->getItemById(ids[i]));
-    }
-}
-
-void SourceAction::resolve()
-{
-    trimTabs(desc);
-
-    for (map<string,string>::iterator it = auxData.begin(); it != auxData.end(); ++it)
-    {
-        trimTabs(it->second);
-    }
-
-    dest = ctx_->getLocationById(destId);
-
-    predicate.clear();
-    for (size_t i = 0; i < predicateIds.size(); i++)
-    {
-        UnresolvedConjunction &conjIds = predicateIds[i];
-        if (conjIds.size())
-        {
-            predicate.push_back(Conjunction());
-            resolveConjunction(conjIds, predicate.back());
-        }
-    }
-
-    files.clear();
-    for (size_t i = 0; i < fileIds.size(); i++)
-    {
-        files.push_back(pair<SourceFile *, bool>(ctx_->getFileById(fileIds[i].first), fileIds[i].second));
-    }
-
-    resolveConjunction(takesIds, takes);
-    resolveConjunction(dropsIds, drops);
-}
-
-
-
-void SourceAction::writeChildren(SourceOutput &out)
-{
-    /*
-    if (file)
-    {
-        file->write(out);
-    }
-    */
-}
-
-byte *SourceAction::dokey() // the key that you get when you are allowed to take the object
-{
-    if (!dokey_)
-    {
-        dokey_ = new byte[KEY_SIZE];
-        generateKey(dokey_);
-    }
-    return dokey_;
-}
-
-void SourceAction::encrypt(StreamTransformationFilter &encryptor)
-{
-    size_t predicateSize = predicate.size();
-    encryptVal<size_t>(encryptor, predicateSize);
-
-    // if there are no predicates in order to do this action, just give them the dokey directly
-    if (predicateSize == 0)
-    {
-        encryptor.Put(dokey(), KEY_SIZE);
-    }
-
-    byte iv[AES::BLOCKSIZE];
-
-    for (size_t i = 0; i < predicateSize; i++)
-    {
-        Conjunction &conjunction = predicate[i];
-        size_t conjunctionSize = conjunction.size();
-        encryptVal<size_t>(encryptor, conjunctionSize);
-   
-        // record the takey hash for each item used in this conjunction
-        for (size_t j = 0; j < conjunctionSize; j++)
-        {
-            SourceItem *requiredItem = conjunction[j];
-            encryptor.Put(requiredItem->takeyhash(), KEYHASH_SIZE);
-        }
-
-        byte conjunctionKey[KEY_SIZE];
-        makeConjunctionKey(conjunction, conjunctionKey);
-
-        // record the dokey for this action, encrypted by the conjunction key
-        ctx_->makerand(iv, AES::BLOCKSIZE);
-        
-        encryptor.Put(iv, AES::BLOCKSIZE);
-
-        if (KEY_SIZE != AES::BLOCKSIZE)
-        {
-            throw "key size not equal to block size... : (";
-        }
-
-        CFB_Mode<AES>::Encryption cfbEncryption(conjunctionKey, KEY_SIZE, iv);
-
-        byte outputBlock[KEY_SIZE];
-
-        cfbEncryption.ProcessData(outputBlock, dokey(), KEY_SIZE);
-
-        encryptor.Put(outputBlock, KEY_SIZE);
-    }
-
-    // now finally, the payload for this action, encrypted by the dokey
-    
-    ctx_->makerand(iv, AES::BLOCKSIZE);
-    encryptor.Put(iv, AES::BLOCKSIZE);
-
-    CFB_Mode<AES>::Encryption innerEncryption(dokey(), KEY_SIZE, iv);
-
-    StreamTransformationFilter innerEncryptor(innerEncryption);
-
-    encryptVal<int>(innerEncryptor, this->actionType);
-    encryptString(innerEncryptor, this->desc);
-    
-    size_t numFiles = files.size();
-    encryptVal<size_t>(innerEncryptor, numFiles);
-    for (size_t i = 0; i < numFiles; i++)
-    {        
-        pair<SourceFile *, bool> &filePair = files[i];
-        innerEncryptor.Put(filePair.first->key(), KEY_SIZE);
-        encryptVal<byte>(innerEncryptor, filePair.second ? 1 : 0); // should the game open this file after decrypting it?
-    }
-
-    size_t numTakes = this->takes.size();
-    encryptVal<size_t>(innerEncryptor, numTakes);
-    for (size_t i = 0; i < numTakes; i++)
-    {
-        SourceItem *takesItem = this->takes[i];
-        innerEncryptor.Put(takesItem->key(), KEY_SIZE);
-        innerEncryptor.Put(takesItem->takey(), KEY_SIZE);
-        
-        encryptPath(innerEncryptor, takesItem->sourceParent());        
-    }
-
-    size_t numDrops = this->drops.size();
-    encryptVal<size_t>(innerEncryptor, numDrops);
-    for (size_t i = 0; i < numDrops; i++)
-    {
-        innerEncryptor.Put(drops[i]->takeyhash(), KEYHASH_SIZE);
-    }
-
-    encryptVal<byte>(innerEncryptor, this->dest ? 1 : 0);
-    
-    if (this->dest)
-    {
-        encryptPath(innerEncryptor, this->dest);
-    }
-
-    encryptVal<size_t>(innerEncryptor, auxData.size());
-    for (map<string,string>::const_iterator it = auxData.begin(); it != auxData.end(); ++it)
-    {
-        encryptString(innerEncryptor, it->first);
-        encryptString(innerEncryptor, it->second);
-    }
-
-    innerEncryptor.MessageEnd();
-    innerEncryptor.TransferAllTo(encryptor);
-}
-
-void SourceAction::encryptPath(StreamTransformationFilter &innerEncryptor, SourceLocation *otherLoc)
-{    
-    vector<SourceLocation *> locationsDown;
-    size_t levelsUp; 
-    sourceParent()->getPath(otherLoc, levelsUp, locationsDown);
-    encryptVal<size_t>(innerEncryptor, levelsUp);
-
-    size_t numLocationsDown = locationsDown.size();
-    encryptVal<size_t>(innerEncryptor, numLocationsDown);
-    for (size_t i = 0; i < numLocationsDown; i++)
-    {
-        innerEncryptor.Put(locationsDown[i]->key(), KEY_SIZE);
-    }
-}
-
-byte *SourceItem::takey() // the key that you get when you are allowed to take the object
-{
-    if (!takey_)
-    {
-        takey_ = new byte[KEY_SIZE];
-        generateKey(takey_);
-    }
-    return takey_;
-}
-
-void SourceItem::encrypt(StreamTransformationFilter &encryptor)
-{
-    encryptVal<byte>(encryptor, visible ? 1 : 0);
-    encryptString(encryptor, title);
-    size_t numTitles = titles.size();
-    encryptVal<size_t>(encryptor, numTitles);
-    for (size_t i = 0; i < numTitles; i++)
-    {
-        byte titleKey[KEY_SIZE];
-        byte titleKeyHash[KEYHASH_SIZE];
-
-        commandKey(titles[i], titleKey);
-        hashKey(titleKey, titleKeyHash);
-
-        encryptor.Put(titleKeyHash, KEYHASH_SIZE);
-    }
-    encryptString(encryptor, desc);
-    encryptVal<byte>(encryptor, restrictTake ? 1 : 0);
-    if (!restrictTake)
-    {
-        encryptor.Put(takey(), KEY_SIZE);
-    }    
-}
-
-void SourceItem::resolve()
-{
-    trimTabs(desc);
-
-    SourceLocation *parentLoc = this->sourceParent();
-    vector<string> oldTitles = this->titles;
-    this->titles.clear();
-    for (size_t i = 0; i < oldTitles.size(); i++)
-    {
-        vector<string> expandedTitles;
-        parentLoc->expandString(oldTitles[i], expandedTitles);    
-        for (size_t j = 0; j < expandedTitles.size(); j++)
-        {
-            this->titles.push_back(expandedTitles[j]);
-        }
-    }
-}
-
-void SourceFile::resolve()
-{
-    if (dest.empty())
-    {
-        dest = baseFileName(src);
-    }
-
-    ifstream in(src.c_str());
-    if (in.fail())
-    {
-        throw InvalidSourceException(string() + "could not open " + src);
-    }
-    in.close();
-}
-
-void SourceFile::encrypt(StreamTransformationFilter &encryptor)
-{
-    encryptString(encryptor, dest);
-
-    fstream in(src.c_str(), ios::in|ios::binary);
-
-    if (in.fail())
-    {
-        throw InvalidSourceException(string() + "could not open " + src);
-    }
-    else
-    {
-    	in.seekg(0, ios::end);
-	    size_t len = in.tellg();
-        encryptVal<size_t>(encryptor, len);
-        in.seekg(0);
-
-        FileSource f(in, true);
-        f.TransferAllTo(encryptor);
-
-        in.close();
-    }
-}
+#include "SourceBase.h"
+#include "SourceOutput.h"
+#include "SourceRandom.h"
+#include "SourceKeyStore.h"
+#include "GameTemplate.h"
+#include "CraneaThread.h"
+
+using namespace std;
+using namespace CryptoPP;
+
+#include "cryptlib.h"
+#include "modes.h"
+#include "aes.h"
+#include "sha.h"
+#include "osrng.h"
+#include <fstream>
+#include <cstring>
+#include <cctype>
+#include <sstream>
+#include <sys/stat.h>
+
+/* xml parsing */
+static const char *const elementNames[NUM_ELEMENTS] = {
+    "action", "adventure", "alt", "aux", "cleartext", "drops", "extracts", "file",
+    "ignored", "item", "location", "needs", "or", "s", "synonyms", "takes"
+};
+
+static const char *const attributeNames[NUM_ATTRIBUTES] = {
+    "cmd", "dest", "exact", "file", "firstvisit", "forced", "id", "item", "key", "launch",
+    "name", "prompt", "restricttake", "returnvisit", "src", "start", "title", "token", "type", "visible"
+};
+
+// longer names can't be in the tables above
+#define MAX_NAME_LENGTH 15
+
+// the index of name (in any case) in names, which are in alphabetical order; or count if it isn't there
+static int findName(const char *const *names, int count, const char *name)
+{
+    char lowerName[MAX_NAME_LENGTH + 1];
+    size_t len;
+    for (len = 0; name[len]; len++)
+    {
+        if (len == MAX_NAME_LENGTH)
+        {
+            return count;
+        }
+        lowerName[len] = (char)tolower((unsigned char)name[len]);
+    }
+    lowerName[len] = 0;
+
+    int low = 0, high = count;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        int cmp = strcmp(names[mid], lowerName);
+        if (cmp == 0)
+        {
+            return mid;
+        }
+        else if (cmp < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return count;
+}
+
+static const SourceElement validNestings[][2] = {
+    /* {child, parent} */
+    { ElementS, ElementSynonyms },
+    { ElementSynonyms, ElementLocation },
+    { ElementIgnored, ElementLocation },
+    { ElementAction, ElementLocation },
+    { ElementItem, ElementLocation },
+    { ElementLocation, ElementLocation },
+    { ElementLocation, ElementAdventure },
+    { ElementCleartext, ElementAdventure },
+    { ElementFile, ElementAdventure },
+    { ElementTakes, ElementAction },
+    { ElementNeeds, ElementAction },
+    { ElementDrops, ElementAction },
+    { ElementExtracts, ElementAction },
+    { ElementAux, ElementAction },
+    { ElementAlt, ElementAction },
+    { ElementOr, ElementAction },
+    { ElementNeeds, ElementOr },
+    { ElementAlt, ElementItem },
+};
+
+// validNestings as a [child][parent] table
+class NestingMatrix
+{
+public:
+    NestingMatrix()
+    {
+        memset(valid_, 0, sizeof(valid_));
+        for (size_t i = 0; i < sizeof(validNestings)/sizeof(validNestings[0]); i++)
+        {
+            valid_[validNestings[i][0]][validNestings[i][1]] = true;
+        }
+    }
+
+    bool isValid(SourceElement child, SourceElement parent) const { return valid_[child][parent]; }
+
+private:
+    bool valid_[NUM_ELEMENTS][NUM_ELEMENTS];
+};
+
+static const NestingMatrix nestingMatrix;
+
+const SourceContext::ElementHandlers SourceContext::elementHandlers_[NUM_ELEMENTS] = {
+    /* {start, text, hasObject}, by SourceElement */
+    { &SourceContext::startAction, &SourceContext::actionText, true },
+    { &SourceContext::startAdventure, NULL, false },
+    { &SourceContext::startAlt, NULL, false },
+    { &SourceContext::startAux, &SourceContext::auxText, false },
+    { NULL, &SourceContext::cleartextText, false },
+    { &SourceContext::startDrops, NULL, false },
+    { &SourceContext::startExtracts, NULL, false },
+    { &SourceContext::startFile, NULL, true },
+    { &SourceContext::startIgnored, NULL, false },
+    { &SourceContext::startItem, &SourceContext::itemText, true },
+    { &SourceContext::startLocation, &SourceContext::locationText, true },
+    { &SourceContext::startNeeds, NULL, false },
+    { &SourceContext::startOr, NULL, false },
+    { NULL, &SourceContext::synonymText, false }, // the synonym is added when the element ends
+    { &SourceContext::startSynonyms, NULL, false },
+    { &SourceContext::startTakes, NULL, false },
+};
+
+struct ActionTypePair
+{
+    string str;
+    ActionType val;
+};
+
+static const ActionTypePair validActionTypes[] = {
+    { "", ActionTypeDefault },
+    { "default", ActionTypeDefault },
+    { "look", ActionTypeLook },
+    { "take", ActionTypeTake },
+    { "drop", ActionTypeDrop },
+    { "call", ActionTypeCall },
+    { "return", ActionTypeReturn },
+    { "inventory", ActionTypeInventory },
+    { "quit", ActionTypeQuit },
+    { "save", ActionTypeSave },
+    { "load", ActionTypeLoad },
+    { "undo", ActionTypeUndo },
+    { "redo", ActionTypeRedo },
+};
+
+// the random stream of the context (the objects' streams are numbered by gid)
+#define CONTEXT_RANDOM_STREAM 0xFFFFFFFF
+
+SourceContext::SourceContext() : hasSeed_(false), currentGid_(0), canonicalSynonyms_(false), keyStore_(NULL)
+{
+    AutoSeededRandomPool().GenerateBlock(seed_, KEY_SIZE);
+    random_ = new SourceRandom(seed_, CONTEXT_RANDOM_STREAM);
+}
+
+SourceContext::~SourceContext()
+{
+    for (size_t i = 0; i < topLevelObjects_.size(); i++)
+    {
+        delete topLevelObjects_[i];
+    }
+    delete random_;
+}
+
+void SourceContext::makerand(byte *bytes, size_t len)
+{
+    random_->generate(bytes, len);
+}
+
+void SourceContext::setSeed(const string &seed)
+{
+    byte digest[SHA1::DIGESTSIZE];
+    SHA1().CalculateDigest(digest, (const byte *)seed.data(), seed.length());
+    memcpy(seed_, digest, KEY_SIZE);
+    hasSeed_ = true;
+
+    delete random_;
+    random_ = new SourceRandom(seed_, CONTEXT_RANDOM_STREAM);
+}
+
+// adds the length and contents of the file at path to hash
+static bool hashFile(SHA1 &hash, const string &path)
+{
+    ifstream in(path.c_str(), ios::in|ios::binary);
+    if (in.fail())
+    {
+        return false;
+    }
+
+    in.seekg(0, ios::end);
+    unsigned long long len = (unsigned long long)in.tellg();
+    in.seekg(0);
+    canonicalizeEndianness(len);
+    hash.Update((const byte *)&len, sizeof(len));
+
+    vector<char> buf(1024 * 1024);
+    while (in.read(&buf[0], buf.size()) || in.gcount() > 0)
+    {
+        hash.Update((const byte *)&buf[0], (size_t)in.gcount());
+    }
+    return in.eof();
+}
+
+bool SourceContext::seedFromInput(const string &path)
+{
+    if (!hasSeed_)
+    {
+        return true;
+    }
+
+    SHA1 hash;
+    hash.Update(seed_, KEY_SIZE);
+
+    // the options that change the records: the synonyms and the objects that were pruned
+    byte canonical = canonicalSynonyms_ ? 1 : 0;
+    hash.Update(&canonical, 1);
+    unsigned long long numPruned = prunedIds_.size();
+    canonicalizeEndianness(numPruned);
+    hash.Update((const byte *)&numPruned, sizeof(numPruned));
+    for (size_t i = 0; i < prunedIds_.size(); i++)
+    {
+        unsigned long long len = prunedIds_[i].length();
+        canonicalizeEndianness(len);
+        hash.Update((const byte *)&len, sizeof(len));
+        hash.Update((const byte *)prunedIds_[i].data(), prunedIds_[i].length());
+    }
+
+    if (!hashFile(hash, path))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < allFiles_.size(); i++)
+    {
+        if (!allFiles_[i]->pruned() && !hashFile(hash, allFiles_[i]->src))
+        {
+            return false;
+        }
+    }
+
+    byte digest[SHA1::DIGESTSIZE];
+    hash.Final(digest);
+    memcpy(seed_, digest, KEY_SIZE);
+
+    delete random_;
+    random_ = new SourceRandom(seed_, CONTEXT_RANDOM_STREAM);
+    return true;
+}
+
+void SourceContext::setKeyStore(SourceKeyStore *keyStore)
+{
+    keyStore_ = keyStore;
+    memcpy(seed_, keyStore->seed(), KEY_SIZE);
+
+    // the keys of new objects are drawn from a stream that no earlier compile has used
+    delete random_;
+    random_ = new SourceRandom(seed_, CONTEXT_RANDOM_STREAM - keyStore->generation());
+}
+
+bool SourceContext::getBoolAttribute(const Attributes &attributes, SourceAttribute key, bool required, bool def)
+{
+    string str = getAttribute(attributes, key, required, "");
+    if (str.empty())
+    {
+        return def;
+    }
+    else
+    {
+        transformLower(str);
+        if (str == "false" || str == "0" || str == "no") 
+            return false;
+        else if (str == "true" || str == "1" || str == "yes") 
+            return true;
+        else 
+            throw InvalidSourceException(string() + "'" + str + "' is not a valid boolean value.");
+    }
+}
+
+string SourceContext::getAttribute(const Attributes &attributes, SourceAttribute key, bool required, const char *def)
+{
+    if (attributes[key])
+    {
+        return attributes[key];
+    }
+    else
+    {
+        if (required)
+        {
+            throw InvalidSourceException(string() + "Missing required attribute '" + attributeNames[key] + "' for element '" + elementNames[elemStack_.back()] + "'");
+        }
+
+        return def;
+    }
+}
+
+SourceLocation *SourceContext::topLocation()
+{
+    assert(!objectStack_.empty() && objectStack_.back()->type() == ObjectTypeLocation);
+    return static_cast<SourceLocation *>(objectStack_.back());
+}
+
+SourceAction *SourceContext::topAction()
+{
+    assert(!objectStack_.empty() && objectStack_.back()->type() == ObjectTypeAction);
+    return static_cast<SourceAction *>(objectStack_.back());
+}
+
+SourceItem *SourceContext::topItem()
+{
+    assert(!objectStack_.empty() && objectStack_.back()->type() == ObjectTypeItem);
+    return static_cast<SourceItem *>(objectStack_.back());
+}
+
+void SourceContext::startElement(const char *name, const char **atts)
+{
+    SourceElement elem = (SourceElement)findName(elementNames, NUM_ELEMENTS, name);
+
+    if (elemStack_.empty())
+    {
+        if (elem != ElementAdventure)
+        {
+            throw InvalidSourceException("The root element was not named 'adventure'");
+        }
+    }
+    else if (elem == NUM_ELEMENTS || !nestingMatrix.isValid(elem, elemStack_.back()))
+    {
+        string lowerName = name;
+        transformLower(lowerName);
+        throw InvalidSourceException(string() + "The '" + lowerName + "' tag cannot appear under a '" + elementNames[elemStack_.back()] + "' tag.");
+    }
+
+    // attributes that the element doesn't use are ignored
+    Attributes attributes;
+    memset(attributes, 0, sizeof(attributes));
+    for (const char **curAtt = atts; *curAtt; curAtt += 2)
+    {
+        int key = findName(attributeNames, NUM_ATTRIBUTES, curAtt[0]);
+        if (key != NUM_ATTRIBUTES)
+        {
+            attributes[key] = curAtt[1];
+        }
+    }
+
+    SourceElement parent = elemStack_.empty() ? elem : elemStack_.back();
+    elemStack_.push_back(elem);
+
+    if (elementHandlers_[elem].start)
+    {
+        (this->*elementHandlers_[elem].start)(parent, attributes);
+    }
+}
+
+void SourceContext::startLocation(SourceElement parent, const Attributes &attributes)
+{
+    SourceLocation *newLoc;
+    if (parent == ElementLocation)
+    {
+        newLoc = topLocation()->newChildLocation();            
+    }
+    else
+    {
+        newLoc = new SourceLocation(*this);
+        topLevelObjects_.push_back(newLoc);
+    }
+
+    newLoc->id = getAttribute(attributes, AttributeId);
+    newLoc->prompt = getAttribute(attributes, AttributePrompt, false);
+    newLoc->startId = getAttribute(attributes, AttributeStart, false);
+    newLoc->title = getAttribute(attributes, AttributeTitle, false);
+
+    objectStack_.push_back(newLoc);
+    allLocations_.push_back(newLoc);
+}
+
+void SourceContext::startSynonyms(SourceElement parent, const Attributes &attributes)
+{
+    topLocation()->synonyms.push_back(set<string>());
+}
+
+void SourceContext::startAdventure(SourceElement parent, const Attributes &attributes)
+{
+    gameName = getAttribute(attributes, AttributeName);
+    startId_ = getAttribute(attributes, AttributeStart, false);
+}
+
+void SourceContext::startIgnored(SourceElement parent, const Attributes &attributes)
+{
+    topLocation()->addIgnored(getAttribute(attributes, AttributeToken));
+}
+
+void SourceContext::startAction(SourceElement parent, const Attributes &attributes)
+{
+    SourceAction *action = topLocation()->newChildAction();       
+
+    bool allowBlankCommand = true;
+    if (getBoolAttribute(attributes, AttributeForced, false, false))
+    {
+        action->commands.push_back(FORCED_COMMAND);
+        allowBlankCommand = false;
+    }
+
+    if (getBoolAttribute(attributes, AttributeFirstVisit, false, false))
+    {
+        action->commands.push_back(FIRST_VISIT_COMMAND);
+        allowBlankCommand = false;
+    }
+
+    if (getBoolAttribute(attributes, AttributeReturnVisit, false, false))
+    {
+        action->commands.push_back(RETURN_VISIT_COMMAND);
+        allowBlankCommand = false;
+    }
+
+    string cmd = getAttribute(attributes, AttributeCmd, false);
+
+    if (allowBlankCommand || !cmd.empty())
+    {
+        action->commands.push_back(cmd);
+    }
+
+    action->exact = getBoolAttribute(attributes, AttributeExact, false, false);
+    action->destId = getAttribute(attributes, AttributeDest, false);
+
+    string actionTypeStr = getAttribute(attributes, AttributeType, false);
+    transformLower(actionTypeStr);
+
+    bool validActionType = false;
+    for (size_t i = 0; i < sizeof(validActionTypes)/sizeof(validActionTypes[0]); i++)
+    {
+        if (validActionTypes[i].str == actionTypeStr)
+        {
+            action->actionType = validActionTypes[i].val;
+            validActionType = true;
+        }
+    }
+    if (!validActionType)
+    {
+        throw InvalidSourceException(string() + "'" + actionTypeStr + "' is not a valid action type.");            
+    }
+
+    // make a conjunction for all the "needs" tags that aren't inside an "or" tag
+    action->predicateIds.push_back(UnresolvedConjunction());
+
+    objectStack_.push_back(action);
+}
+
+void SourceContext::startOr(SourceElement parent, const Attributes &attributes)
+{
+    topAction()->predicateIds.push_back(UnresolvedConjunction());
+}
+
+void SourceContext::startAux(SourceElement parent, const Attributes &attributes)
+{
+    curAuxKey_ = getAttribute(attributes, AttributeKey);
+}
+
+void SourceContext::startNeeds(SourceElement parent, const Attributes &attributes)
+{
+    SourceAction *parentAction = topAction();
+
+    UnresolvedConjunction &conj = (parent == ElementAction) 
+        ? parentAction->predicateIds[0] : parentAction->predicateIds.back();
+
+    conj.push_back(getAttribute(attributes, AttributeItem));
+}
+
+void SourceContext::startTakes(SourceElement parent, const Attributes &attributes)
+{
+    topAction()->takesIds.push_back(getAttribute(attributes, AttributeItem));
+}
+
+void SourceContext::startDrops(SourceElement parent, const Attributes &attributes)
+{
+    topAction()->dropsIds.push_back(getAttribute(attributes, AttributeItem));
+}
+
+void SourceContext::startItem(SourceElement parent, const Attributes &attributes)
+{
+    SourceItem *item = topLocation()->newChildItem();       
+
+    item->id = getAttribute(attributes, AttributeId);
+
+    item->title = getAttribute(attributes, AttributeTitle, false);
+
+    if (!item->title.empty())
+    {
+        item->titles.push_back(item->title);
+    }
+    item->restrictTake = getBoolAttribute(attributes, AttributeRestrictTake, false, true);
+    item->visible = getBoolAttribute(attributes, AttributeVisible, false, true);
+
+    objectStack_.push_back(item);
+    allItems_.push_back(item);
+}
+
+void SourceContext::startAlt(SourceElement parent, const Attributes &attributes)
+{
+    if (parent == ElementItem)
+    {
+        topItem()->titles.push_back(getAttribute(attributes, AttributeTitle));
+    }
+    else
+    {
+        topAction()->commands.push_back(getAttribute(attributes, AttributeCmd));
+    }
+}
+
+void SourceContext::startFile(SourceElement parent, const Attributes &attributes)
+{
+    SourceFile *file = new SourceFile(*this);
+
+    file->id = getAttribute(attributes, AttributeId);
+    file->src = getAttribute(attributes, AttributeSrc);
+    file->dest = getAttribute(attributes, AttributeDest, false);
+
+    topLevelObjects_.push_back(file);
+    objectStack_.push_back(file);
+    allFiles_.push_back(file);
+}
+
+void SourceContext::startExtracts(SourceElement parent, const Attributes &attributes)
+{
+    string fileId = getAttribute(attributes, AttributeFile);
+    bool launch = getBoolAttribute(attributes, AttributeLaunch, false, true);
+    
+    topAction()->fileIds.push_back(pair<string, bool>(fileId, launch));
+}
+
+template <typename SourceType>
+SourceType *resolveId(const map<string, SourceType *> &map, const string &typeDesc, const string &id)
+{
+    if (id.empty())
+    {  
+        return NULL;
+    }
+
+    // typename map<string, SourceType *>::const_iterator it = map.find(id); // why doesn't this compile?
+    if (map.find(id) == map.end())
+    {
+        throw InvalidSourceException(string() + "Could not resolve reference to "+typeDesc+" '"+id+"'");
+    }
+    return map.find(id)->second;
+}
+
+SourceLocation *SourceContext::getLocationById(const std::string &id)
+{
+    return resolveId(locationsMap_, "location", id);
+}
+
+SourceItem *SourceContext::getItemById(const std::string &id)
+{
+    return resolveId(itemsMap_, "item", id);
+}
+
+SourceFile *SourceContext::getFileById(const std::string &id)
+{
+    return resolveId(filesMap_, "file", id);
+}
+
+void SourceContext::endElement()
+{
+    SourceElement elem = elemStack_.back();
+
+    if (elementHandlers_[elem].hasObject)
+    {
+        objectStack_.pop_back();
+    }
+    else if (elem == ElementS)
+    {
+        if (!curSynonym_.empty())
+        {
+            topLocation()->synonyms.back().insert(curSynonym_);
+            curSynonym_.clear();
+        }
+    }
+
+    elemStack_.pop_back();
+}
+
+void trimTabs(string &str)
+{
+    // split lines.
+
+    vector<string> lines;
+
+    size_t start = 0;
+    while (true)
+    {
+        size_t newLine = str.find_first_of("\n", start);
+
+        if (newLine == string::npos)
+        {
+            lines.push_back(str.substr(start));
+            break;
+        }
+
+        lines.push_back(str.substr(start, newLine - start + 1));        
+        start = newLine + 1;
+    }
+
+    // count # of whitespace characters at the start of each line that contains non-whitespace. 
+    // find the minimum of these counts.
+
+    bool dedent = false;
+    size_t minSpaces = 999999;
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        size_t numSpaces = lines[i].find_first_not_of("\t\r\n ");
+        if (numSpaces != string::npos)
+        {
+            if (numSpaces < minSpaces)
+            {
+                dedent = true;
+                minSpaces = numSpaces;
+            }
+        }
+    }
+
+    // trim that number of characters off the beginning of each line, and any whitespace from the end.
+    str = "";
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        size_t lastNonWhitespace = lines[i].find_last_not_of(" \r\n\t");
+
+        if (lastNonWhitespace != string::npos && lastNonWhitespace >= minSpaces)
+        {
+            str.append(lines[i].substr(minSpaces, lastNonWhitespace - minSpaces + 1));
+        }
+        str.append("\n");
+    }
+
+    // strip newlines at beginning and end
+    size_t lastNonNewLine = str.find_last_not_of('\n');
+    if (lastNonNewLine != string::npos)
+    {
+        str.erase(lastNonNewLine + 1);
+        
+        size_t firstNonNewLine = str.find_first_not_of('\n');
+        if (firstNonNewLine != string::npos)
+        {
+            str.erase(0, firstNonNewLine);
+        }
+    }
+    else 
+    {
+        str = "";
+    }
+}
+
+static bool isWhitespace(const char *text, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (text[i] != '\t' && text[i] != '\r' && text[i] != '\n' && text[i] != ' ')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SourceContext::handleText(const char *text, size_t len)
+{
+    if (elemStack_.empty())
+    {        
+        if (isWhitespace(text, len))
+        {
+            return;
+        }
+        else
+        {
+            throw InvalidSourceException(string() + "Unexpected text outside of 'adventure' tag: '" + string(text, len) + "'");
+        }
+    }
+
+    SourceElement parentElem = elemStack_.back();
+
+    if (elementHandlers_[parentElem].text)
+    {
+        (this->*elementHandlers_[parentElem].text)(text, len);
+    }
+    else if (!isWhitespace(text, len))
+    {
+        throw InvalidSourceException(string() + "Unexpected text inside '" + elementNames[parentElem] + "' tag: '" + string(text, len) + "'");
+    }
+}
+
+void SourceContext::cleartextText(const char *text, size_t len)
+{
+    gameDesc_.append(text, len);
+}
+
+void SourceContext::synonymText(const char *text, size_t len)
+{
+    curSynonym_.append(text, len);
+}
+
+void SourceContext::actionText(const char *text, size_t len)
+{
+    topAction()->desc.append(text, len);
+}
+
+void SourceContext::locationText(const char *text, size_t len)
+{
+    topLocation()->desc.append(text, len);
+}
+
+void SourceContext::itemText(const char *text, size_t len)
+{
+    topItem()->desc.append(text, len);
+}
+
+void SourceContext::auxText(const char *text, size_t len)
+{
+    topAction()->auxData[curAuxKey_].append(text, len);
+}
+
+template <typename SourceType>
+void insertInIdMap(const vector<SourceType *> &objs, map<string, SourceType *> &map)
+{
+    map.clear();
+    for (size_t i = 0; i < objs.size(); i++)
+    {
+        SourceType *obj = objs[i];
+        const string &id = obj->id;
+
+        if (map.find(id) != map.end())
+        {
+            throw InvalidSourceException(string() + "Duplicate id: " + id);
+        }
+        map[id] = obj;
+    }
+}
+
+void SourceContext::findUnreachable(vector<SourceBase *> &unreachable)
+{
+    set<SourceBase *> reached;
+    vector<SourceBase *> pending;
+    reached.insert(start_);
+    pending.push_back(start_);
+    while (!pending.empty())
+    {
+        SourceBase *object = pending.back();
+        pending.pop_back();
+
+        vector<SourceBase *> references;
+        object->collectReferences(references);
+        for (size_t i = 0; i < references.size(); i++)
+        {
+            if (reached.insert(references[i]).second)
+            {
+                pending.push_back(references[i]);
+            }
+        }
+    }
+
+    vector<SourceBase *> objects;
+    set<SourceBase *> seen;
+    for (size_t i = 0; i < topLevelObjects_.size(); i++)
+    {
+        topLevelObjects_[i]->collect(objects, seen);
+    }
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        if (objects[i]->type() != ObjectTypeAction && reached.find(objects[i]) == reached.end())
+        {
+            unreachable.push_back(objects[i]);
+        }
+    }
+}
+
+void SourceContext::prune(const vector<SourceBase *> &unreachable)
+{
+    for (size_t i = 0; i < unreachable.size(); i++)
+    {
+        unreachable[i]->prune();
+        prunedIds_.push_back(unreachable[i]->stableId());
+
+        // the actions of an unreachable location can't be reached either
+        SourceLocation *loc = dynamic_cast<SourceLocation *>(unreachable[i]);
+        if (loc)
+        {
+            loc->pruneActions();
+        }
+    }
+}
+
+/* The objects being encrypted by SourceContext::write. Each thread takes the next object
+ * that nobody has taken yet, and the records are written in order as they are finished.
+ * The threads stay at most maxAhead objects ahead of the writer, so that the records
+ * waiting to be written don't pile up in memory.
+ */
+struct EncryptionJob
+{
+    EncryptionJob(const vector<SourceBase *> &objects, const vector<char> &skipped, size_t maxAhead)
+        : objects(&objects), skipped(&skipped), records(objects.size()), errors(objects.size()), 
+          done(objects.size()), next(0), written(0), maxAhead(maxAhead) {}
+
+    const vector<SourceBase *> *objects;
+    const vector<char> *skipped; // the objects that the writer copies or streams itself
+    vector<string> records;
+    vector<string> errors; // the message of an exception thrown while encrypting the object
+    vector<char> done;
+    size_t next;
+    size_t written; // the number of objects the writer has finished with
+    size_t maxAhead;
+    Mutex mutex;
+    Event recordDone;
+    Event recordWritten; // a thread that wakes up passes it on to the next one, while there is room
+};
+
+// an exception thrown while encrypting the object is kept in error, so that it doesn't escape a thread
+static void encryptObject(SourceBase *object, string &record, string &error, SourceOutput *out = NULL, string *digest = NULL)
+{
+    try
+    {
+        if (out)
+        {
+            object->streamRecord(*out, digest);
+        }
+        else
+        {
+            object->encryptRecord(record);
+        }
+    }
+    catch (InvalidSourceException &ex)
+    {
+        error = ex.message();
+    }
+    catch (const char *msg)
+    {
+        error = msg;
+    }
+    catch (std::exception &ex)
+    {
+        error = string() + "Could not encrypt the " + object->stableId() + ": " + ex.what();
+    }
+    catch (...)
+    {
+        error = "Could not encrypt the " + object->stableId();
+    }
+
+    if (!error.empty())
+    {
+        record.clear();
+    }
+}
+
+static void encryptObjects(void *arg)
+{
+    EncryptionJob *job = (EncryptionJob *)arg;
+    while (true)
+    {
+        size_t i;
+        {
+            ScopedLock lock(job->mutex);
+            while (job->next < job->objects->size() && job->next - job->written >= job->maxAhead)
+            {
+                job->mutex.unlock();
+                job->recordWritten.wait();
+                job->mutex.lock();
+            }
+            if (job->next >= job->objects->size())
+            {
+                job->recordWritten.set();
+                return;
+            }
+            i = job->next++;
+            if (job->next - job->written < job->maxAhead)
+            {
+                job->recordWritten.set();
+            }
+        }
+
+        string record, error;
+        if (!(*job->skipped)[i])
+        {
+            encryptObject((*job->objects)[i], record, error);
+        }
+
+        {
+            ScopedLock lock(job->mutex);
+            job->records[i].swap(record);
+            job->errors[i] = error;
+            job->done[i] = true;
+        }
+        job->recordDone.set();
+    }
+}
+
+static string recordDigest(const string &record)
+{
+    byte digest[SHA1::DIGESTSIZE];
+    SHA1().CalculateDigest(digest, (const byte *)record.data(), record.length());
+    return string((char *)digest, SHA1::DIGESTSIZE);
+}
+
+// after an error, the threads finish the objects they are encrypting and stop
+static void stopEncryption(EncryptionJob &job, vector<Thread *> &threads)
+{
+    {
+        ScopedLock lock(job.mutex);
+        job.next = job.objects->size();
+    }
+    job.recordWritten.set();
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i]->join();
+        delete threads[i];
+    }
+}
+
+// the number of objects that each thread can encrypt ahead of the writer
+#define OBJECTS_AHEAD_PER_THREAD 4
+
+void SourceContext::write(SourceOutput &out, size_t numThreads)
+{
+    out.writePlaintext(this->gameDesc_);
+
+    out.startEncryptedBlock(canonicalSynonyms_ ? FORMAT_CANONICAL_SYNONYMS : 0);
+
+    vector<SourceBase *> allObjects, objects;
+    set<SourceBase *> seen;
+    for (size_t i = 0; i < topLevelObjects_.size(); i++)
+    {
+        topLevelObjects_[i]->collect(allObjects, seen);
+    }
+    for (size_t i = 0; i < allObjects.size(); i++)
+    {
+        if (!allObjects[i]->pruned())
+        {
+            objects.push_back(allObjects[i]);
+        }
+    }
+
+    vector<char> copied(objects.size());
+    if (keyStore_)
+    {
+        restoreKeys(objects, copied);
+    }
+
+    // the pruned objects are prepared too, since an action may need an item that can't be reached
+    for (size_t i = 0; i < allObjects.size(); i++)
+    {
+        allObjects[i]->prepare();
+    }
+
+    // the records that are too big to keep in memory are encrypted by the writer as it writes them
+    vector<char> streamed(objects.size()), skipped(objects.size());
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        streamed[i] = objects[i]->streamsRecord();
+        skipped[i] = copied[i] || streamed[i];
+    }
+
+    EncryptionJob job(objects, skipped, OBJECTS_AHEAD_PER_THREAD * numThreads);
+    vector<Thread *> threads;
+    for (size_t i = 0; numThreads > 1 && i < numThreads && i < objects.size(); i++)
+    {
+        Thread *thread = new Thread();
+        if (!thread->start(&encryptObjects, &job))
+        {
+            delete thread;
+            break;
+        }
+        threads.push_back(thread);
+    }
+
+    string error;
+    try
+    {
+        for (size_t i = 0; i < objects.size() && error.empty(); i++)
+        {
+            string record;
+            if (skipped[i])
+            {
+                // no need to wait for the thread that skipped it
+            }
+            else if (threads.empty())
+            {
+                encryptObject(objects[i], record, error);
+            }
+            else
+            {
+                while (true)
+                {
+                    {
+                        ScopedLock lock(job.mutex);
+                        if (job.done[i])
+                        {
+                            record.swap(job.records[i]);
+                            error = job.errors[i];
+                            break;
+                        }
+                    }
+                    job.recordDone.wait();
+                }
+            }
+
+            if (!error.empty())
+            {
+                break;
+            }
+
+            off_t offset = out.pos();
+            out.recordObject(objects[i]);
+            bool written = copied[i] && copyRecord(objects[i], offset, out, error);
+            if (!written && streamed[i])
+            {
+                string digest;
+                encryptObject(objects[i], record, error, &out, keyStore_ ? &digest : NULL);
+                if (error.empty() && keyStore_)
+                {
+                    storeKeys(objects[i], offset, (size_t)(out.pos() - offset), digest);
+                }
+            }
+            else if (!written)
+            {
+                if (copied[i])
+                {
+                    // the record in the previous data file was no good after all
+                    encryptObject(objects[i], record, error);
+                }
+                if (error.empty() && (!keyStore_ || storeRecord(objects[i], offset, record, error)))
+                {
+                    out.writeRecord(record);
+                }
+            }
+
+            {
+                ScopedLock lock(job.mutex);
+                job.written = i + 1;
+            }
+            job.recordWritten.set();
+        }
+    }
+    catch (...)
+    {
+        // the threads are stopped before the job goes away
+        stopEncryption(job, threads);
+        throw;
+    }
+    stopEncryption(job, threads);
+
+    if (!error.empty())
+    {
+        throw InvalidSourceException(error);
+    }
+
+    out.setInitialLocation(start_);
+    out.finalize();
+}
+
+// gives the objects the keys they had in the previous compile, and finds the records that can be copied
+void SourceContext::restoreKeys(const vector<SourceBase *> &objects, vector<char> &copied)
+{
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        SourceBase *object = objects[i];
+        const SourceKeyStore::Entry *entry = keyStore_->find(object->stableId());
+        if (!entry)
+        {
+            int gid = keyStore_->newGid();
+            object->restoreKeys(gid, gid, NULL, NULL);
+            continue;
+        }
+
+        // an object whose input has changed gets a new iv before it is encrypted, since the key can't
+        // encrypt the new contents with the same iv (the others are checked by storeRecord)
+        string digest;
+        bool hasDigest = object->inputDigest(digest) && !entry->digest.empty();
+        unsigned int ivStream = (hasDigest && digest != entry->digest) ? (unsigned int)keyStore_->newGid() : entry->ivStream;
+
+        object->restoreKeys(entry->gid, ivStream, entry->key, entry->hasExtraKey ? entry->extraKey : NULL);
+
+        copied[i] = keyStore_->hasPreviousData() && hasDigest && digest == entry->digest;
+    }
+}
+
+/* Copies the record of the object from the previous data file, and returns true, unless the
+ * record there doesn't start with the object's iv. Then the record has to be encrypted instead.
+ */
+bool SourceContext::copyRecord(SourceBase *object, off_t offset, SourceOutput &out, string &error)
+{
+    SourceKeyStore::Entry entry = *keyStore_->find(object->stableId());
+    if (!keyStore_->recordStartsWith(entry, object->recordIv()))
+    {
+        return false;
+    }
+
+    if (!keyStore_->copyRecord(entry, out))
+    {
+        error = "Could not copy the record of the " + object->stableId() + " from the previous data file";
+        return true;
+    }
+    entry.offset = offset;
+    keyStore_->update(object->stableId(), entry);
+    return true;
+}
+
+/* Saves the keys and record of the object. An object without an input digest (see restoreKeys)
+ * is encrypted again if its record has changed since the previous compile.
+ */
+bool SourceContext::storeRecord(SourceBase *object, off_t offset, string &record, string &error)
+{
+    const SourceKeyStore::Entry *previous = keyStore_->find(object->stableId());
+    string digest = recordDigest(record);
+    if (previous && previous->ivStream == object->ivStream() && previous->recordDigest != digest)
+    {
+        // the key can't encrypt the new contents with the same iv
+        object->setIvStream(keyStore_->newGid());
+        encryptObject(object, record, error);
+        if (!error.empty())
+        {
+            return false;
+        }
+        digest = recordDigest(record);
+    }
+
+    storeKeys(object, offset, record.length(), digest);
+    return true;
+}
+
+void SourceContext::storeKeys(SourceBase *object, off_t offset, size_t length, const string &digest)
+{
+    SourceKeyStore::Entry entry;
+    entry.gid = object->gid();
+    entry.ivStream = object->ivStream();
+    memcpy(entry.key, object->key(), KEY_SIZE);
+
+    byte *extraKey = object->extraKey();
+    entry.hasExtraKey = (extraKey != NULL);
+    if (extraKey)
+    {
+        memcpy(entry.extraKey, extraKey, KEY_SIZE);
+    }
+
+    object->inputDigest(entry.digest);
+    entry.recordDigest = digest;
+    entry.offset = offset;
+    entry.length = length;
+    keyStore_->update(object->stableId(), entry);
+}
+
+bool isOkGameNameChar(char c)
+{
+    return isOkFilenameChar(c) && c != '.';
+}
+
+void SourceContext::resolve()
+{
+    if (allLocations_.empty())
+    {
+        throw InvalidSourceException("The adventure requires at least one location.");
+    }    
+
+    insertInIdMap(allLocations_, locationsMap_);
+    insertInIdMap(allItems_, itemsMap_);
+    insertInIdMap(allFiles_, filesMap_);
+
+    for (size_t i = 0; i < gameName.size(); i++)
+    {
+        if (!isOkGameNameChar(gameName[i]))
+            throw InvalidSourceException(string() + "Invalid character in adventure name: " + gameName[i]);
+    }
+
+    start_ = getLocationById(startId_);
+
+    bool startIsTopLevel = false;
+
+    for (size_t i = 0; i < topLevelObjects_.size(); i++)
+    {
+        SourceLocation *loc = dynamic_cast<SourceLocation *>(topLevelObjects_[i]);
+
+        if (loc)
+        {
+            if (!start_)
+            {
+                start_ = loc;
+            }
+
+            if (loc == start_)
+            {
+                startIsTopLevel = true;
+                break;
+            }
+        }
+    }
+
+    if (!startIsTopLevel)
+    {
+        throw InvalidSourceException(string() + "Start location " +startId_+ " is not a direct child of the <adventure> tag");
+    }
+
+    trimTabs(gameDesc_);
+    for (size_t i = 0; i < topLevelObjects_.size(); i++)
+    {
+        topLevelObjects_[i]->resolve();
+    }    
+}
+
+byte *SourceBase::key()
+{
+    if (!key_)
+    {
+        key_ = new byte[KEY_SIZE];
+        generateKey(key_);
+    }
+    return key_;
+}
+
+void SourceBase::restoreKeys(int gid, unsigned int ivStream, const byte *key, const byte *extraKey)
+{
+    gid_ = gid;
+    ivStream_ = ivStream;
+    if (key)
+    {
+        if (!key_)
+        {
+            key_ = new byte[KEY_SIZE];
+        }
+        memcpy(key_, key, KEY_SIZE);
+    }
+    if (extraKey)
+    {
+        restoreExtraKey(extraKey);
+    }
+}
+
+void SourceBase::collect(vector<SourceBase *> &objects, set<SourceBase *> &seen)
+{
+    if (!seen.insert(this).second)
+    {
+        return;
+    }
+    objects.push_back(this);
+
+    collectChildren(objects, seen);
+}
+
+void SourceBase::prepare()
+{
+    keyhash();
+}
+
+string SourceBase::recordIv()
+{
+    byte iv[AES::BLOCKSIZE];
+    SourceRandom(ctx_->seed(), ivStream_).generate(iv, AES::BLOCKSIZE);
+    return string((char *)iv, AES::BLOCKSIZE);
+}
+
+void SourceBase::encryptRecord(string &record)
+{
+    SourceRandom random(ctx_->seed(), ivStream_);
+    random_ = &random;
+
+    byte iv[AES::BLOCKSIZE];
+   
+    makeiv(iv);
+
+    //cout << "writing object with gid " << this->gid_ << endl;
+
+    record.assign((char *)iv, AES::BLOCKSIZE);
+
+    //cout << "write iv: ";
+    //debugBinary(iv, AES::BLOCKSIZE);
+
+    //cout << "write key: ";
+    //debugBinary(this->key(), KEY_SIZE);
+
+    // the plaintext is written after the iv, and encrypted where it is
+    writeVal<int>(record, DEBUG_MAGIC);
+
+    this->serialize(record);
+
+    encryptFrom(record, AES::BLOCKSIZE, this->key(), iv);
+
+    random_ = NULL;
+}
+
+void SourceBase::writeBytes(string &record, const byte *bytes, size_t len)
+{
+    record.append((const char *)bytes, len);
+}
+
+void SourceBase::writeString(string &record, const string &str)
+{
+    writeVal<size_t>(record, str.length());
+    record.append(str);
+}
+
+void SourceBase::writeText(string &record, const string &text)
+{
+    GameTemplate tmpl(text);
+    string bytecode;
+    tmpl.encode(bytecode);
+    writeString(record, bytecode);
+}
+
+void SourceBase::encryptFrom(string &record, size_t start, const byte *key, const byte *iv)
+{
+    if (start < record.length())
+    {
+        CFB_Mode<AES>::Encryption cfbEncryption(key, KEY_SIZE, iv);
+        byte *plaintext = (byte *)&record[start];
+        cfbEncryption.ProcessData(plaintext, plaintext, record.length() - start);
+    }
+}
+
+void SourceBase::checkText(const string &text)
+{
+    GameTemplate tmpl;
+    string var;
+    if (!tmpl.parse(text, &var))
+    {
+        throw InvalidSourceException(string() + "Unknown variable {" + var + "} in text: '" + text + "'");
+    }
+}
+
+void SourceBase::collectChildren(vector<SourceBase *> &objects, set<SourceBase *> &seen)
+{
+}
+
+
+void SourceBase::generateKey(byte *outputKey)
+{    
+    ctx_->makerand(outputKey, KEY_SIZE); 
+    // we hope that this key and its hash are unique for this game (TODO: verify this)
+}
+
+void SourceBase::makeiv(byte *iv)
+{
+    random_->generate(iv, AES::BLOCKSIZE);
+}
+
+SourceLocation::~SourceLocation()
+{
+    for (size_t i = 0; i < locations_.size(); i++)
+    {
+        delete locations_[i];
+    }
+    for (size_t i = 0; i < actions_.size(); i++)
+    {
+        delete actions_[i];
+    }
+    for (size_t i = 0; i < mergedSynonyms_.size(); i++)
+    {
+        delete mergedSynonyms_[i];
+    }
+}
+
+SourceLocation *SourceLocation::newChildLocation()
+{
+    SourceLocation *loc = new SourceLocation(*ctx_, this);
+    locations_.push_back(loc);
+    return loc;
+}
+
+SourceAction *SourceLocation::newChildAction()
+{
+    SourceAction *act = new SourceAction(*ctx_, this, actions_.size());
+    actions_.push_back(act);
+    return act;
+}
+
+SourceItem *SourceLocation::newChildItem()
+{
+    SourceItem *item = new SourceItem(*ctx_, this);
+    items_.push_back(item);
+    return item;
+}
+
+const set<string> *SourceLocation::getSynonyms(const string &token)
+{
+    assert(synonymIndex_);
+
+    SynonymIndex::const_iterator it = synonymIndex_->find(token);
+    return (it != synonymIndex_->end()) ? it->second : NULL;
+}
+
+void SourceLocation::makeSynonymIndex()
+{
+    SourceLocation *parentLoc = this->sourceParent();
+    static const SynonymIndex emptyIndex;
+    const SynonymIndex *parentIndex = parentLoc ? parentLoc->synonymIndex_ : &emptyIndex;
+
+    if (synonyms.empty())
+    {
+        synonymIndex_ = parentIndex;
+        return;
+    }
+
+    // a token's synonyms are those of the first group here that has it, merged with its
+    // synonyms at the parent. tokens that only have synonyms at the parent keep the parent's.
+    ownSynonymIndex_ = *parentIndex;
+    set<string> localTokens;
+    map<pair<size_t, const set<string> *>, set<string> *> merged;
+    for (size_t i = 0; i < synonyms.size(); i++)
+    {
+        for (set<string>::const_iterator it = synonyms[i].begin(); it != synonyms[i].end(); ++it)
+        {
+            if (!localTokens.insert(*it).second)
+            {
+                continue;
+            }
+
+            SynonymIndex::const_iterator pit = parentIndex->find(*it);
+            if (pit == parentIndex->end())
+            {
+                ownSynonymIndex_[*it] = &synonyms[i];
+                continue;
+            }
+
+            set<string> *&mergedSynonyms = merged[make_pair(i, pit->second)];
+            if (!mergedSynonyms)
+            {
+                mergedSynonyms = new set<string>(synonyms[i]);
+                mergedSynonyms->insert(pit->second->begin(), pit->second->end());
+                mergedSynonyms_.push_back(mergedSynonyms);
+            }
+            ownSynonymIndex_[*it] = mergedSynonyms;
+        }
+    }
+    synonymIndex_ = &ownSynonymIndex_;
+}
+
+void SourceLocation::resolve()
+{
+    trimTabs(desc);
+    checkText(title);
+    checkText(desc);
+    checkText(prompt);
+    for (size_t i = 0; i < synonyms.size(); i++)
+    {
+        set<string> &synonymsSet = synonyms[i];
+        set<string> synonymsCopy = synonymsSet;
+        synonymsSet.clear();
+        for (set<string>::const_iterator it = synonymsCopy.begin(); it != synonymsCopy.end(); ++it)
+        {
+            string syn = *it;
+            trimTabs(syn);
+            transformLower(syn);
+            synonymsSet.insert(syn);
+        }
+    }
+
+    // the children are resolved after this, so the parent's index is always ready
+    makeSynonymIndex();
+
+    if (ctx_->canonicalSynonyms() && !synonyms.empty())
+    {
+        makeCanonicalSynonyms();
+    }
+
+    start = ctx_->getLocationById(startId);
+    if (start)
+    {
+        bool startAtImmediateChild = false;
+        for (size_t i = 0; i < locations_.size(); i++)
+        {
+            if (start == locations_[i])
+            {
+                startAtImmediateChild = true;
+                break;
+            }
+        }
+        if (!startAtImmediateChild)
+        {
+            throw InvalidSourceException(string() + " start id '" + startId + "' is not an immediate child of '" +id+ "'");
+        }
+    }
+
+    for (size_t i = 0; i < items_.size(); i++)
+    {
+        items_[i]->resolve();
+    }
+    for (size_t i = 0; i < actions_.size(); i++)
+    {
+        actions_[i]->resolve();
+    }
+    for (size_t i = 0; i < locations_.size(); i++)
+    {
+        locations_[i]->resolve();
+    }
+}
+
+// the first phrase (in alphabetical order) of the merged synonym group that phrase is in,
+// where groups maps each phrase to another phrase of its group that comes before it
+static string findSynonymGroup(map<string, string> &groups, const string &phrase)
+{
+    map<string, string>::iterator it = groups.find(phrase);
+    if (it == groups.end())
+    {
+        groups[phrase] = phrase;
+        return phrase;
+    }
+    if (it->second == phrase)
+    {
+        return phrase;
+    }
+
+    string first = findSynonymGroup(groups, it->second);
+    it->second = first;
+    return first;
+}
+
+static void mergeSynonymGroups(map<string, string> &groups, const string &phrase1, const string &phrase2)
+{
+    string first1 = findSynonymGroup(groups, phrase1);
+    string first2 = findSynonymGroup(groups, phrase2);
+    if (first1 < first2)
+    {
+        groups[first2] = first1;
+    }
+    else if (first2 < first1)
+    {
+        groups[first1] = first2;
+    }
+}
+
+void SourceLocation::makeCanonicalSynonyms()
+{
+    // the groups of this location and its ancestors that share a phrase are merged
+    map<string, string> groups;
+    for (SourceLocation *loc = this; loc != NULL; loc = loc->sourceParent())
+    {
+        for (size_t i = 0; i < loc->synonyms.size(); i++)
+        {
+            string firstPhrase;
+            for (set<string>::const_iterator it = loc->synonyms[i].begin(); it != loc->synonyms[i].end(); ++it)
+            {
+                // phrases are tokenized like the player's commands
+                vector<string> tokens;
+                tokenize(*it, tokens);
+                string phrase;
+                concatenateTokens(tokens, phrase);
+                if (phrase.empty())
+                {
+                    continue;
+                }
+
+                if (firstPhrase.empty())
+                {
+                    firstPhrase = phrase;
+                }
+                mergeSynonymGroups(groups, firstPhrase, phrase);
+            }
+        }
+    }
+
+    // every phrase is stored, even if it is canonical, so that a longer phrase is never
+    // mistaken for a shorter one that starts it
+    for (map<string, string>::const_iterator it = groups.begin(); it != groups.end(); ++it)
+    {
+        addCanonicalSynonym(it->first, findSynonymGroup(groups, it->first));
+    }
+}
+
+void SourceLocation::addIgnored(const string &token)
+{
+    string lowerToken = token;
+    // TODO: normalize spaces
+    transformLower(lowerToken);
+    ignoredSet_.insert(lowerToken);
+}
+
+
+void SourceLocation::serialize(string &record)
+{
+    char hasStart = (this->start) ? 1 : 0;
+    record += hasStart;
+
+    if (hasStart)
+    {
+        writeBytes(record, this->start->key(), KEY_SIZE);
+    }
+    writeText(record, title);
+    writeText(record, desc);
+    writeText(record, prompt);
+    
+    size_t numIgnored = ignoredSet_.size();
+    writeVal<size_t>(record, numIgnored);
+    for (set<string>::const_iterator it = ignoredSet_.begin(); it != ignoredSet_.end(); ++it)
+    {
+        writeString(record, *it);
+    }
+
+    if (ctx_->canonicalSynonyms())
+    {
+        writeVal<size_t>(record, canonicalSynonyms_.size());
+        for (map<string, string>::const_iterator it = canonicalSynonyms_.begin(); it != canonicalSynonyms_.end(); ++it)
+        {
+            writeString(record, it->first);
+            writeString(record, it->second);
+        }
+    }
+
+    vector<SourceLocation *> childLocations;
+    for (size_t i = 0; i < locations_.size(); i++)
+    {
+        if (!locations_[i]->pruned())
+        {
+            childLocations.push_back(locations_[i]);
+        }
+    }
+
+    size_t numChildLocations = childLocations.size();
+    writeVal<size_t>(record, numChildLocations);
+    for (size_t i = 0; i < numChildLocations; i++)
+    {
+        //cout << "location " << this->gid() << " has child with keyhash ";
+        //debugBinary(childLocations[i]->keyhash(), KEYHASH_SIZE);
+
+        writeBytes(record, childLocations[i]->keyhash(), KEYHASH_SIZE);
+        writeVal<int>(record, childLocations[i]->gid());
+    }
+
+    size_t numItems = items_.size();
+    writeVal<size_t>(record, numItems);
+    for (size_t i = 0; i < numItems; i++)
+    {
+        writeBytes(record, items_[i]->key(), KEY_SIZE);
+    }
+
+    vector<ExpandedAction> expandedActions;
+    this->getExpandedActions(expandedActions);
+    size_t numExpandedActions = expandedActions.size();
+    writeVal<size_t>(record, numExpandedActions);
+
+    for (size_t i = 0; i < numExpandedActions; i++)
+    {
+        ExpandedAction &expAction = expandedActions[i];
+        byte cmdKey[KEY_SIZE];
+        byte cmdKeyHash[KEYHASH_SIZE];
+        commandKey(expAction.cmd, cmdKey);
+
+        //cout << expAction.cmd << endl;
+
+        hashKey(cmdKey, cmdKeyHash);
+        writeBytes(record, cmdKeyHash, KEYHASH_SIZE);
+
+        byte iv[AES::BLOCKSIZE];
+        makeiv(iv);
+        
+        writeBytes(record, iv, AES::BLOCKSIZE);
+
+        byte gidBlock[AES::BLOCKSIZE];
+        memset(gidBlock, 0, AES::BLOCKSIZE);
+        int gid = expAction.action->gid();
+        canonicalizeEndianness(gid);
+
+        byte exact = expAction.action->exact ? 1 : 0;
+
+        *gidBlock = exact;
+        *((int *)gidBlock + 1) = gid;        
+        
+        // the gid block and the action's key, encrypted by the command key
+        size_t start = record.length();
+        writeBytes(record, gidBlock, AES::BLOCKSIZE);
+        writeBytes(record, expAction.action->key(), AES::BLOCKSIZE);
+        encryptFrom(record, start, cmdKey, iv);
+    }
+}
+
+void SourceLocation::pruneActions()
+{
+    for (size_t i = 0; i < actions_.size(); i++)
+    {
+        actions_[i]->prune();
+    }
+}
+
+void SourceLocation::collectReferences(vector<SourceBase *> &references)
+{
+    // the child locations are only listed by keyhash, so they are reached through their start or a path
+    if (start)
+    {
+        references.push_back(start);
+    }
+    references.insert(references.end(), items_.begin(), items_.end());
+    references.insert(references.end(), actions_.begin(), actions_.end());
+}
+
+void SourceLocation::collectChildren(vector<SourceBase *> &objects, set<SourceBase *> &seen)
+{
+    for (size_t i = 0; i < locations_.size(); i++)
+    {
+        locations_[i]->collect(objects, seen);
+    }
+
+    for (size_t i = 0; i < items_.size(); i++)
+    {
+        items_[i]->collect(objects, seen);
+    }
+    
+    for (size_t i = 0; i < actions_.size(); i++)
+    {
+        actions_[i]->collect(objects, seen);
+    }
+}
+
+void SourceLocation::getPath(SourceLocation *other, size_t &levelsUp, vector<SourceLocation *> &locationsDown)
+{
+    vector<SourceLocation *> thisAncestors, otherAncestors;
+    this->getAncestors(thisAncestors);
+    other->getAncestors(otherAncestors);
+
+    while (thisAncestors.size() && otherAncestors.size())
+    {
+        SourceLocation *thisAncestor = thisAncestors.back();
+        SourceLocation *otherAncestor = otherAncestors.back();
+
+        if (thisAncestor != otherAncestor)
+            break;
+
+        thisAncestors.pop_back();
+        otherAncestors.pop_back();
+    }
+
+    levelsUp = thisAncestors.size();
+
+    while (otherAncestors.size())
+    {
+        locationsDown.push_back(otherAncestors.back());
+        otherAncestors.pop_back();
+    }
+}
+
+void SourceLocation::expandStringInternal(vector<string> &tokens, size_t i, vector<string> &commands)
+{
+    if (i >= tokens.size())
+    {
+        // concatenate tokens, joined by space, and append to commands array
+        
+        string cmd;
+        concatenateTokens(tokens, cmd);
+        commands.push_back(cmd);
+    }
+    else
+    {
+        string &token = tokens[i];
+
+        const set<string> *synonyms = getSynonyms(token);
+        if (synonyms)
+        {
+            string origToken = tokens[i];
+            
+            for (set<string>::const_iterator it = synonyms->begin(); it != synonyms->end(); ++it)
+            {
+                tokens[i] = *it;
+                expandStringInternal(tokens, i+1, commands);
+            }
+            tokens[i] = origToken;
+        }
+        else
+        {
+            expandStringInternal(tokens, i+1, commands);
+        }
+    }
+}
+
+void SourceLocation::expandString(const string &str, vector<string> &expanded)
+{
+    vector<string> tokens;
+    tokenize(str, tokens);
+    expandStringInternal(tokens, 0, expanded);
+}
+
+
+void SourceLocation::getExpandedActions(std::vector<ExpandedAction> &expandedActions)
+{
+    size_t numActions = actions_.size();
+    for (size_t i = 0; i < numActions; i++)
+    {
+        SourceAction *action = actions_[i];
+
+        vector<string> &actionCommands = action->commands;
+
+        if (ctx_->canonicalSynonyms())
+        {
+            // the player canonicalizes the command the same way before looking it up
+            set<string> canonicalCommands;
+            for (size_t k = 0; k < actionCommands.size(); k++)
+            {
+                vector<string> tokens;
+                tokenize(actionCommands[k], tokens);
+                canonicalize(tokens);
+
+                string cmd;
+                concatenateTokens(tokens, cmd);
+                if (canonicalCommands.insert(cmd).second)
+                {
+                    expandedActions.push_back(ExpandedAction(action, cmd));
+                }
+            }
+            continue;
+        }
+
+        for (size_t k = 0; k < actionCommands.size(); k++)
+        {
+            vector<string> expandedCommands;            
+            expandString(actionCommands[k], expandedCommands);
+
+            for (size_t j = 0; j < expandedCommands.size(); j++)
+            {
+                expandedActions.push_back(ExpandedAction(action, expandedCommands[j]));
+            }
+        }
+    }
+}
+
+void SourceLocation::getAncestors(vector<SourceLocation *> &ancestors)
+{
+    SourceLocation *cur = this;
+    while (cur != NULL)
+    {
+        ancestors.push_back(cur);
+        cur = cur->sourceParent();
+    }
+}
+
+void SourceAction::resolveConjunction(const UnresolvedConjunction &ids, Conjunction &conj)
+{
+    conj.clear();
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        conj.push_back(ctx_->getItemById(ids[i]));
+    }
+}
+
+// all aux data is printed as story text, except for save names
+static bool isTextAuxKey(const string &key)
+{
+    return key != "savename";
+}
+
+void SourceAction::resolve()
+{
+    trimTabs(desc);
+    checkText(desc);
+
+    for (map<string,string>::iterator it = auxData.begin(); it != auxData.end(); ++it)
+    {
+        trimTabs(it->second);
+        if (isTextAuxKey(it->first))
+        {
+            checkText(it->second);
+        }
+    }
+
+    dest = ctx_->getLocationById(destId);
+
+    predicate.clear();
+    for (size_t i = 0; i < predicateIds.size(); i++)
+    {
+        UnresolvedConjunction &conjIds = predicateIds[i];
+        if (conjIds.size())
+        {
+            predicate.push_back(Conjunction());
+            resolveConjunction(conjIds, predicate.back());
+        }
+    }
+
+    files.clear();
+    for (size_t i = 0; i < fileIds.size(); i++)
+    {
+        files.push_back(pair<SourceFile *, bool>(ctx_->getFileById(fileIds[i].first), fileIds[i].second));
+    }
+
+    resolveConjunction(takesIds, takes);
+    resolveConjunction(dropsIds, drops);
+}
+
+
+
+byte *SourceAction::dokey() // the key that you get when you are allowed to take the object
+{
+    if (!dokey_)
+    {
+        dokey_ = new byte[KEY_SIZE];
+        generateKey(dokey_);
+    }
+    return dokey_;
+}
+
+void SourceAction::restoreExtraKey(const byte *extraKey)
+{
+    if (!dokey_)
+    {
+        dokey_ = new byte[KEY_SIZE];
+    }
+    memcpy(dokey_, extraKey, KEY_SIZE);
+}
+
+string SourceAction::stableId()
+{
+    ostringstream id;
+    id << sourceParent()->stableId() << " action " << index_;
+    return id.str();
+}
+
+void SourceAction::prepare()
+{
+    SourceBase::prepare();
+    dokey();
+}
+
+void SourceAction::serialize(string &record)
+{
+    size_t predicateSize = predicate.size();
+    writeVal<size_t>(record, predicateSize);
+
+    // if there are no predicates in order to do this action, just give them the dokey directly
+    if (predicateSize == 0)
+    {
+        writeBytes(record, dokey(), KEY_SIZE);
+    }
+
+    byte iv[AES::BLOCKSIZE];
+
+    for (size_t i = 0; i < predicateSize; i++)
+    {
+        Conjunction &conjunction = predicate[i];
+        size_t conjunctionSize = conjunction.size();
+        writeVal<size_t>(record, conjunctionSize);
+   
+        // record the takey hash for each item used in this conjunction
+        for (size_t j = 0; j < conjunctionSize; j++)
+        {
+            SourceItem *requiredItem = conjunction[j];
+            writeBytes(record, requiredItem->takeyhash(), KEYHASH_SIZE);
+        }
+
+        byte conjunctionKey[KEY_SIZE];
+        makeConjunctionKey(conjunction, conjunctionKey);
+
+        // record the dokey for this action, encrypted by the conjunction key
+        makeiv(iv);
+        
+        writeBytes(record, iv, AES::BLOCKSIZE);
+
+        if (KEY_SIZE != AES::BLOCKSIZE)
+        {
+            throw "key size not equal to block size... : (";
+        }
+
+        size_t start = record.length();
+        writeBytes(record, dokey(), KEY_SIZE);
+        encryptFrom(record, start, conjunctionKey, iv);
+    }
+
+    // now finally, the payload for this action, encrypted by the dokey (after the rest of the record is written)
+    
+    makeiv(iv);
+    writeBytes(record, iv, AES::BLOCKSIZE);
+
+    size_t payloadStart = record.length();
+
+    writeVal<int>(record, this->actionType);
+    writeText(record, this->desc);
+    
+    size_t numFiles = files.size();
+    writeVal<size_t>(record, numFiles);
+    for (size_t i = 0; i < numFiles; i++)
+    {        
+        pair<SourceFile *, bool> &filePair = files[i];
+        writeBytes(record, filePair.first->key(), KEY_SIZE);
+        writeVal<byte>(record, filePair.second ? 1 : 0); // should the game open this file after decrypting it?
+    }
+
+    size_t numTakes = this->takes.size();
+    writeVal<size_t>(record, numTakes);
+    for (size_t i = 0; i < numTakes; i++)
+    {
+        SourceItem *takesItem = this->takes[i];
+        writeBytes(record, takesItem->key(), KEY_SIZE);
+        writeBytes(record, takesItem->takey(), KEY_SIZE);
+        
+        writePath(record, takesItem->sourceParent());        
+    }
+
+    size_t numDrops = this->drops.size();
+    writeVal<size_t>(record, numDrops);
+    for (size_t i = 0; i < numDrops; i++)
+    {
+        writeBytes(record, drops[i]->takeyhash(), KEYHASH_SIZE);
+    }
+
+    writeVal<byte>(record, this->dest ? 1 : 0);
+    
+    if (this->dest)
+    {
+        writePath(record, this->dest);
+    }
+
+    writeVal<size_t>(record, auxData.size());
+    for (map<string,string>::const_iterator it = auxData.begin(); it != auxData.end(); ++it)
+    {
+        writeString(record, it->first);
+        if (isTextAuxKey(it->first))
+        {
+            writeText(record, it->second);
+        }
+        else
+        {
+            writeString(record, it->second);
+        }
+    }
+
+    encryptFrom(record, payloadStart, dokey(), iv);
+}
+
+void SourceAction::collectReferences(vector<SourceBase *> &references)
+{
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        references.push_back(files[i].first);
+    }
+    for (size_t i = 0; i < takes.size(); i++)
+    {
+        references.push_back(takes[i]);
+        collectPath(references, takes[i]->sourceParent());
+    }
+    if (dest)
+    {
+        collectPath(references, dest);
+    }
+}
+
+// the locations whose keys writePath writes
+void SourceAction::collectPath(vector<SourceBase *> &references, SourceLocation *otherLoc)
+{
+    vector<SourceLocation *> locationsDown;
+    size_t levelsUp; 
+    sourceParent()->getPath(otherLoc, levelsUp, locationsDown);
+    references.insert(references.end(), locationsDown.begin(), locationsDown.end());
+}
+
+void SourceAction::writePath(string &record, SourceLocation *otherLoc)
+{    
+    vector<SourceLocation *> locationsDown;
+    size_t levelsUp; 
+    sourceParent()->getPath(otherLoc, levelsUp, locationsDown);
+    writeVal<size_t>(record, levelsUp);
+
+    size_t numLocationsDown = locationsDown.size();
+    writeVal<size_t>(record, numLocationsDown);
+    for (size_t i = 0; i < numLocationsDown; i++)
+    {
+        writeBytes(record, locationsDown[i]->key(), KEY_SIZE);
+    }
+}
+
+byte *SourceItem::takey() // the key that you get when you are allowed to take the object
+{
+    if (!takey_)
+    {
+        takey_ = new byte[KEY_SIZE];
+        generateKey(takey_);
+    }
+    return takey_;
+}
+
+void SourceItem::restoreExtraKey(const byte *extraKey)
+{
+    if (!takey_)
+    {
+        takey_ = new byte[KEY_SIZE];
+    }
+    memcpy(takey_, extraKey, KEY_SIZE);
+}
+
+void SourceItem::prepare()
+{
+    SourceBase::prepare();
+    takeyhash();
+}
+
+void SourceItem::serialize(string &record)
+{
+    writeVal<byte>(record, visible ? 1 : 0);
+    writeText(record, title);
+    size_t numTitles = titles.size();
+    writeVal<size_t>(record, numTitles);
+    for (size_t i = 0; i < numTitles; i++)
+    {
+        byte titleKey[KEY_SIZE];
+        byte titleKeyHash[KEYHASH_SIZE];
+
+        commandKey(titles[i], titleKey);
+        hashKey(titleKey, titleKeyHash);
+
+        writeBytes(record, titleKeyHash, KEYHASH_SIZE);
+    }
+    writeString(record, desc);
+    writeVal<byte>(record, restrictTake ? 1 : 0);
+    if (!restrictTake)
+    {
+        writeBytes(record, takey(), KEY_SIZE);
+    }    
+}
+
+void SourceItem::resolve()
+{
+    trimTabs(desc);
+    checkText(title);
+
+    SourceLocation *parentLoc = this->sourceParent();
+    vector<string> oldTitles = this->titles;
+    this->titles.clear();
+    for (size_t i = 0; i < oldTitles.size(); i++)
+    {
+        vector<string> expandedTitles;
+        parentLoc->expandString(oldTitles[i], expandedTitles);    
+        for (size_t j = 0; j < expandedTitles.size(); j++)
+        {
+            this->titles.push_back(expandedTitles[j]);
+        }
+    }
+}
+
+void SourceFile::resolve()
+{
+    if (dest.empty())
+    {
+        dest = baseFileName(src);
+    }
+
+    ifstream in(src.c_str());
+    if (in.fail())
+    {
+        throw InvalidSourceException(string() + "could not open " + src);
+    }
+    in.close();
+}
+
+bool SourceFile::inputDigest(string &digest)
+{
+    struct stat st;
+    if (stat(src.c_str(), &st) != 0)
+    {
+        return false;
+    }
+
+    ostringstream inputs;
+    inputs << dest << '\0' << src << '\0' << (unsigned long)st.st_size << '\0' << (unsigned long)st.st_mtime;
+    string str = inputs.str();
+
+    byte hash[SHA1::DIGESTSIZE];
+    SHA1().CalculateDigest(hash, (const byte *)str.data(), str.length());
+    digest.assign((char *)hash, SHA1::DIGESTSIZE);
+    return true;
+}
+
+void SourceFile::serialize(string &record)
+{
+    writeString(record, dest);
+
+    fstream in(src.c_str(), ios::in|ios::binary);
+
+    if (in.fail())
+    {
+        throw InvalidSourceException(string() + "could not open " + src);
+    }
+    else
+    {
+    	in.seekg(0, ios::end);
+	    size_t len = in.tellg();
+        writeVal<size_t>(record, len);
+        in.seekg(0);
+
+        // read straight into the record, which is encrypted where it is
+        size_t start = record.length();
+        record.resize(start + len);
+        if (len > 0 && !in.read(&record[start], len))
+        {
+            throw InvalidSourceException(string() + "could not read " + src);
+        }
+
+        in.close();
+    }
+}
+
+bool SourceFile::streamsRecord()
+{
+    struct stat st;
+    return stat(src.c_str(), &st) == 0 && (unsigned long long)st.st_size >= STREAMED_RECORD_SIZE;
+}
+
+// the size of the pieces that a streamed file is read and encrypted in
+#define STREAM_CHUNK_SIZE (1024 * 1024)
+
+void SourceFile::streamRecord(SourceOutput &out, string *digest)
+{
+    ifstream in(src.c_str(), ios::in|ios::binary);
+    if (in.fail())
+    {
+        throw InvalidSourceException(string() + "could not open " + src);
+    }
+    in.seekg(0, ios::end);
+    size_t len = in.tellg();
+    in.seekg(0);
+
+    // the same record as encryptRecord and serialize write, with one encryption carried on from chunk to chunk
+    string chunk = recordIv();
+    byte iv[AES::BLOCKSIZE];
+    memcpy(iv, chunk.data(), AES::BLOCKSIZE);
+    writeVal<int>(chunk, DEBUG_MAGIC);
+    writeString(chunk, dest);
+    writeVal<size_t>(chunk, len);
+
+    CFB_Mode<AES>::Encryption cfbEncryption(this->key(), KEY_SIZE, iv);
+    SHA1 hash;
+    size_t start = AES::BLOCKSIZE, remaining = len;
+    while (true)
+    {
+        byte *plaintext = (byte *)&chunk[start];
+        cfbEncryption.ProcessData(plaintext, plaintext, chunk.length() - start);
+        if (digest)
+        {
+            hash.Update((const byte *)chunk.data(), chunk.length());
+        }
+        out.writeRecord(chunk);
+
+        if (remaining == 0)
+        {
+            break;
+        }
+        size_t n = (remaining < STREAM_CHUNK_SIZE) ? remaining : STREAM_CHUNK_SIZE;
+        chunk.resize(n);
+        start = 0;
+        if (!in.read(&chunk[0], n))
+        {
+            throw InvalidSourceException(string() + "could not read " + src);
+        }
+        remaining -= n;
+    }
+
+    if (digest)
+    {
+        digest->resize(SHA1::DIGESTSIZE);
+        hash.Final((byte *)&(*digest)[0]);
+    }
+}
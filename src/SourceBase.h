@@ -1,280 +1,531 @@
-#ifndef _SOURCEBASE_H
-#define _SOURCEBASE_H
-
-#include "CraneaBase.h"
-#include "osrng.h"
-
-class SourceLocation;
-class SourceAction;
-class SourceItem;
-class SourceBase;
-class SourceFile;
-class SourceOutput;
-
-class InvalidSourceException
-{
-public:
-    InvalidSourceException(std::string msg) : msg(msg)
-    {
-    }
-    const std::string &message() { return msg; }
-private:
-    std::string msg;
-};
-
-class SourceContext
-{
-public:
-    SourceContext() : currentGid_(0) { }
-    ~SourceContext();
-    void makerand(byte *bytes, size_t len) { rng_.GenerateBlock(bytes, len); }
-    int nextGid() { return currentGid_++; }
-
-    void write(SourceOutput &out);
-
-    /* xml parsing */
-    void startElement(const std::string &_name, const std::map<std::string, std::string> &attributes);
-    void endElement();
-    void handleText(const std::string &str);    
-    
-    SourceLocation *getLocationById(const std::string &id);
-    SourceItem *getItemById(const std::string &id);
-    SourceFile *getFileById(const std::string &id);
-
-    void resolve();
-
-    std::string gameName;
-
-private:
-    CryptoPP::AutoSeededRandomPool rng_;
-    int currentGid_;
-
-    bool getBoolAttribute(const std::map<std::string, std::string> &attributes, const std::string &key, bool required, bool def);
-    const std::string &getAttribute(const std::map<std::string, std::string> &attributes, const std::string &key, bool required = true, const std::string &def = "");
-    
-    std::string gameDesc_;
-    
-    std::string startId_;
-    SourceLocation *start_;
-
-    std::vector<std::string> elemStack_;
-    std::vector<SourceBase *> objectStack_;
-
-    std::vector<SourceBase *> topLevelObjects_;
-
-    std::vector<SourceLocation *> allLocations_;
-    std::vector<SourceItem *> allItems_;
-    std::vector<SourceFile *> allFiles_;
-
-    std::map<std::string, SourceLocation *> locationsMap_;
-    std::map<std::string, SourceItem *> itemsMap_;
-    std::map<std::string, SourceFile *> filesMap_;
-
-    std::string curAuxKey_;
-};
-
-class SourceBase : public CraneaBase
-{
-public:
-    virtual ~SourceBase() { if (key_) delete[] key_; }
-
-    virtual bool isTopLevel() = 0;
-    virtual ObjectType type() = 0;
-    
-    virtual byte *key();
-
-    virtual void resolve() {} // resolves any named references to other objects
-
-    virtual int gid() { return gid_; } 
-
-    void write(SourceOutput &out);
-
-protected:
-    SourceBase(SourceContext &ctx) 
-        : ctx_(&ctx), key_(NULL), gid_(ctx.nextGid()) {}    
-
-    virtual void writeChildren(SourceOutput &out);
-    virtual void encrypt(CryptoPP::StreamTransformationFilter &encryptor) = 0;
-
-    void encryptString(CryptoPP::StreamTransformationFilter &encryptor, const std::string &str);
-
-    template <typename T>
-    void encryptVal(CryptoPP::StreamTransformationFilter &encryptor, T val);
-
-    void generateKey(byte *outputKey);
-
-    SourceContext *ctx_;
-private:
-    byte *key_;
-    int gid_;
-};
-
-class SourceLocation : public SourceBase, public CraneaLocation
-{
-public:
-    SourceLocation(SourceContext &ctx, SourceLocation *parent = NULL) : 
-      SourceBase(ctx), CraneaLocation(parent), start(NULL) {}
-    virtual ~SourceLocation();
-
-    virtual bool isTopLevel() { return parent_ == NULL; }
-    virtual ObjectType type() { return ObjectTypeLocation; }
-    
-    virtual void resolve();
-
-    std::string id;
-    
-    std::string startId;
-    SourceLocation *start;
-
-    SourceLocation *newChildLocation();
-    SourceAction *newChildAction();
-    SourceItem *newChildItem();
-
-    std::vector<std::set<std::string> > synonyms;
-
-    std::set<std::string> *getSynonyms(const std::string &token);
-
-    void addIgnored(const std::string &token);
-
-    void getPath(SourceLocation *other, size_t &levelsUp, std::vector<SourceLocation *> &locationsDown);
-
-    SourceLocation *sourceParent() 
-    { 
-        return (parent_) ? dynamic_cast<SourceLocation *>(parent_) : NULL;
-    }
-
-    void expandString(const std::string &str, std::vector<std::string> &expanded);    
-
-protected:
-    virtual void encrypt(CryptoPP::StreamTransformationFilter &encryptor);
-
-    virtual void writeChildren(SourceOutput &out);
-
-private:
-    struct ExpandedAction
-    {
-        ExpandedAction(SourceAction *action, std::string cmd) : action(action), cmd(cmd) {}
-        SourceAction *action;
-        std::string cmd;
-    };
-
-    std::set<std::string> *getLocalSynonyms(const std::string &token);
-
-    void getExpandedActions(std::vector<ExpandedAction> &expandedActions);
-
-    void getAncestors(std::vector<SourceLocation *> &ancestors);
-
-    void expandStringInternal(std::vector<std::string> &tokens, size_t i, std::vector<std::string> &commands);
-
-    std::vector<SourceLocation *> locations_;
-    std::vector<SourceAction *> actions_;
-    std::vector<SourceItem *> items_;
-
-    std::map<std::string, std::set<std::string> *> mergedSynonymsMap_;
-};
-
-typedef std::vector<SourceItem *> Conjunction;
-
-typedef std::vector<std::string> UnresolvedConjunction;
-
-class SourceAction : public SourceBase, public CraneaAction
-{
-public:
-    SourceAction(SourceContext &ctx, SourceLocation *loc) :
-  SourceBase(ctx), CraneaAction(loc), dest(NULL), exact(false), actionType(ActionTypeDefault), dokey_(NULL) {}
-    virtual ~SourceAction() { if (dokey_) delete[] dokey_; }
-
-    std::string destId;
-    SourceLocation *dest;
-
-    std::vector<std::pair<std::string, bool> > fileIds;
-    std::vector<std::pair<SourceFile *, bool> > files;
-
-    virtual void resolve();
-
-    std::vector<Conjunction> predicate; /* in form ((item1^item2)v(item3^item4^item5)v(...)) */
-
-    bool exact;
-
-    std::vector<UnresolvedConjunction> predicateIds;
-
-    std::vector<std::string> commands;
-
-    Conjunction takes;
-    UnresolvedConjunction takesIds;
-
-    Conjunction drops;
-    UnresolvedConjunction dropsIds;
-
-    virtual void writeChildren(SourceOutput &out);
-
-    ActionType actionType;
-
-    virtual bool isTopLevel() { return false; }
-    virtual ObjectType type() { return ObjectTypeAction; }
-
-    virtual byte *dokey(); 
-
-    SourceLocation *sourceParent() 
-    { 
-        return parent_ ? dynamic_cast<SourceLocation *>(parent_) : NULL;
-    }
-
-protected:
-    virtual void encrypt(CryptoPP::StreamTransformationFilter &encryptor);
-
-private:
-    void encryptPath(CryptoPP::StreamTransformationFilter &innerEncryptor, SourceLocation *otherLoc);
-    void resolveConjunction(const UnresolvedConjunction &ids, Conjunction &conj);
-    byte *dokey_;
-
-};
-
-class SourceItem : public SourceBase, public CraneaItem
-{
-public:
-    SourceItem(SourceContext &ctx, SourceLocation *parent) : 
-      SourceBase(ctx), CraneaItem(parent), takey_(NULL) {}
-    
-    virtual ~SourceItem() { if (takey_) delete[] takey_; }
-
-    virtual bool isTopLevel() { return true; }
-    virtual ObjectType type() { return ObjectTypeItem; }
-
-    virtual void resolve();
-    virtual byte *takey();
-
-    std::string id;
-    std::vector<std::string> titles;
-
-    SourceLocation *sourceParent() 
-    { 
-        return (parent_) ? dynamic_cast<SourceLocation *>(parent_) : NULL;
-    }
-
-protected:
-    virtual void encrypt(CryptoPP::StreamTransformationFilter &encryptor);
-
-private:
-    byte *takey_;
-};
-
-
-class SourceFile : public SourceBase, public CraneaFile
-{
-public:
-    SourceFile(SourceContext &ctx) : SourceBase(ctx), CraneaFile() {}
-
-    std::string id;
-    std::string src;
-
-    virtual bool isTopLevel() { return true; }
-    virtual ObjectType type() { return ObjectTypeFile; }
-    virtual void resolve();
-
-protected:
-    virtual void encrypt(CryptoPP::StreamTransformationFilter &encryptor);
-
-};
-
-#endif 
+#ifndef _SOURCEBASE_H
+#define _SOURCEBASE_H
+
+#include "CraneaBase.h"
+
+class SourceLocation;
+class SourceAction;
+class SourceItem;
+class SourceBase;
+class SourceFile;
+class SourceOutput;
+class SourceRandom;
+class SourceKeyStore;
+
+class InvalidSourceException
+{
+public:
+    InvalidSourceException(std::string msg) : msg(msg)
+    {
+    }
+    const std::string &message() { return msg; }
+private:
+    std::string msg;
+};
+
+/* the elements and attributes of the source, in alphabetical order (see findName) */
+enum SourceElement
+{
+    ElementAction = 0,
+    ElementAdventure,
+    ElementAlt,
+    ElementAux,
+    ElementCleartext,
+    ElementDrops,
+    ElementExtracts,
+    ElementFile,
+    ElementIgnored,
+    ElementItem,
+    ElementLocation,
+    ElementNeeds,
+    ElementOr,
+    ElementS,
+    ElementSynonyms,
+    ElementTakes
+};
+#define NUM_ELEMENTS ((int)ElementTakes + 1)
+
+enum SourceAttribute
+{
+    AttributeCmd = 0,
+    AttributeDest,
+    AttributeExact,
+    AttributeFile,
+    AttributeFirstVisit,
+    AttributeForced,
+    AttributeId,
+    AttributeItem,
+    AttributeKey,
+    AttributeLaunch,
+    AttributeName,
+    AttributePrompt,
+    AttributeRestrictTake,
+    AttributeReturnVisit,
+    AttributeSrc,
+    AttributeStart,
+    AttributeTitle,
+    AttributeToken,
+    AttributeType,
+    AttributeVisible
+};
+#define NUM_ATTRIBUTES ((int)AttributeVisible + 1)
+
+class SourceContext
+{
+public:
+    SourceContext();
+    ~SourceContext();
+
+    // draws the keys of the objects (before they are encrypted, see SourceBase::prepare)
+    void makerand(byte *bytes, size_t len);
+    int nextGid() { return currentGid_++; }
+
+    // derives every key and iv from seed, so that compiling again writes the same data file
+    // (by default, the seed is random). the input is mixed into it too (see seedFromInput).
+    void setSeed(const std::string &seed);
+    const byte *seed() { return seed_; }
+
+    /* Mixes the contents of the source file at path, of the embedded files that aren't
+     * pruned, and the options that change the records (the canonical synonyms and the pruned
+     * objects) into a seed given by setSeed, so that an edited adventure or another set of
+     * options gets new keys and ivs instead of encrypting new contents with the old ones.
+     * Call once the source has been resolved and pruned, and the options set, before any key
+     * is drawn. Returns false if a file can't be read.
+     */
+    bool seedFromInput(const std::string &path);
+
+    // stores each location's synonyms and only the canonical form of each command, instead
+    // of every combination of synonyms in each command. synonym groups that share a word
+    // are merged into one, in which every word is a synonym of every other.
+    void setCanonicalSynonyms(bool canonicalSynonyms) { canonicalSynonyms_ = canonicalSynonyms; }
+    bool canonicalSynonyms() { return canonicalSynonyms_; }
+
+    // encrypts the objects on numThreads threads, and writes them to out in a fixed order
+    void write(SourceOutput &out, size_t numThreads = 1);
+
+    /* Finds the objects that the player can never reach from the start location: those whose
+     * keys aren't in the record of any object that can be reached (see SourceBase::collectReferences).
+     * Only the locations, items and files are listed, since the actions of a location can be
+     * reached along with it.
+     */
+    void findUnreachable(std::vector<SourceBase *> &unreachable);
+
+    // leaves the objects out of the data file (see findUnreachable)
+    void prune(const std::vector<SourceBase *> &unreachable);
+
+    // compiles incrementally: the objects keep the keys and gids they had in the previous
+    // compile, and the seed is the store's (see SourceKeyStore). call before write().
+    void setKeyStore(SourceKeyStore *keyStore);
+
+    /* xml parsing */
+    // atts is expat's NULL-terminated list of names and values
+    void startElement(const char *name, const char **atts);
+    void endElement();
+    void handleText(const char *text, size_t len);
+    
+    SourceLocation *getLocationById(const std::string &id);
+    SourceItem *getItemById(const std::string &id);
+    SourceFile *getFileById(const std::string &id);
+
+    void resolve();
+
+    std::string gameName;
+
+private:
+    byte seed_[KEY_SIZE];
+    bool hasSeed_; // see setSeed
+    SourceRandom *random_;
+    int currentGid_;
+    bool canonicalSynonyms_;
+    std::vector<std::string> prunedIds_; // the stable ids of the pruned objects, in order
+    SourceKeyStore *keyStore_;
+
+    void restoreKeys(const std::vector<SourceBase *> &objects, std::vector<char> &copied);
+    bool copyRecord(SourceBase *object, off_t offset, SourceOutput &out, std::string &error);
+    bool storeRecord(SourceBase *object, off_t offset, std::string &record, std::string &error);
+    void storeKeys(SourceBase *object, off_t offset, size_t length, const std::string &digest);
+
+    // the value of each attribute of the element, by SourceAttribute (NULL if it is missing)
+    typedef const char *Attributes[NUM_ATTRIBUTES];
+
+    bool getBoolAttribute(const Attributes &attributes, SourceAttribute key, bool required, bool def);
+    std::string getAttribute(const Attributes &attributes, SourceAttribute key, bool required = true, const char *def = "");
+
+    /* Each element has a handler for its start tag, and one for the text inside it
+     * (elements without a text handler only allow whitespace). parent is the element
+     * it is nested in; the nesting has already been checked.
+     */
+    struct ElementHandlers
+    {
+        void (SourceContext::*start)(SourceElement parent, const Attributes &attributes);
+        void (SourceContext::*text)(const char *text, size_t len);
+        bool hasObject; // whether the start handler pushes an object on objectStack_
+    };
+    static const ElementHandlers elementHandlers_[NUM_ELEMENTS];
+
+    void startAction(SourceElement parent, const Attributes &attributes);
+    void startAdventure(SourceElement parent, const Attributes &attributes);
+    void startAlt(SourceElement parent, const Attributes &attributes);
+    void startAux(SourceElement parent, const Attributes &attributes);
+    void startDrops(SourceElement parent, const Attributes &attributes);
+    void startExtracts(SourceElement parent, const Attributes &attributes);
+    void startFile(SourceElement parent, const Attributes &attributes);
+    void startIgnored(SourceElement parent, const Attributes &attributes);
+    void startItem(SourceElement parent, const Attributes &attributes);
+    void startLocation(SourceElement parent, const Attributes &attributes);
+    void startNeeds(SourceElement parent, const Attributes &attributes);
+    void startOr(SourceElement parent, const Attributes &attributes);
+    void startSynonyms(SourceElement parent, const Attributes &attributes);
+    void startTakes(SourceElement parent, const Attributes &attributes);
+
+    void actionText(const char *text, size_t len);
+    void auxText(const char *text, size_t len);
+    void cleartextText(const char *text, size_t len);
+    void itemText(const char *text, size_t len);
+    void locationText(const char *text, size_t len);
+    void synonymText(const char *text, size_t len);
+
+    // the object that the current element belongs to
+    SourceLocation *topLocation();
+    SourceAction *topAction();
+    SourceItem *topItem();
+    
+    std::string gameDesc_;
+    
+    std::string startId_;
+    SourceLocation *start_;
+
+    std::vector<SourceElement> elemStack_;
+    std::vector<SourceBase *> objectStack_;
+
+    std::vector<SourceBase *> topLevelObjects_;
+
+    std::vector<SourceLocation *> allLocations_;
+    std::vector<SourceItem *> allItems_;
+    std::vector<SourceFile *> allFiles_;
+
+    std::map<std::string, SourceLocation *> locationsMap_;
+    std::map<std::string, SourceItem *> itemsMap_;
+    std::map<std::string, SourceFile *> filesMap_;
+
+    std::string curAuxKey_;
+    std::string curSynonym_; // the text of the current 's' element, which expat may pass in several pieces
+};
+
+class SourceBase : public CraneaBase
+{
+public:
+    virtual ~SourceBase() { if (key_) delete[] key_; }
+
+    virtual bool isTopLevel() = 0;
+    virtual ObjectType type() = 0;
+    
+    virtual byte *key();
+
+    virtual void resolve() {} // resolves any named references to other objects
+
+    virtual int gid() { return gid_; } 
+
+    // identifies the object from one compile to the next (see SourceKeyStore)
+    virtual std::string stableId() = 0;
+
+    // the other key that the object was given when it was created (the dokey or takey), if any
+    virtual byte *extraKey() { return NULL; }
+
+    // gives the object the gid, iv stream and keys that it had in the previous compile
+    void restoreKeys(int gid, unsigned int ivStream, const byte *key, const byte *extraKey);
+
+    // the random stream that the iv is drawn from (the gid, unless the key store changed it)
+    unsigned int ivStream() { return ivStream_; }
+    void setIvStream(unsigned int ivStream) { ivStream_ = ivStream; }
+
+    // the iv that the record starts with
+    std::string recordIv();
+
+    /* Sums up everything that goes into the record of the object besides its keys and gid,
+     * without reading all of it, for objects whose records are expensive to encrypt.
+     * Returns false if the object has no such digest, and is always encrypted again.
+     */
+    virtual bool inputDigest(std::string & /* digest */) { return false; }
+
+    // adds this object and its descendants to objects (in the order they are written),
+    // skipping the objects in seen
+    void collect(std::vector<SourceBase *> &objects, std::set<SourceBase *> &seen);
+
+    // adds the objects whose keys are in the record of this object, which the player can
+    // reach once they reach this one
+    virtual void collectReferences(std::vector<SourceBase *> & /* references */) {}
+
+    // true if the object is left out of the data file (see SourceContext::prune)
+    bool pruned() { return pruned_; }
+    void prune() { pruned_ = true; }
+
+    /* Creates the keys (and anything else computed on first use) that this object or
+     * other objects need when they are encrypted, so that encryptRecord() only reads
+     * shared state and objects can be encrypted on several threads at once.
+     */
+    virtual void prepare();
+
+    // the iv and the encrypted contents of this object, as written to the data file
+    void encryptRecord(std::string &record);
+
+    // true if the record is too big to be built in memory, and is written by streamRecord instead
+    virtual bool streamsRecord() { return false; }
+
+    /* Writes the same record as encryptRecord to out a piece at a time (see streamsRecord),
+     * and the digest of the record to digest, if it is given.
+     */
+    virtual void streamRecord(SourceOutput & /* out */, std::string * /* digest */) {}
+
+protected:
+    SourceBase(SourceContext &ctx) 
+        : ctx_(&ctx), random_(NULL), key_(NULL), gid_(ctx.nextGid()), ivStream_(gid_), pruned_(false) {}    
+
+    virtual void collectChildren(std::vector<SourceBase *> &objects, std::set<SourceBase *> &seen);
+
+    /* Appends the plaintext of this object to record, which is encrypted with a single call
+     * once the whole object has been written (see encryptRecord).
+     */
+    virtual void serialize(std::string &record) = 0;
+
+    static void writeBytes(std::string &record, const byte *bytes, size_t len);
+    static void writeString(std::string &record, const std::string &str);
+
+    // story strings (ACDATA) are written as GameTemplate bytecode
+    static void writeText(std::string &record, const std::string &text);
+
+    // throws InvalidSourceException if the story string uses a variable that doesn't exist
+    static void checkText(const std::string &text);
+
+    template <typename T>
+    static void writeVal(std::string &record, T val)
+    {
+        canonicalizeEndianness(val);
+        record.append((const char *)&val, sizeof(T));
+    }
+
+    // encrypts the end of record, from start on, where it is (with AES in CFB mode)
+    static void encryptFrom(std::string &record, size_t start, const byte *key, const byte *iv);
+
+    void generateKey(byte *outputKey);
+
+    virtual void restoreExtraKey(const byte * /* extraKey */) {}
+
+    // draws an iv from the random stream of this object (only while it is being encrypted)
+    void makeiv(byte *iv);
+
+    SourceContext *ctx_;
+private:
+    SourceRandom *random_;
+    byte *key_;
+    int gid_;
+    unsigned int ivStream_;
+    bool pruned_;
+};
+
+class SourceLocation : public SourceBase, public CraneaLocation
+{
+public:
+    SourceLocation(SourceContext &ctx, SourceLocation *parent = NULL) : 
+      SourceBase(ctx), CraneaLocation(parent), start(NULL), synonymIndex_(NULL) {}
+    virtual ~SourceLocation();
+
+    virtual bool isTopLevel() { return parent_ == NULL; }
+    virtual ObjectType type() { return ObjectTypeLocation; }
+    virtual std::string stableId() { return "location " + id; }
+    
+    virtual void resolve();
+    virtual void collectReferences(std::vector<SourceBase *> &references);
+    void pruneActions();
+
+    std::string id;
+    
+    std::string startId;
+    SourceLocation *start;
+
+    SourceLocation *newChildLocation();
+    SourceAction *newChildAction();
+    SourceItem *newChildItem();
+
+    std::vector<std::set<std::string> > synonyms;
+
+    // the synonyms of token here, merged with its synonyms at the ancestors (NULL if it has none).
+    // only available once the location is resolved.
+    const std::set<std::string> *getSynonyms(const std::string &token);
+
+    void addIgnored(const std::string &token);
+
+    void getPath(SourceLocation *other, size_t &levelsUp, std::vector<SourceLocation *> &locationsDown);
+
+    SourceLocation *sourceParent() 
+    { 
+        return (parent_) ? dynamic_cast<SourceLocation *>(parent_) : NULL;
+    }
+
+    void expandString(const std::string &str, std::vector<std::string> &expanded);    
+
+protected:
+    virtual void serialize(std::string &record);
+
+    virtual void collectChildren(std::vector<SourceBase *> &objects, std::set<SourceBase *> &seen);
+
+private:
+    struct ExpandedAction
+    {
+        ExpandedAction(SourceAction *action, std::string cmd) : action(action), cmd(cmd) {}
+        SourceAction *action;
+        std::string cmd;
+    };
+
+    // the synonyms of each token that has any here or at the ancestors
+    typedef std::map<std::string, const std::set<std::string> *> SynonymIndex;
+
+    void makeSynonymIndex();
+
+    void getExpandedActions(std::vector<ExpandedAction> &expandedActions);
+
+    void makeCanonicalSynonyms();
+
+    void getAncestors(std::vector<SourceLocation *> &ancestors);
+
+    void expandStringInternal(std::vector<std::string> &tokens, size_t i, std::vector<std::string> &commands);
+
+    std::vector<SourceLocation *> locations_;
+    std::vector<SourceAction *> actions_;
+    std::vector<SourceItem *> items_;
+
+    // the parent's index, unless this location has synonyms of its own
+    const SynonymIndex *synonymIndex_;
+    SynonymIndex ownSynonymIndex_;
+    std::vector<std::set<std::string> *> mergedSynonyms_; // the groups merged with the parent's
+};
+
+typedef std::vector<SourceItem *> Conjunction;
+
+typedef std::vector<std::string> UnresolvedConjunction;
+
+class SourceAction : public SourceBase, public CraneaAction
+{
+public:
+    SourceAction(SourceContext &ctx, SourceLocation *loc, size_t index) :
+  SourceBase(ctx), CraneaAction(loc), dest(NULL), exact(false), actionType(ActionTypeDefault), index_(index), dokey_(NULL) {}
+    virtual ~SourceAction() { if (dokey_) delete[] dokey_; }
+
+    std::string destId;
+    SourceLocation *dest;
+
+    std::vector<std::pair<std::string, bool> > fileIds;
+    std::vector<std::pair<SourceFile *, bool> > files;
+
+    virtual void resolve();
+
+    std::vector<Conjunction> predicate; /* in form ((item1^item2)v(item3^item4^item5)v(...)) */
+
+    bool exact;
+
+    std::vector<UnresolvedConjunction> predicateIds;
+
+    std::vector<std::string> commands;
+
+    Conjunction takes;
+    UnresolvedConjunction takesIds;
+
+    Conjunction drops;
+    UnresolvedConjunction dropsIds;
+
+    ActionType actionType;
+
+    virtual bool isTopLevel() { return false; }
+    virtual ObjectType type() { return ObjectTypeAction; }
+
+    virtual std::string stableId();
+    virtual byte *extraKey() { return dokey(); }
+
+    virtual byte *dokey(); 
+
+    virtual void prepare();
+    virtual void collectReferences(std::vector<SourceBase *> &references);
+
+    SourceLocation *sourceParent() 
+    { 
+        return parent_ ? dynamic_cast<SourceLocation *>(parent_) : NULL;
+    }
+
+protected:
+    virtual void serialize(std::string &record);
+
+private:
+    void writePath(std::string &record, SourceLocation *otherLoc);
+    void collectPath(std::vector<SourceBase *> &references, SourceLocation *otherLoc);
+    void resolveConjunction(const UnresolvedConjunction &ids, Conjunction &conj);
+    virtual void restoreExtraKey(const byte *extraKey);
+
+    size_t index_; // among the actions of the location
+    byte *dokey_;
+
+};
+
+class SourceItem : public SourceBase, public CraneaItem
+{
+public:
+    SourceItem(SourceContext &ctx, SourceLocation *parent) : 
+      SourceBase(ctx), CraneaItem(parent), takey_(NULL) {}
+    
+    virtual ~SourceItem() { if (takey_) delete[] takey_; }
+
+    virtual bool isTopLevel() { return true; }
+    virtual ObjectType type() { return ObjectTypeItem; }
+
+    virtual void resolve();
+    virtual std::string stableId() { return "item " + id; }
+    virtual byte *extraKey() { return takey(); }
+    virtual byte *takey();
+
+    virtual void prepare();
+
+    std::string id;
+    std::vector<std::string> titles;
+
+    SourceLocation *sourceParent() 
+    { 
+        return (parent_) ? dynamic_cast<SourceLocation *>(parent_) : NULL;
+    }
+
+protected:
+    virtual void serialize(std::string &record);
+
+private:
+    virtual void restoreExtraKey(const byte *extraKey);
+
+    byte *takey_;
+};
+
+// files at least this big are encrypted as they are written, instead of in memory (see SourceFile::streamRecord)
+#define STREAMED_RECORD_SIZE (16 * 1024 * 1024)
+
+class SourceFile : public SourceBase, public CraneaFile
+{
+public:
+    SourceFile(SourceContext &ctx) : SourceBase(ctx), CraneaFile() {}
+
+    std::string id;
+    std::string src;
+
+    virtual bool isTopLevel() { return true; }
+    virtual ObjectType type() { return ObjectTypeFile; }
+    virtual std::string stableId() { return "file " + id; }
+    virtual void resolve();
+
+    // the source file's path, size and modification time, rather than its contents
+    virtual bool inputDigest(std::string &digest);
+
+    // files of STREAMED_RECORD_SIZE or more are read and encrypted a chunk at a time
+    virtual bool streamsRecord();
+    virtual void streamRecord(SourceOutput &out, std::string *digest);
+
+protected:
+    virtual void serialize(std::string &record);
+
+};
+
+#endif 
@@ -0,0 +1,251 @@
+#include "SourceKeyStore.h"
+#include "SourceOutput.h"
+#include <sstream>
+#include <cstring>
+
+using namespace std;
+
+#define KEY_STORE_MAGIC "cranea-keys"
+#define KEY_STORE_VERSION 1
+
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+static string toHex(const byte *bytes, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (size_t i = 0; i < len; i++)
+    {
+        hex += digits[bytes[i] >> 4];
+        hex += digits[bytes[i] & 0xf];
+    }
+    return hex;
+}
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static bool fromHex(const string &hex, byte *bytes, size_t len)
+{
+    if (hex.length() != 2 * len)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        int high = hexDigit(hex[2 * i]), low = hexDigit(hex[2 * i + 1]);
+        if (high < 0 || low < 0)
+        {
+            return false;
+        }
+        bytes[i] = (byte)(high * 16 + low);
+    }
+    return true;
+}
+
+// a digest, which is written as "-" if it is empty
+static string digestToHex(const string &digest)
+{
+    return digest.empty() ? "-" : toHex((const byte *)digest.data(), digest.length());
+}
+
+static bool fromHex(const string &hex, string &digest)
+{
+    digest.clear();
+    if (hex == "-")
+    {
+        return true;
+    }
+    if (hex.empty())
+    {
+        return false;
+    }
+    digest.resize(hex.length() / 2);
+    return fromHex(hex, (byte *)&digest[0], digest.length());
+}
+
+static off_t fileSize(const string &path)
+{
+    ifstream in(path.c_str(), ios::in | ios::binary);
+    if (in.fail())
+    {
+        return -1;
+    }
+    in.seekg(0, ios::end);
+    return (off_t)in.tellg();
+}
+
+SourceKeyStore::SourceKeyStore() : generation_(0), nextGid_(0)
+{
+    memset(seed_, 0, KEY_SIZE);
+}
+
+bool SourceKeyStore::load(const string &path, const string &dataPath, const byte *seed)
+{
+    ifstream in(path.c_str());
+    if (in.fail())
+    {
+        memcpy(seed_, seed, KEY_SIZE);
+        return true;
+    }
+
+    string magic;
+    int version = 0;
+    in >> magic >> version;
+    if (magic != KEY_STORE_MAGIC || version != KEY_STORE_VERSION)
+    {
+        return false;
+    }
+
+    off_t dataSize = -1;
+    string line;
+    while (getline(in, line))
+    {
+        istringstream fields(line);
+        string field;
+        if (!(fields >> field))
+        {
+            continue;
+        }
+
+        if (field == "seed")
+        {
+            string hex;
+            fields >> hex;
+            if (!fromHex(hex, seed_, KEY_SIZE))
+            {
+                return false;
+            }
+        }
+        else if (field == "generation")
+        {
+            fields >> generation_;
+            generation_++;
+        }
+        else if (field == "nextgid")
+        {
+            fields >> nextGid_;
+        }
+        else if (field == "datasize")
+        {
+            fields >> dataSize;
+        }
+        else if (field == "object")
+        {
+            Entry entry;
+            string key, extraKey, digest, recordDigest, id;
+            fields >> entry.gid >> entry.ivStream >> key >> extraKey >> digest >> recordDigest;
+            fields >> entry.offset >> entry.length;
+            fields.get(); // the space before the id, which may have spaces of its own
+            getline(fields, id);
+
+            if (fields.fail() || id.empty() || !fromHex(key, entry.key, KEY_SIZE))
+            {
+                return false;
+            }
+            entry.hasExtraKey = (extraKey != "-");
+            if (entry.hasExtraKey && !fromHex(extraKey, entry.extraKey, KEY_SIZE))
+            {
+                return false;
+            }
+            if (!fromHex(digest, entry.digest) || !fromHex(recordDigest, entry.recordDigest))
+            {
+                return false;
+            }
+            entries_[id] = entry;
+        }
+    }
+
+    // the records can't be copied from a data file that was written since (by a compile without the store),
+    // and the ivs of the records are checked as well in case it happens to be the same size
+    if (dataSize >= 0 && fileSize(dataPath) == dataSize)
+    {
+        previousData_.open(dataPath.c_str(), ios::in | ios::binary);
+    }
+    return true;
+}
+
+bool SourceKeyStore::save(const string &path, const string &dataPath)
+{
+    ofstream out(path.c_str(), ios::out | ios::trunc);
+    if (out.fail())
+    {
+        return false;
+    }
+
+    out << KEY_STORE_MAGIC << " " << KEY_STORE_VERSION << endl;
+    out << "seed " << toHex(seed_, KEY_SIZE) << endl;
+    out << "generation " << generation_ << endl;
+    out << "nextgid " << nextGid_ << endl;
+    out << "datasize " << fileSize(dataPath) << endl;
+
+    for (map<string, Entry>::const_iterator it = updated_.begin(); it != updated_.end(); ++it)
+    {
+        const Entry &entry = it->second;
+        out << "object " << entry.gid << " " << entry.ivStream << " " << toHex(entry.key, KEY_SIZE);
+        out << " " << (entry.hasExtraKey ? toHex(entry.extraKey, KEY_SIZE) : "-");
+        out << " " << digestToHex(entry.digest) << " " << digestToHex(entry.recordDigest);
+        out << " " << entry.offset << " " << entry.length << " " << it->first << endl;
+    }
+
+    out.close();
+    return !out.fail();
+}
+
+const SourceKeyStore::Entry *SourceKeyStore::find(const string &id) const
+{
+    map<string, Entry>::const_iterator it = entries_.find(id);
+    return (it != entries_.end()) ? &it->second : NULL;
+}
+
+void SourceKeyStore::update(const string &id, const Entry &entry)
+{
+    updated_[id] = entry;
+}
+
+bool SourceKeyStore::recordStartsWith(const Entry &entry, const string &prefix)
+{
+    if (entry.length < prefix.length())
+    {
+        return false;
+    }
+
+    string start(prefix.length(), '\0');
+    previousData_.clear();
+    previousData_.seekg(entry.offset);
+    previousData_.read(&start[0], start.length());
+    return (size_t)previousData_.gcount() == start.length() && start == prefix;
+}
+
+bool SourceKeyStore::copyRecord(const Entry &entry, SourceOutput &out)
+{
+    previousData_.clear();
+    previousData_.seekg(entry.offset);
+
+    char buf[COPY_BUFFER_SIZE];
+    size_t remaining = entry.length;
+    while (remaining > 0)
+    {
+        size_t n = (remaining < COPY_BUFFER_SIZE) ? remaining : COPY_BUFFER_SIZE;
+        previousData_.read(buf, n);
+        if ((size_t)previousData_.gcount() != n)
+        {
+            return false;
+        }
+        out.write(buf, n);
+        remaining -= n;
+    }
+    return true;
+}
+
+void SourceKeyStore::closePreviousData()
+{
+    if (previousData_.is_open())
+    {
+        previousData_.close();
+    }
+}
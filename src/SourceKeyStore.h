@@ -0,0 +1,95 @@
+#ifndef _SOURCE_KEY_STORE_H_
+#define _SOURCE_KEY_STORE_H_
+
+#include "cranea.h"
+#include <string>
+#include <map>
+#include <fstream>
+
+class SourceOutput;
+
+/* SourceKeyStore
+ * ==============
+ * The keys, gids and records of the objects of an incremental compile (see the -incremental
+ * option of the compiler), kept in a file next to the data file until the next compile.
+ *
+ * Each object is known by a stable id (see SourceBase::stableId), and keeps the gid and keys
+ * that it was given the first time it was compiled. Its iv is drawn from a random stream of
+ * the seed that the store keeps too, so an object that hasn't changed is encrypted to the same
+ * record as before. An object that has changed is given a new iv stream, since the old key
+ * and iv must not encrypt different contents. The record of an object whose inputs are summed
+ * up by a digest (see SourceBase::inputDigest) is copied from the previous data file if the
+ * digest hasn't changed, so that it doesn't have to be encrypted again.
+ *
+ * Like a seed, the store must be kept as secret as the adventure itself.
+ */
+class SourceKeyStore
+{
+public:
+    struct Entry
+    {
+        Entry() : gid(0), ivStream(0), hasExtraKey(false), offset(0), length(0) {}
+
+        int gid;
+        unsigned int ivStream;
+        byte key[KEY_SIZE];
+        bool hasExtraKey; // see SourceBase::extraKey
+        byte extraKey[KEY_SIZE];
+        std::string digest; // of the inputs (empty if the object has none)
+        std::string recordDigest; // of the record, to tell whether the object has changed
+        off_t offset; // of the record in the data file
+        size_t length;
+    };
+
+    SourceKeyStore();
+
+    /* Reads the store at path, or starts a new one with seed (KEY_SIZE bytes) if there is
+     * none. The records can only be copied from dataPath if it is the size of the data file
+     * that was written with the store. Returns false if the store can't be read.
+     */
+    bool load(const std::string &path, const std::string &dataPath, const byte *seed);
+
+    // writes the entries that were updated in this compile, for the data file at dataPath
+    bool save(const std::string &path, const std::string &dataPath);
+
+    const byte *seed() { return seed_; }
+
+    // the number of compiles that used the store before this one
+    unsigned int generation() { return generation_; }
+
+    // the entry of the object in the previous compile (NULL if it is new)
+    const Entry *find(const std::string &id) const;
+
+    // a gid (or iv stream) that no object has had yet
+    int newGid() { return nextGid_++; }
+
+    void update(const std::string &id, const Entry &entry);
+
+    // true if the records of the previous data file can be copied
+    bool hasPreviousData() { return previousData_.is_open(); }
+
+    // true if the record of the entry in the previous data file starts with prefix (its iv),
+    // which it doesn't if the data file was written since by a compile without the store
+    bool recordStartsWith(const Entry &entry, const std::string &prefix);
+
+    // copies the record of the entry from the previous data file to out
+    bool copyRecord(const Entry &entry, SourceOutput &out);
+
+    // closes the previous data file, so that it can be replaced
+    void closePreviousData();
+
+private:
+    SourceKeyStore(const SourceKeyStore &);
+    SourceKeyStore &operator=(const SourceKeyStore &);
+
+    byte seed_[KEY_SIZE];
+    unsigned int generation_;
+    int nextGid_;
+
+    std::map<std::string, Entry> entries_; // by stable id, from the previous compile
+    std::map<std::string, Entry> updated_; // from this compile
+
+    std::ifstream previousData_;
+};
+
+#endif
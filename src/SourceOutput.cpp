@@ -1,113 +1,288 @@
-#include "SourceOutput.h"
-#include "SourceBase.h"
-#include <iostream>
-#include <fstream>
-#include <string>
-
-using namespace std;
-
-SourceOutput::SourceOutput(const string &filename) :  
-    out_(filename.c_str(), ios::binary | ios::out | ios::trunc), encryptedStart_(0)
-{
-}
-
-void SourceOutput::writePlaintext(const std::string &str)
-{
-    if (str.find('\0') != string::npos)
-    {
-        throw "Embedded NUL character in string";
-    }
-
-    if (!str.empty())
-    {
-        out_.write(str.c_str(), str.length());
-    }
-}
-
-void SourceOutput::startEncryptedBlock()
-{
-    char buf[KEY_SIZE + (1 + NUM_GLOBAL_MAPS) * sizeof(off_t)];
-    out_.put('\0');
-
-    encryptedStart_ = out_.tellp();
-
-    out_.write(buf, sizeof(buf));
-}
-
-
-void SourceOutput::setInitialLocation(SourceLocation *loc)
-{
-    initialLoc_ = loc;
-}
-
-bool SourceOutput::isRecorded(SourceBase *object)
-{
-    return offsetMap_.find(object->gid()) != offsetMap_.end();
-}
-
-void SourceOutput::recordObject(SourceBase *object)
-{
-    int gid = object->gid();
-    offsetMap_[gid] = out_.tellp();
-    if (object->isTopLevel())
-    {
-        gidMaps_[object->type()][object->keyhash()] = gid;
-    }
-}
-
-ostream &SourceOutput::stream()
-{
-    return out_;
-}
-
-void SourceOutput::finalize()
-{
-    // writes the offsetMap and stores its offset at the beginning of the file
-
-    off_t mapOffset = out_.tellp();
-
-    writeVal<size_t>(offsetMap_.size());
-
-    for (map<int, off_t>::const_iterator it = offsetMap_.begin(); it != offsetMap_.end(); ++it)
-    {
-        writeVal<int>(it->first);
-        writeVal<off_t>(it->second);
-    }
-    writeValAndReturn<off_t>(mapOffset, encryptedStart_);
-
-    // writes the gidMaps and stores their offset at the beginning of the file
-    for (int i = 0; i < NUM_GLOBAL_MAPS; i++)
-    {
-        mapOffset = out_.tellp();
-        
-        map<byte *, int> &gidMap = gidMaps_[i];
-
-        writeVal<size_t>(gidMap.size());
-        
-        for (map<byte *, int>::const_iterator it = gidMap.begin(); it != gidMap.end(); ++it)
-        {
-            byte *objectKeyHash = it->first;         
-
-            out_.write((char *)objectKeyHash, KEYHASH_SIZE);
-            writeVal<int>(it->second);
-        }            
-
-        writeValAndReturn<off_t>(mapOffset, encryptedStart_ + (i+1) * sizeof(off_t));
-    }
-    
-    if (initialLoc_)
-    {
-        out_.seekp(encryptedStart_ + (1 + NUM_GLOBAL_MAPS) * sizeof(off_t));
-        out_.write((char *)initialLoc_->key(), KEY_SIZE);
-    }
-}
-    
-off_t SourceOutput::pos()
-{
-    return out_.tellp();
-}
-
-void SourceOutput::close()
-{
-    out_.close();
-}
+#include "SourceOutput.h"
+#include "SourceBase.h"
+#include <string>
+#include <cstring>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+// records at least this big are written as they are, instead of being copied into the buffer
+#define LARGE_RECORD_SIZE (64 * 1024)
+
+SourceOutput::SourceOutput(const string &filename) :
+    initialLoc_(NULL), encryptedStart_(0), fail_(false), pos_(0)
+{
+#ifdef WIN32
+    file_ = CreateFileA(filename.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    fail_ = (file_ == INVALID_HANDLE_VALUE);
+#else
+    fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    fail_ = (fd_ < 0);
+#endif
+
+    buffer_.reserve(OUTPUT_BUFFER_SIZE);
+}
+
+SourceOutput::~SourceOutput()
+{
+    close();
+}
+
+void SourceOutput::write(const char *data, size_t len)
+{
+    if (buffer_.length() + len > OUTPUT_BUFFER_SIZE)
+    {
+        flush();
+    }
+    buffer_.append(data, len);
+    pos_ += len;
+}
+
+void SourceOutput::writeRecord(const string &record)
+{
+    if (record.length() < LARGE_RECORD_SIZE)
+    {
+        write(record.data(), record.length());
+    }
+    else
+    {
+        flush(record.data(), record.length());
+        pos_ += record.length();
+    }
+}
+
+void SourceOutput::writePlaintext(const std::string &str)
+{
+    if (str.find('\0') != string::npos)
+    {
+        throw "Embedded NUL character in string";
+    }
+
+    if (!str.empty())
+    {
+        write(str.c_str(), str.length());
+    }
+}
+
+void SourceOutput::startEncryptedBlock(int flags)
+{
+    // the offsets of the tables and the initial key are patched in by finalize()
+    char buf[KEY_SIZE + (1 + NUM_GLOBAL_MAPS) * sizeof(off_t)];
+    memset(buf, 0, sizeof(buf));
+    write("", 1);
+
+    write(FORMAT_MAGIC, FORMAT_MAGIC_SIZE);
+    writeVal<int>(FORMAT_COMPILED_TEXT | flags);
+
+    encryptedStart_ = pos_;
+
+    write(buf, sizeof(buf));
+}
+
+
+void SourceOutput::setInitialLocation(SourceLocation *loc)
+{
+    initialLoc_ = loc;
+}
+
+void SourceOutput::recordObject(SourceBase *object)
+{
+    int gid = object->gid();
+    offsetMap_[gid] = pos_;
+    if (object->isTopLevel())
+    {
+        gidMaps_[object->type()][string((char *)object->keyhash(), KEYHASH_SIZE)] = gid;
+    }
+}
+
+void SourceOutput::finalize()
+{
+    // writes the offsetMap and stores its offset at the beginning of the file
+
+    off_t mapOffset = pos_;
+
+    writeVal<size_t>(offsetMap_.size());
+
+    for (map<int, off_t>::const_iterator it = offsetMap_.begin(); it != offsetMap_.end(); ++it)
+    {
+        writeVal<int>(it->first);
+        writeVal<off_t>(it->second);
+    }
+    patchVal<off_t>(mapOffset, encryptedStart_);
+
+    // writes the gidMaps and stores their offset at the beginning of the file
+    for (int i = 0; i < NUM_GLOBAL_MAPS; i++)
+    {
+        mapOffset = pos_;
+
+        map<string, int> &gidMap = gidMaps_[i];
+
+        writeVal<size_t>(gidMap.size());
+
+        for (map<string, int>::const_iterator it = gidMap.begin(); it != gidMap.end(); ++it)
+        {
+            write(it->first.data(), KEYHASH_SIZE);
+            writeVal<int>(it->second);
+        }
+
+        patchVal<off_t>(mapOffset, encryptedStart_ + (i+1) * sizeof(off_t));
+    }
+
+    if (initialLoc_)
+    {
+        patches_.push_back(Patch(encryptedStart_ + (1 + NUM_GLOBAL_MAPS) * sizeof(off_t),
+            string((char *)initialLoc_->key(), KEY_SIZE)));
+    }
+}
+
+bool SourceOutput::close()
+{
+#ifdef WIN32
+    if (file_ == INVALID_HANDLE_VALUE)
+#else
+    if (fd_ < 0)
+#endif
+    {
+        return !fail_;
+    }
+
+    flush();
+    for (size_t i = 0; i < patches_.size() && !fail_; i++)
+    {
+        fail_ = !writeAt(patches_[i].first, patches_[i].second);
+    }
+    patches_.clear();
+
+#ifdef WIN32
+    if (!CloseHandle(file_))
+    {
+        fail_ = true;
+    }
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    if (::close(fd_) != 0)
+    {
+        fail_ = true;
+    }
+    fd_ = -1;
+#endif
+    return !fail_;
+}
+
+#ifdef WIN32
+
+// the most that WriteFile is given at once
+#define MAX_WRITE_SIZE (1 << 30)
+
+static bool writeFully(HANDLE file, const char *data, size_t len, OVERLAPPED *overlapped)
+{
+    while (len > 0)
+    {
+        DWORD n = (DWORD)min(len, (size_t)MAX_WRITE_SIZE), written = 0;
+        if (!WriteFile(file, data, n, &written, overlapped) || written == 0)
+        {
+            return false;
+        }
+        if (overlapped)
+        {
+            ULONGLONG offset = ((ULONGLONG)overlapped->OffsetHigh << 32 | overlapped->Offset) + written;
+            overlapped->Offset = (DWORD)offset;
+            overlapped->OffsetHigh = (DWORD)(offset >> 32);
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+void SourceOutput::flush(const char *data, size_t len)
+{
+    if (!fail_)
+    {
+        fail_ = !writeFully(file_, buffer_.data(), buffer_.length(), NULL) || !writeFully(file_, data, len, NULL);
+    }
+    buffer_.clear();
+}
+
+bool SourceOutput::writeAt(off_t loc, const string &data)
+{
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)loc;
+    overlapped.OffsetHigh = (DWORD)((unsigned long long)loc >> 32);
+    return writeFully(file_, data.data(), data.length(), &overlapped);
+}
+
+#else
+
+void SourceOutput::flush(const char *data, size_t len)
+{
+    struct iovec iov[2];
+    size_t numIov = 0;
+    if (!buffer_.empty())
+    {
+        iov[numIov].iov_base = (void *)buffer_.data();
+        iov[numIov].iov_len = buffer_.length();
+        numIov++;
+    }
+    if (len > 0)
+    {
+        iov[numIov].iov_base = (void *)data;
+        iov[numIov].iov_len = len;
+        numIov++;
+    }
+
+    // writev may stop partway through, so it continues from wherever it stopped
+    struct iovec *next = iov;
+    while (numIov > 0 && !fail_)
+    {
+        ssize_t written = writev(fd_, next, (int)numIov);
+        if (written < 0)
+        {
+            fail_ = (errno != EINTR);
+            continue;
+        }
+
+        size_t n = (size_t)written;
+        while (numIov > 0 && n >= next->iov_len)
+        {
+            n -= next->iov_len;
+            next++;
+            numIov--;
+        }
+        if (numIov > 0)
+        {
+            next->iov_base = (char *)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+    buffer_.clear();
+}
+
+bool SourceOutput::writeAt(off_t loc, const string &data)
+{
+    size_t done = 0;
+    while (done < data.length())
+    {
+        ssize_t written = pwrite(fd_, data.data() + done, data.length() - done, loc + done);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        done += (size_t)written;
+    }
+    return true;
+}
+
+#endif
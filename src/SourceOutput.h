@@ -1,56 +1,95 @@
-#ifndef _SOURCE_OUTPUT_H
-#define _SOURCE_OUTPUT_H
-
-#include "cranea.h"
-#include <map>
-#include <string>
-#include <fstream>
-
-class SourceBase;
-class SourceLocation;
-
-class SourceOutput
-{  
-public:
-    SourceOutput(const std::string &filename);
-    void recordObject(SourceBase *object);
-    bool isRecorded(SourceBase *object);
-    std::ostream &stream();
-
-    void writePlaintext(const std::string &str);
-
-    void startEncryptedBlock();
-
-    void finalize();    
-    off_t pos();
-    void close();
-
-    void SourceOutput::setInitialLocation(SourceLocation *loc);
-
-    template<typename T>
-    void writeValAndReturn(T val, off_t loc)
-    {
-        off_t cur = out_.tellp();
-        out_.seekp(loc);
-        canonicalizeEndianness(val);
-        out_.write((char *)&val, sizeof(T));
-        out_.seekp(cur);
-    }
-
-    template<typename T>
-    void writeVal(T val)
-    {
-        canonicalizeEndianness(val);
-        out_.write((char *)&val, sizeof(T));
-    }
-
-private:
-
-    std::map<byte *, int> gidMaps_[NUM_GLOBAL_MAPS];
-    std::map<int, off_t> offsetMap_;
-    std::ofstream out_;
-    SourceLocation *initialLoc_;
-    size_t encryptedStart_;
-};
-
-#endif
+#ifndef _SOURCE_OUTPUT_H
+#define _SOURCE_OUTPUT_H
+
+#include "cranea.h"
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#define VC_EXTRALEAN
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h> // for HANDLE
+#endif
+
+class SourceBase;
+class SourceLocation;
+
+// the small writes are collected until there are this many bytes
+#define OUTPUT_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* SourceOutput
+ * ============
+ * Writes the data file behind a buffer. Small writes are collected in the buffer until it
+ * is full, and a large record is written along with what is in the buffer by one call
+ * (writev), without being copied. The slots in the header that are only known at the end
+ * are patched when the file is closed.
+ */
+class SourceOutput
+{
+public:
+    SourceOutput(const std::string &filename);
+    ~SourceOutput();
+
+    void recordObject(SourceBase *object);
+
+    // writes the record of the object that was just recorded, or the next piece of it
+    void writeRecord(const std::string &record);
+
+    void write(const char *data, size_t len);
+
+    void writePlaintext(const std::string &str);
+
+    // flags are the FORMAT_ flags besides FORMAT_COMPILED_TEXT
+    void startEncryptedBlock(int flags = 0);
+
+    void finalize();
+    off_t pos() { return pos_; }
+
+    // writes everything that is waiting, and the header. returns false if the file couldn't be written.
+    bool close();
+
+    void SourceOutput::setInitialLocation(SourceLocation *loc);
+
+    template<typename T>
+    void writeVal(T val)
+    {
+        canonicalizeEndianness(val);
+        write((char *)&val, sizeof(T));
+    }
+
+private:
+    SourceOutput(const SourceOutput &);
+    SourceOutput &operator=(const SourceOutput &);
+
+    // the value is written at loc when the file is closed
+    template<typename T>
+    void patchVal(T val, off_t loc)
+    {
+        canonicalizeEndianness(val);
+        patches_.push_back(Patch(loc, std::string((char *)&val, sizeof(T))));
+    }
+
+    // writes the buffer, followed by len bytes of data
+    void flush(const char *data = NULL, size_t len = 0);
+    bool writeAt(off_t loc, const std::string &data);
+
+    typedef std::pair<off_t, std::string> Patch;
+
+    std::map<std::string, int> gidMaps_[NUM_GLOBAL_MAPS]; // by keyhash, so that they are written in the same order every time
+    std::map<int, off_t> offsetMap_;
+    SourceLocation *initialLoc_;
+    size_t encryptedStart_;
+
+#ifdef WIN32
+    HANDLE file_;
+#else
+    int fd_;
+#endif
+    bool fail_;
+    off_t pos_; // of the end of the output, including the buffer
+    std::string buffer_; // keeps its capacity, so it is only allocated once
+    std::vector<Patch> patches_;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include "SourceRandom.h"
+#include <cstring>
+
+using namespace CryptoPP;
+
+SourceRandom::SourceRandom(const byte *seed, unsigned int stream) : pos_(RANDOM_BUFFER_SIZE)
+{
+    // the stream number goes in the high bytes of the counter, which counts up from the low bytes
+    byte counter[AES::BLOCKSIZE];
+    memset(counter, 0, AES::BLOCKSIZE);
+    counter[0] = (byte)(stream >> 24);
+    counter[1] = (byte)(stream >> 16);
+    counter[2] = (byte)(stream >> 8);
+    counter[3] = (byte)stream;
+
+    keystream_.SetKeyWithIV(seed, KEY_SIZE, counter);
+}
+
+void SourceRandom::generate(byte *output, size_t len)
+{
+    while (len > 0)
+    {
+        if (pos_ == RANDOM_BUFFER_SIZE)
+        {
+            refill();
+        }
+
+        size_t n = RANDOM_BUFFER_SIZE - pos_;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(output, buffer_ + pos_, n);
+        pos_ += n;
+        output += n;
+        len -= n;
+    }
+}
+
+void SourceRandom::refill()
+{
+    // the keystream is the encryption of zeros
+    memset(buffer_, 0, RANDOM_BUFFER_SIZE);
+    keystream_.ProcessData(buffer_, buffer_, RANDOM_BUFFER_SIZE);
+    pos_ = 0;
+}
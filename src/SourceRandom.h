@@ -0,0 +1,40 @@
+#ifndef _SOURCE_RANDOM_H_
+#define _SOURCE_RANDOM_H_
+
+#include "cranea.h"
+#include "modes.h"
+#include "aes.h"
+
+#define RANDOM_BUFFER_SIZE 1024
+
+/* SourceRandom
+ * ============
+ * Random bytes for the keys and ivs of the compiler: the AES keystream (counter mode)
+ * of a seed. Each stream number starts its own counter, so every object can draw its
+ * ivs from its own generator on whichever thread encrypts it, and a compile with a
+ * given seed always writes the same data file. The keystream is generated a buffer at
+ * a time.
+ *
+ * Anyone who knows the seed can compute every key in the data file, so a seed must be
+ * kept as secret as the adventure itself.
+ */
+class SourceRandom
+{
+public:
+    // seed is KEY_SIZE bytes
+    SourceRandom(const byte *seed, unsigned int stream);
+
+    void generate(byte *output, size_t len);
+
+private:
+    SourceRandom(const SourceRandom &);
+    SourceRandom &operator=(const SourceRandom &);
+
+    void refill();
+
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption keystream_;
+    byte buffer_[RANDOM_BUFFER_SIZE];
+    size_t pos_;
+};
+
+#endif
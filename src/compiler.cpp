@@ -1,181 +1,310 @@
-
-#include "cranea.h"
-#include <string>
-#include "SourceOutput.h"
-#include "SourceBase.h"
-
-#define XML_STATIC
-
-#include "expat.h"
-using namespace std;
-#include <iostream>
-#include <fstream>
-
-#define OUTPUT_DIR "game"
-
-#include <sys/stat.h> 
-
-void startElementHandler(void *_ctx, const XML_Char *name, const XML_Char **atts)
-{
-    SourceContext *ctx = (SourceContext *)_ctx;
-
-    map<string, string> attributes;
-
-    const XML_Char **curAtt = atts;
-    while (*curAtt)
-    {
-        attributes[curAtt[0]] = curAtt[1];
-        curAtt += 2;
-    }
-    
-    ctx->startElement(name, attributes);
-}
-void endElementHandler(void *_ctx, const XML_Char *name)
-{
-    SourceContext *ctx = (SourceContext *)_ctx;
-    ctx->endElement();
-}
-
-void textHandler(void *_ctx, const XML_Char *s, int len)
-{
-    SourceContext *ctx = (SourceContext *)_ctx;
-
-    ctx->handleText(string(s,len));
-}
-
-void printPos(XML_Parser parser)
-{
-    cout << " at line " << XML_GetCurrentLineNumber(parser);
-    cout << ", column " << XML_GetCurrentColumnNumber(parser) << endl;
-}
-
-bool parse(XML_Parser parser, const char *buf, size_t length, bool last)
-{
-    bool parseResult;
-    try 
-    {
-        parseResult = XML_Parse(parser, buf, (int)length, last) ? true : false;
-    }
-    catch (InvalidSourceException &ex)
-    {
-        cout << "Invalid XML: " << ex.message() << endl;
-        printPos(parser);
-        return false;
-    }
-
-    if (!parseResult)
-    {
-        XML_Error err = XML_GetErrorCode(parser);
-        cout << XML_ErrorString(err);
-        printPos(parser);
-        return false;
-    }
-    return true;
-}
-
-bool parseXML(SourceContext &ctx, ifstream &xmlInput, XML_Parser parser)
-{
-    while (!xmlInput.eof())
-    {
-        string buf;
-        getline(xmlInput, buf);
-        buf += "\n";
-
-        if (!parse(parser, buf.c_str(), buf.length(), false))
-        {
-            return false;
-        }
-    }
-
-    if (!parse(parser, NULL, 0, true))
-    {
-        return false;
-    }
-
-    try
-    {
-        ctx.resolve();
-    }
-    catch (InvalidSourceException &ex)
-    {
-        cout << "Invalid XML: " << ex.message() << endl;
-        return false;
-    }
-    return true;
-}
-
-
-bool parseInput(SourceContext &ctx, const string &filename)
-{
-    ifstream xmlInput(filename.c_str());
-    if (xmlInput.fail())
-    {
-        cout << "could not open " << filename << endl;
-        return false;
-    }
-
-    XML_Parser parser = XML_ParserCreate(NULL);
-    XML_SetUserData(parser, &ctx);
-    XML_SetElementHandler(parser, startElementHandler, endElementHandler);
-    XML_SetCharacterDataHandler(parser, textHandler);
-
-    bool success = parseXML(ctx, xmlInput, parser);
-
-    XML_ParserFree(parser); 
-
-    return success;
-}
-
-string promptDefault(const string &prompt, const string &def)
-{
-    cout << prompt << " [" << def << "]: ";
-    string line;
-    getline(cin, line);
-    return line.empty() ? def : line;
-}
-
-int main(int argc, char* argv[])
-{
-    SourceContext ctx;
-
-    string inputFile;
-
-    if (argc > 1)
-    {
-        inputFile = argv[1];
-    }
-    else
-    {
-        inputFile = promptDefault("input file", "adventure.xml");
-    }
-
-    bool success = parseInput(ctx, inputFile);
-
-    if (success)
-    {
-        string gamePrefix = OUTPUT_DIR"/" + ctx.gameName;
-        string encryptedFilename = gamePrefix + ENCRYPTED_EXT;
-        string playerFilename = gamePrefix + ".exe";
-
-        struct stat outputDirInfo; 
-        if (stat(OUTPUT_DIR, &outputDirInfo) != 0) 
-        { 
-            system("mkdir "OUTPUT_DIR);
-        }
-
-        system(("cp player.exe \"" + playerFilename + "\"").c_str());
-
-        SourceOutput out(encryptedFilename);
-        
-        ctx.write(out);
-
-        out.close();
-
-        cout << "done!" << endl;
-    }
-
-    //string line;
-    //getline(cin, line);
-
-    return success ? 0 : 1;
-}
+
+#include "cranea.h"
+#include <string>
+#include "SourceOutput.h"
+#include "SourceBase.h"
+#include "SourceKeyStore.h"
+#include "CraneaThread.h"
+
+#define XML_STATIC
+
+#include "expat.h"
+using namespace std;
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+
+#define OUTPUT_DIR "game"
+
+#define XML_BLOCK_SIZE (1024 * 1024)
+
+#include <sys/stat.h> 
+
+void startElementHandler(void *_ctx, const XML_Char *name, const XML_Char **atts)
+{
+    SourceContext *ctx = (SourceContext *)_ctx;
+    ctx->startElement(name, atts);
+}
+
+void endElementHandler(void *_ctx, const XML_Char *name)
+{
+    SourceContext *ctx = (SourceContext *)_ctx;
+    ctx->endElement();
+}
+
+void textHandler(void *_ctx, const XML_Char *s, int len)
+{
+    SourceContext *ctx = (SourceContext *)_ctx;
+    ctx->handleText(s, (size_t)len);
+}
+
+void printPos(XML_Parser parser)
+{
+    cout << " at line " << XML_GetCurrentLineNumber(parser);
+    cout << ", column " << XML_GetCurrentColumnNumber(parser) << endl;
+}
+
+// parses the length bytes that were read into the buffer from XML_GetBuffer
+bool parse(XML_Parser parser, size_t length, bool last)
+{
+    bool parseResult;
+    try 
+    {
+        parseResult = XML_ParseBuffer(parser, (int)length, last) ? true : false;
+    }
+    catch (InvalidSourceException &ex)
+    {
+        cout << "Invalid XML: " << ex.message() << endl;
+        printPos(parser);
+        return false;
+    }
+
+    if (!parseResult)
+    {
+        XML_Error err = XML_GetErrorCode(parser);
+        cout << XML_ErrorString(err);
+        printPos(parser);
+        return false;
+    }
+    return true;
+}
+
+bool parseXML(SourceContext &ctx, ifstream &xmlInput, XML_Parser parser)
+{
+    // expat reads the file in large blocks straight into its own buffer
+    bool last = false;
+    while (!last)
+    {
+        void *buf = XML_GetBuffer(parser, XML_BLOCK_SIZE);
+        if (!buf)
+        {
+            cout << XML_ErrorString(XML_GetErrorCode(parser)) << endl;
+            return false;
+        }
+
+        xmlInput.read((char *)buf, XML_BLOCK_SIZE);
+        size_t length = (size_t)xmlInput.gcount();
+        last = (length < XML_BLOCK_SIZE);
+
+        if (!parse(parser, length, last))
+        {
+            return false;
+        }
+    }
+
+    try
+    {
+        ctx.resolve();
+    }
+    catch (InvalidSourceException &ex)
+    {
+        cout << "Invalid XML: " << ex.message() << endl;
+        return false;
+    }
+    return true;
+}
+
+
+bool parseInput(SourceContext &ctx, const string &filename)
+{
+    ifstream xmlInput(filename.c_str(), ios::in | ios::binary);
+    if (xmlInput.fail())
+    {
+        cout << "could not open " << filename << endl;
+        return false;
+    }
+
+    XML_Parser parser = XML_ParserCreate(NULL);
+    XML_SetUserData(parser, &ctx);
+    XML_SetElementHandler(parser, startElementHandler, endElementHandler);
+    XML_SetCharacterDataHandler(parser, textHandler);
+
+    bool success = parseXML(ctx, xmlInput, parser);
+
+    XML_ParserFree(parser); 
+
+    return success;
+}
+
+string promptDefault(const string &prompt, const string &def)
+{
+    cout << prompt << " [" << def << "]: ";
+    string line;
+    getline(cin, line);
+    return line.empty() ? def : line;
+}
+
+void usage()
+{
+    cout << "Usage: compiler [-j N] [-seed TEXT] [-canonical] [-incremental] [-prune] [FILE]" << endl;
+    cout << "  -j N          encrypt the objects on N threads (default: one per processor)" << endl;
+    cout << "  -seed TEXT    derive the keys from TEXT, the input and the options, so that the same" << endl;
+    cout << "                input always compiles to the same data file (keep TEXT as secret as FILE)" << endl;
+    cout << "  -canonical    store each command once, and let the player replace the synonyms" << endl;
+    cout << "                in commands (overlapping synonym groups are merged into one)" << endl;
+    cout << "  -incremental  keep the keys in FILE.keys, and only encrypt the objects that have" << endl;
+    cout << "                changed since the last compile (keep FILE.keys as secret as FILE)" << endl;
+    cout << "  -prune        leave out the objects that can't be reached from the start location" << endl;
+    cout << "                (which are listed as warnings otherwise)" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    SourceContext ctx;
+
+    string inputFile;
+    size_t numThreads = numProcessors();
+    bool incremental = false;
+    bool prune = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc)
+        {
+            numThreads = (size_t)atoi(argv[++i]);
+        }
+        else if (arg == "-seed" && i + 1 < argc)
+        {
+            ctx.setSeed(argv[++i]);
+        }
+        else if (arg == "-canonical")
+        {
+            ctx.setCanonicalSynonyms(true);
+        }
+        else if (arg == "-incremental")
+        {
+            incremental = true;
+        }
+        else if (arg == "-prune")
+        {
+            prune = true;
+        }
+        else if (arg[0] == '-' || !inputFile.empty())
+        {
+            usage();
+            return 1;
+        }
+        else
+        {
+            inputFile = arg;
+        }
+    }
+
+    if (inputFile.empty())
+    {
+        inputFile = promptDefault("input file", "adventure.xml");
+    }
+
+    bool success = parseInput(ctx, inputFile);
+
+    if (success)
+    {
+        vector<SourceBase *> unreachable;
+        ctx.findUnreachable(unreachable);
+        for (size_t i = 0; i < unreachable.size(); i++)
+        {
+            cout << (prune ? "Pruned " : "Warning: can't reach ") << unreachable[i]->stableId() << endl;
+        }
+        if (prune)
+        {
+            ctx.prune(unreachable);
+        }
+
+        if (!ctx.seedFromInput(inputFile))
+        {
+            cout << "Could not read the input to seed the keys" << endl;
+            success = false;
+        }
+    }
+
+    if (success)
+    {
+        string gamePrefix = OUTPUT_DIR"/" + ctx.gameName;
+        string encryptedFilename = gamePrefix + ENCRYPTED_EXT;
+        string playerFilename = gamePrefix + ".exe";
+
+        struct stat outputDirInfo; 
+        if (stat(OUTPUT_DIR, &outputDirInfo) != 0) 
+        { 
+            system("mkdir "OUTPUT_DIR);
+        }
+
+        system(("cp player.exe \"" + playerFilename + "\"").c_str());
+
+        // an incremental compile copies records from the previous data file, so it writes a new one beside it
+        SourceKeyStore keyStore;
+        string keyStoreFilename = inputFile + ".keys";
+        string outputFilename = encryptedFilename;
+        if (incremental)
+        {
+            if (!keyStore.load(keyStoreFilename, encryptedFilename, ctx.seed()))
+            {
+                cout << "Could not read the key store " << keyStoreFilename << endl;
+                return 1;
+            }
+            ctx.setKeyStore(&keyStore);
+            outputFilename = encryptedFilename + ".new";
+        }
+
+        SourceOutput out(outputFilename);
+        
+        try
+        {
+            ctx.write(out, numThreads);
+        }
+        catch (InvalidSourceException &ex)
+        {
+            cout << "Invalid XML: " << ex.message() << endl;
+            success = false;
+        }
+
+        if (!out.close() && success)
+        {
+            cout << "Could not write " << outputFilename << endl;
+            success = false;
+        }
+
+        if (incremental)
+        {
+            // the new key store is written beside the old one too, so that a failure leaves both old files as
+            // they were. it replaces the old store only once the new data file is in place, since a data file
+            // next to a stale store would have its ivs used again on the next compile.
+            keyStore.closePreviousData();
+            string newKeyStoreFilename = keyStoreFilename + ".new";
+            if (success && !keyStore.save(newKeyStoreFilename, outputFilename))
+            {
+                cout << "Could not write " << newKeyStoreFilename << endl;
+                success = false;
+            }
+            if (success && !replaceFile(outputFilename, encryptedFilename))
+            {
+                cout << "Could not replace " << encryptedFilename << endl;
+                success = false;
+            }
+            if (!success)
+            {
+                remove(outputFilename.c_str());
+                remove(newKeyStoreFilename.c_str());
+            }
+            else if (!replaceFile(newKeyStoreFilename, keyStoreFilename))
+            {
+                // without a store, the next compile starts over with new keys
+                cout << "Could not replace " << keyStoreFilename << endl;
+                remove(keyStoreFilename.c_str());
+                success = false;
+            }
+        }
+
+        if (success)
+        {
+            cout << "done!" << endl;
+        }
+    }
+
+    //string line;
+    //getline(cin, line);
+
+    return success ? 0 : 1;
+}
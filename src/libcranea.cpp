@@ -0,0 +1,372 @@
+#include "libcranea.h"
+#include "GameBase.h"
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+struct cranea_image
+{
+    cranea_image(const char *path) : image(path) {}
+
+    GameImage image;
+};
+
+// hands each file that the player extracts to the host's callback, if it set one
+class CallbackFileHandler : public GameFileHandler
+{
+public:
+    CallbackFileHandler() : callback_(NULL), arg_(NULL) {}
+
+    void setCallback(cranea_file_callback callback, void *arg)
+    {
+        callback_ = callback;
+        arg_ = arg;
+    }
+
+    virtual bool open(const string &name, size_t len, ostream & /* out */)
+    {
+        if (!callback_)
+        {
+            return false;
+        }
+        name_ = name;
+        data_.clear();
+        data_.reserve(len);
+        return true;
+    }
+
+    virtual void write(const char *data, size_t len)
+    {
+        data_.append(data, len);
+    }
+
+    virtual void close(ostream & /* out */)
+    {
+        callback_(arg_, name_.c_str(), data_.data(), data_.size());
+        string().swap(data_);
+    }
+
+    // a library never runs the files it extracts
+    virtual void launch(const string & /* name */, ostream & /* out */) {}
+
+private:
+    cranea_file_callback callback_;
+    void *arg_;
+    string name_;
+    string data_;
+};
+
+struct cranea_session
+{
+    cranea_session(const GameImage &image) : in(image), ctx(in), failed(false)
+    {
+        ctx.setOutputSink(sink);
+        ctx.setSaveStore(saveStore);
+        ctx.setFileHandler(fileHandler);
+    }
+
+    // the context is destroyed first, since it writes to the sink and the store when it ends
+    MemoryOutputSink sink;
+    MemorySaveStore saveStore;
+    CallbackFileHandler fileHandler;
+    GameInput in;
+    GameContext ctx;
+    string output; // the output returned by cranea_session_output
+    bool failed;
+    string error;
+};
+
+enum SessionCall
+{
+    CallStart,
+    CallSubmit,
+    CallResume,
+    CallEndInput
+};
+
+static int statusOf(cranea_session *session)
+{
+    if (session->failed)
+    {
+        return CRANEA_ERROR;
+    }
+
+    switch (session->ctx.status())
+    {
+    case GameContext::Delayed:
+        return CRANEA_DELAYED;
+    case GameContext::Ended:
+        return CRANEA_ENDED;
+    default:
+        return CRANEA_WAITING_FOR_INPUT;
+    }
+}
+
+// runs the game, turning the exceptions that end it into CRANEA_ERROR
+static int runSession(cranea_session *session, SessionCall call, const char *line = NULL)
+{
+    if (session->failed)
+    {
+        return CRANEA_ERROR;
+    }
+
+    try
+    {
+        switch (call)
+        {
+        case CallStart:
+            session->ctx.start();
+            break;
+        case CallSubmit:
+            session->ctx.submitLine(line);
+            break;
+        case CallResume:
+            session->ctx.resume();
+            break;
+        case CallEndInput:
+            session->ctx.endInput();
+            break;
+        }
+    }
+    catch (const char *error)
+    {
+        session->failed = true;
+        session->error = error;
+    }
+    catch (const bad_alloc &)
+    {
+        session->failed = true;
+        session->error = "out of memory";
+    }
+    catch (const exception &ex)
+    {
+        session->failed = true;
+        session->error = ex.what();
+    }
+    catch (...)
+    {
+        session->failed = true;
+        session->error = "unexpected error";
+    }
+    return statusOf(session);
+}
+
+// no exception may leave the functions below, since their callers aren't C++
+
+extern "C" {
+
+cranea_image *cranea_image_open(const char *path)
+{
+    cranea_image *image = NULL;
+    try
+    {
+        image = new cranea_image(path);
+        if (image->image.fail())
+        {
+            delete image;
+            return NULL;
+        }
+    }
+    catch (...)
+    {
+        delete image;
+        return NULL;
+    }
+    return image;
+}
+
+void cranea_image_close(cranea_image *image)
+{
+    try
+    {
+        delete image;
+    }
+    catch (...)
+    {
+    }
+}
+
+cranea_session *cranea_session_create(cranea_image *image)
+{
+    cranea_session *session = NULL;
+    try
+    {
+        session = new cranea_session(image->image);
+        if (session->in.fail() || runSession(session, CallStart) == CRANEA_ERROR)
+        {
+            delete session;
+            return NULL;
+        }
+    }
+    catch (...)
+    {
+        delete session;
+        return NULL;
+    }
+    return session;
+}
+
+void cranea_session_destroy(cranea_session *session)
+{
+    try
+    {
+        delete session;
+    }
+    catch (...)
+    {
+    }
+}
+
+int cranea_session_submit(cranea_session *session, const char *line)
+{
+    return runSession(session, CallSubmit, line);
+}
+
+int cranea_session_resume(cranea_session *session)
+{
+    return runSession(session, CallResume);
+}
+
+int cranea_session_end_input(cranea_session *session)
+{
+    return runSession(session, CallEndInput);
+}
+
+int cranea_session_status(cranea_session *session)
+{
+    return statusOf(session);
+}
+
+unsigned long cranea_session_due_in(cranea_session *session)
+{
+    try
+    {
+        return session->failed ? 0 : session->ctx.scheduler().dueIn();
+    }
+    catch (...)
+    {
+        return 0;
+    }
+}
+
+const char *cranea_session_output(cranea_session *session, size_t *len)
+{
+    try
+    {
+        session->output = session->sink.contents();
+        session->sink.clear();
+    }
+    catch (...)
+    {
+        // the output stays in the sink for the next call
+        session->output.clear();
+    }
+    if (len)
+    {
+        *len = session->output.size();
+    }
+    return session->output.c_str();
+}
+
+void cranea_session_set_file_callback(cranea_session *session, cranea_file_callback callback, void *arg)
+{
+    session->fileHandler.setCallback(callback, arg);
+}
+
+int cranea_session_save(cranea_session *session, char **data, size_t *len)
+{
+    if (session->failed)
+    {
+        return -1;
+    }
+
+    try
+    {
+        ostringstream out;
+        SaveData saveData;
+        session->ctx.captureSaveData(saveData);
+        if (!saveData.write(out))
+        {
+            return -1;
+        }
+
+        string saved = out.str();
+        *data = (char *)malloc(saved.size());
+        if (!*data)
+        {
+            return -1;
+        }
+        memcpy(*data, saved.data(), saved.size());
+        *len = saved.size();
+    }
+    catch (...)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int cranea_session_load(cranea_session *session, const char *data, size_t len)
+{
+    if (session->failed || session->ctx.status() != GameContext::WaitingForInput)
+    {
+        return -1;
+    }
+
+    try
+    {
+        SaveData saveData;
+        istringstream in(string(data, len));
+        if (!saveData.read(in))
+        {
+            return -1;
+        }
+
+        // loading is a command of its own, so that undo reverts just the load
+        session->ctx.journal().beginCommand();
+        if (!session->ctx.load(saveData))
+        {
+            return -1;
+        }
+    }
+    catch (const char *error)
+    {
+        session->failed = true;
+        session->error = error;
+        return -1;
+    }
+    catch (const bad_alloc &)
+    {
+        session->failed = true;
+        session->error = "out of memory";
+        return -1;
+    }
+    catch (const exception &ex)
+    {
+        session->failed = true;
+        session->error = ex.what();
+        return -1;
+    }
+    catch (...)
+    {
+        session->failed = true;
+        session->error = "unexpected error";
+        return -1;
+    }
+    return 0;
+}
+
+const char *cranea_session_error(cranea_session *session)
+{
+    return session->failed ? session->error.c_str() : NULL;
+}
+
+void cranea_free(void *data)
+{
+    free(data);
+}
+
+}
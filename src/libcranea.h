@@ -0,0 +1,103 @@
+#ifndef _LIBCRANEA_H_
+#define _LIBCRANEA_H_
+
+#include <stddef.h>
+
+/* libcranea
+ * =========
+ * The game engine as a library, for programs that want to play .cra files themselves
+ * (a chat bot, a web server, another language's bindings) instead of running the player.
+ *
+ * An image is a .cra file loaded into memory. Any number of sessions can play the same
+ * image, and different sessions can be used from different threads at the same time;
+ * each session must only be used by one thread at a time.
+ *
+ * A session never waits: each call runs the game as far as it can go and returns its
+ * status. The output is collected until cranea_session_output() takes it. A game with
+ * delays in its output returns CRANEA_DELAYED, and should be resumed after
+ * cranea_session_due_in() milliseconds.
+ *
+ * Games that the player saves with the SAVE command are kept in memory for as long as
+ * the session lasts. To keep a game for longer, the host takes it with
+ * cranea_session_save() and gives it back to a later session with cranea_session_load().
+ *
+ * The files that an adventure gives the player are discarded, unless the host takes them
+ * with cranea_session_set_file_callback(). The library never writes them to disk or opens
+ * them itself.
+ *
+ * Functions that return a status return CRANEA_ERROR if the game failed (for instance,
+ * because the data file is corrupt). The session can only be destroyed after that, and
+ * cranea_session_error() tells what went wrong.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cranea_image cranea_image;
+typedef struct cranea_session cranea_session;
+
+#define CRANEA_WAITING_FOR_INPUT 0  /* for cranea_session_submit() or cranea_session_end_input() */
+#define CRANEA_DELAYED 1            /* for cranea_session_resume() */
+#define CRANEA_ENDED 2
+#define CRANEA_ERROR (-1)
+
+/* loads a .cra file. returns NULL if it can't be read. */
+cranea_image *cranea_image_open(const char *path);
+
+/* the image must outlive the sessions that play it */
+void cranea_image_close(cranea_image *image);
+
+/* starts a game: its introduction is ready in cranea_session_output().
+ * returns NULL if the game can't be started. */
+cranea_session *cranea_session_create(cranea_image *image);
+
+void cranea_session_destroy(cranea_session *session);
+
+/* handles a line of input from the player (without the newline) */
+int cranea_session_submit(cranea_session *session, const char *line);
+
+/* continues the game after a delay */
+int cranea_session_resume(cranea_session *session);
+
+/* the player has left: the rest of the output is delivered and the game ends */
+int cranea_session_end_input(cranea_session *session);
+
+/* what the game is waiting for */
+int cranea_session_status(cranea_session *session);
+
+/* milliseconds until the game should be resumed (if it is CRANEA_DELAYED) */
+unsigned long cranea_session_due_in(cranea_session *session);
+
+/* the output since the last call, NUL-terminated (and its length in *len, if len is
+ * not NULL). the buffer stays valid until the next call on the session. */
+const char *cranea_session_output(cranea_session *session, size_t *len);
+
+/* called with each file that the player extracts: name is a relative path (already
+ * cleaned up, but the host should still check it before using it), and data is only
+ * valid during the call. */
+typedef void (*cranea_file_callback)(void *arg, const char *name, const char *data, size_t len);
+
+/* hands the files that the player extracts from now on to callback (NULL to discard
+ * them, which is the default). files extracted by the introduction are discarded. */
+void cranea_session_set_file_callback(cranea_session *session, cranea_file_callback callback, void *arg);
+
+/* saves the game in progress to a buffer that the caller frees with cranea_free().
+ * returns 0 on success. */
+int cranea_session_save(cranea_session *session, char **data, size_t *len);
+
+/* replaces the game in progress with a game saved by cranea_session_save() (from this
+ * image), while the game waits for input. the player can undo it like a LOAD command.
+ * returns 0 on success, and keeps the game in progress on failure. */
+int cranea_session_load(cranea_session *session, const char *data, size_t len);
+
+/* why the game failed (NULL if it didn't) */
+const char *cranea_session_error(cranea_session *session);
+
+void cranea_free(void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
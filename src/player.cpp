@@ -1,50 +1,263 @@
-// player.cpp : Defines the entry point for the console application.
-//
-
-#include "cranea.h"
-#include "GameBase.h"
-#include "GameInput.h"
-#include <iostream>
-using namespace std;
-
-int main(int argc, char* argv[])
-{
-    if (argc == 0)
-    {
-        cerr << "Need at least 1 argument to main!" << endl;
-        return 1;
-    }
-
-    string executableName = baseFileName(argv[0]);
-    
-    size_t extPos = executableName.rfind('.');
-    if (extPos != string::npos)
-    {
-        executableName = executableName.substr(0, extPos);
-    }
-
-    string encryptedFilename = executableName + ENCRYPTED_EXT;
-
-    while (true)
-    {
-        GameInput in(encryptedFilename);        
-
-        if (in.fail())
-        {
-            cerr << "Error opening data file " << encryptedFilename << "." << endl;
-            cout << "Enter another file (blank to quit):";
-            getline(cin, encryptedFilename);
-            if (encryptedFilename.empty())
-                break;
-            else
-                continue;
-        }
-
-        GameContext ctx(in);
-        ctx.playGame();
-        break;
-    }
-
-    return 0;
-}
-
+// player.cpp : Defines the entry point for the console application.
+//
+
+#include "cranea.h"
+#include "GameBase.h"
+#include "GameInput.h"
+#include "GameSaveLog.h"
+#include "GameRecoveryLog.h"
+#include "GameServer.h"
+#include "GameMaster.h"
+#include <iostream>
+#include <cstdlib>
+#include <csignal>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static GameServer *runningServer = NULL;
+static GameMaster *runningMaster = NULL;
+
+static void stopServer(int)
+{
+    if (runningMaster)
+    {
+        runningMaster->stop();
+    }
+    else
+    {
+        runningServer->stop();
+    }
+}
+
+class ConsoleLineSource : public LineSource
+{
+public:
+    virtual bool readLine(string &line)
+    {
+        return !!getline(cin, line);
+    }
+};
+
+// plays a session for each client that connects to the socket at socketPath
+static int serve(const string &encryptedFilename, const string &socketPath,
+    GameSaveLog *saveLog, size_t autosaveInterval, size_t checkpointInterval, size_t numWorkers, size_t numProcesses,
+    size_t hibernateSeconds)
+{
+    GameImage image(encryptedFilename);
+    if (image.fail())
+    {
+        cerr << "Error opening data file " << encryptedFilename << "." << endl;
+        return 1;
+    }
+
+    GameServer server(image, socketPath);
+    if (saveLog)
+    {
+        server.setSaveLog(*saveLog);
+    }
+    server.setAutosave(autosaveInterval);
+    server.setRecoveryLog(checkpointInterval);
+    server.setWorkers(numWorkers ? numWorkers : numProcessors());
+    server.setHibernate(hibernateSeconds * 1000UL);
+
+    // the worker processes share the image that was mapped here
+    GameMaster master(server, socketPath, numProcesses);
+
+    runningServer = &server;
+    if (numProcesses)
+    {
+        runningMaster = &master;
+    }
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+
+    cerr << "Serving " << encryptedFilename << " on " << socketPath << endl;
+    bool success = numProcesses ? master.run() : server.run();
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    runningServer = NULL;
+    runningMaster = NULL;
+    return success ? 0 : 1;
+}
+
+void usage(const string &executableName)
+{
+    cerr << "Usage: " << executableName << " [-autosave N] [-recover N] [-savelog PATH [-session NAME]] [-output PATH] [-server PATH [-workers N] [-processes N] [-hibernate N]]" << endl;
+    cerr << "  -autosave N     save the game as \"" AUTOSAVE_NAME "\" every N commands" << endl;
+    cerr << "  -recover N      log input to recover the game after a crash, with a checkpoint every N commands" << endl;
+    cerr << "  -savelog PATH   keep saved games in the save log at PATH instead of .crs files" << endl;
+    cerr << "  -session NAME   the session of the saved games in the save log (default: " << executableName << ")" << endl;
+    cerr << "  -output PATH    write the output of the game to the file at PATH instead of the console" << endl;
+    cerr << "  -server PATH    play a game for each client that connects to the Unix socket at PATH" << endl;
+    cerr << "  -workers N      the number of threads that run the server's games (default: one per processor)" << endl;
+    cerr << "  -processes N    run the server's games in N worker processes (each with its own workers)" << endl;
+    cerr << "  -hibernate N    free the memory of a server's game after N seconds without a command" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == 0)
+    {
+        cerr << "Need at least 1 argument to main!" << endl;
+        return 1;
+    }
+
+    string executableName = baseFileName(argv[0]);
+    
+    size_t extPos = executableName.rfind('.');
+    if (extPos != string::npos)
+    {
+        executableName = executableName.substr(0, extPos);
+    }
+
+    string encryptedFilename = executableName + ENCRYPTED_EXT;
+
+    size_t autosaveInterval = 0;
+    size_t checkpointInterval = 0;
+    string saveLogPath;
+    string session = executableName;
+    string outputPath;
+    string socketPath;
+    size_t numWorkers = 0;
+    size_t numProcesses = 0;
+    size_t hibernateSeconds = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-autosave" && i + 1 < argc)
+        {
+            autosaveInterval = atoi(argv[++i]);
+        }
+        else if (arg == "-recover" && i + 1 < argc)
+        {
+            checkpointInterval = atoi(argv[++i]);
+        }
+        else if (arg == "-savelog" && i + 1 < argc)
+        {
+            saveLogPath = argv[++i];
+        }
+        else if (arg == "-session" && i + 1 < argc)
+        {
+            session = argv[++i];
+        }
+        else if (arg == "-output" && i + 1 < argc)
+        {
+            outputPath = argv[++i];
+        }
+        else if (arg == "-server" && i + 1 < argc)
+        {
+            socketPath = argv[++i];
+        }
+        else if (arg == "-workers" && i + 1 < argc)
+        {
+            numWorkers = atoi(argv[++i]);
+        }
+        else if (arg == "-processes" && i + 1 < argc)
+        {
+            numProcesses = atoi(argv[++i]);
+        }
+        else if (arg == "-hibernate" && i + 1 < argc)
+        {
+            hibernateSeconds = atoi(argv[++i]);
+        }
+        else
+        {
+            usage(executableName);
+            return 1;
+        }
+    }
+
+    if (numProcesses && !saveLogPath.empty())
+    {
+        cerr << "The save log can't be shared by worker processes." << endl;
+        return 1;
+    }
+
+    GameSaveLog *saveLog = NULL;
+    LogSaveStore *logSaveStore = NULL;
+    if (!saveLogPath.empty())
+    {
+        saveLog = new GameSaveLog(saveLogPath);
+        if (saveLog->fail())
+        {
+            cerr << "Error opening save log " << saveLogPath << "." << endl;
+            delete saveLog;
+            return 1;
+        }
+        logSaveStore = new LogSaveStore(*saveLog, session);
+    }
+
+    if (!socketPath.empty())
+    {
+        int res = serve(encryptedFilename, socketPath, saveLog, autosaveInterval, checkpointInterval, numWorkers, numProcesses, hibernateSeconds);
+        delete logSaveStore;
+        delete saveLog;
+        return res;
+    }
+
+    FileOutputSink *fileOutputSink = NULL;
+    if (!outputPath.empty())
+    {
+        fileOutputSink = new FileOutputSink(outputPath);
+        if (fileOutputSink->fail())
+        {
+            cerr << "Error opening output file " << outputPath << "." << endl;
+            delete fileOutputSink;
+            delete logSaveStore;
+            delete saveLog;
+            return 1;
+        }
+    }
+
+    while (true)
+    {
+        GameInput in(encryptedFilename);        
+
+        if (in.fail())
+        {
+            cerr << "Error opening data file " << encryptedFilename << "." << endl;
+            cout << "Enter another file (blank to quit):";
+            getline(cin, encryptedFilename);
+            if (encryptedFilename.empty())
+                break;
+            else
+                continue;
+        }
+
+        StdoutOutputSink stdoutSink;
+        GameContext ctx(in);
+        if (logSaveStore)
+        {
+            ctx.setSaveStore(*logSaveStore);
+        }
+        if (fileOutputSink)
+        {
+            ctx.setOutputSink(*fileOutputSink);
+        }
+        else
+        {
+            ctx.setOutputSink(stdoutSink);
+        }
+        ctx.setAutosave(autosaveInterval, AUTOSAVE_NAME);
+        if (checkpointInterval)
+        {
+            ctx.setRecoveryLog(session + RECOVERY_LOG_EXTENSION, checkpointInterval);
+        }
+        ConsoleLineSource console;
+        ctx.playGame(console);
+        break;
+    }
+
+    delete logSaveStore;
+    delete saveLog;
+    delete fileOutputSink;
+
+    return 0;
+}
+